@@ -27,6 +27,7 @@
 #ifndef _WIN32
 #include <sys/types.h>
 #include <sys/mman.h>
+#include <zlib.h>
 #endif
 #include "config.h"
 #include "monitor/monitor.h"
@@ -40,11 +41,13 @@
 #include "hw/audio/audio.h"
 #include "sysemu/kvm.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "hw/i386/smbios.h"
 #include "exec/address-spaces.h"
 #include "hw/audio/pcspk.h"
 #include "migration/page_cache.h"
 #include "qemu/config-file.h"
+#include "qemu/queue.h"
 #include "qmp-commands.h"
 #include "trace.h"
 #include "exec/cpu-all.h"
@@ -115,6 +118,8 @@ const uint32_t arch_type = QEMU_ARCH;
 #define RAM_SAVE_FLAG_EOS      0x10
 #define RAM_SAVE_FLAG_CONTINUE 0x20
 #define RAM_SAVE_FLAG_XBZRLE   0x40
+/* 0x80 is reserved */
+#define RAM_SAVE_FLAG_COMPRESS_PAGE 0x100
 
 
 static struct defconfig_file {
@@ -189,7 +194,12 @@ typedef struct AccountingInfo {
     uint64_t xbzrle_bytes;
     uint64_t xbzrle_pages;
     uint64_t xbzrle_cache_miss;
+    uint64_t xbzrle_cache_hit;
+    uint64_t xbzrle_cache_evictions;
     uint64_t xbzrle_overflows;
+    uint64_t compress_pages;
+    uint64_t compress_bytes;
+    uint64_t compress_busy;
 } AccountingInfo;
 
 static AccountingInfo acct_info;
@@ -244,6 +254,16 @@ uint64_t xbzrle_mig_pages_cache_miss(void)
     return acct_info.xbzrle_cache_miss;
 }
 
+uint64_t xbzrle_mig_pages_cache_hit(void)
+{
+    return acct_info.xbzrle_cache_hit;
+}
+
+uint64_t xbzrle_mig_cache_evictions(void)
+{
+    return acct_info.xbzrle_cache_evictions;
+}
+
 uint64_t xbzrle_mig_pages_overflow(void)
 {
     return acct_info.xbzrle_overflows;
@@ -276,12 +296,14 @@ static int save_xbzrle_page(QEMUFile *f, uint8_t *current_data,
     uint8_t *prev_cached_page;
 
     if (!cache_is_cached(XBZRLE.cache, current_addr)) {
-        if (!last_stage) {
-            cache_insert(XBZRLE.cache, current_addr, current_data);
+        if (!last_stage &&
+            cache_insert(XBZRLE.cache, current_addr, current_data)) {
+            acct_info.xbzrle_cache_evictions++;
         }
         acct_info.xbzrle_cache_miss++;
         return -1;
     }
+    acct_info.xbzrle_cache_hit++;
 
     prev_cached_page = get_cached_data(XBZRLE.cache, current_addr);
 
@@ -328,9 +350,468 @@ static RAMBlock *last_seen_block;
 static RAMBlock *last_sent_block;
 static ram_addr_t last_offset;
 static unsigned long *migration_bitmap;
+/* Pages known to be zero on the destination: skipped in the bulk stage or
+ * last sent as zero.  If they are still zero when dirtied again, there is
+ * no need to send them.
+ */
+static unsigned long *zero_bitmap;
 static uint64_t migration_dirty_pages;
 static uint32_t last_version;
 static bool ram_bulk_stage;
+static uint64_t dirty_sync_count;
+
+/* Set once the guest runs on the destination.  Pages are then sent as they
+ * are, those the destination asks for first.
+ */
+static bool ram_postcopy;
+
+typedef struct RAMPageRequest {
+    RAMBlock *block;
+    ram_addr_t offset;
+    ram_addr_t len;
+    QSIMPLEQ_ENTRY(RAMPageRequest) next;
+} RAMPageRequest;
+
+static QemuMutex page_req_lock;
+static QSIMPLEQ_HEAD(, RAMPageRequest) page_requests =
+    QSIMPLEQ_HEAD_INITIALIZER(page_requests);
+
+/*
+ * Multi-threaded page compression (the "compress" capability)
+ *
+ * The migration thread hands each page to an idle compression thread.  When
+ * no thread is idle it waits for one to finish, writes that thread's output
+ * to the stream and reuses it.  Pages are therefore sent slightly out of
+ * order, so all pending output is flushed before every RAM_SAVE_FLAG_EOS: a
+ * page that is dirtied again is resent in a later iteration, and its stale
+ * compressed copy must not overtake it.
+ *
+ * Pages are compressed straight from guest memory.  If the guest writes to a
+ * page while it is being compressed, the page is dirty again and is resent.
+ */
+
+typedef struct CompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    z_stream stream;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    /* protected by comp_done_lock */
+    bool done;
+    /* written by the migration thread while the compression thread is idle */
+    RAMBlock *block;
+    ram_addr_t offset;
+    /* output of the last request */
+    uint8_t *buf;
+    int len;
+    /* accounting */
+    uint64_t pages;
+    uint64_t bytes;
+    int64_t busy_ns;
+} CompressParam;
+
+static CompressParam *comp_param;
+static int comp_thread_count;
+static QemuMutex comp_done_lock;
+static QemuCond comp_done_cond;
+
+/* Per-thread statistics, kept after the threads are gone */
+static CompressThreadStats *comp_stats;
+static int comp_stats_count;
+
+static void *do_data_compress(void *opaque)
+{
+    CompressParam *param = opaque;
+    z_stream *stream = &param->stream;
+    int64_t t0;
+    uint8_t *p;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        t0 = get_clock();
+        p = memory_region_get_ram_ptr(param->block->mr) + param->offset;
+        deflateReset(stream);
+        stream->next_in = p;
+        stream->avail_in = TARGET_PAGE_SIZE;
+        stream->next_out = param->buf;
+        stream->avail_out = TARGET_PAGE_SIZE;
+        ret = deflate(stream, Z_FINISH);
+        param->busy_ns += get_clock() - t0;
+
+        qemu_mutex_lock(&comp_done_lock);
+        /* output that does not fit in a page is sent uncompressed */
+        param->len = (ret == Z_STREAM_END) ? stream->total_out : -1;
+        param->done = true;
+        qemu_cond_signal(&comp_done_cond);
+        qemu_mutex_unlock(&comp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static int compress_threads_create(void)
+{
+    int i, level = migrate_compress_level();
+
+    comp_thread_count = migrate_compress_threads();
+    comp_param = g_new0(CompressParam, comp_thread_count);
+    qemu_mutex_init(&comp_done_lock);
+    qemu_cond_init(&comp_done_cond);
+
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        if (deflateInit(&param->stream, level) != Z_OK) {
+            comp_thread_count = i;
+            return -1;
+        }
+        param->buf = g_malloc(TARGET_PAGE_SIZE);
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_compress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+
+    g_free(comp_stats);
+    comp_stats = g_new0(CompressThreadStats, comp_thread_count);
+    comp_stats_count = comp_thread_count;
+    acct_info.compress_pages = 0;
+    acct_info.compress_bytes = 0;
+    acct_info.compress_busy = 0;
+    return 0;
+}
+
+static void compress_threads_join(void)
+{
+    int i;
+
+    for (i = 0; i < comp_thread_count; i++) {
+        CompressParam *param = &comp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        deflateEnd(&param->stream);
+        g_free(param->buf);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+    }
+    qemu_mutex_destroy(&comp_done_lock);
+    qemu_cond_destroy(&comp_done_cond);
+    g_free(comp_param);
+    comp_param = NULL;
+    comp_thread_count = 0;
+}
+
+/* Write the result of a finished request.  Needs comp_done_lock. */
+static int flush_compressed_page(QEMUFile *f, CompressParam *param)
+{
+    RAMBlock *block = param->block;
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    CompressThreadStats *stats = &comp_stats[param - comp_param];
+    int bytes_sent;
+
+    if (param->len < 0) {
+        uint8_t *p = memory_region_get_ram_ptr(block->mr) + param->offset;
+
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    } else {
+        bytes_sent = save_block_hdr(f, block, param->offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS_PAGE);
+        qemu_put_be32(f, param->len);
+        qemu_put_buffer(f, param->buf, param->len);
+        bytes_sent += 4 + param->len;
+        acct_info.compress_pages++;
+        acct_info.compress_bytes += param->len;
+        param->pages++;
+        param->bytes += param->len;
+    }
+
+    stats->pages = param->pages;
+    stats->bytes = param->bytes;
+    stats->busy_time = param->busy_ns / 1000000;
+
+    last_sent_block = block;
+    param->block = NULL;
+    return bytes_sent;
+}
+
+/*
+ * Queue a page for compression.  Returns the number of bytes written to the
+ * stream for an earlier page, if a thread had to be reused.
+ */
+static int compress_page_with_multi_thread(QEMUFile *f, RAMBlock *block,
+                                           ram_addr_t offset)
+{
+    CompressParam *param = NULL;
+    int i, bytes_sent = 0;
+
+    qemu_mutex_lock(&comp_done_lock);
+    while (!param) {
+        for (i = 0; i < comp_thread_count; i++) {
+            if (comp_param[i].done) {
+                param = &comp_param[i];
+                break;
+            }
+        }
+        if (!param) {
+            acct_info.compress_busy++;
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+    }
+
+    if (param->block) {
+        bytes_sent = flush_compressed_page(f, param);
+    }
+    param->done = false;
+    qemu_mutex_unlock(&comp_done_lock);
+
+    qemu_mutex_lock(&param->mutex);
+    param->block = block;
+    param->offset = offset;
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+
+    return bytes_sent;
+}
+
+/* Wait for all queued pages and write them out */
+static int flush_compressed_data(QEMUFile *f)
+{
+    int i, bytes_sent = 0;
+
+    if (!comp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&comp_done_lock);
+    for (i = 0; i < comp_thread_count; i++) {
+        while (!comp_param[i].done) {
+            qemu_cond_wait(&comp_done_cond, &comp_done_lock);
+        }
+        if (comp_param[i].block) {
+            bytes_sent += flush_compressed_page(f, &comp_param[i]);
+        }
+    }
+    qemu_mutex_unlock(&comp_done_lock);
+
+    return bytes_sent;
+}
+
+CompressionStats *compress_mig_stats(void)
+{
+    CompressionStats *info = g_malloc0(sizeof(*info));
+    CompressThreadStatsList *entry, **tail = &info->threads;
+    int i;
+
+    info->pages = acct_info.compress_pages;
+    info->bytes = acct_info.compress_bytes;
+    info->busy = acct_info.compress_busy;
+
+    for (i = 0; i < comp_stats_count; i++) {
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = g_malloc0(sizeof(*entry->value));
+        *entry->value = comp_stats[i];
+        entry->value->id = i;
+        *tail = entry;
+        tail = &entry->next;
+    }
+    return info;
+}
+
+/*
+ * Decompression threads used by ram_load.  They are started when the first
+ * compressed page arrives and stopped by migrate_decompress_threads_join().
+ */
+
+typedef struct DecompressParam {
+    QemuThread thread;
+    QemuMutex mutex;
+    QemuCond cond;
+    z_stream stream;
+    /* protected by mutex */
+    bool start;
+    bool quit;
+    /* protected by decomp_done_lock */
+    bool done;
+    /* request, written by ram_load while the thread is idle */
+    void *host;
+    uint8_t *buf;
+    int len;
+} DecompressParam;
+
+static DecompressParam *decomp_param;
+static int decomp_thread_count;
+static QemuMutex decomp_done_lock;
+static QemuCond decomp_done_cond;
+static bool decomp_error;
+
+static void *do_data_decompress(void *opaque)
+{
+    DecompressParam *param = opaque;
+    z_stream *stream = &param->stream;
+    int ret;
+
+    qemu_mutex_lock(&param->mutex);
+    while (!param->quit) {
+        if (!param->start) {
+            qemu_cond_wait(&param->cond, &param->mutex);
+            continue;
+        }
+        param->start = false;
+        qemu_mutex_unlock(&param->mutex);
+
+        inflateReset(stream);
+        stream->next_in = param->buf;
+        stream->avail_in = param->len;
+        stream->next_out = param->host;
+        stream->avail_out = TARGET_PAGE_SIZE;
+        ret = inflate(stream, Z_FINISH);
+
+        qemu_mutex_lock(&decomp_done_lock);
+        if (ret != Z_STREAM_END || stream->total_out != TARGET_PAGE_SIZE) {
+            decomp_error = true;
+        }
+        param->done = true;
+        qemu_cond_signal(&decomp_done_cond);
+        qemu_mutex_unlock(&decomp_done_lock);
+
+        qemu_mutex_lock(&param->mutex);
+    }
+    qemu_mutex_unlock(&param->mutex);
+
+    return NULL;
+}
+
+static void migrate_decompress_threads_create(void)
+{
+    int i;
+
+    decomp_thread_count = migrate_decompress_threads();
+    decomp_param = g_new0(DecompressParam, decomp_thread_count);
+    qemu_mutex_init(&decomp_done_lock);
+    qemu_cond_init(&decomp_done_cond);
+    decomp_error = false;
+
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        inflateInit(&param->stream);
+        param->buf = g_malloc(TARGET_PAGE_SIZE);
+        param->done = true;
+        qemu_mutex_init(&param->mutex);
+        qemu_cond_init(&param->cond);
+        qemu_thread_create(&param->thread, do_data_decompress, param,
+                           QEMU_THREAD_JOINABLE);
+    }
+}
+
+void migrate_decompress_threads_join(void)
+{
+    int i;
+
+    if (!decomp_param) {
+        return;
+    }
+
+    for (i = 0; i < decomp_thread_count; i++) {
+        DecompressParam *param = &decomp_param[i];
+
+        qemu_mutex_lock(&param->mutex);
+        param->quit = true;
+        qemu_cond_signal(&param->cond);
+        qemu_mutex_unlock(&param->mutex);
+        qemu_thread_join(&param->thread);
+
+        inflateEnd(&param->stream);
+        g_free(param->buf);
+        qemu_mutex_destroy(&param->mutex);
+        qemu_cond_destroy(&param->cond);
+    }
+    qemu_mutex_destroy(&decomp_done_lock);
+    qemu_cond_destroy(&decomp_done_cond);
+    g_free(decomp_param);
+    decomp_param = NULL;
+    decomp_thread_count = 0;
+}
+
+static void decompress_data_with_multi_threads(QEMUFile *f, void *host,
+                                               int len)
+{
+    DecompressParam *param = NULL;
+    int i;
+
+    if (!decomp_param) {
+        migrate_decompress_threads_create();
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    while (!param) {
+        for (i = 0; i < decomp_thread_count; i++) {
+            if (decomp_param[i].done) {
+                param = &decomp_param[i];
+                break;
+            }
+        }
+        if (!param) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    param->done = false;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    qemu_get_buffer(f, param->buf, len);
+
+    qemu_mutex_lock(&param->mutex);
+    param->host = host;
+    param->len = len;
+    param->start = true;
+    qemu_cond_signal(&param->cond);
+    qemu_mutex_unlock(&param->mutex);
+}
+
+/* Wait until all queued pages are in guest memory; < 0 on a bad page */
+static int wait_for_decompress_done(void)
+{
+    int i, ret;
+
+    if (!decomp_param) {
+        return 0;
+    }
+
+    qemu_mutex_lock(&decomp_done_lock);
+    for (i = 0; i < decomp_thread_count; i++) {
+        while (!decomp_param[i].done) {
+            qemu_cond_wait(&decomp_done_cond, &decomp_done_lock);
+        }
+    }
+    ret = decomp_error ? -EINVAL : 0;
+    qemu_mutex_unlock(&decomp_done_lock);
+
+    return ret;
+}
 
 static inline
 ram_addr_t migration_bitmap_find_and_reset_dirty(MemoryRegion *mr,
@@ -369,36 +850,58 @@ static inline bool migration_bitmap_set_dirty(MemoryRegion *mr,
     return ret;
 }
 
+static void migration_bitmap_set_dirty_page(ram_addr_t addr, void *opaque)
+{
+    if (!test_and_set_bit(addr >> TARGET_PAGE_BITS, migration_bitmap)) {
+        migration_dirty_pages++;
+    }
+}
+
+static void migration_bitmap_sync_block(RAMBlock *block)
+{
+    ram_addr_t addr;
+
+    for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
+        if (memory_region_test_and_clear_dirty(block->mr,
+                                               addr, TARGET_PAGE_SIZE,
+                                               DIRTY_MEMORY_MIGRATION)) {
+            migration_bitmap_set_dirty(block->mr, addr);
+        }
+    }
+}
+
 /* Needs iothread lock! */
 
 static void migration_bitmap_sync(void)
 {
     RAMBlock *block;
-    ram_addr_t addr;
     uint64_t num_dirty_pages_init = migration_dirty_pages;
     MigrationState *s = migrate_get_current();
     static int64_t start_time;
     static int64_t num_dirty_pages_period;
     int64_t end_time;
+    bool full_scan;
 
     if (!start_time) {
         start_time = qemu_get_clock_ms(rt_clock);
     }
 
     trace_migration_bitmap_sync_start();
+    dirty_sync_count++;
     memory_global_sync_dirty_bitmap(get_system_memory());
 
-    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
-        for (addr = 0; addr < block->length; addr += TARGET_PAGE_SIZE) {
-            if (memory_region_test_and_clear_dirty(block->mr,
-                                                   addr, TARGET_PAGE_SIZE,
-                                                   DIRTY_MEMORY_MIGRATION)) {
-                migration_bitmap_set_dirty(block->mr, addr);
-            }
+    /* Usually only the pages dirtied since the last sync are visited; the
+     * whole of RAM is scanned the first time and when the log overflowed.
+     */
+    full_scan = !cpu_physical_memory_drain_dirty_log(
+        migration_bitmap_set_dirty_page, NULL);
+    if (full_scan) {
+        QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+            migration_bitmap_sync_block(block);
         }
     }
     trace_migration_bitmap_sync_end(migration_dirty_pages
-                                    - num_dirty_pages_init);
+                                    - num_dirty_pages_init, full_scan);
     num_dirty_pages_period += migration_dirty_pages - num_dirty_pages_init;
     end_time = qemu_get_clock_ms(rt_clock);
 
@@ -412,6 +915,44 @@ static void migration_bitmap_sync(void)
     }
 }
 
+/*
+ * save_zero_page: Sends a zero page, unless the destination is known
+ * to have zeroes there already
+ *
+ * Returns:  The number of bytes written.
+ */
+static int save_zero_page(QEMUFile *f, RAMBlock *block, ram_addr_t offset,
+                          int cont)
+{
+    ram_addr_t current_addr = block->offset + offset;
+    int bytes_sent;
+
+    /* After the switch to post-copy every page is placed explicitly, so
+     * that the guest does not fault on it.
+     */
+    if (ram_bulk_stage ||
+        (test_bit(current_addr >> TARGET_PAGE_BITS, zero_bitmap) &&
+         !ram_postcopy)) {
+        acct_info.skipped_pages++;
+        set_bit(current_addr >> TARGET_PAGE_BITS, zero_bitmap);
+        return 0;
+    }
+
+    bytes_sent = save_block_hdr(f, block, offset, cont,
+                                RAM_SAVE_FLAG_COMPRESS);
+    qemu_put_byte(f, 0);
+    bytes_sent++;
+    set_bit(current_addr >> TARGET_PAGE_BITS, zero_bitmap);
+
+    /* XBZRLE deltas are applied to what the destination has */
+    if (XBZRLE.cache && cache_is_cached(XBZRLE.cache, current_addr)) {
+        memset(get_cached_data(XBZRLE.cache, current_addr), 0,
+               TARGET_PAGE_SIZE);
+    }
+
+    return bytes_sent;
+}
+
 /*
  * ram_save_block: Writes a page of memory to the stream f
  *
@@ -453,25 +994,30 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
 
             p = memory_region_get_ram_ptr(mr) + offset;
 
+            current_addr = block->offset + offset;
+
             /* In doubt sent page as normal */
             bytes_sent = -1;
             if (is_zero_page(p)) {
                 acct_info.dup_pages++;
-                if (!ram_bulk_stage) {
-                    bytes_sent = save_block_hdr(f, block, offset, cont,
-                                                RAM_SAVE_FLAG_COMPRESS);
-                    qemu_put_byte(f, 0);
-                    bytes_sent++;
-                } else {
-                    acct_info.skipped_pages++;
-                    bytes_sent = 0;
-                }
-            } else if (!ram_bulk_stage && migrate_use_xbzrle()) {
-                current_addr = block->offset + offset;
-                bytes_sent = save_xbzrle_page(f, p, current_addr, block,
-                                              offset, cont, last_stage);
-                if (!last_stage) {
-                    p = get_cached_data(XBZRLE.cache, current_addr);
+                bytes_sent = save_zero_page(f, block, offset, cont);
+            } else {
+                clear_bit(current_addr >> TARGET_PAGE_BITS, zero_bitmap);
+                if (!ram_bulk_stage && migrate_use_xbzrle() &&
+                    !ram_postcopy) {
+                    bytes_sent = save_xbzrle_page(f, p, current_addr, block,
+                                                  offset, cont, last_stage);
+                    if (!last_stage) {
+                        p = get_cached_data(XBZRLE.cache, current_addr);
+                    }
+                } else if (comp_param && !ram_postcopy) {
+                    /* this may write out an earlier page, of any block */
+                    bytes_sent = compress_page_with_multi_thread(f, block,
+                                                                 offset);
+                    if (bytes_sent > 0) {
+                        break;
+                    }
+                    continue;
                 }
             }
 
@@ -496,6 +1042,171 @@ static int ram_save_block(QEMUFile *f, bool last_stage)
     return bytes_sent;
 }
 
+/* Sends a page the destination asked for, dirty or not */
+static int ram_save_requested_page(QEMUFile *f, RAMBlock *block,
+                                   ram_addr_t offset)
+{
+    int cont = (block == last_sent_block) ? RAM_SAVE_FLAG_CONTINUE : 0;
+    uint8_t *p = memory_region_get_ram_ptr(block->mr) + offset;
+    int bytes_sent;
+
+    if (test_and_clear_bit((block->offset + offset) >> TARGET_PAGE_BITS,
+                           migration_bitmap)) {
+        migration_dirty_pages--;
+    }
+
+    if (is_zero_page(p)) {
+        acct_info.dup_pages++;
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_COMPRESS);
+        qemu_put_byte(f, 0);
+        bytes_sent++;
+        set_bit((block->offset + offset) >> TARGET_PAGE_BITS, zero_bitmap);
+    } else {
+        clear_bit((block->offset + offset) >> TARGET_PAGE_BITS, zero_bitmap);
+        bytes_sent = save_block_hdr(f, block, offset, cont,
+                                    RAM_SAVE_FLAG_PAGE);
+        qemu_put_buffer_async(f, p, TARGET_PAGE_SIZE);
+        bytes_sent += TARGET_PAGE_SIZE;
+        acct_info.norm_pages++;
+    }
+    last_sent_block = block;
+
+    return bytes_sent;
+}
+
+static int ram_save_requested_pages(QEMUFile *f)
+{
+    RAMPageRequest *req;
+    ram_addr_t offset;
+    int bytes_sent = 0;
+
+    for (;;) {
+        qemu_mutex_lock(&page_req_lock);
+        req = QSIMPLEQ_FIRST(&page_requests);
+        if (req) {
+            QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        }
+        qemu_mutex_unlock(&page_req_lock);
+        if (!req) {
+            break;
+        }
+
+        for (offset = req->offset; offset < req->offset + req->len;
+             offset += TARGET_PAGE_SIZE) {
+            bytes_sent += ram_save_requested_page(f, req->block, offset);
+        }
+        g_free(req);
+    }
+
+    /* somebody is waiting for these */
+    if (bytes_sent) {
+        qemu_fflush(f);
+    }
+    return bytes_sent;
+}
+
+/* Called from the return path thread */
+int ram_save_queue_pages(const char *idstr, uint64_t start, uint64_t len)
+{
+    RAMPageRequest *req;
+    RAMBlock *block;
+
+    trace_ram_save_queue_pages(idstr, start, len);
+
+    /* The list does not change while the source is stopped in post-copy */
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (!strcmp(idstr, block->idstr)) {
+            break;
+        }
+    }
+    if (!block || start > block->length || len > block->length - start ||
+        (start | len) & ~TARGET_PAGE_MASK) {
+        fprintf(stderr, "Invalid page request %s 0x%" PRIx64 "+0x%" PRIx64
+                "\n", idstr, start, len);
+        return -EINVAL;
+    }
+
+    req = g_malloc(sizeof(*req));
+    req->block = block;
+    req->offset = start;
+    req->len = len;
+
+    qemu_mutex_lock(&page_req_lock);
+    QSIMPLEQ_INSERT_TAIL(&page_requests, req, next);
+    qemu_mutex_unlock(&page_req_lock);
+    return 0;
+}
+
+static void ram_page_requests_reset(void)
+{
+    static bool initialized;
+    RAMPageRequest *req;
+
+    if (!initialized) {
+        qemu_mutex_init(&page_req_lock);
+        initialized = true;
+    }
+
+    qemu_mutex_lock(&page_req_lock);
+    while ((req = QSIMPLEQ_FIRST(&page_requests))) {
+        QSIMPLEQ_REMOVE_HEAD(&page_requests, next);
+        g_free(req);
+    }
+    qemu_mutex_unlock(&page_req_lock);
+}
+
+#define DISCARD_BATCH 512
+
+/*
+ * Switch to post-copy.  Every page that is dirty now was either never sent
+ * or has changed since; tell the destination to drop its copy, so that it
+ * faults when the guest touches it.  Needs the iothread lock.
+ */
+int ram_postcopy_send_discard(QEMUFile *f)
+{
+    uint64_t starts[DISCARD_BATCH], lengths[DISCARD_BATCH];
+    RAMBlock *block;
+
+    qemu_mutex_lock_ramlist();
+    flush_compressed_data(f);
+    migration_bitmap_sync();
+    ram_postcopy = true;
+    /* requests clear bits out of order from now on */
+    ram_bulk_stage = false;
+
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        unsigned long first = block->offset >> TARGET_PAGE_BITS;
+        unsigned long last = first + (block->length >> TARGET_PAGE_BITS);
+        unsigned long start = find_next_bit(migration_bitmap, last, first);
+        uint64_t ranges = 0;
+        unsigned int nr = 0;
+
+        while (start < last) {
+            unsigned long end = find_next_zero_bit(migration_bitmap, last,
+                                                   start);
+
+            starts[nr] = (uint64_t)(start - first) << TARGET_PAGE_BITS;
+            lengths[nr] = (uint64_t)(end - start) << TARGET_PAGE_BITS;
+            ranges++;
+            if (++nr == DISCARD_BATCH) {
+                qemu_savevm_send_postcopy_ram_discard(f, block->idstr, nr,
+                                                      starts, lengths);
+                nr = 0;
+            }
+            start = find_next_bit(migration_bitmap, last, end);
+        }
+        if (nr) {
+            qemu_savevm_send_postcopy_ram_discard(f, block->idstr, nr,
+                                                  starts, lengths);
+        }
+        trace_ram_postcopy_send_discard(block->idstr, ranges);
+    }
+    qemu_mutex_unlock_ramlist();
+
+    return qemu_file_get_error(f);
+}
+
 static uint64_t bytes_transferred;
 
 static ram_addr_t ram_save_remaining(void)
@@ -513,6 +1224,11 @@ uint64_t ram_bytes_transferred(void)
     return bytes_transferred;
 }
 
+uint64_t ram_dirty_sync_count(void)
+{
+    return dirty_sync_count;
+}
+
 uint64_t ram_bytes_total(void)
 {
     RAMBlock *block;
@@ -530,6 +1246,12 @@ static void migration_end(void)
         memory_global_dirty_log_stop();
         g_free(migration_bitmap);
         migration_bitmap = NULL;
+        g_free(zero_bitmap);
+        zero_bitmap = NULL;
+    }
+
+    if (comp_param) {
+        compress_threads_join();
     }
 
     if (XBZRLE.cache) {
@@ -565,6 +1287,7 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
 
     migration_bitmap = bitmap_new(ram_pages);
     bitmap_set(migration_bitmap, 0, ram_pages);
+    zero_bitmap = bitmap_new(ram_pages);
     migration_dirty_pages = ram_pages;
 
     if (migrate_use_xbzrle()) {
@@ -580,9 +1303,19 @@ static int ram_save_setup(QEMUFile *f, void *opaque)
         acct_clear();
     }
 
+    if (migrate_use_compression() && compress_threads_create() < 0) {
+        DPRINTF("Error creating compression threads\n");
+        compress_threads_join();
+        return -1;
+    }
+
+    ram_page_requests_reset();
+
     qemu_mutex_lock_iothread();
     qemu_mutex_lock_ramlist();
     bytes_transferred = 0;
+    dirty_sync_count = 0;
+    ram_postcopy = false;
     reset_ram_globals();
 
     memory_global_dirty_log_start();
@@ -618,10 +1351,19 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
 
     t0 = qemu_get_clock_ns(rt_clock);
     i = 0;
-    while ((ret = qemu_file_rate_limit(f)) == 0) {
-        int bytes_sent;
+    while ((ret = qemu_file_rate_limit(f)) == 0 || ram_postcopy) {
+        int bytes_sent = 0;
 
-        bytes_sent = ram_save_block(f, false);
+        if (ram_postcopy) {
+            /* the rate limit only applies to pages nobody waits for */
+            bytes_sent = ram_save_requested_pages(f);
+            if (bytes_sent == 0 && qemu_file_rate_limit(f)) {
+                break;
+            }
+        }
+        if (bytes_sent == 0) {
+            bytes_sent = ram_save_block(f, false);
+        }
         /* no more blocks to sent */
         if (bytes_sent == 0) {
             break;
@@ -644,6 +1386,7 @@ static int ram_save_iterate(QEMUFile *f, void *opaque)
         i++;
     }
 
+    total_sent += flush_compressed_data(f);
     qemu_mutex_unlock_ramlist();
 
     if (ret < 0) {
@@ -676,6 +1419,7 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
         }
         bytes_transferred += bytes_sent;
     }
+    bytes_transferred += flush_compressed_data(f);
     migration_end();
 
     qemu_mutex_unlock_ramlist();
@@ -684,6 +1428,11 @@ static int ram_save_complete(QEMUFile *f, void *opaque)
     return 0;
 }
 
+static bool ram_has_postcopy(void *opaque)
+{
+    return migrate_postcopy_ram();
+}
+
 static uint64_t ram_save_pending(QEMUFile *f, void *opaque, uint64_t max_size)
 {
     uint64_t remaining_size;
@@ -776,6 +1525,8 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     int flags, ret = 0;
     int error;
     static uint64_t seq_iter;
+    static uint8_t *postcopy_buf;
+    bool postcopy = postcopy_ram_incoming_active();
 
     seq_iter++;
 
@@ -783,6 +1534,10 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
         return -EINVAL;
     }
 
+    if (postcopy && !postcopy_buf) {
+        postcopy_buf = g_malloc(TARGET_PAGE_SIZE);
+    }
+
     do {
         addr = qemu_get_be64(f);
 
@@ -837,6 +1592,18 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
             }
 
             ch = qemu_get_byte(f);
+            if (postcopy) {
+                if (ch == 0) {
+                    ret = postcopy_place_zero_page(host);
+                } else {
+                    memset(postcopy_buf, ch, TARGET_PAGE_SIZE);
+                    ret = postcopy_place_page(host, postcopy_buf);
+                }
+                if (ret < 0) {
+                    goto done;
+                }
+                continue;
+            }
             memset(host, ch, TARGET_PAGE_SIZE);
 #ifndef _WIN32
             if (ch == 0 &&
@@ -853,7 +1620,20 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 return -EINVAL;
             }
 
-            qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            if (postcopy) {
+                qemu_get_buffer(f, postcopy_buf, TARGET_PAGE_SIZE);
+                ret = postcopy_place_page(host, postcopy_buf);
+                if (ret < 0) {
+                    goto done;
+                }
+            } else {
+                qemu_get_buffer(f, host, TARGET_PAGE_SIZE);
+            }
+        } else if (postcopy && (flags & (RAM_SAVE_FLAG_XBZRLE |
+                                         RAM_SAVE_FLAG_COMPRESS_PAGE))) {
+            fprintf(stderr, "Unexpected page encoding in post-copy\n");
+            ret = -EINVAL;
+            goto done;
         } else if (flags & RAM_SAVE_FLAG_XBZRLE) {
             void *host = host_from_stream_offset(f, addr, flags);
             if (!host) {
@@ -864,6 +1644,21 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
                 ret = -EINVAL;
                 goto done;
             }
+        } else if (flags & RAM_SAVE_FLAG_COMPRESS_PAGE) {
+            void *host = host_from_stream_offset(f, addr, flags);
+            int len;
+
+            if (!host) {
+                return -EINVAL;
+            }
+
+            len = qemu_get_be32(f);
+            if (len <= 0 || len > TARGET_PAGE_SIZE) {
+                fprintf(stderr, "Invalid compressed page length %d\n", len);
+                ret = -EINVAL;
+                goto done;
+            }
+            decompress_data_with_multi_threads(f, host, len);
         }
         error = qemu_file_get_error(f);
         if (error) {
@@ -873,6 +1668,11 @@ static int ram_load(QEMUFile *f, void *opaque, int version_id)
     } while (!(flags & RAM_SAVE_FLAG_EOS));
 
 done:
+    /* a page may be sent again in the next section */
+    if (wait_for_decompress_done() < 0) {
+        fprintf(stderr, "Failed to load compressed page\n");
+        ret = -EINVAL;
+    }
     DPRINTF("Completed load of VM with exit code %d seq iteration "
             "%" PRIu64 "\n", ret, seq_iter);
     return ret;
@@ -883,6 +1683,7 @@ SaveVMHandlers savevm_ram_handlers = {
     .save_live_iterate = ram_save_iterate,
     .save_live_complete = ram_save_complete,
     .save_live_pending = ram_save_pending,
+    .has_postcopy = ram_has_postcopy,
     .load_state = ram_load,
     .cancel = ram_migration_cancel,
 };
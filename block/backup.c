@@ -0,0 +1,481 @@
+/*
+ * Point-in-time backup
+ *
+ * Copyright Red Hat, Inc. 2013
+ *
+ * This work is licensed under the terms of the GNU LGPL, version 2 or later.
+ * See the COPYING.LIB file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "block/block_int.h"
+#include "block/blockjob.h"
+#include "qemu/ratelimit.h"
+
+#define BACKUP_CLUSTER_BITS 16
+#define BACKUP_CLUSTER_SIZE (1 << BACKUP_CLUSTER_BITS)
+#define BACKUP_SECTORS_PER_CLUSTER (BACKUP_CLUSTER_SIZE / BDRV_SECTOR_SIZE)
+
+#define SLICE_TIME 100000000ULL /* ns */
+
+typedef struct CowRequest {
+    int64_t start;
+    int64_t end;
+    QLIST_ENTRY(CowRequest) list;
+    CoQueue wait_queue; /* coroutines blocked on this request */
+} CowRequest;
+
+typedef struct BackupBlockJob {
+    BlockJob common;
+    BlockDriverState *target;
+    MirrorSyncMode sync_mode;
+    BdrvDirtyBitmap *sync_bitmap;
+    BdrvDirtyBitmap *frozen_bitmap;
+    RateLimit limit;
+    BlockdevOnError on_source_error;
+    BlockdevOnError on_target_error;
+    CoRwlock flush_rwlock;
+    uint64_t sectors_read;
+    HBitmap *bitmap;
+    int cow_ret;
+    QLIST_HEAD(, CowRequest) inflight_reqs;
+} BackupBlockJob;
+
+/* See if in-flight requests overlap and wait for them to complete */
+static void coroutine_fn wait_for_overlapping_requests(BackupBlockJob *job,
+                                                       int64_t start,
+                                                       int64_t end)
+{
+    CowRequest *req;
+    bool retry;
+
+    do {
+        retry = false;
+        QLIST_FOREACH(req, &job->inflight_reqs, list) {
+            if (end > req->start && start < req->end) {
+                qemu_co_queue_wait(&req->wait_queue);
+                retry = true;
+                break;
+            }
+        }
+    } while (retry);
+}
+
+/* Keep track of an in-flight request */
+static void cow_request_begin(CowRequest *req, BackupBlockJob *job,
+                              int64_t start, int64_t end)
+{
+    req->start = start;
+    req->end = end;
+    qemu_co_queue_init(&req->wait_queue);
+    QLIST_INSERT_HEAD(&job->inflight_reqs, req, list);
+}
+
+/* Forget about a completed request */
+static void cow_request_end(CowRequest *req)
+{
+    QLIST_REMOVE(req, list);
+    qemu_co_queue_restart_all(&req->wait_queue);
+}
+
+static int coroutine_fn backup_do_cow(BlockDriverState *bs,
+                                      int64_t sector_num, int nb_sectors,
+                                      bool *error_is_read)
+{
+    BackupBlockJob *job = (BackupBlockJob *)bs->job;
+    CowRequest cow_request;
+    struct iovec iov;
+    QEMUIOVector bounce_qiov;
+    void *bounce_buffer = NULL;
+    int ret = 0;
+    int64_t start, end, total_sectors;
+    int n;
+
+    qemu_co_rwlock_rdlock(&job->flush_rwlock);
+
+    start = sector_num / BACKUP_SECTORS_PER_CLUSTER;
+    end = DIV_ROUND_UP(sector_num + nb_sectors, BACKUP_SECTORS_PER_CLUSTER);
+    total_sectors = job->common.len >> BDRV_SECTOR_BITS;
+
+    trace_backup_do_cow_enter(job, start, sector_num, nb_sectors);
+
+    wait_for_overlapping_requests(job, start, end);
+    cow_request_begin(&cow_request, job, start, end);
+
+    for (; start < end; start++) {
+        if (hbitmap_get(job->bitmap, start)) {
+            trace_backup_do_cow_skip(job, start);
+            continue; /* already copied */
+        }
+
+        trace_backup_do_cow_process(job, start);
+
+        n = MIN(BACKUP_SECTORS_PER_CLUSTER,
+                total_sectors - start * BACKUP_SECTORS_PER_CLUSTER);
+
+        if (!bounce_buffer) {
+            bounce_buffer = qemu_blockalign(bs, BACKUP_CLUSTER_SIZE);
+        }
+        iov.iov_base = bounce_buffer;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&bounce_qiov, &iov, 1);
+
+        ret = bdrv_co_readv(bs, start * BACKUP_SECTORS_PER_CLUSTER, n,
+                            &bounce_qiov);
+        if (ret < 0) {
+            trace_backup_do_cow_read_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = true;
+            }
+            goto out;
+        }
+
+        if (buffer_is_zero(iov.iov_base, iov.iov_len)) {
+            ret = bdrv_co_write_zeroes(job->target,
+                                       start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                       0);
+        } else {
+            ret = bdrv_co_writev(job->target,
+                                 start * BACKUP_SECTORS_PER_CLUSTER, n,
+                                 &bounce_qiov);
+        }
+        if (ret < 0) {
+            trace_backup_do_cow_write_fail(job, start, ret);
+            if (error_is_read) {
+                *error_is_read = false;
+            }
+            goto out;
+        }
+
+        hbitmap_set(job->bitmap, start, 1);
+
+        /* Publish progress, guest I/O counts as progress too.  Note that the
+         * offset field is an opaque progress value, it is not a disk offset.
+         */
+        job->sectors_read += n;
+        job->common.offset += n * BDRV_SECTOR_SIZE;
+    }
+
+out:
+    if (bounce_buffer) {
+        qemu_vfree(bounce_buffer);
+    }
+
+    cow_request_end(&cow_request);
+
+    trace_backup_do_cow_return(job, sector_num, nb_sectors, ret);
+
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    return ret;
+}
+
+static int coroutine_fn backup_before_write_notify(
+        NotifierWithReturn *notifier,
+        void *opaque)
+{
+    BdrvTrackedRequest *req = opaque;
+    BackupBlockJob *job = (BackupBlockJob *)req->bs->job;
+    int ret;
+
+    if (job->cow_ret < 0) {
+        return 0;
+    }
+
+    /* The backup cannot be consistent any more once the old data of a
+     * cluster is lost, but there is no point in failing the guest request
+     * as well.  Let the job fail instead.
+     */
+    ret = backup_do_cow(req->bs, req->sector_num, req->nb_sectors, NULL);
+    if (ret < 0) {
+        job->cow_ret = ret;
+        if (!job->common.busy) {
+            qemu_coroutine_enter(job->common.co, NULL);
+        }
+    }
+    return 0;
+}
+
+static void backup_set_speed(BlockJob *job, int64_t speed, Error **errp)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    if (speed < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER, "speed");
+        return;
+    }
+    ratelimit_set_speed(&s->limit, speed / BDRV_SECTOR_SIZE, SLICE_TIME);
+}
+
+static void backup_iostatus_reset(BlockJob *job)
+{
+    BackupBlockJob *s = container_of(job, BackupBlockJob, common);
+
+    bdrv_iostatus_reset(s->target);
+}
+
+static BlockJobType backup_job_type = {
+    .instance_size  = sizeof(BackupBlockJob),
+    .job_type       = "backup",
+    .set_speed      = backup_set_speed,
+    .iostatus_reset = backup_iostatus_reset,
+};
+
+static BlockErrorAction backup_error_action(BackupBlockJob *job,
+                                            bool read, int error)
+{
+    if (read) {
+        return block_job_error_action(&job->common, job->common.bs,
+                                      job->on_source_error, true, error);
+    } else {
+        return block_job_error_action(&job->common, job->target,
+                                      job->on_target_error, false, error);
+    }
+}
+
+/* Mark the clusters that are clean in the sync bitmap as already copied.
+ * Their contents are expected to be in the backing file of the target.
+ */
+static void backup_init_incremental(BackupBlockJob *job, int64_t end)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sectors_per_chunk =
+        bdrv_dirty_bitmap_granularity(job->frozen_bitmap) >> BDRV_SECTOR_BITS;
+    HBitmapIter hbi;
+    int64_t sector, first, last, clean;
+
+    hbitmap_set(job->bitmap, 0, end);
+    bdrv_dirty_iter_init(bs, job->frozen_bitmap, &hbi);
+    while ((sector = hbitmap_iter_next(&hbi)) >= 0) {
+        first = sector / BACKUP_SECTORS_PER_CLUSTER;
+        last = DIV_ROUND_UP(sector + sectors_per_chunk,
+                            BACKUP_SECTORS_PER_CLUSTER);
+        hbitmap_reset(job->bitmap, first, MIN(last, end) - first);
+    }
+
+    /* Clean clusters count as progress right away */
+    clean = hbitmap_count(job->bitmap) * (int64_t)BACKUP_CLUSTER_SIZE;
+    if (hbitmap_get(job->bitmap, end - 1)) {
+        clean -= end * (int64_t)BACKUP_CLUSTER_SIZE - job->common.len;
+    }
+    job->common.offset = clean;
+}
+
+/* Return whether any sector of the cluster is allocated in the top image */
+static int coroutine_fn backup_cluster_allocated(BackupBlockJob *job,
+                                                 int64_t cluster)
+{
+    BlockDriverState *bs = job->common.bs;
+    int64_t sector_num = cluster * BACKUP_SECTORS_PER_CLUSTER;
+    int64_t total_sectors = job->common.len >> BDRV_SECTOR_BITS;
+    int nb_sectors = MIN(BACKUP_SECTORS_PER_CLUSTER, total_sectors - sector_num);
+    int i, n, ret;
+
+    /* bdrv_co_is_allocated() only describes the first run of sectors that
+     * are in the same state, so look at the whole cluster.
+     */
+    for (i = 0; i < nb_sectors; i += n) {
+        ret = bdrv_co_is_allocated(bs, sector_num + i, nb_sectors - i, &n);
+        if (ret != 0 || n == 0) {
+            return ret < 0 ? ret : 1;
+        }
+    }
+    return 0;
+}
+
+static void coroutine_fn backup_run(void *opaque)
+{
+    BackupBlockJob *job = opaque;
+    BlockDriverState *bs = job->common.bs;
+    BlockDriverState *target = job->target;
+    BlockdevOnError on_target_error = job->on_target_error;
+    NotifierWithReturn before_write = {
+        .notify = backup_before_write_notify,
+    };
+    int64_t start, end;
+    int ret = 0;
+
+    QLIST_INIT(&job->inflight_reqs);
+    qemu_co_rwlock_init(&job->flush_rwlock);
+
+    start = 0;
+    end = DIV_ROUND_UP(job->common.len / BDRV_SECTOR_SIZE,
+                       BACKUP_SECTORS_PER_CLUSTER);
+
+    job->bitmap = hbitmap_alloc(end, 0);
+    if (job->sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        backup_init_incremental(job, end);
+    }
+
+    bdrv_set_enable_write_cache(target, true);
+    bdrv_set_on_error(target, on_target_error, on_target_error);
+    bdrv_iostatus_enable(target);
+
+    bdrv_add_before_write_notifier(bs, &before_write);
+
+    if (job->sync_mode == MIRROR_SYNC_MODE_NONE) {
+        while (!block_job_is_cancelled(&job->common) && job->cow_ret == 0) {
+            /* Yield until the job is cancelled.  We just let our before_write
+             * notify callback service CoW requests.
+             */
+            job->common.busy = false;
+            qemu_coroutine_yield();
+            job->common.busy = true;
+        }
+    } else {
+        /* The remaining modes copy all the clusters that are not done yet */
+        for (; start < end; start++) {
+            bool error_is_read;
+
+            if (block_job_is_cancelled(&job->common) || job->cow_ret < 0) {
+                break;
+            }
+
+            /* Yield periodically so that qemu_aio_flush() returns */
+            if (job->common.speed) {
+                uint64_t delay_ns = ratelimit_calculate_delay(
+                        &job->limit, job->sectors_read);
+                job->sectors_read = 0;
+                block_job_sleep_ns(&job->common, rt_clock, delay_ns);
+            } else {
+                block_job_sleep_ns(&job->common, rt_clock, 0);
+            }
+
+            if (block_job_is_cancelled(&job->common) || job->cow_ret < 0) {
+                break;
+            }
+
+            if (hbitmap_get(job->bitmap, start)) {
+                continue;
+            }
+
+            if (job->sync_mode == MIRROR_SYNC_MODE_TOP) {
+                ret = backup_cluster_allocated(job, start);
+                if (ret == 0) {
+                    /* The target's backing file has this cluster */
+                    hbitmap_set(job->bitmap, start, 1);
+                    job->common.offset += MIN(BACKUP_CLUSTER_SIZE,
+                        job->common.len - start * BACKUP_CLUSTER_SIZE);
+                    continue;
+                }
+            }
+
+            ret = backup_do_cow(bs, start * BACKUP_SECTORS_PER_CLUSTER,
+                                BACKUP_SECTORS_PER_CLUSTER, &error_is_read);
+            if (ret < 0) {
+                /* Depending on error action, fail now or retry cluster */
+                BlockErrorAction action =
+                    backup_error_action(job, error_is_read, -ret);
+                if (action == BDRV_ACTION_REPORT) {
+                    break;
+                } else {
+                    start--;
+                    continue;
+                }
+            }
+        }
+    }
+
+    notifier_with_return_remove(&before_write);
+
+    /* wait until pending backup_do_cow() calls have completed */
+    qemu_co_rwlock_wrlock(&job->flush_rwlock);
+    qemu_co_rwlock_unlock(&job->flush_rwlock);
+
+    if (ret == 0 && job->cow_ret < 0) {
+        ret = job->cow_ret;
+    }
+    if (ret == 0 && !block_job_is_cancelled(&job->common)) {
+        ret = bdrv_flush(target);
+    }
+
+    if (job->frozen_bitmap) {
+        if (ret < 0 || block_job_is_cancelled(&job->common)) {
+            /* The next backup has to copy these clusters again */
+            bdrv_merge_dirty_bitmap(bs, job->sync_bitmap, job->frozen_bitmap);
+        }
+        bdrv_release_dirty_bitmap(bs, job->frozen_bitmap);
+    }
+
+    hbitmap_free(job->bitmap);
+
+    bdrv_iostatus_disable(target);
+    bdrv_delete(target);
+
+    block_job_completed(&job->common, ret);
+}
+
+void backup_start(BlockDriverState *bs, BlockDriverState *target,
+                  int64_t speed, MirrorSyncMode sync_mode,
+                  BdrvDirtyBitmap *bitmap,
+                  BlockdevOnError on_source_error,
+                  BlockdevOnError on_target_error,
+                  BlockDriverCompletionFunc *cb, void *opaque,
+                  Error **errp)
+{
+    BdrvDirtyBitmap *frozen_bitmap = NULL;
+    BackupBlockJob *job;
+    int64_t len;
+
+    assert(bs);
+    assert(target);
+    assert(cb);
+    assert((sync_mode == MIRROR_SYNC_MODE_INCREMENTAL) == (bitmap != NULL));
+
+    if ((on_source_error == BLOCKDEV_ON_ERROR_STOP ||
+         on_source_error == BLOCKDEV_ON_ERROR_ENOSPC) &&
+        !bdrv_iostatus_is_enabled(bs)) {
+        error_set(errp, QERR_INVALID_PARAMETER, "on-source-error");
+        return;
+    }
+
+    /* Copy-before-write reads the source from within a guest write, which
+     * would wait for the write itself if requests are serialized.
+     */
+    if (bs->copy_on_read) {
+        error_setg(errp, "Backup is not supported with copy-on-read");
+        return;
+    }
+
+    len = bdrv_getlength(bs);
+    if (len < 0) {
+        error_setg_errno(errp, -len, "unable to get length for '%s'",
+                         bdrv_get_device_name(bs));
+        return;
+    }
+
+    if (bitmap) {
+        /* Take over the current contents of the bitmap, so that it tracks
+         * the writes that the next incremental backup has to copy.
+         */
+        frozen_bitmap = bdrv_create_dirty_bitmap(bs,
+            bdrv_dirty_bitmap_granularity(bitmap), NULL, errp);
+        if (!frozen_bitmap) {
+            return;
+        }
+        bdrv_merge_dirty_bitmap(bs, frozen_bitmap, bitmap);
+    }
+
+    job = block_job_create(&backup_job_type, bs, speed, cb, opaque, errp);
+    if (!job) {
+        if (frozen_bitmap) {
+            bdrv_release_dirty_bitmap(bs, frozen_bitmap);
+        }
+        return;
+    }
+
+    if (bitmap) {
+        bdrv_clear_dirty_bitmap(bs, bitmap);
+    }
+
+    job->on_source_error = on_source_error;
+    job->on_target_error = on_target_error;
+    job->target = target;
+    job->sync_mode = sync_mode;
+    job->sync_bitmap = bitmap;
+    job->frozen_bitmap = frozen_bitmap;
+    job->common.len = len;
+    job->common.co = qemu_coroutine_create(backup_run);
+    qemu_coroutine_enter(job->common.co, job);
+}
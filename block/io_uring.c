@@ -0,0 +1,489 @@
+/*
+ * Linux io_uring support.
+ *
+ * Copyright Red Hat, Inc. 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+#include "qemu-common.h"
+#include "block/aio.h"
+#include "qemu/queue.h"
+#include "qemu/atomic.h"
+#include "block/raw-aio.h"
+#include "qemu/event_notifier.h"
+#include "trace.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+/*
+ * Ring size (per-device).  The completion ring is twice as large, so it
+ * can never overflow as long as no more than this many requests are in
+ * flight.  Requests beyond that wait in the pending queue.
+ */
+#define MAX_ENTRIES 128
+
+struct qemu_luringcb {
+    BlockDriverAIOCB common;
+    struct qemu_luring_state *s;
+    struct io_uring_sqe sqe;
+    ssize_t ret;
+    size_t nbytes;
+    QEMUIOVector *qiov;
+    bool is_read;
+    QSIMPLEQ_ENTRY(qemu_luringcb) next;
+};
+
+/*
+ * The rings are shared with the kernel.  The kernel advances the submission
+ * head and the completion tail, we advance the other two.
+ */
+typedef struct {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    unsigned *array;
+    struct io_uring_sqe *sqes;
+} LuringSQ;
+
+typedef struct {
+    unsigned *head;
+    unsigned *tail;
+    unsigned *ring_mask;
+    struct io_uring_cqe *cqes;
+} LuringCQ;
+
+/*
+ * Requests that are not in the submission ring yet.  While the queue is
+ * plugged they are collected here and submitted together on unplug.
+ */
+typedef struct {
+    QSIMPLEQ_HEAD(, qemu_luringcb) pending;
+    unsigned int plugged;
+    unsigned int queued;        /* in the submission ring, not consumed */
+    unsigned int in_flight;     /* consumed by the kernel */
+} LuringQueue;
+
+struct qemu_luring_state {
+    int fd;
+    AioContext *aio_context;
+    EventNotifier e;
+    int count;      /* pending and in-flight requests */
+    LuringQueue io_q;
+
+    void *sq_ring;
+    size_t sq_ring_size;
+    void *cq_ring;
+    size_t cq_ring_size;
+    size_t sqes_size;
+    LuringSQ sq;
+    LuringCQ cq;
+};
+
+static int io_uring_setup(unsigned entries, struct io_uring_params *p)
+{
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int io_uring_enter(int fd, unsigned to_submit, unsigned min_complete,
+                          unsigned flags)
+{
+    return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags,
+                   NULL, 0);
+}
+
+static int io_uring_register(int fd, unsigned opcode, void *arg,
+                             unsigned nr_args)
+{
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void ioq_submit(struct qemu_luring_state *s);
+
+/*
+ * Completes an io_uring request (calls the callback and frees the ACB).
+ */
+static void luring_process_completion(struct qemu_luring_state *s,
+                                      struct qemu_luringcb *luringcb)
+{
+    int ret;
+
+    s->count--;
+
+    ret = luringcb->ret;
+    if (ret == luringcb->nbytes) {
+        ret = 0;
+    } else if (ret >= 0) {
+        /* Short reads mean EOF, pad with zeros. */
+        if (luringcb->is_read) {
+            qemu_iovec_memset(luringcb->qiov, ret, 0,
+                              luringcb->qiov->size - ret);
+            ret = 0;
+        } else {
+            ret = -EINVAL;
+        }
+    }
+
+    trace_luring_process_completion(s, luringcb, ret);
+    luringcb->common.cb(luringcb->common.opaque, ret);
+    qemu_aio_release(luringcb);
+}
+
+/*
+ * Reaps the completion ring.  This only reads shared memory, so it is cheap
+ * enough to be called whenever requests may have finished, not just when
+ * the eventfd fires.
+ */
+static void luring_process_completions(struct qemu_luring_state *s)
+{
+    unsigned head = *s->cq.head;
+
+    for (;;) {
+        struct qemu_luringcb *luringcb;
+        struct io_uring_cqe *cqe;
+        unsigned tail;
+
+        tail = *s->cq.tail;
+        smp_rmb();
+        if (head == tail) {
+            break;
+        }
+
+        cqe = &s->cq.cqes[head & *s->cq.ring_mask];
+        luringcb = (struct qemu_luringcb *)(uintptr_t)cqe->user_data;
+        luringcb->ret = cqe->res;
+
+        /* Give the entry back before the callback can submit more I/O */
+        smp_mb();
+        *s->cq.head = ++head;
+
+        s->io_q.in_flight--;
+        luring_process_completion(s, luringcb);
+    }
+}
+
+static void luring_completion_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    if (event_notifier_test_and_clear(&s->e)) {
+        luring_process_completions(s);
+
+        /* Completions made room for requests that did not fit */
+        if (!s->io_q.plugged) {
+            ioq_submit(s);
+        }
+    }
+}
+
+static int luring_flush_cb(EventNotifier *e)
+{
+    struct qemu_luring_state *s = container_of(e, struct qemu_luring_state, e);
+
+    /* Somebody waits for completion, so nothing may be held back */
+    ioq_submit(s);
+    luring_process_completions(s);
+    return (s->count > 0) ? 1 : 0;
+}
+
+/*
+ * Takes back the entries that the kernel has not consumed and fails them.
+ * Without SQPOLL the kernel only reads the submission ring inside
+ * io_uring_enter(), so this is safe.
+ */
+static void ioq_fail_queued(struct qemu_luring_state *s, int ret)
+{
+    unsigned tail = *s->sq.tail;
+
+    while (s->io_q.queued > 0) {
+        struct io_uring_sqe *sqe;
+        struct qemu_luringcb *luringcb;
+
+        tail--;
+        sqe = &s->sq.sqes[tail & *s->sq.ring_mask];
+        luringcb = (struct qemu_luringcb *)(uintptr_t)sqe->user_data;
+        *s->sq.tail = tail;
+        s->io_q.queued--;
+
+        luringcb->ret = ret;
+        luring_process_completion(s, luringcb);
+    }
+}
+
+/*
+ * Moves pending requests into the submission ring and passes them to the
+ * kernel with a single io_uring_enter().  If the kernel is short of
+ * resources, they stay in the ring and are retried when a request
+ * completes.
+ */
+static void ioq_submit(struct qemu_luring_state *s)
+{
+    struct qemu_luringcb *luringcb;
+    unsigned tail = *s->sq.tail;
+    int ret;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending) &&
+           s->io_q.queued + s->io_q.in_flight < MAX_ENTRIES) {
+        unsigned idx = tail & *s->sq.ring_mask;
+
+        luringcb = QSIMPLEQ_FIRST(&s->io_q.pending);
+        QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        s->sq.sqes[idx] = luringcb->sqe;
+        s->sq.array[idx] = idx;
+        tail++;
+        s->io_q.queued++;
+    }
+
+    if (s->io_q.queued == 0) {
+        return;
+    }
+
+    smp_wmb();
+    *s->sq.tail = tail;
+
+    do {
+        ret = io_uring_enter(s->fd, s->io_q.queued, 0, 0);
+    } while (ret < 0 && errno == EINTR);
+
+    trace_luring_submit(s, s->io_q.queued, ret);
+    if (ret < 0) {
+        ret = -errno;
+        if ((ret == -EAGAIN || ret == -EBUSY) && s->io_q.in_flight > 0) {
+            return;
+        }
+        /* Nothing will complete to retry on, so give up on these */
+        ioq_fail_queued(s, ret);
+        return;
+    }
+
+    s->io_q.queued -= ret;
+    s->io_q.in_flight += ret;
+}
+
+static bool ioq_remove(struct qemu_luring_state *s,
+                       struct qemu_luringcb *luringcb)
+{
+    struct qemu_luringcb *p;
+
+    QSIMPLEQ_FOREACH(p, &s->io_q.pending, next) {
+        if (p == luringcb) {
+            QSIMPLEQ_REMOVE(&s->io_q.pending, luringcb, qemu_luringcb, next);
+            return true;
+        }
+    }
+    return false;
+}
+
+static void luring_cancel(BlockDriverAIOCB *blockacb)
+{
+    struct qemu_luringcb *luringcb = (struct qemu_luringcb *)blockacb;
+    struct qemu_luring_state *s = luringcb->s;
+
+    if (luringcb->ret != -EINPROGRESS) {
+        return;
+    }
+
+    /* Not submitted yet, simply drop it */
+    if (ioq_remove(s, luringcb)) {
+        s->count--;
+        qemu_aio_release(luringcb);
+        return;
+    }
+
+    /* Otherwise wait for it, the kernel does not cancel file I/O anyway */
+    while (luringcb->ret == -EINPROGRESS) {
+        ioq_submit(s);
+        io_uring_enter(s->fd, 0, 1, IORING_ENTER_GETEVENTS);
+        luring_process_completions(s);
+    }
+}
+
+static const AIOCBInfo luring_aiocb_info = {
+    .aiocb_size         = sizeof(struct qemu_luringcb),
+    .cancel             = luring_cancel,
+};
+
+BlockDriverAIOCB *luring_submit(BlockDriverState *bs, void *aio_ctx, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        BlockDriverCompletionFunc *cb, void *opaque, int type)
+{
+    struct qemu_luring_state *s = aio_ctx;
+    struct qemu_luringcb *luringcb;
+    struct io_uring_sqe *sqe;
+
+    luringcb = qemu_aio_get(&luring_aiocb_info, bs, cb, opaque);
+    luringcb->nbytes = nb_sectors * 512;
+    luringcb->s = s;
+    luringcb->ret = -EINPROGRESS;
+    luringcb->is_read = (type == QEMU_AIO_READ);
+    luringcb->qiov = qiov;
+
+    sqe = &luringcb->sqe;
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->fd = fd;
+    sqe->user_data = (uintptr_t)luringcb;
+
+    switch (type) {
+    case QEMU_AIO_WRITE:
+        sqe->opcode = IORING_OP_WRITEV;
+        break;
+    case QEMU_AIO_READ:
+        sqe->opcode = IORING_OP_READV;
+        break;
+    case QEMU_AIO_FLUSH:
+        sqe->opcode = IORING_OP_FSYNC;
+        break;
+    default:
+        fprintf(stderr, "%s: invalid AIO request type 0x%x.\n",
+                        __func__, type);
+        qemu_aio_release(luringcb);
+        return NULL;
+    }
+
+    if (qiov) {
+        sqe->addr = (uintptr_t)qiov->iov;
+        sqe->len = qiov->niov;
+        sqe->off = sector_num * 512;
+    }
+
+    s->count++;
+    QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, luringcb, next);
+    if (!s->io_q.plugged) {
+        ioq_submit(s);
+    }
+    return &luringcb->common;
+}
+
+void luring_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void luring_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0) {
+        ioq_submit(s);
+    }
+}
+
+static int luring_map_rings(struct qemu_luring_state *s,
+                            struct io_uring_params *p)
+{
+    s->sq_ring_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    s->cq_ring_size = p->cq_off.cqes +
+                      p->cq_entries * sizeof(struct io_uring_cqe);
+    s->sqes_size = p->sq_entries * sizeof(struct io_uring_sqe);
+
+    s->sq_ring = mmap(NULL, s->sq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->fd, IORING_OFF_SQ_RING);
+    if (s->sq_ring == MAP_FAILED) {
+        s->sq_ring = NULL;
+        return -errno;
+    }
+
+    s->cq_ring = mmap(NULL, s->cq_ring_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->fd, IORING_OFF_CQ_RING);
+    if (s->cq_ring == MAP_FAILED) {
+        s->cq_ring = NULL;
+        return -errno;
+    }
+
+    s->sq.sqes = mmap(NULL, s->sqes_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED | MAP_POPULATE, s->fd, IORING_OFF_SQES);
+    if (s->sq.sqes == MAP_FAILED) {
+        s->sq.sqes = NULL;
+        return -errno;
+    }
+
+    s->sq.head = s->sq_ring + p->sq_off.head;
+    s->sq.tail = s->sq_ring + p->sq_off.tail;
+    s->sq.ring_mask = s->sq_ring + p->sq_off.ring_mask;
+    s->sq.array = s->sq_ring + p->sq_off.array;
+
+    s->cq.head = s->cq_ring + p->cq_off.head;
+    s->cq.tail = s->cq_ring + p->cq_off.tail;
+    s->cq.ring_mask = s->cq_ring + p->cq_off.ring_mask;
+    s->cq.cqes = s->cq_ring + p->cq_off.cqes;
+    return 0;
+}
+
+static void luring_unmap_rings(struct qemu_luring_state *s)
+{
+    if (s->sq.sqes) {
+        munmap(s->sq.sqes, s->sqes_size);
+    }
+    if (s->cq_ring) {
+        munmap(s->cq_ring, s->cq_ring_size);
+    }
+    if (s->sq_ring) {
+        munmap(s->sq_ring, s->sq_ring_size);
+    }
+}
+
+/*
+ * Completions are signalled through an eventfd that is registered with
+ * the given AioContext, so the rings can be driven by a dataplane thread
+ * as well as by the main loop.
+ */
+void *luring_init(AioContext *ctx)
+{
+    struct qemu_luring_state *s;
+    struct io_uring_params p;
+    int efd;
+
+    s = g_malloc0(sizeof(*s));
+    QSIMPLEQ_INIT(&s->io_q.pending);
+    s->aio_context = ctx;
+
+    memset(&p, 0, sizeof(p));
+    s->fd = io_uring_setup(MAX_ENTRIES, &p);
+    if (s->fd < 0) {
+        goto out_free_state;
+    }
+    qemu_set_cloexec(s->fd);
+
+    if (luring_map_rings(s, &p) < 0) {
+        goto out_unmap;
+    }
+
+    if (event_notifier_init(&s->e, false) < 0) {
+        goto out_unmap;
+    }
+
+    efd = event_notifier_get_fd(&s->e);
+    if (io_uring_register(s->fd, IORING_REGISTER_EVENTFD, &efd, 1) < 0) {
+        goto out_close_efd;
+    }
+
+    aio_set_event_notifier(ctx, &s->e, luring_completion_cb,
+                           luring_flush_cb);
+    return s;
+
+out_close_efd:
+    event_notifier_cleanup(&s->e);
+out_unmap:
+    luring_unmap_rings(s);
+    close(s->fd);
+out_free_state:
+    g_free(s);
+    return NULL;
+}
+
+void luring_cleanup(void *aio_ctx)
+{
+    struct qemu_luring_state *s = aio_ctx;
+
+    assert(s->count == 0);
+    aio_set_event_notifier(s->aio_context, &s->e, NULL, NULL);
+    event_notifier_cleanup(&s->e);
+    luring_unmap_rings(s);
+    close(s->fd);
+    g_free(s);
+}
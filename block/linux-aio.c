@@ -19,9 +19,8 @@
  * Queue size (per-device).
  *
  * XXX: eventually we need to communicate this to the guest and/or make it
- *      tunable by the guest.  If we get more outstanding requests at a time
- *      than this we will get EAGAIN from io_submit which is communicated to
- *      the guest as an I/O error.
+ *      tunable by the guest.  Requests beyond this number wait in the
+ *      pending queue until earlier ones complete.
  */
 #define MAX_EVENTS 128
 
@@ -33,13 +32,24 @@ struct qemu_laiocb {
     size_t nbytes;
     QEMUIOVector *qiov;
     bool is_read;
-    QLIST_ENTRY(qemu_laiocb) node;
+    QSIMPLEQ_ENTRY(qemu_laiocb) next;
 };
 
+/*
+ * Requests that have not been passed to io_submit yet.  While the queue is
+ * plugged they are collected here and submitted together on unplug.
+ */
+typedef struct {
+    QSIMPLEQ_HEAD(, qemu_laiocb) pending;
+    unsigned int plugged;
+    unsigned int in_flight;
+} LaioQueue;
+
 struct qemu_laio_state {
     io_context_t ctx;
     EventNotifier e;
-    int count;
+    int count;      /* pending and in-flight requests */
+    LaioQueue io_q;
 };
 
 static inline ssize_t io_event_ret(struct io_event *ev)
@@ -47,6 +57,8 @@ static inline ssize_t io_event_ret(struct io_event *ev)
     return (ssize_t)(((uint64_t)ev->res2 << 32) | ev->res);
 }
 
+static void ioq_submit(struct qemu_laio_state *s);
+
 /*
  * Completes an AIO request (calls the callback and frees the ACB).
  */
@@ -96,8 +108,14 @@ static void qemu_laio_completion_cb(EventNotifier *e)
                     container_of(iocb, struct qemu_laiocb, iocb);
 
             laiocb->ret = io_event_ret(&events[i]);
+            s->io_q.in_flight--;
             qemu_laio_process_completion(s, laiocb);
         }
+
+        /* Completions made room for requests that did not fit */
+        if (!s->io_q.plugged) {
+            ioq_submit(s);
+        }
     }
 }
 
@@ -105,9 +123,70 @@ static int qemu_laio_flush_cb(EventNotifier *e)
 {
     struct qemu_laio_state *s = container_of(e, struct qemu_laio_state, e);
 
+    /* Somebody waits for completion, so nothing may be held back */
+    ioq_submit(s);
     return (s->count > 0) ? 1 : 0;
 }
 
+static bool ioq_remove(struct qemu_laio_state *s, struct qemu_laiocb *laiocb)
+{
+    struct qemu_laiocb *p;
+
+    QSIMPLEQ_FOREACH(p, &s->io_q.pending, next) {
+        if (p == laiocb) {
+            QSIMPLEQ_REMOVE(&s->io_q.pending, laiocb, qemu_laiocb, next);
+            return true;
+        }
+    }
+    return false;
+}
+
+/*
+ * Passes pending requests to the kernel, batching as many as the io context
+ * has room for into each io_submit.  If the kernel is short of resources,
+ * the rest stay queued and are retried when a request completes.
+ */
+static void ioq_submit(struct qemu_laio_state *s)
+{
+    struct iocb *iocbs[MAX_EVENTS];
+    struct qemu_laiocb *laiocb;
+    int len, ret, i;
+
+    while (!QSIMPLEQ_EMPTY(&s->io_q.pending)) {
+        len = 0;
+        QSIMPLEQ_FOREACH(laiocb, &s->io_q.pending, next) {
+            if (len == MAX_EVENTS - s->io_q.in_flight) {
+                break;
+            }
+            iocbs[len++] = &laiocb->iocb;
+        }
+        if (len == 0) {
+            break;
+        }
+
+        ret = io_submit(s->ctx, len, iocbs);
+        if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+            break;
+        }
+        if (ret < 0) {
+            /* Nothing will complete to retry on, so give up on this one */
+            laiocb = QSIMPLEQ_FIRST(&s->io_q.pending);
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+            laiocb->ret = ret;
+            qemu_laio_process_completion(s, laiocb);
+            continue;
+        }
+
+        for (i = 0; i < ret; i++) {
+            QSIMPLEQ_REMOVE_HEAD(&s->io_q.pending, next);
+        }
+        s->io_q.in_flight += ret;
+        if (ret < len) {
+            break;
+        }
+    }
+}
+
 static void laio_cancel(BlockDriverAIOCB *blockacb)
 {
     struct qemu_laiocb *laiocb = (struct qemu_laiocb *)blockacb;
@@ -117,6 +196,13 @@ static void laio_cancel(BlockDriverAIOCB *blockacb)
     if (laiocb->ret != -EINPROGRESS)
         return;
 
+    /* Not submitted yet, simply drop it */
+    if (ioq_remove(laiocb->ctx, laiocb)) {
+        laiocb->ctx->count--;
+        qemu_aio_release(laiocb);
+        return;
+    }
+
     /*
      * Note that as of Linux 2.6.31 neither the block device code nor any
      * filesystem implements cancellation of AIO request.
@@ -153,6 +239,7 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     struct qemu_laiocb *laiocb;
     struct iocb *iocbs;
     off_t offset = sector_num * 512;
+    int ret;
 
     laiocb = qemu_aio_get(&laio_aiocb_info, bs, cb, opaque);
     laiocb->nbytes = nb_sectors * 512;
@@ -179,8 +266,26 @@ BlockDriverAIOCB *laio_submit(BlockDriverState *bs, void *aio_ctx, int fd,
     io_set_eventfd(&laiocb->iocb, event_notifier_get_fd(&s->e));
     s->count++;
 
-    if (io_submit(s->ctx, 1, &iocbs) < 0)
+    /*
+     * Requests are queued while plugged, or behind others that did not fit.
+     * Otherwise submit right away, so that an error can still be returned
+     * to the caller.
+     */
+    if (s->io_q.plugged || !QSIMPLEQ_EMPTY(&s->io_q.pending) ||
+        s->io_q.in_flight == MAX_EVENTS) {
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+        return &laiocb->common;
+    }
+
+    ret = io_submit(s->ctx, 1, &iocbs);
+    if (ret == -EAGAIN && s->io_q.in_flight > 0) {
+        QSIMPLEQ_INSERT_TAIL(&s->io_q.pending, laiocb, next);
+        return &laiocb->common;
+    }
+    if (ret < 0) {
         goto out_dec_count;
+    }
+    s->io_q.in_flight++;
     return &laiocb->common;
 
 out_dec_count:
@@ -190,11 +295,29 @@ out_free_aiocb:
     return NULL;
 }
 
+void laio_io_plug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    s->io_q.plugged++;
+}
+
+void laio_io_unplug(BlockDriverState *bs, void *aio_ctx)
+{
+    struct qemu_laio_state *s = aio_ctx;
+
+    assert(s->io_q.plugged > 0);
+    if (--s->io_q.plugged == 0) {
+        ioq_submit(s);
+    }
+}
+
 void *laio_init(void)
 {
     struct qemu_laio_state *s;
 
     s = g_malloc0(sizeof(*s));
+    QSIMPLEQ_INIT(&s->io_q.pending);
     if (event_notifier_init(&s->e, false) < 0) {
         goto out_free_state;
     }
@@ -18,7 +18,12 @@
 #include "qemu/bitmap.h"
 
 #define SLICE_TIME    100000000ULL /* ns */
-#define MAX_IN_FLIGHT 16
+#define MAX_IO_SECTORS ((1 << 20) >> BDRV_SECTOR_BITS)
+
+/* Bounds and initial value for the number of concurrent operations */
+#define MIN_IN_FLIGHT     2
+#define MAX_IN_FLIGHT     64
+#define DEFAULT_IN_FLIGHT 16
 
 /* The mirroring buffer is a list of granularity-sized chunks.
  * Free chunks are organized in a list.
@@ -32,6 +37,7 @@ typedef struct MirrorBlockJob {
     RateLimit limit;
     BlockDriverState *target;
     MirrorSyncMode mode;
+    BdrvDirtyBitmap *sync_bitmap;
     BlockdevOnError on_source_error, on_target_error;
     bool synced;
     bool should_complete;
@@ -39,6 +45,7 @@ typedef struct MirrorBlockJob {
     int64_t granularity;
     size_t buf_size;
     unsigned long *cow_bitmap;
+    BdrvDirtyBitmap *dirty_bitmap;
     HBitmapIter hbi;
     uint8_t *buf;
     QSIMPLEQ_HEAD(, MirrorBuffer) buf_free;
@@ -47,6 +54,15 @@ typedef struct MirrorBlockJob {
     unsigned long *in_flight_bitmap;
     int in_flight;
     int ret;
+    bool waiting_for_io;
+
+    /* The in-flight window is adapted to the latency of the target, see
+     * mirror_update_window().  Latencies are per granularity-sized chunk.
+     */
+    int max_in_flight;
+    int window_acks;
+    int64_t avg_latency_ns;
+    int64_t base_latency_ns;
 } MirrorBlockJob;
 
 typedef struct MirrorOp {
@@ -54,6 +70,7 @@ typedef struct MirrorOp {
     QEMUIOVector qiov;
     int64_t sector_num;
     int nb_sectors;
+    int64_t write_start_ns;
 } MirrorOp;
 
 static BlockErrorAction mirror_error_action(MirrorBlockJob *s, bool read,
@@ -95,7 +112,64 @@ static void mirror_iteration_done(MirrorOp *op, int ret)
     }
 
     g_slice_free(MirrorOp, op);
-    qemu_coroutine_enter(s->common.co, NULL);
+
+    /* Do not cut short a rate-limiting sleep.  */
+    if (s->waiting_for_io) {
+        qemu_coroutine_enter(s->common.co, NULL);
+    }
+}
+
+static void coroutine_fn mirror_wait_for_io(MirrorBlockJob *s)
+{
+    assert(!s->waiting_for_io);
+    s->waiting_for_io = true;
+    qemu_coroutine_yield();
+    s->waiting_for_io = false;
+}
+
+/* Grow the window by one operation for every window's worth of writes
+ * that completed at full concurrency, and halve it when the target starts
+ * queueing requests, i.e. when the average latency goes above twice the
+ * latency of an idle target.  The idle latency slowly drifts upwards, so
+ * that a single fast write does not keep the window small forever.
+ */
+static void mirror_update_window(MirrorBlockJob *s, MirrorOp *op)
+{
+    int64_t latency_ns;
+    int old_max_in_flight = s->max_in_flight;
+    bool window_full;
+
+    latency_ns = qemu_get_clock_ns(rt_clock) - op->write_start_ns;
+    latency_ns /= op->qiov.niov;
+
+    if (s->base_latency_ns == 0 || latency_ns < s->base_latency_ns) {
+        s->base_latency_ns = latency_ns;
+    } else {
+        s->base_latency_ns += (s->base_latency_ns >> 8) + 1;
+    }
+    if (s->avg_latency_ns == 0) {
+        s->avg_latency_ns = latency_ns;
+    } else {
+        s->avg_latency_ns = (s->avg_latency_ns * 7 + latency_ns) / 8;
+    }
+
+    /* This operation is still counted in s->in_flight.  */
+    window_full = s->in_flight >= s->max_in_flight;
+    if (++s->window_acks < s->max_in_flight) {
+        return;
+    }
+
+    s->window_acks = 0;
+    if (s->avg_latency_ns > 2 * s->base_latency_ns) {
+        s->max_in_flight = MAX(MIN_IN_FLIGHT, s->max_in_flight / 2);
+    } else if (window_full) {
+        s->max_in_flight = MIN(MAX_IN_FLIGHT, s->max_in_flight + 1);
+    }
+
+    if (s->max_in_flight != old_max_in_flight) {
+        trace_mirror_update_window(s, s->max_in_flight, s->avg_latency_ns,
+                                   s->base_latency_ns);
+    }
 }
 
 static void mirror_write_complete(void *opaque, int ret)
@@ -103,14 +177,16 @@ static void mirror_write_complete(void *opaque, int ret)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     if (ret < 0) {
-        BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, false, -ret);
         if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
         }
+    } else {
+        mirror_update_window(s, op);
+        block_job_account(&s->common, op->nb_sectors * BDRV_SECTOR_SIZE);
     }
     mirror_iteration_done(op, ret);
 }
@@ -120,10 +196,9 @@ static void mirror_read_complete(void *opaque, int ret)
     MirrorOp *op = opaque;
     MirrorBlockJob *s = op->s;
     if (ret < 0) {
-        BlockDriverState *source = s->common.bs;
         BlockErrorAction action;
 
-        bdrv_set_dirty(source, op->sector_num, op->nb_sectors);
+        bdrv_set_dirty_bitmap(s->dirty_bitmap, op->sector_num, op->nb_sectors);
         action = mirror_error_action(s, true, -ret);
         if (action == BDRV_ACTION_REPORT && s->ret >= 0) {
             s->ret = ret;
@@ -132,29 +207,49 @@ static void mirror_read_complete(void *opaque, int ret)
         mirror_iteration_done(op, ret);
         return;
     }
+    op->write_start_ns = qemu_get_clock_ns(rt_clock);
     bdrv_aio_writev(s->target, op->sector_num, &op->qiov, op->nb_sectors,
                     mirror_write_complete, op);
 }
 
-static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
+static uint64_t coroutine_fn mirror_iteration(MirrorBlockJob *s)
 {
     BlockDriverState *source = s->common.bs;
     int nb_sectors, sectors_per_chunk, nb_chunks;
+    int64_t max_sectors;
     int64_t end, sector_num, next_chunk, next_sector, hbitmap_next_sector;
     MirrorOp *op;
+    bool wrapped = false;
 
-    s->sector_num = hbitmap_iter_next(&s->hbi);
-    if (s->sector_num < 0) {
-        bdrv_dirty_iter_init(source, &s->hbi);
+    sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
+    end = s->common.len >> BDRV_SECTOR_BITS;
+
+    /* Chunks that were dirtied again while being copied are picked up when
+     * the iterator wraps around, so skip them instead of waiting for the
+     * previous copy to finish.  Only wait if everything that is dirty is
+     * also in flight.
+     */
+    for (;;) {
         s->sector_num = hbitmap_iter_next(&s->hbi);
-        trace_mirror_restart_iter(s, bdrv_get_dirty_count(source));
-        assert(s->sector_num >= 0);
+        if (s->sector_num < 0) {
+            if (wrapped) {
+                trace_mirror_yield_in_flight(s, -1, s->in_flight);
+                mirror_wait_for_io(s);
+            }
+            bdrv_dirty_iter_init(source, s->dirty_bitmap, &s->hbi);
+            s->sector_num = hbitmap_iter_next(&s->hbi);
+            trace_mirror_restart_iter(s,
+                                      bdrv_get_dirty_count(source, s->dirty_bitmap));
+            assert(s->sector_num >= 0);
+            wrapped = true;
+        }
+        if (!test_bit(s->sector_num / sectors_per_chunk, s->in_flight_bitmap)) {
+            break;
+        }
     }
 
     hbitmap_next_sector = s->sector_num;
     sector_num = s->sector_num;
-    sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
-    end = s->common.len >> BDRV_SECTOR_BITS;
 
     /* Extend the QEMUIOVector to include all adjacent blocks that will
      * be copied in this operation.
@@ -172,18 +267,18 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
     nb_chunks = 0;
     nb_sectors = 0;
     next_sector = sector_num;
-    next_chunk = sector_num / sectors_per_chunk;
 
-    /* Wait for I/O to this cluster (from a previous iteration) to be done.  */
-    while (test_bit(next_chunk, s->in_flight_bitmap)) {
-        trace_mirror_yield_in_flight(s, sector_num, s->in_flight);
-        qemu_coroutine_yield();
+    /* With a rate limit, larger requests would overshoot the quota.  */
+    max_sectors = MAX_IO_SECTORS;
+    if (s->common.speed) {
+        max_sectors = MIN(max_sectors, s->limit.slice_quota);
     }
+    next_chunk = sector_num / sectors_per_chunk;
 
     do {
         int added_sectors, added_chunks;
 
-        if (!bdrv_get_dirty(source, next_sector) ||
+        if (!bdrv_get_dirty(source, s->dirty_bitmap, next_sector) ||
             test_bit(next_chunk, s->in_flight_bitmap)) {
             assert(nb_sectors > 0);
             break;
@@ -208,12 +303,17 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         added_sectors = MIN(added_sectors, end - (sector_num + nb_sectors));
         added_chunks = (added_sectors + sectors_per_chunk - 1) / sectors_per_chunk;
 
+        /* Leave the rest to other operations that can run in parallel.  */
+        if (nb_sectors > 0 && nb_sectors + added_sectors > max_sectors) {
+            break;
+        }
+
         /* When doing COW, it may happen that there is not enough space for
          * a full cluster.  Wait if that is the case.
          */
         while (nb_chunks == 0 && s->buf_free_count < added_chunks) {
             trace_mirror_yield_buf_busy(s, nb_chunks, s->in_flight);
-            qemu_coroutine_yield();
+            mirror_wait_for_io(s);
         }
         if (s->buf_free_count < nb_chunks + added_chunks) {
             trace_mirror_break_buf_busy(s, nb_chunks, s->in_flight);
@@ -249,20 +349,26 @@ static void coroutine_fn mirror_iteration(MirrorBlockJob *s)
         /* Advance the HBitmapIter in parallel, so that we do not examine
          * the same sector twice.
          */
-        if (next_sector > hbitmap_next_sector && bdrv_get_dirty(source, next_sector)) {
+        if (next_sector > hbitmap_next_sector &&
+            bdrv_get_dirty(source, s->dirty_bitmap, next_sector)) {
             hbitmap_next_sector = hbitmap_iter_next(&s->hbi);
         }
 
         next_sector += sectors_per_chunk;
     }
 
-    bdrv_reset_dirty(source, sector_num, nb_sectors);
+    bdrv_reset_dirty_bitmap(s->dirty_bitmap, sector_num, nb_sectors);
 
     /* Copy the dirty cluster.  */
     s->in_flight++;
     trace_mirror_one_iteration(s, sector_num, nb_sectors);
     bdrv_aio_readv(source, sector_num, &op->qiov, nb_sectors,
                    mirror_read_complete, op);
+
+    if (s->common.speed) {
+        return ratelimit_calculate_delay(&s->limit, nb_sectors);
+    }
+    return 0;
 }
 
 static void mirror_free_init(MirrorBlockJob *s)
@@ -285,7 +391,7 @@ static void mirror_free_init(MirrorBlockJob *s)
 static void mirror_drain(MirrorBlockJob *s)
 {
     while (s->in_flight > 0) {
-        qemu_coroutine_yield();
+        mirror_wait_for_io(s);
     }
 }
 
@@ -332,7 +438,10 @@ static void coroutine_fn mirror_run(void *opaque)
     sectors_per_chunk = s->granularity >> BDRV_SECTOR_BITS;
     mirror_free_init(s);
 
-    if (s->mode != MIRROR_SYNC_MODE_NONE) {
+    if (s->mode == MIRROR_SYNC_MODE_INCREMENTAL) {
+        /* Copy what changed since the bitmap was last cleared */
+        bdrv_merge_dirty_bitmap(bs, s->dirty_bitmap, s->sync_bitmap);
+    } else if (s->mode != MIRROR_SYNC_MODE_NONE) {
         /* First part, loop on the sectors and initialize the dirty bitmap.  */
         BlockDriverState *base;
         base = s->mode == MIRROR_SYNC_MODE_FULL ? NULL : bs->backing_hd;
@@ -347,7 +456,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
             assert(n > 0);
             if (ret == 1) {
-                bdrv_set_dirty(bs, sector_num, n);
+                bdrv_set_dirty_bitmap(s->dirty_bitmap, sector_num, n);
                 sector_num = next;
             } else {
                 sector_num += n;
@@ -355,10 +464,10 @@ static void coroutine_fn mirror_run(void *opaque)
         }
     }
 
-    bdrv_dirty_iter_init(bs, &s->hbi);
+    bdrv_dirty_iter_init(bs, s->dirty_bitmap, &s->hbi);
     last_pause_ns = qemu_get_clock_ns(rt_clock);
     for (;;) {
-        uint64_t delay_ns;
+        uint64_t delay_ns = 0;
         int64_t cnt;
         bool should_complete;
 
@@ -367,7 +476,7 @@ static void coroutine_fn mirror_run(void *opaque)
             goto immediate_exit;
         }
 
-        cnt = bdrv_get_dirty_count(bs);
+        cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
 
         /* Note that even when no rate limit is applied we need to yield
          * periodically with no pending I/O so that qemu_aio_flush() returns.
@@ -376,14 +485,16 @@ static void coroutine_fn mirror_run(void *opaque)
          */
         if (qemu_get_clock_ns(rt_clock) - last_pause_ns < SLICE_TIME &&
             s->common.iostatus == BLOCK_DEVICE_IO_STATUS_OK) {
-            if (s->in_flight == MAX_IN_FLIGHT || s->buf_free_count == 0 ||
+            if (s->in_flight >= s->max_in_flight || s->buf_free_count == 0 ||
                 (cnt == 0 && s->in_flight > 0)) {
                 trace_mirror_yield(s, s->in_flight, s->buf_free_count, cnt);
-                qemu_coroutine_yield();
+                mirror_wait_for_io(s);
                 continue;
             } else if (cnt != 0) {
-                mirror_iteration(s);
-                continue;
+                delay_ns = mirror_iteration(s);
+                if (delay_ns == 0) {
+                    continue;
+                }
             }
         }
 
@@ -409,7 +520,7 @@ static void coroutine_fn mirror_run(void *opaque)
 
                 should_complete = s->should_complete ||
                     block_job_is_cancelled(&s->common);
-                cnt = bdrv_get_dirty_count(bs);
+                cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
             }
         }
 
@@ -424,7 +535,7 @@ static void coroutine_fn mirror_run(void *opaque)
              */
             trace_mirror_before_drain(s, cnt);
             bdrv_drain_all();
-            cnt = bdrv_get_dirty_count(bs);
+            cnt = bdrv_get_dirty_count(bs, s->dirty_bitmap);
         }
 
         ret = 0;
@@ -432,13 +543,6 @@ static void coroutine_fn mirror_run(void *opaque)
         if (!s->synced) {
             /* Publish progress */
             s->common.offset = (end - cnt) * BDRV_SECTOR_SIZE;
-
-            if (s->common.speed) {
-                delay_ns = ratelimit_calculate_delay(&s->limit, sectors_per_chunk);
-            } else {
-                delay_ns = 0;
-            }
-
             block_job_sleep_ns(&s->common, rt_clock, delay_ns);
             if (block_job_is_cancelled(&s->common)) {
                 break;
@@ -452,6 +556,10 @@ static void coroutine_fn mirror_run(void *opaque)
              */
             assert(QLIST_EMPTY(&bs->tracked_requests));
             s->common.cancelled = false;
+            if (s->sync_bitmap) {
+                /* Everything up to now is on the target */
+                bdrv_clear_dirty_bitmap(bs, s->sync_bitmap);
+            }
             break;
         }
         last_pause_ns = qemu_get_clock_ns(rt_clock);
@@ -471,7 +579,7 @@ immediate_exit:
     qemu_vfree(s->buf);
     g_free(s->cow_bitmap);
     g_free(s->in_flight_bitmap);
-    bdrv_set_dirty_tracking(bs, 0);
+    bdrv_release_dirty_bitmap(bs, s->dirty_bitmap);
     bdrv_iostatus_disable(s->target);
     if (s->should_complete && ret == 0) {
         if (bdrv_get_flags(s->target) != bdrv_get_flags(s->common.bs)) {
@@ -534,12 +642,14 @@ static BlockJobType mirror_job_type = {
 
 void mirror_start(BlockDriverState *bs, BlockDriverState *target,
                   int64_t speed, int64_t granularity, int64_t buf_size,
-                  MirrorSyncMode mode, BlockdevOnError on_source_error,
+                  MirrorSyncMode mode, BdrvDirtyBitmap *bitmap,
+                  BlockdevOnError on_source_error,
                   BlockdevOnError on_target_error,
                   BlockDriverCompletionFunc *cb,
                   void *opaque, Error **errp)
 {
     MirrorBlockJob *s;
+    BdrvDirtyBitmap *dirty_bitmap;
 
     if (granularity == 0) {
         /* Choose the default granularity based on the target file's cluster
@@ -562,8 +672,16 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
         return;
     }
 
+    assert((mode == MIRROR_SYNC_MODE_INCREMENTAL) == (bitmap != NULL));
+
+    dirty_bitmap = bdrv_create_dirty_bitmap(bs, granularity, NULL, errp);
+    if (!dirty_bitmap) {
+        return;
+    }
+
     s = block_job_create(&mirror_job_type, bs, speed, cb, opaque, errp);
     if (!s) {
+        bdrv_release_dirty_bitmap(bs, dirty_bitmap);
         return;
     }
 
@@ -571,10 +689,12 @@ void mirror_start(BlockDriverState *bs, BlockDriverState *target,
     s->on_target_error = on_target_error;
     s->target = target;
     s->mode = mode;
+    s->sync_bitmap = bitmap;
     s->granularity = granularity;
     s->buf_size = MAX(buf_size, granularity);
+    s->max_in_flight = DEFAULT_IN_FLIGHT;
+    s->dirty_bitmap = dirty_bitmap;
 
-    bdrv_set_dirty_tracking(bs, granularity);
     bdrv_set_enable_write_cache(s->target, true);
     bdrv_set_on_error(s->target, on_target_error, on_target_error);
     bdrv_iostatus_enable(s->target);
@@ -0,0 +1,525 @@
+/*
+ * Persistent dirty bitmaps for the QCOW version 2 format
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include "qemu-common.h"
+#include "block/block_int.h"
+#include "block/qcow2.h"
+#include "qemu/error-report.h"
+
+/*
+ * Persistent bitmaps are owned by the image only while it is not opened
+ * read-write.  When it is, they are moved into memory and removed from the
+ * image, so that a crash cannot leave stale bitmaps behind; they are written
+ * back when the image is closed.
+ */
+
+typedef struct QEMU_PACKED Qcow2BitmapDirEntry {
+    /* header is 8 byte aligned */
+    uint64_t bitmap_table_offset;
+    uint32_t bitmap_table_size;
+    uint32_t flags;
+    uint8_t granularity_bits;
+    uint8_t reserved;
+    uint16_t name_size;
+    /* name follows, padded to a multiple of 8 bytes */
+} Qcow2BitmapDirEntry;
+
+static int bitmap_dir_entry_size(int name_size)
+{
+    return align_offset(sizeof(Qcow2BitmapDirEntry) + name_size, 8);
+}
+
+/* Number of bitmap table entries for a bitmap with the given granularity */
+static uint32_t bitmap_table_size(BlockDriverState *bs, int granularity_bits)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t bits = DIV_ROUND_UP(bs->total_sectors * BDRV_SECTOR_SIZE,
+                                 (uint64_t) 1 << granularity_bits);
+
+    return DIV_ROUND_UP(bits, (uint64_t) s->cluster_size * 8);
+}
+
+void qcow2_free_bitmap_list(Qcow2Bitmap *bitmaps, int nb_bitmaps)
+{
+    int i;
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        g_free(bitmaps[i].name);
+    }
+    g_free(bitmaps);
+}
+
+/*
+ * Reads and validates the bitmap directory.  Returns the number of bitmaps
+ * and stores them in *pbitmaps, -EINVAL if the directory is corrupted, or
+ * another negative errno on I/O errors.
+ */
+int qcow2_read_bitmap_list(BlockDriverState *bs, Qcow2Bitmap **pbitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    uint8_t *dir, *p, *end;
+    int i, j, ret;
+
+    *pbitmaps = NULL;
+    if (s->nb_bitmaps == 0) {
+        return 0;
+    }
+
+    if (s->nb_bitmaps > QCOW2_MAX_BITMAPS ||
+        s->bitmap_directory_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE ||
+        (s->bitmap_directory_offset & (s->cluster_size - 1))) {
+        return -EINVAL;
+    }
+
+    dir = g_malloc(s->bitmap_directory_size);
+    ret = bdrv_pread(bs->file, s->bitmap_directory_offset, dir,
+                     s->bitmap_directory_size);
+    if (ret < 0) {
+        g_free(dir);
+        return ret;
+    }
+
+    bitmaps = g_malloc0(s->nb_bitmaps * sizeof(Qcow2Bitmap));
+    p = dir;
+    end = dir + s->bitmap_directory_size;
+    for (i = 0; i < s->nb_bitmaps; i++) {
+        Qcow2BitmapDirEntry *e = (Qcow2BitmapDirEntry *) p;
+        Qcow2Bitmap *bm = &bitmaps[i];
+        uint16_t name_size;
+
+        if (end - p < sizeof(*e)) {
+            goto corrupt;
+        }
+        name_size = be16_to_cpu(e->name_size);
+        if (name_size == 0 || name_size > QCOW2_MAX_BITMAP_NAME_SIZE ||
+            end - p < bitmap_dir_entry_size(name_size)) {
+            goto corrupt;
+        }
+
+        bm->table_offset = be64_to_cpu(e->bitmap_table_offset);
+        bm->table_size = be32_to_cpu(e->bitmap_table_size);
+        bm->granularity_bits = e->granularity_bits;
+        bm->name = g_strndup((char *) (e + 1), name_size);
+        p += bitmap_dir_entry_size(name_size);
+
+        if (be32_to_cpu(e->flags) != 0 ||
+            bm->granularity_bits < BDRV_SECTOR_BITS ||
+            bm->granularity_bits > QCOW2_MAX_BITMAP_GRANULARITY_BITS ||
+            (bm->table_offset & (s->cluster_size - 1)) ||
+            bm->table_size != bitmap_table_size(bs, bm->granularity_bits) ||
+            strlen(bm->name) != name_size) {
+            goto corrupt;
+        }
+        for (j = 0; j < i; j++) {
+            if (!strcmp(bitmaps[j].name, bm->name)) {
+                goto corrupt;
+            }
+        }
+    }
+
+    g_free(dir);
+    *pbitmaps = bitmaps;
+    return s->nb_bitmaps;
+
+corrupt:
+    g_free(dir);
+    qcow2_free_bitmap_list(bitmaps, s->nb_bitmaps);
+    return -EINVAL;
+}
+
+/*
+ * Reads the bitmap table of bm into *ptable (in CPU byte order).  Returns
+ * -EINVAL if an entry is invalid.
+ */
+int qcow2_read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            uint64_t **ptable)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t *table;
+    int i, ret;
+
+    table = g_malloc(bm->table_size * sizeof(uint64_t));
+    ret = bdrv_pread(bs->file, bm->table_offset, table,
+                     bm->table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        g_free(table);
+        return ret;
+    }
+
+    for (i = 0; i < bm->table_size; i++) {
+        be64_to_cpus(&table[i]);
+        if ((table[i] & ~BME_TABLE_ENTRY_OFFSET_MASK) ||
+            (table[i] & (s->cluster_size - 1))) {
+            g_free(table);
+            return -EINVAL;
+        }
+    }
+
+    *ptable = table;
+    return 0;
+}
+
+static int load_bitmap_data(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            BdrvDirtyBitmap *bitmap)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        ((uint64_t) s->cluster_size * 8) << (bm->granularity_bits -
+                                             BDRV_SECTOR_BITS);
+    uint64_t *table;
+    uint8_t *buf;
+    int i, ret;
+
+    ret = qcow2_read_bitmap_table(bs, bm, &table);
+    if (ret < 0) {
+        return ret;
+    }
+
+    buf = g_malloc(s->cluster_size);
+    for (i = 0; i < bm->table_size; i++) {
+        int64_t sector = i * sectors_per_cluster;
+
+        if (table[i] == 0) {
+            continue;
+        }
+        ret = bdrv_pread(bs->file, table[i], buf, s->cluster_size);
+        if (ret < 0) {
+            goto out;
+        }
+        bdrv_dirty_bitmap_deserialize(bitmap, buf, sector,
+            MIN(sectors_per_cluster, bs->total_sectors - sector));
+    }
+    ret = 0;
+
+out:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+/* Drops the bitmaps from the header first, so that a crash can only leak
+ * the clusters that they use */
+static int remove_stored_bitmaps(BlockDriverState *bs, Qcow2Bitmap *bitmaps,
+                                 int nb_bitmaps)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t dir_offset = s->bitmap_directory_offset;
+    uint64_t dir_size = s->bitmap_directory_size;
+    int i, j, ret;
+
+    s->nb_bitmaps = 0;
+    s->bitmap_directory_offset = 0;
+    s->bitmap_directory_size = 0;
+    s->autoclear_features &= ~QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0 || !bitmaps) {
+        return ret;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        uint64_t *table;
+
+        if (qcow2_read_bitmap_table(bs, &bitmaps[i], &table) < 0) {
+            continue;
+        }
+        for (j = 0; j < bitmaps[i].table_size; j++) {
+            if (table[j]) {
+                qcow2_free_clusters(bs, table[j], s->cluster_size);
+            }
+        }
+        qcow2_free_clusters(bs, bitmaps[i].table_offset,
+                            bitmaps[i].table_size * sizeof(uint64_t));
+        g_free(table);
+    }
+    qcow2_free_clusters(bs, dir_offset, dir_size);
+    return 0;
+}
+
+/*
+ * Moves the persistent bitmaps stored in the image into memory, where they
+ * track writes from now on.  A corrupted bitmap directory is dropped with a
+ * warning, so that the image can still be opened and repaired.
+ */
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs)
+{
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps, i, ret;
+
+    nb_bitmaps = qcow2_read_bitmap_list(bs, &bitmaps);
+    if (nb_bitmaps == -EINVAL) {
+        error_report("Ignoring corrupted dirty bitmaps in %s", bs->filename);
+        return remove_stored_bitmaps(bs, NULL, 0);
+    } else if (nb_bitmaps < 0) {
+        return nb_bitmaps;
+    }
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        Qcow2Bitmap *bm = &bitmaps[i];
+        BdrvDirtyBitmap *bitmap;
+
+        /* When the image is reopened, the in-memory copy is up to date */
+        if (bdrv_find_dirty_bitmap(bs, bm->name)) {
+            continue;
+        }
+
+        bitmap = bdrv_create_dirty_bitmap(bs, 1 << bm->granularity_bits,
+                                          bm->name, NULL);
+        if (!bitmap) {
+            ret = -EINVAL;
+            goto fail;
+        }
+        bdrv_dirty_bitmap_set_persistent(bitmap, true);
+
+        ret = load_bitmap_data(bs, bm, bitmap);
+        if (ret == -EINVAL) {
+            error_report("Dirty bitmap '%s' in %s is corrupted, marking "
+                         "everything as dirty", bm->name, bs->filename);
+            bdrv_set_dirty_bitmap(bitmap, 0, bs->total_sectors);
+        } else if (ret < 0) {
+            goto fail;
+        }
+    }
+
+    ret = remove_stored_bitmaps(bs, bitmaps, nb_bitmaps);
+
+fail:
+    qcow2_free_bitmap_list(bitmaps, nb_bitmaps);
+    return ret;
+}
+
+/* Returns the offset of the bitmap table, or a negative errno */
+static int64_t store_bitmap_data(BlockDriverState *bs,
+                                 BdrvDirtyBitmap *bitmap,
+                                 uint32_t table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    uint64_t sectors_per_cluster =
+        ((uint64_t) s->cluster_size * 8) *
+        (bdrv_dirty_bitmap_granularity(bitmap) >> BDRV_SECTOR_BITS);
+    uint64_t *table;
+    int64_t table_offset, offset;
+    uint8_t *buf;
+    int i, ret;
+
+    table = g_malloc0(table_size * sizeof(uint64_t));
+    buf = g_malloc(s->cluster_size);
+
+    for (i = 0; i < table_size; i++) {
+        int64_t sector = i * sectors_per_cluster;
+
+        memset(buf, 0, s->cluster_size);
+        bdrv_dirty_bitmap_serialize(bitmap, buf, sector,
+            MIN(sectors_per_cluster, bs->total_sectors - sector));
+        if (buffer_is_zero(buf, s->cluster_size)) {
+            continue;
+        }
+
+        offset = qcow2_alloc_clusters(bs, s->cluster_size);
+        if (offset < 0) {
+            ret = offset;
+            goto fail;
+        }
+        ret = bdrv_pwrite(bs->file, offset, buf, s->cluster_size);
+        if (ret < 0) {
+            goto fail;
+        }
+        table[i] = cpu_to_be64(offset);
+    }
+
+    table_offset = qcow2_alloc_clusters(bs, table_size * sizeof(uint64_t));
+    if (table_offset < 0) {
+        ret = table_offset;
+        goto fail;
+    }
+    ret = bdrv_pwrite(bs->file, table_offset, table,
+                      table_size * sizeof(uint64_t));
+    if (ret < 0) {
+        goto fail;
+    }
+
+    g_free(buf);
+    g_free(table);
+    return table_offset;
+
+fail:
+    g_free(buf);
+    g_free(table);
+    return ret;
+}
+
+/*
+ * Checks that a new persistent bitmap called @name fits in the bitmap
+ * directory next to the persistent bitmaps that bs already has.
+ */
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      Error **errp)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    size_t name_size = strlen(name);
+    uint64_t dir_size;
+    int nb_bitmaps = 1;
+
+    if (s->qcow_version < 3 || bs->read_only) {
+        error_setg(errp, "Persistent dirty bitmaps are not supported by "
+                   "the image of device '%s'", bdrv_get_device_name(bs));
+        return false;
+    }
+    if (name_size > QCOW2_MAX_BITMAP_NAME_SIZE) {
+        error_setg(errp, "Bitmap name is longer than %d bytes",
+                   QCOW2_MAX_BITMAP_NAME_SIZE);
+        return false;
+    }
+
+    dir_size = bitmap_dir_entry_size(name_size);
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        if (bdrv_dirty_bitmap_is_persistent(bitmap)) {
+            nb_bitmaps++;
+            dir_size += bitmap_dir_entry_size(
+                strlen(bdrv_dirty_bitmap_name(bitmap)));
+        }
+    }
+    if (nb_bitmaps > QCOW2_MAX_BITMAPS ||
+        dir_size > QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+        error_setg(errp, "Too many persistent dirty bitmaps for the image of "
+                   "device '%s'", bdrv_get_device_name(bs));
+        return false;
+    }
+    return true;
+}
+
+/*
+ * Writes all persistent bitmaps of bs to the image, which must not contain
+ * any bitmaps yet.  On failure the bitmaps are lost and their clusters may
+ * be leaked.
+ */
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs)
+{
+    BDRVQcowState *s = bs->opaque;
+    BdrvDirtyBitmap *bitmap = NULL;
+    uint8_t *dir = NULL;
+    size_t dir_size = 0;
+    int64_t dir_offset;
+    int nb_bitmaps = 0;
+    int ret;
+
+    if (bs->read_only) {
+        return 0;
+    }
+
+    while ((bitmap = bdrv_dirty_bitmap_next(bs, bitmap)) != NULL) {
+        const char *name = bdrv_dirty_bitmap_name(bitmap);
+        int granularity_bits = ffs(bdrv_dirty_bitmap_granularity(bitmap)) - 1;
+        uint32_t table_size = bitmap_table_size(bs, granularity_bits);
+        Qcow2BitmapDirEntry *e;
+        int64_t table_offset;
+        size_t name_size;
+
+        if (!bdrv_dirty_bitmap_is_persistent(bitmap)) {
+            continue;
+        }
+
+        if (s->qcow_version < 3 || nb_bitmaps == QCOW2_MAX_BITMAPS) {
+            error_report("Cannot store dirty bitmap '%s' in %s", name,
+                         bs->filename);
+            continue;
+        }
+
+        /* Never write a directory that qcow2_read_bitmap_list rejects */
+        name_size = strlen(name);
+        if (name_size > QCOW2_MAX_BITMAP_NAME_SIZE) {
+            error_report("Cannot store dirty bitmap '%s' in %s: name too long",
+                         name, bs->filename);
+            continue;
+        }
+        if (dir_size + bitmap_dir_entry_size(name_size) >
+            QCOW2_MAX_BITMAP_DIRECTORY_SIZE) {
+            error_report("Cannot store dirty bitmap '%s' in %s: bitmap "
+                         "directory full", name, bs->filename);
+            continue;
+        }
+
+        table_offset = 0;
+        if (table_size) {
+            table_offset = store_bitmap_data(bs, bitmap, table_size);
+        }
+        if (table_offset < 0) {
+            ret = table_offset;
+            goto fail;
+        }
+
+        dir = g_realloc(dir, dir_size + bitmap_dir_entry_size(name_size));
+        e = (Qcow2BitmapDirEntry *) (dir + dir_size);
+        memset(e, 0, bitmap_dir_entry_size(name_size));
+        e->bitmap_table_offset = cpu_to_be64(table_offset);
+        e->bitmap_table_size = cpu_to_be32(table_size);
+        e->granularity_bits = granularity_bits;
+        e->name_size = cpu_to_be16(name_size);
+        memcpy(e + 1, name, name_size);
+        dir_size += bitmap_dir_entry_size(name_size);
+        nb_bitmaps++;
+    }
+
+    if (nb_bitmaps == 0) {
+        return 0;
+    }
+
+    dir_offset = qcow2_alloc_clusters(bs, dir_size);
+    if (dir_offset < 0) {
+        ret = dir_offset;
+        goto fail;
+    }
+    ret = bdrv_pwrite(bs->file, dir_offset, dir, dir_size);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    /* The refcounts must be stable before the header points to them */
+    ret = qcow2_cache_flush(bs, s->refcount_block_cache);
+    if (ret < 0) {
+        goto fail;
+    }
+    ret = bdrv_flush(bs->file);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    s->nb_bitmaps = nb_bitmaps;
+    s->bitmap_directory_offset = dir_offset;
+    s->bitmap_directory_size = dir_size;
+    s->autoclear_features |= QCOW2_AUTOCLEAR_BITMAPS;
+    ret = qcow2_update_header(bs);
+    if (ret < 0) {
+        s->nb_bitmaps = 0;
+        goto fail;
+    }
+
+    g_free(dir);
+    return 0;
+
+fail:
+    error_report("Failed to store dirty bitmaps in %s: %s", bs->filename,
+                 strerror(-ret));
+    g_free(dir);
+    return ret;
+}
@@ -175,7 +175,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     /* allocate a new l2 entry */
 
-    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * sizeof(uint64_t));
+    l2_offset = qcow2_alloc_clusters(bs, s->l2_size * s->l2_entry_size);
     if (l2_offset < 0) {
         return l2_offset;
     }
@@ -197,7 +197,7 @@ static int l2_allocate(BlockDriverState *bs, int l1_index, uint64_t **table)
 
     if ((old_l2_offset & L1E_OFFSET_MASK) == 0) {
         /* if there was no old l2 table, clear the new table */
-        memset(l2_table, 0, s->l2_size * sizeof(uint64_t));
+        memset(l2_table, 0, s->l2_size * s->l2_entry_size);
     } else {
         uint64_t* old_table;
 
@@ -254,32 +254,34 @@ fail:
  * as contiguous. (This allows it, for example, to stop at the first compressed
  * cluster which may require a different handling)
  */
-static int count_contiguous_clusters(uint64_t nb_clusters, int cluster_size,
-        uint64_t *l2_table, uint64_t start, uint64_t stop_flags)
+static int count_contiguous_clusters(BDRVQcowState *s, uint64_t nb_clusters,
+        uint64_t *l2_table, int l2_index, uint64_t stop_flags)
 {
     int i;
     uint64_t mask = stop_flags | L2E_OFFSET_MASK;
-    uint64_t offset = be64_to_cpu(l2_table[0]) & mask;
+    uint64_t offset = get_l2_entry(s, l2_table, l2_index) & mask;
 
     if (!offset)
         return 0;
 
-    for (i = start; i < start + nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[i]) & mask;
-        if (offset + (uint64_t) i * cluster_size != l2_entry) {
+    for (i = 0; i < nb_clusters; i++) {
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i) & mask;
+        if (offset + (uint64_t) i * s->cluster_size != l2_entry) {
             break;
         }
     }
 
-	return (i - start);
+	return i;
 }
 
-static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_table)
+static int count_contiguous_free_clusters(BDRVQcowState *s,
+        uint64_t nb_clusters, uint64_t *l2_table, int l2_index)
 {
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        int type = qcow2_get_cluster_type(be64_to_cpu(l2_table[i]));
+        int type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                       l2_index + i));
 
         if (type != QCOW2_CLUSTER_UNALLOCATED) {
             break;
@@ -289,6 +291,58 @@ static int count_contiguous_free_clusters(uint64_t nb_clusters, uint64_t *l2_tab
     return i;
 }
 
+/*
+ * Counts the subclusters of an image with extended L2 entries, starting with
+ * subcluster sc_index of the cluster at l2_index, that have the same type as
+ * the first one. Allocated subclusters must also be contiguous in the image
+ * file, and if need_copied is true their clusters must have
+ * QCOW_OFLAG_COPIED set. The search stops at the end of the L2 table.
+ *
+ * Returns the number of subclusters (at most nb_subclusters) and stores
+ * the QCOW2_CLUSTER_* type of the first one in *type.
+ */
+static int count_contiguous_subclusters(BDRVQcowState *s, uint64_t *l2_table,
+    int l2_index, int sc_index, int nb_subclusters, bool need_copied,
+    int *type)
+{
+    uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index);
+    uint64_t l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+    uint64_t expected_offset = l2_entry & L2E_OFFSET_MASK;
+    int n = 0;
+
+    *type = qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index);
+
+    /* Compressed clusters can only be processed one by one */
+    if (*type == QCOW2_CLUSTER_COMPRESSED) {
+        return MIN(nb_subclusters, s->subclusters_per_cluster - sc_index);
+    }
+
+    while (n < nb_subclusters && l2_index < s->l2_size) {
+        l2_entry = get_l2_entry(s, l2_table, l2_index);
+        l2_bitmap = get_l2_bitmap(s, l2_table, l2_index);
+
+        if (*type == QCOW2_CLUSTER_NORMAL &&
+            ((l2_entry & L2E_OFFSET_MASK) != expected_offset ||
+             (need_copied && !(l2_entry & QCOW_OFLAG_COPIED)))) {
+            break;
+        }
+
+        for (; sc_index < s->subclusters_per_cluster && n < nb_subclusters;
+             sc_index++, n++) {
+            if (qcow2_get_subcluster_type(l2_entry, l2_bitmap, sc_index)
+                != *type) {
+                return n;
+            }
+        }
+
+        sc_index = 0;
+        l2_index++;
+        expected_offset += s->cluster_size;
+    }
+
+    return n;
+}
+
 /* The crypt function is compatible with the linux cryptoloop
    algorithm for < 4 GB images. NOTE: out_buf == in_buf is
    supported */
@@ -443,7 +497,28 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     /* find the cluster offset for the given disk offset */
 
     l2_index = (offset >> s->cluster_bits) & (s->l2_size - 1);
-    *cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    *cluster_offset = get_l2_entry(s, l2_table, l2_index);
+
+    if (has_subclusters(s)) {
+        int sc_index = offset_to_sc_index(s, offset);
+        int nb_subclusters = DIV_ROUND_UP(nb_needed, s->subcluster_sectors)
+                             - sc_index;
+
+        c = count_contiguous_subclusters(s, l2_table, l2_index, sc_index,
+                                         nb_subclusters, false, &ret);
+        if (ret == QCOW2_CLUSTER_COMPRESSED) {
+            *cluster_offset &= L2E_COMPRESSED_OFFSET_SIZE_MASK;
+        } else if (ret == QCOW2_CLUSTER_NORMAL) {
+            *cluster_offset &= L2E_OFFSET_MASK;
+        } else {
+            *cluster_offset = 0;
+        }
+
+        qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
+        nb_available = (uint64_t) (sc_index + c) * s->subcluster_sectors;
+        goto out;
+    }
+
     nb_clusters = size_to_clusters(s, nb_needed << 9);
 
     ret = qcow2_get_cluster_type(*cluster_offset);
@@ -457,20 +532,19 @@ int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
         if (s->qcow_version < 3) {
             return -EIO;
         }
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_UNALLOCATED:
         /* how many empty clusters ? */
-        c = count_contiguous_free_clusters(nb_clusters, &l2_table[l2_index]);
+        c = count_contiguous_free_clusters(s, nb_clusters, l2_table,
+                                           l2_index);
         *cluster_offset = 0;
         break;
     case QCOW2_CLUSTER_NORMAL:
         /* how many allocated clusters ? */
-        c = count_contiguous_clusters(nb_clusters, s->cluster_size,
-                &l2_table[l2_index], 0,
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
                 QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO);
         *cluster_offset &= L2E_OFFSET_MASK;
         break;
@@ -491,6 +565,89 @@ out:
     return ret;
 }
 
+/*
+ * Fast path for requests to clusters that are already allocated. It neither
+ * takes s->lock nor yields, so it can run while another request holds the
+ * lock, for example because it is allocating clusters or loading an L2 table.
+ *
+ * Only L2 tables that are already cached are used. For writes, the clusters
+ * must not need COW and must not overlap a running allocation.
+ *
+ * Returns:
+ *   1:     *host_offset is the image file offset of guest_offset, and the
+ *          first *bytes bytes can be accessed in place
+ *   0:     the request must take the slow path
+ */
+int qcow2_get_host_offset_fast(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t *bytes, uint64_t *host_offset, bool write)
+{
+    BDRVQcowState *s = bs->opaque;
+    QCowL2Meta *alloc;
+    uint64_t l1_index, l2_offset, entry, stop_flags, avail;
+    uint64_t *l2_table;
+    unsigned int l2_index, nb_clusters, c;
+    int type;
+
+    l1_index = guest_offset >> (s->l2_bits + s->cluster_bits);
+    if (l1_index >= s->l1_size) {
+        return 0;
+    }
+    l2_offset = s->l1_table[l1_index] & L1E_OFFSET_MASK;
+    if (!l2_offset ||
+        qcow2_cache_get_cached(s->l2_table_cache, l2_offset,
+                               (void **) &l2_table) < 0) {
+        return 0;
+    }
+
+    /* Stop at L2 table boundaries like the slow path does */
+    l2_index = offset_to_l2_index(s, guest_offset);
+    nb_clusters = size_to_clusters(s, offset_into_cluster(s, guest_offset) +
+                                      *bytes);
+    nb_clusters = MIN(nb_clusters, s->l2_size - l2_index);
+
+    entry = get_l2_entry(s, l2_table, l2_index);
+    avail = 0;
+    if (has_subclusters(s)) {
+        /* Writes to unallocated subclusters need COW */
+        int sc_index = offset_to_sc_index(s, guest_offset);
+        int nb_subclusters =
+            size_to_subclusters(s, offset_into_cluster(s, guest_offset)
+                                   + *bytes) - sc_index;
+
+        c = count_contiguous_subclusters(s, l2_table, l2_index, sc_index,
+                                         nb_subclusters, write, &type);
+        if (type == QCOW2_CLUSTER_NORMAL) {
+            avail = (uint64_t) (sc_index + c) * s->subcluster_size;
+        }
+    } else if (qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+        (!write || (entry & QCOW_OFLAG_COPIED))) {
+        stop_flags = write ? QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO
+                           : QCOW_OFLAG_COMPRESSED | QCOW_OFLAG_ZERO;
+        c = count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                      stop_flags);
+        avail = (uint64_t) c * s->cluster_size;
+    }
+    qcow2_cache_put(bs, s->l2_table_cache, (void **) &l2_table);
+
+    if (avail == 0 || (entry & L2E_OFFSET_MASK & 511)) {
+        return 0;
+    }
+    *bytes = MIN(*bytes, avail - offset_into_cluster(s, guest_offset));
+
+    if (write) {
+        QLIST_FOREACH(alloc, &s->cluster_allocs, next_in_flight) {
+            if (guest_offset < l2meta_cow_end(s, alloc) &&
+                guest_offset + *bytes > l2meta_cow_start(alloc)) {
+                return 0;
+            }
+        }
+    }
+
+    *host_offset = (entry & L2E_OFFSET_MASK) +
+                   offset_into_cluster(s, guest_offset);
+    return 1;
+}
+
 /*
  * get_cluster_table
  *
@@ -541,7 +698,8 @@ static int get_cluster_table(BlockDriverState *bs, uint64_t offset,
 
         /* Then decrease the refcount of the old table */
         if (l2_offset) {
-            qcow2_free_clusters(bs, l2_offset, s->l2_size * sizeof(uint64_t));
+            qcow2_free_clusters(bs, l2_offset,
+                                s->l2_size * s->l2_entry_size);
         }
     }
 
@@ -585,7 +743,7 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     /* Compression can't overwrite anything. Fail if the cluster was already
      * allocated. */
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
     if (cluster_offset & L2E_OFFSET_MASK) {
         qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
         return 0;
@@ -609,7 +767,10 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 
     BLKDBG_EVENT(bs->file, BLKDBG_L2_UPDATE_COMPRESSED);
     qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-    l2_table[l2_index] = cpu_to_be64(cluster_offset);
+    set_l2_entry(s, l2_table, l2_index, cluster_offset);
+    if (has_subclusters(s)) {
+        set_l2_bitmap(s, l2_table, l2_index, 0);
+    }
     ret = qcow2_cache_put(bs, s->l2_table_cache, (void**) &l2_table);
     if (ret < 0) {
         return 0;
@@ -653,6 +814,10 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
     int i, j = 0, l2_index, ret;
     uint64_t *old_cluster, *l2_table;
     uint64_t cluster_offset = m->alloc_offset;
+    /* Area written by guest data and COW, from the start of the first cluster */
+    int64_t data_start = m->cow_start.offset;
+    int64_t data_end = m->cow_end.offset +
+                       (m->cow_end.nb_sectors << BDRV_SECTOR_BITS);
 
     trace_qcow2_cluster_link_l2(qemu_coroutine_self(), m->nb_clusters);
     assert(m->nb_clusters > 0);
@@ -692,11 +857,32 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
 	 * cluster the second one has to do RMW (which is done above by
 	 * copy_sectors()), update l2 table with its cluster pointer and free
 	 * old cluster. This is what this loop does */
-        if(l2_table[l2_index + i] != 0)
-            old_cluster[j++] = l2_table[l2_index + i];
+        uint64_t old_entry = get_l2_entry(s, l2_table, l2_index + i);
+        uint64_t new_entry = (cluster_offset + (i << s->cluster_bits));
+
+        /* Filling unallocated subclusters keeps the host cluster */
+        if (old_entry != 0 &&
+            (qcow2_get_cluster_type(old_entry) != QCOW2_CLUSTER_NORMAL ||
+             (old_entry & L2E_OFFSET_MASK) != new_entry)) {
+            old_cluster[j++] = old_entry;
+        }
 
-        l2_table[l2_index + i] = cpu_to_be64((cluster_offset +
-                    (i << s->cluster_bits)) | QCOW_OFLAG_COPIED);
+        set_l2_entry(s, l2_table, l2_index + i,
+                     new_entry | QCOW_OFLAG_COPIED);
+
+        if (has_subclusters(s)) {
+            int64_t cluster_start = (int64_t) i << s->cluster_bits;
+            int64_t start = MAX(data_start, cluster_start) - cluster_start;
+            int64_t end = MIN(data_end, cluster_start + s->cluster_size)
+                          - cluster_start;
+            int first_sc = start >> s->subcluster_bits;
+            int end_sc = DIV_ROUND_UP(end, s->subcluster_size);
+            uint64_t bitmap = get_l2_bitmap(s, l2_table, l2_index + i);
+
+            bitmap &= ~QCOW_OFLAG_SUB_ZERO_RANGE(first_sc, end_sc);
+            bitmap |= QCOW_OFLAG_SUB_ALLOC_RANGE(first_sc, end_sc);
+            set_l2_bitmap(s, l2_table, l2_index + i, bitmap);
+        }
      }
 
 
@@ -711,7 +897,7 @@ int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m)
      */
     if (j != 0) {
         for (i = 0; i < j; i++) {
-            qcow2_free_any_clusters(bs, be64_to_cpu(old_cluster[i]), 1);
+            qcow2_free_any_clusters(bs, old_cluster[i], 1);
         }
     }
 
@@ -729,12 +915,20 @@ err:
 static int count_cow_clusters(BDRVQcowState *s, int nb_clusters,
     uint64_t *l2_table, int l2_index)
 {
+    int first_type = qcow2_get_cluster_type(get_l2_entry(s, l2_table,
+                                                         l2_index));
     int i;
 
     for (i = 0; i < nb_clusters; i++) {
-        uint64_t l2_entry = be64_to_cpu(l2_table[l2_index + i]);
+        uint64_t l2_entry = get_l2_entry(s, l2_table, l2_index + i);
         int cluster_type = qcow2_get_cluster_type(l2_entry);
 
+        /* With subclusters, the amount of COW depends on the cluster type.
+         * Keep it the same for the whole allocation. */
+        if (has_subclusters(s) && cluster_type != first_type) {
+            goto out;
+        }
+
         switch(cluster_type) {
         case QCOW2_CLUSTER_NORMAL:
             if (l2_entry & QCOW_OFLAG_COPIED) {
@@ -781,7 +975,7 @@ static int handle_dependencies(BlockDriverState *bs, uint64_t guest_offset,
         uint64_t start = guest_offset;
         uint64_t end = start + bytes;
         uint64_t old_start = l2meta_cow_start(old_alloc);
-        uint64_t old_end = l2meta_cow_end(old_alloc);
+        uint64_t old_end = l2meta_cow_end(s, old_alloc);
 
         if (end <= old_start || start >= old_end) {
             /* No intersection */
@@ -875,7 +1069,7 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    cluster_offset = be64_to_cpu(l2_table[l2_index]);
+    cluster_offset = get_l2_entry(s, l2_table, l2_index);
 
     /* Check how many clusters are already allocated and don't need COW */
     if (qcow2_get_cluster_type(cluster_offset) == QCOW2_CLUSTER_NORMAL
@@ -891,16 +1085,37 @@ static int handle_copied(BlockDriverState *bs, uint64_t guest_offset,
             goto out;
         }
 
-        /* We keep all QCOW_OFLAG_COPIED clusters */
-        keep_clusters =
-            count_contiguous_clusters(nb_clusters, s->cluster_size,
-                                      &l2_table[l2_index], 0,
-                                      QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
-        assert(keep_clusters <= nb_clusters);
+        if (has_subclusters(s)) {
+            /* Unallocated subclusters still need COW */
+            int sc_index = offset_to_sc_index(s, guest_offset);
+            int nb_subclusters =
+                size_to_subclusters(s, offset_into_cluster(s, guest_offset)
+                                       + *bytes) - sc_index;
+            int keep_subclusters, type;
+
+            keep_subclusters =
+                count_contiguous_subclusters(s, l2_table, l2_index, sc_index,
+                                             nb_subclusters, true, &type);
+            if (type != QCOW2_CLUSTER_NORMAL) {
+                ret = 0;
+                goto out;
+            }
 
-        *bytes = MIN(*bytes,
-                 keep_clusters * s->cluster_size
-                 - offset_into_cluster(s, guest_offset));
+            *bytes = MIN(*bytes,
+                     (uint64_t) (sc_index + keep_subclusters)
+                     * s->subcluster_size
+                     - offset_into_cluster(s, guest_offset));
+        } else {
+            /* We keep all QCOW_OFLAG_COPIED clusters */
+            keep_clusters =
+                count_contiguous_clusters(s, nb_clusters, l2_table, l2_index,
+                                          QCOW_OFLAG_COPIED | QCOW_OFLAG_ZERO);
+            assert(keep_clusters <= nb_clusters);
+
+            *bytes = MIN(*bytes,
+                     keep_clusters * s->cluster_size
+                     - offset_into_cluster(s, guest_offset));
+        }
 
         ret = 1;
     } else {
@@ -1000,6 +1215,8 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     uint64_t entry;
     unsigned int nb_clusters;
     int ret;
+    bool fill_subclusters = false;
+    bool cow_subclusters;
 
     uint64_t alloc_cluster_offset;
 
@@ -1023,10 +1240,34 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         return ret;
     }
 
-    entry = be64_to_cpu(l2_table[l2_index]);
+    entry = get_l2_entry(s, l2_table, l2_index);
 
-    /* For the moment, overwrite compressed clusters one by one */
-    if (entry & QCOW_OFLAG_COMPRESSED) {
+    if (has_subclusters(s) &&
+        qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_NORMAL &&
+        (entry & QCOW_OFLAG_COPIED)) {
+        /*
+         * handle_copied() stopped at unallocated subclusters of a cluster
+         * that we own. Write them in place, but don't touch allocated
+         * subclusters after them: COW could race with in-place writes.
+         */
+        int sc_index = offset_to_sc_index(s, guest_offset);
+        int nb_subclusters = MIN(size_to_subclusters(s,
+                                     offset_into_cluster(s, guest_offset)
+                                     + *bytes) - sc_index,
+                                 s->subclusters_per_cluster - sc_index);
+        int type;
+
+        nb_subclusters =
+            count_contiguous_subclusters(s, l2_table, l2_index, sc_index,
+                                         nb_subclusters, false, &type);
+        assert(type != QCOW2_CLUSTER_NORMAL && nb_subclusters > 0);
+        *bytes = MIN(*bytes, (uint64_t) (sc_index + nb_subclusters)
+                             * s->subcluster_size
+                             - offset_into_cluster(s, guest_offset));
+        nb_clusters = 1;
+        fill_subclusters = true;
+    } else if (entry & QCOW_OFLAG_COMPRESSED) {
+        /* For the moment, overwrite compressed clusters one by one */
         nb_clusters = 1;
     } else {
         nb_clusters = count_cow_clusters(s, nb_clusters, l2_table, l2_index);
@@ -1044,10 +1285,18 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
 
     /* Allocate, if necessary at a given offset in the image file */
     alloc_cluster_offset = start_of_cluster(s, *host_offset);
-    ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
-                                  &nb_clusters);
-    if (ret < 0) {
-        goto fail;
+    if (fill_subclusters) {
+        if (alloc_cluster_offset != 0 &&
+            alloc_cluster_offset != (entry & L2E_OFFSET_MASK)) {
+            nb_clusters = 0;
+        }
+        alloc_cluster_offset = entry & L2E_OFFSET_MASK;
+    } else {
+        ret = do_alloc_cluster_offset(bs, guest_offset, &alloc_cluster_offset,
+                                      &nb_clusters);
+        if (ret < 0) {
+            goto fail;
+        }
     }
 
     /* Can't extend contiguous allocation */
@@ -1080,6 +1329,22 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
     int nb_sectors = MIN(requested_sectors, avail_sectors);
     QCowL2Meta *old_m = *m;
 
+    /*
+     * With extended L2 entries, unallocated clusters only need COW up to
+     * the subcluster boundaries, the rest of the cluster stays unallocated.
+     * All other clusters are copied as a whole.
+     */
+    int cow_start_sector = 0;
+    int cow_end_sector = avail_sectors;
+
+    cow_subclusters = has_subclusters(s) &&
+        (fill_subclusters ||
+         qcow2_get_cluster_type(entry) == QCOW2_CLUSTER_UNALLOCATED);
+    if (cow_subclusters) {
+        cow_start_sector = alloc_n_start & ~(s->subcluster_sectors - 1);
+        cow_end_sector = align_offset(nb_sectors, s->subcluster_sectors);
+    }
+
     *m = g_malloc0(sizeof(**m));
 
     **m = (QCowL2Meta) {
@@ -1091,12 +1356,12 @@ static int handle_alloc(BlockDriverState *bs, uint64_t guest_offset,
         .nb_available   = nb_sectors,
 
         .cow_start = {
-            .offset     = 0,
-            .nb_sectors = alloc_n_start,
+            .offset     = cow_start_sector * BDRV_SECTOR_SIZE,
+            .nb_sectors = alloc_n_start - cow_start_sector,
         },
         .cow_end = {
             .offset     = nb_sectors * BDRV_SECTOR_SIZE,
-            .nb_sectors = avail_sectors - nb_sectors,
+            .nb_sectors = cow_end_sector - nb_sectors,
         },
     };
     qemu_co_queue_init(&(*m)->dependent_requests);
@@ -1322,14 +1587,17 @@ static int discard_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
         if ((old_offset & L2E_OFFSET_MASK) == 0) {
             continue;
         }
 
         /* First remove L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        l2_table[l2_index + i] = cpu_to_be64(0);
+        set_l2_entry(s, l2_table, l2_index + i, 0);
+        if (has_subclusters(s)) {
+            set_l2_bitmap(s, l2_table, l2_index + i, 0);
+        }
 
         /* Then decrease the refcount */
         qcow2_free_any_clusters(bs, old_offset, 1);
@@ -1381,9 +1649,12 @@ int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
  * This zeroes as many clusters of nb_clusters as possible at once (i.e.
  * all clusters in the same L2 table) and returns the number of zeroed
  * clusters.
+ *
+ * With BDRV_REQ_MAY_UNMAP, the host clusters are freed as well instead of
+ * being kept around for later writes.
  */
 static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
-    unsigned int nb_clusters)
+    unsigned int nb_clusters, int flags)
 {
     BDRVQcowState *s = bs->opaque;
     uint64_t *l2_table;
@@ -1402,15 +1673,34 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     for (i = 0; i < nb_clusters; i++) {
         uint64_t old_offset;
 
-        old_offset = be64_to_cpu(l2_table[l2_index + i]);
+        old_offset = get_l2_entry(s, l2_table, l2_index + i);
 
         /* Update L2 entries */
         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
-        if (old_offset & QCOW_OFLAG_COMPRESSED) {
-            l2_table[l2_index + i] = cpu_to_be64(QCOW_OFLAG_ZERO);
+        if (flags & BDRV_REQ_MAY_UNMAP) {
+            /* A preallocated zero cluster still owns its host cluster */
+            set_l2_entry(s, l2_table, l2_index + i,
+                         has_subclusters(s) ? 0 : QCOW_OFLAG_ZERO);
+            if (has_subclusters(s)) {
+                set_l2_bitmap(s, l2_table, l2_index + i,
+                              QCOW_L2_BITMAP_ALL_ZEROES);
+            }
+            qcow2_free_any_clusters(bs, old_offset & ~QCOW_OFLAG_ZERO, 1);
+        } else if (has_subclusters(s)) {
+            /* Keep the host cluster for later writes, like without
+             * subclusters */
+            if (old_offset & QCOW_OFLAG_COMPRESSED) {
+                set_l2_entry(s, l2_table, l2_index + i, 0);
+                qcow2_free_any_clusters(bs, old_offset, 1);
+            }
+            set_l2_bitmap(s, l2_table, l2_index + i,
+                          QCOW_L2_BITMAP_ALL_ZEROES);
+        } else if (old_offset & QCOW_OFLAG_COMPRESSED) {
+            set_l2_entry(s, l2_table, l2_index + i, QCOW_OFLAG_ZERO);
             qcow2_free_any_clusters(bs, old_offset, 1);
         } else {
-            l2_table[l2_index + i] |= cpu_to_be64(QCOW_OFLAG_ZERO);
+            set_l2_entry(s, l2_table, l2_index + i,
+                         old_offset | QCOW_OFLAG_ZERO);
         }
     }
 
@@ -1422,7 +1712,8 @@ static int zero_single_l2(BlockDriverState *bs, uint64_t offset,
     return nb_clusters;
 }
 
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags)
 {
     BDRVQcowState *s = bs->opaque;
     unsigned int nb_clusters;
@@ -1437,7 +1728,7 @@ int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors)
     nb_clusters = size_to_clusters(s, nb_sectors << BDRV_SECTOR_BITS);
 
     while (nb_clusters > 0) {
-        ret = zero_single_l2(bs, offset, nb_clusters);
+        ret = zero_single_l2(bs, offset, nb_clusters, flags);
         if (ret < 0) {
             return ret;
         }
@@ -774,7 +774,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
             }
 
             for(j = 0; j < s->l2_size; j++) {
-                offset = be64_to_cpu(l2_table[j]);
+                offset = get_l2_entry(s, l2_table, j);
                 if (offset != 0) {
                     old_offset = offset;
                     offset &= ~QCOW_OFLAG_COPIED;
@@ -814,7 +814,7 @@ int qcow2_update_snapshot_refcount(BlockDriverState *bs,
                             qcow2_cache_set_dependency(bs, s->l2_table_cache,
                                 s->refcount_block_cache);
                         }
-                        l2_table[j] = cpu_to_be64(offset);
+                        set_l2_entry(s, l2_table, j, offset);
                         qcow2_cache_entry_mark_dirty(s->l2_table_cache, l2_table);
                     }
                 }
@@ -925,6 +925,35 @@ enum {
     CHECK_FRAG_INFO = 0x2,      /* update BlockFragInfo counters */
 };
 
+/*
+ * Checks the subcluster allocation bitmap of an extended L2 entry
+ */
+static void check_l2_bitmap(BdrvCheckResult *res, uint64_t l2_entry,
+    uint64_t l2_bitmap)
+{
+    uint64_t alloc = l2_bitmap & QCOW_L2_BITMAP_ALL_ALLOC;
+    uint64_t zero = l2_bitmap >> 32;
+    const char *error = NULL;
+
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        if (l2_bitmap) {
+            error = "compressed cluster has a subcluster bitmap";
+        }
+    } else if (l2_entry & QCOW_OFLAG_ZERO) {
+        error = "zero flag is reserved with extended L2 entries";
+    } else if (!(l2_entry & L2E_OFFSET_MASK) && alloc) {
+        error = "unallocated cluster has allocated subclusters";
+    } else if (alloc & zero) {
+        error = "subclusters are both allocated and zero";
+    }
+
+    if (error) {
+        fprintf(stderr, "ERROR L2 entry %" PRIx64 " bitmap %" PRIx64 ": %s\n",
+            l2_entry, l2_bitmap, error);
+        res->corruptions++;
+    }
+}
+
 /*
  * Increases the refcount in the given refcount table for the all clusters
  * referenced in the L2 table. While doing so, performs some checks on L2
@@ -943,7 +972,7 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
     int i, l2_size, nb_csectors, refcount;
 
     /* Read L2 table from disk */
-    l2_size = s->l2_size * sizeof(uint64_t);
+    l2_size = s->l2_size * s->l2_entry_size;
     l2_table = g_malloc(l2_size);
 
     if (bdrv_pread(bs->file, l2_offset, l2_table, l2_size) != l2_size)
@@ -951,7 +980,11 @@ static int check_refcounts_l2(BlockDriverState *bs, BdrvCheckResult *res,
 
     /* Do the actual checks */
     for(i = 0; i < s->l2_size; i++) {
-        l2_entry = be64_to_cpu(l2_table[i]);
+        l2_entry = get_l2_entry(s, l2_table, i);
+
+        if (has_subclusters(s)) {
+            check_l2_bitmap(res, l2_entry, get_l2_bitmap(s, l2_table, i));
+        }
 
         switch (qcow2_get_cluster_type(l2_entry)) {
         case QCOW2_CLUSTER_COMPRESSED:
@@ -1141,6 +1174,63 @@ fail:
  * Returns 0 if no errors are found, the number of errors in case the image is
  * detected as corrupted, and -errno when an internal error occurred.
  */
+/*
+ * Increases the refcount in the given refcount table for the bitmap
+ * directory and the bitmap tables and data clusters that it references.
+ */
+static int check_refcounts_bitmaps(BlockDriverState *bs, BdrvCheckResult *res,
+                                   uint16_t *refcount_table,
+                                   int refcount_table_size)
+{
+    BDRVQcowState *s = bs->opaque;
+    Qcow2Bitmap *bitmaps;
+    int nb_bitmaps, i, j, ret;
+
+    nb_bitmaps = qcow2_read_bitmap_list(bs, &bitmaps);
+    if (nb_bitmaps == -EINVAL) {
+        fprintf(stderr, "ERROR bitmap directory is corrupted\n");
+        res->corruptions++;
+        return 0;
+    } else if (nb_bitmaps < 0) {
+        return nb_bitmaps;
+    } else if (nb_bitmaps == 0) {
+        return 0;
+    }
+
+    inc_refcounts(bs, res, refcount_table, refcount_table_size,
+        s->bitmap_directory_offset, s->bitmap_directory_size);
+
+    for (i = 0; i < nb_bitmaps; i++) {
+        uint64_t *table;
+
+        ret = qcow2_read_bitmap_table(bs, &bitmaps[i], &table);
+        if (ret == -EINVAL) {
+            fprintf(stderr, "ERROR bitmap table of '%s' is corrupted\n",
+                    bitmaps[i].name);
+            res->corruptions++;
+            continue;
+        } else if (ret < 0) {
+            goto fail;
+        }
+
+        inc_refcounts(bs, res, refcount_table, refcount_table_size,
+            bitmaps[i].table_offset,
+            bitmaps[i].table_size * sizeof(uint64_t));
+        for (j = 0; j < bitmaps[i].table_size; j++) {
+            if (table[j]) {
+                inc_refcounts(bs, res, refcount_table, refcount_table_size,
+                    table[j], s->cluster_size);
+            }
+        }
+        g_free(table);
+    }
+    ret = 0;
+
+fail:
+    qcow2_free_bitmap_list(bitmaps, nb_bitmaps);
+    return ret;
+}
+
 int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
                           BdrvCheckMode fix)
 {
@@ -1182,6 +1272,12 @@ int qcow2_check_refcounts(BlockDriverState *bs, BdrvCheckResult *res,
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->snapshots_offset, s->snapshots_size);
 
+    /* dirty bitmaps */
+    ret = check_refcounts_bitmaps(bs, res, refcount_table, nb_clusters);
+    if (ret < 0) {
+        goto fail;
+    }
+
     /* refcount data */
     inc_refcounts(bs, res, refcount_table, nb_clusters,
         s->refcount_table_offset,
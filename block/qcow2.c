@@ -27,9 +27,11 @@
 #include <zlib.h>
 #include "qemu/aes.h"
 #include "block/qcow2.h"
+#include "block/thread-pool.h"
 #include "qemu/error-report.h"
 #include "qapi/qmp/qerror.h"
 #include "qapi/qmp/qbool.h"
+#include "qapi/qmp/qint.h"
 #include "trace.h"
 
 /*
@@ -57,6 +59,14 @@ typedef struct {
 #define  QCOW2_EXT_MAGIC_END 0
 #define  QCOW2_EXT_MAGIC_BACKING_FORMAT 0xE2792ACA
 #define  QCOW2_EXT_MAGIC_FEATURE_TABLE 0x6803f857
+#define  QCOW2_EXT_MAGIC_BITMAPS 0x23852875
+
+typedef struct QEMU_PACKED Qcow2BitmapHeaderExt {
+    uint32_t nb_bitmaps;
+    uint32_t reserved32;
+    uint64_t bitmap_directory_size;
+    uint64_t bitmap_directory_offset;
+} Qcow2BitmapHeaderExt;
 
 static int qcow2_probe(const uint8_t *buf, int buf_size, const char *filename)
 {
@@ -149,6 +159,26 @@ static int qcow2_read_extensions(BlockDriverState *bs, uint64_t start_offset,
             }
             break;
 
+        case QCOW2_EXT_MAGIC_BITMAPS:
+            {
+                Qcow2BitmapHeaderExt bitmaps_ext;
+
+                if (ext.len != sizeof(bitmaps_ext)) {
+                    error_report("Invalid dirty bitmaps header extension");
+                    return -EINVAL;
+                }
+                ret = bdrv_pread(bs->file, offset, &bitmaps_ext, ext.len);
+                if (ret < 0) {
+                    return ret;
+                }
+                s->nb_bitmaps = be32_to_cpu(bitmaps_ext.nb_bitmaps);
+                s->bitmap_directory_size =
+                    be64_to_cpu(bitmaps_ext.bitmap_directory_size);
+                s->bitmap_directory_offset =
+                    be64_to_cpu(bitmaps_ext.bitmap_directory_offset);
+            }
+            break;
+
         default:
             /* unknown magic - save it in case we need to rewrite the header */
             {
@@ -295,6 +325,16 @@ static QemuOptsList qcow2_runtime_opts = {
             .type = QEMU_OPT_BOOL,
             .help = "Postpone refcount updates",
         },
+        {
+            .name = QCOW2_OPT_L2_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum L2 table cache size",
+        },
+        {
+            .name = QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+            .type = QEMU_OPT_SIZE,
+            .help = "Maximum refcount block cache size",
+        },
         { /* end of list */ }
     },
 };
@@ -304,9 +344,10 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     BDRVQcowState *s = bs->opaque;
     int len, i, ret = 0;
     QCowHeader header;
-    QemuOpts *opts;
+    QemuOpts *opts = NULL;
     Error *local_err = NULL;
     uint64_t ext_end;
+    uint64_t l2_cache_size, refcount_cache_size;
 
     ret = bdrv_pread(bs->file, 0, &header, sizeof(header));
     if (ret < 0) {
@@ -409,7 +450,26 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     s->cluster_bits = header.cluster_bits;
     s->cluster_size = 1 << s->cluster_bits;
     s->cluster_sectors = 1 << (s->cluster_bits - 9);
-    s->l2_bits = s->cluster_bits - 3; /* L2 is always one cluster */
+
+    if (has_subclusters(s)) {
+        if (s->cluster_bits < MIN_CLUSTER_BITS_EXTL2) {
+            report_unsupported(bs, "Extended L2 entries with %d byte "
+                               "clusters", s->cluster_size);
+            ret = -EINVAL;
+            goto fail;
+        }
+        s->l2_entry_size = 2 * sizeof(uint64_t);
+        s->subclusters_per_cluster = QCOW_EXTL2_SUBCLUSTERS;
+    } else {
+        s->l2_entry_size = sizeof(uint64_t);
+        s->subclusters_per_cluster = 1;
+    }
+    s->subcluster_size = s->cluster_size / s->subclusters_per_cluster;
+    s->subcluster_bits = ffs(s->subcluster_size) - 1;
+    s->subcluster_sectors = s->subcluster_size >> BDRV_SECTOR_BITS;
+
+    /* L2 is always one cluster */
+    s->l2_bits = s->cluster_bits - (ffs(s->l2_entry_size) - 1);
     s->l2_size = 1 << s->l2_bits;
     bs->total_sectors = header.size / 512;
     s->csize_shift = (62 - (s->cluster_bits - 8));
@@ -445,9 +505,37 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         }
     }
 
+    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
+    qemu_opts_absorb_qdict(opts, options, &local_err);
+    if (error_is_set(&local_err)) {
+        qerror_report_err(local_err);
+        error_free(local_err);
+        ret = -EINVAL;
+        goto fail;
+    }
+
     /* alloc L2 table/refcount block cache */
-    s->l2_table_cache = qcow2_cache_create(bs, L2_CACHE_SIZE);
-    s->refcount_block_cache = qcow2_cache_create(bs, REFCOUNT_CACHE_SIZE);
+    l2_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_L2_CACHE_SIZE,
+                                      L2_CACHE_SIZE * s->cluster_size);
+    refcount_cache_size = qemu_opt_get_size(opts, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+                                      REFCOUNT_CACHE_SIZE * s->cluster_size);
+    l2_cache_size /= s->cluster_size;
+    refcount_cache_size /= s->cluster_size;
+    if (l2_cache_size < MIN_L2_CACHE_SIZE || l2_cache_size > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "L2 cache size must hold "
+            "between %d and %d tables", MIN_L2_CACHE_SIZE, INT_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+    if (refcount_cache_size < REFCOUNT_CACHE_SIZE ||
+        refcount_cache_size > INT_MAX) {
+        qerror_report(ERROR_CLASS_GENERIC_ERROR, "Refcount cache size must "
+            "hold between %d and %d blocks", REFCOUNT_CACHE_SIZE, INT_MAX);
+        ret = -EINVAL;
+        goto fail;
+    }
+    s->l2_table_cache = qcow2_cache_create(bs, l2_cache_size);
+    s->refcount_block_cache = qcow2_cache_create(bs, refcount_cache_size);
 
     s->cluster_cache = g_malloc(s->cluster_size);
     /* one more sector for decompressed data alignment */
@@ -488,9 +576,15 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         goto fail;
     }
 
+    /* The bitmaps are stale if an older version has written to the image
+     * and cleared the autoclear bit */
+    if (!(s->autoclear_features & QCOW2_AUTOCLEAR_BITMAPS)) {
+        s->nb_bitmaps = 0;
+    }
+
     /* Clear unknown autoclear feature bits */
-    if (!bs->read_only && s->autoclear_features != 0) {
-        s->autoclear_features = 0;
+    if (!bs->read_only && (s->autoclear_features & ~QCOW2_AUTOCLEAR_MASK)) {
+        s->autoclear_features &= QCOW2_AUTOCLEAR_MASK;
         ret = qcow2_update_header(bs);
         if (ret < 0) {
             goto fail;
@@ -499,6 +593,7 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
 
     /* Initialise locks */
     qemu_co_mutex_init(&s->lock);
+    qemu_co_queue_init(&s->compress_queue);
 
     /* Repair image if dirty */
     if (!(flags & BDRV_O_CHECK) && !bs->read_only &&
@@ -512,19 +607,11 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     }
 
     /* Enable lazy_refcounts according to image and command line options */
-    opts = qemu_opts_create_nofail(&qcow2_runtime_opts);
-    qemu_opts_absorb_qdict(opts, options, &local_err);
-    if (error_is_set(&local_err)) {
-        qerror_report_err(local_err);
-        error_free(local_err);
-        ret = -EINVAL;
-        goto fail;
-    }
-
     s->use_lazy_refcounts = qemu_opt_get_bool(opts, QCOW2_OPT_LAZY_REFCOUNTS,
         (s->compatible_features & QCOW2_COMPAT_LAZY_REFCOUNTS));
 
     qemu_opts_del(opts);
+    opts = NULL;
 
     if (s->use_lazy_refcounts && s->qcow_version < 3) {
         qerror_report(ERROR_CLASS_GENERIC_ERROR, "Lazy refcounts require "
@@ -533,6 +620,14 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
         goto fail;
     }
 
+    /* Writes must be tracked in memory from now on */
+    if (!bs->read_only && s->nb_bitmaps) {
+        ret = qcow2_load_dirty_bitmaps(bs);
+        if (ret < 0) {
+            goto fail;
+        }
+    }
+
 #ifdef DEBUG_ALLOC
     {
         BdrvCheckResult result = {0};
@@ -542,6 +637,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     return ret;
 
  fail:
+    if (opts) {
+        qemu_opts_del(opts);
+    }
     g_free(s->unknown_header_fields);
     cleanup_unknown_header_ext(bs);
     qcow2_free_snapshots(bs);
@@ -550,6 +648,9 @@ static int qcow2_open(BlockDriverState *bs, QDict *options, int flags)
     if (s->l2_table_cache) {
         qcow2_cache_destroy(bs, s->l2_table_cache);
     }
+    if (s->refcount_block_cache) {
+        qcow2_cache_destroy(bs, s->refcount_block_cache);
+    }
     g_free(s->cluster_cache);
     qemu_vfree(s->cluster_data);
     return ret;
@@ -597,11 +698,18 @@ static int qcow2_set_key(BlockDriverState *bs, const char *key)
     return 0;
 }
 
-/* We have nothing to do for QCOW2 reopen, stubs just return
- * success */
 static int qcow2_reopen_prepare(BDRVReopenState *state,
                                 BlockReopenQueue *queue, Error **errp)
 {
+    BDRVQcowState *s = state->bs->opaque;
+
+    /* Stored bitmaps are only loaded when the image is opened */
+    if ((state->flags & BDRV_O_RDWR) && state->bs->read_only &&
+        s->nb_bitmaps) {
+        error_setg(errp, "Cannot reopen an image with stored dirty bitmaps "
+                   "read-write");
+        return -ENOTSUP;
+    }
     return 0;
 }
 
@@ -642,6 +750,60 @@ int qcow2_backing_read1(BlockDriverState *bs, QEMUIOVector *qiov,
     return n1;
 }
 
+/*
+ * Handles the start of a request that maps to already allocated clusters
+ * without taking s->lock, so that such requests run in parallel with each
+ * other and with requests that are waiting for metadata I/O.
+ *
+ * Returns the number of sectors that were processed (possibly 0), or -errno.
+ */
+static coroutine_fn int qcow2_co_rw_fast(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, QEMUIOVector *qiov, bool is_write)
+{
+    BDRVQcowState *s = bs->opaque;
+    QEMUIOVector hd_qiov;
+    uint64_t bytes, host_offset;
+    int done = 0;
+    int ret = 0;
+
+    /* Encrypted data needs a bounce buffer, leave that to the slow path */
+    if (s->crypt_method) {
+        return 0;
+    }
+
+    qemu_iovec_init(&hd_qiov, qiov->niov);
+
+    while (done < nb_sectors) {
+        bytes = (uint64_t) (nb_sectors - done) * 512;
+        if (!qcow2_get_host_offset_fast(bs, (sector_num + done) << 9, &bytes,
+                                        &host_offset, is_write)) {
+            break;
+        }
+        trace_qcow2_rw_fast(qemu_coroutine_self(), sector_num + done,
+                            bytes >> 9, is_write);
+
+        qemu_iovec_reset(&hd_qiov);
+        qemu_iovec_concat(&hd_qiov, qiov, done * 512, bytes);
+
+        if (is_write) {
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_AIO);
+            ret = bdrv_co_writev(bs->file, host_offset >> 9, bytes >> 9,
+                                 &hd_qiov);
+        } else {
+            BLKDBG_EVENT(bs->file, BLKDBG_READ_AIO);
+            ret = bdrv_co_readv(bs->file, host_offset >> 9, bytes >> 9,
+                                &hd_qiov);
+        }
+        if (ret < 0) {
+            break;
+        }
+        done += bytes >> 9;
+    }
+
+    qemu_iovec_destroy(&hd_qiov);
+    return ret < 0 ? ret : done;
+}
+
 static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
                           int remaining_sectors, QEMUIOVector *qiov)
 {
@@ -654,6 +816,14 @@ static coroutine_fn int qcow2_co_readv(BlockDriverState *bs, int64_t sector_num,
     QEMUIOVector hd_qiov;
     uint8_t *cluster_data = NULL;
 
+    ret = qcow2_co_rw_fast(bs, sector_num, remaining_sectors, qiov, false);
+    if (ret < 0 || ret == remaining_sectors) {
+        return ret < 0 ? ret : 0;
+    }
+    sector_num += ret;
+    remaining_sectors -= ret;
+    bytes_done = ret * 512;
+
     qemu_iovec_init(&hd_qiov, qiov->niov);
 
     qemu_co_mutex_lock(&s->lock);
@@ -802,6 +972,17 @@ static coroutine_fn int qcow2_co_writev(BlockDriverState *bs,
 
     s->cluster_cache_offset = -1; /* disable compressed cache */
 
+    ret = qcow2_co_rw_fast(bs, sector_num, remaining_sectors, qiov, true);
+    if (ret < 0 || ret == remaining_sectors) {
+        qemu_iovec_destroy(&hd_qiov);
+        ret = ret < 0 ? ret : 0;
+        trace_qcow2_writev_done_req(qemu_coroutine_self(), ret);
+        return ret;
+    }
+    sector_num += ret;
+    remaining_sectors -= ret;
+    bytes_done = ret * 512;
+
     qemu_co_mutex_lock(&s->lock);
 
     while (remaining_sectors != 0) {
@@ -911,6 +1092,8 @@ fail:
 static void qcow2_close(BlockDriverState *bs)
 {
     BDRVQcowState *s = bs->opaque;
+
+    qcow2_store_dirty_bitmaps(bs);
     g_free(s->l1_table);
 
     qcow2_cache_flush(bs, s->l2_table_cache);
@@ -938,6 +1121,7 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
     AES_KEY aes_decrypt_key;
     uint32_t crypt_method = 0;
     QDict *options;
+    BlockCacheStats l2_cache, refcount_cache;
 
     /*
      * Backing files are read-only which makes all of their metadata immutable,
@@ -950,11 +1134,18 @@ static void qcow2_invalidate_cache(BlockDriverState *bs)
         memcpy(&aes_decrypt_key, &s->aes_decrypt_key, sizeof(aes_decrypt_key));
     }
 
+    qcow2_cache_get_stats(s->l2_table_cache, &l2_cache);
+    qcow2_cache_get_stats(s->refcount_block_cache, &refcount_cache);
+
     qcow2_close(bs);
 
     options = qdict_new();
     qdict_put(options, QCOW2_OPT_LAZY_REFCOUNTS,
               qbool_from_int(s->use_lazy_refcounts));
+    qdict_put(options, QCOW2_OPT_L2_CACHE_SIZE,
+              qint_from_int(l2_cache.size * s->cluster_size));
+    qdict_put(options, QCOW2_OPT_REFCOUNT_CACHE_SIZE,
+              qint_from_int(refcount_cache.size * s->cluster_size));
 
     memset(s, 0, sizeof(BDRVQcowState));
     qcow2_open(bs, options, flags);
@@ -1094,11 +1285,21 @@ int qcow2_update_header(BlockDriverState *bs)
             .bit  = QCOW2_INCOMPAT_DIRTY_BITNR,
             .name = "dirty bit",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_INCOMPATIBLE,
+            .bit  = QCOW2_INCOMPAT_EXTL2_BITNR,
+            .name = "extended L2 entries",
+        },
         {
             .type = QCOW2_FEAT_TYPE_COMPATIBLE,
             .bit  = QCOW2_COMPAT_LAZY_REFCOUNTS_BITNR,
             .name = "lazy refcounts",
         },
+        {
+            .type = QCOW2_FEAT_TYPE_AUTOCLEAR,
+            .bit  = QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+            .name = "dirty bitmaps",
+        },
     };
 
     ret = header_ext_add(buf, QCOW2_EXT_MAGIC_FEATURE_TABLE,
@@ -1109,6 +1310,24 @@ int qcow2_update_header(BlockDriverState *bs)
     buf += ret;
     buflen -= ret;
 
+    /* Dirty bitmaps header extension */
+    if (s->nb_bitmaps) {
+        Qcow2BitmapHeaderExt bitmaps_ext = {
+            .nb_bitmaps = cpu_to_be32(s->nb_bitmaps),
+            .bitmap_directory_size = cpu_to_be64(s->bitmap_directory_size),
+            .bitmap_directory_offset =
+                cpu_to_be64(s->bitmap_directory_offset),
+        };
+
+        ret = header_ext_add(buf, QCOW2_EXT_MAGIC_BITMAPS,
+                             &bitmaps_ext, sizeof(bitmaps_ext), buflen);
+        if (ret < 0) {
+            goto fail;
+        }
+        buf += ret;
+        buflen -= ret;
+    }
+
     /* Keep unknown header extensions */
     QLIST_FOREACH(uext, &s->unknown_header_ext, next) {
         ret = header_ext_add(buf, uext->magic, uext->data, uext->len, buflen);
@@ -1237,6 +1456,12 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             1 << MIN_CLUSTER_BITS, 1 << (MAX_CLUSTER_BITS - 10));
         return -EINVAL;
     }
+    if ((flags & BLOCK_FLAG_EXTENDED_L2) &&
+        cluster_bits < MIN_CLUSTER_BITS_EXTL2) {
+        error_report("Extended L2 entries need a cluster size of at least "
+                     "%dk", 1 << (MIN_CLUSTER_BITS_EXTL2 - 10));
+        return -EINVAL;
+    }
 
     /*
      * Open the image file and write a minimal qcow2 header.
@@ -1289,6 +1514,10 @@ static int qcow2_create2(const char *filename, int64_t total_size,
             cpu_to_be64(QCOW2_COMPAT_LAZY_REFCOUNTS);
     }
 
+    if (flags & BLOCK_FLAG_EXTENDED_L2) {
+        header.incompatible_features |= cpu_to_be64(QCOW2_INCOMPAT_EXTL2);
+    }
+
     ret = bdrv_pwrite(bs, 0, &header, sizeof(header));
     if (ret < 0) {
         goto out;
@@ -1404,6 +1633,8 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
             }
         } else if (!strcmp(options->name, BLOCK_OPT_LAZY_REFCOUNTS)) {
             flags |= options->value.n ? BLOCK_FLAG_LAZY_REFCOUNTS : 0;
+        } else if (!strcmp(options->name, BLOCK_OPT_EXTENDED_L2)) {
+            flags |= options->value.n ? BLOCK_FLAG_EXTENDED_L2 : 0;
         }
         options++;
     }
@@ -1420,6 +1651,13 @@ static int qcow2_create(const char *filename, QEMUOptionParameter *options)
         return -EINVAL;
     }
 
+    if (version < 3 && (flags & BLOCK_FLAG_EXTENDED_L2)) {
+        fprintf(stderr, "Extended L2 entries only supported with "
+                "compatibility level 1.1 and above (use compat=1.1 or "
+                "greater)\n");
+        return -EINVAL;
+    }
+
     return qcow2_create2(filename, sectors, backing_file, backing_fmt, flags,
                          cluster_size, prealloc, options, version);
 }
@@ -1445,7 +1683,7 @@ static int qcow2_make_empty(BlockDriverState *bs)
 }
 
 static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
-    int64_t sector_num, int nb_sectors)
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
 {
     int ret;
     BDRVQcowState *s = bs->opaque;
@@ -1458,7 +1696,7 @@ static coroutine_fn int qcow2_co_write_zeroes(BlockDriverState *bs,
     /* Whatever is left can use real zero clusters */
     qemu_co_mutex_lock(&s->lock);
     ret = qcow2_zero_clusters(bs, sector_num << BDRV_SECTOR_BITS,
-        nb_sectors);
+        nb_sectors, flags);
     qemu_co_mutex_unlock(&s->lock);
 
     return ret;
@@ -1517,16 +1755,67 @@ static int qcow2_truncate(BlockDriverState *bs, int64_t offset)
     return 0;
 }
 
+typedef struct Qcow2CompressData {
+    const uint8_t *buf;
+    uint8_t *out_buf;
+    int cluster_size;
+} Qcow2CompressData;
+
+/*
+ * Deflate one cluster.  Runs in a thread pool worker.
+ *
+ * Returns the compressed size, 0 if the cluster does not compress and must
+ * be written as a normal cluster, or -errno on failure.
+ */
+static int qcow2_compress_worker(void *opaque)
+{
+    Qcow2CompressData *data = opaque;
+    z_stream strm;
+    int ret, out_len;
+
+    /* best compression, small window, no zlib header */
+    memset(&strm, 0, sizeof(strm));
+    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
+                       Z_DEFLATED, -12,
+                       9, Z_DEFAULT_STRATEGY);
+    if (ret != 0) {
+        return -EINVAL;
+    }
+
+    strm.avail_in = data->cluster_size;
+    strm.next_in = (uint8_t *)data->buf;
+    strm.avail_out = data->cluster_size;
+    strm.next_out = data->out_buf;
+
+    ret = deflate(&strm, Z_FINISH);
+    if (ret != Z_STREAM_END && ret != Z_OK) {
+        deflateEnd(&strm);
+        return -EINVAL;
+    }
+    out_len = strm.next_out - data->out_buf;
+
+    deflateEnd(&strm);
+
+    if (ret != Z_STREAM_END || out_len >= data->cluster_size) {
+        return 0;
+    }
+    return out_len;
+}
+
 /* XXX: put compressed sectors first, then all the cluster aligned
    tables to avoid losing bytes in alignment */
-static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
-                                  const uint8_t *buf, int nb_sectors)
+static coroutine_fn int qcow2_write_compressed(BlockDriverState *bs,
+                                               int64_t sector_num,
+                                               const uint8_t *buf,
+                                               int nb_sectors)
 {
     BDRVQcowState *s = bs->opaque;
-    z_stream strm;
+    Qcow2CompressData data;
+    ThreadPool *pool;
     int ret, out_len;
     uint8_t *out_buf;
-    uint64_t cluster_offset;
+    uint64_t cluster_offset = 0;
+    uint64_t ticket;
 
     if (nb_sectors == 0) {
         /* align end of file to a sector boundary to ease reading with
@@ -1553,49 +1842,48 @@ static int qcow2_write_compressed(BlockDriverState *bs, int64_t sector_num,
         return ret;
     }
 
-    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
-
-    /* best compression, small window, no zlib header */
-    memset(&strm, 0, sizeof(strm));
-    ret = deflateInit2(&strm, Z_DEFAULT_COMPRESSION,
-                       Z_DEFLATED, -12,
-                       9, Z_DEFAULT_STRATEGY);
-    if (ret != 0) {
-        ret = -EINVAL;
-        goto fail;
-    }
+    /* Take a ticket before yielding, so that clusters are written in the
+     * order the requests were submitted even though several of them are
+     * being deflated at the same time. */
+    ticket = s->compress_ticket_next++;
 
-    strm.avail_in = s->cluster_size;
-    strm.next_in = (uint8_t *)buf;
-    strm.avail_out = s->cluster_size;
-    strm.next_out = out_buf;
+    out_buf = g_malloc(s->cluster_size + (s->cluster_size / 1000) + 128);
+    data = (Qcow2CompressData) {
+        .buf            = buf,
+        .out_buf        = out_buf,
+        .cluster_size   = s->cluster_size,
+    };
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    out_len = thread_pool_submit_co(pool, qcow2_compress_worker, &data);
 
-    ret = deflate(&strm, Z_FINISH);
-    if (ret != Z_STREAM_END && ret != Z_OK) {
-        deflateEnd(&strm);
-        ret = -EINVAL;
-        goto fail;
+    /* Compressed clusters are packed and may share a sector, for which
+     * bdrv_pwrite does a read-modify-write; so the writes are serialized
+     * too, not just the allocation. */
+    while (ticket != s->compress_ticket_write) {
+        qemu_co_queue_wait(&s->compress_queue);
     }
-    out_len = strm.next_out - out_buf;
-
-    deflateEnd(&strm);
-
-    if (ret != Z_STREAM_END || out_len >= s->cluster_size) {
-        /* could not compress: write normal cluster */
-        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
-        if (ret < 0) {
-            goto fail;
-        }
-    } else {
+    ret = out_len;
+    if (out_len > 0) {
+        qemu_co_mutex_lock(&s->lock);
         cluster_offset = qcow2_alloc_compressed_cluster_offset(bs,
             sector_num << 9, out_len);
+        qemu_co_mutex_unlock(&s->lock);
         if (!cluster_offset) {
             ret = -EIO;
-            goto fail;
+        } else {
+            cluster_offset &= s->cluster_offset_mask;
+            BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
+            ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
         }
-        cluster_offset &= s->cluster_offset_mask;
-        BLKDBG_EVENT(bs->file, BLKDBG_WRITE_COMPRESSED);
-        ret = bdrv_pwrite(bs->file, cluster_offset, out_buf, out_len);
+    }
+    s->compress_ticket_write++;
+    qemu_co_queue_restart_all(&s->compress_queue);
+
+    if (ret < 0) {
+        goto fail;
+    } else if (out_len == 0) {
+        /* could not compress: write normal cluster */
+        ret = bdrv_write(bs, sector_num, buf, s->cluster_sectors);
         if (ret < 0) {
             goto fail;
         }
@@ -1640,10 +1928,27 @@ static int qcow2_get_info(BlockDriverState *bs, BlockDriverInfo *bdi)
 {
     BDRVQcowState *s = bs->opaque;
     bdi->cluster_size = s->cluster_size;
+    if (has_subclusters(s)) {
+        bdi->subcluster_size = s->subcluster_size;
+    }
     bdi->vm_state_offset = qcow2_vm_state_offset(s);
     return 0;
 }
 
+static void qcow2_get_stats(const BlockDriverState *bs,
+                            BlockDeviceStats *stats)
+{
+    BDRVQcowState *s = bs->opaque;
+
+    stats->has_l2_cache = true;
+    stats->l2_cache = g_malloc0(sizeof(*stats->l2_cache));
+    qcow2_cache_get_stats(s->l2_table_cache, stats->l2_cache);
+
+    stats->has_refcount_cache = true;
+    stats->refcount_cache = g_malloc0(sizeof(*stats->refcount_cache));
+    qcow2_cache_get_stats(s->refcount_block_cache, stats->refcount_cache);
+}
+
 #if 0
 static void dump_refcounts(BlockDriverState *bs)
 {
@@ -1737,6 +2042,11 @@ static QEMUOptionParameter qcow2_create_options[] = {
         .type = OPT_FLAG,
         .help = "Postpone refcount updates",
     },
+    {
+        .name = BLOCK_OPT_EXTENDED_L2,
+        .type = OPT_FLAG,
+        .help = "Allocate and copy on write in subclusters of 1/32 cluster",
+    },
     { NULL }
 };
 
@@ -1767,11 +2077,13 @@ static BlockDriver bdrv_qcow2 = {
     .bdrv_snapshot_list     = qcow2_snapshot_list,
     .bdrv_snapshot_load_tmp     = qcow2_snapshot_load_tmp,
     .bdrv_get_info      = qcow2_get_info,
+    .bdrv_get_stats     = qcow2_get_stats,
 
     .bdrv_save_vmstate    = qcow2_save_vmstate,
     .bdrv_load_vmstate    = qcow2_load_vmstate,
 
     .bdrv_change_backing_file   = qcow2_change_backing_file,
+    .bdrv_can_store_new_dirty_bitmap = qcow2_can_store_new_dirty_bitmap,
 
     .bdrv_invalidate_cache      = qcow2_invalidate_cache,
 
@@ -46,20 +46,46 @@
 /* The cluster reads as all zeros */
 #define QCOW_OFLAG_ZERO (1LL << 0)
 
+/* Subcluster allocation bitmap of extended L2 entries */
+#define QCOW_OFLAG_SUB_ALLOC(x)   (1ULL << (x))
+#define QCOW_OFLAG_SUB_ZERO(x)    (QCOW_OFLAG_SUB_ALLOC(x) << 32)
+/* Subclusters [x, y) */
+#define QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC(y) - QCOW_OFLAG_SUB_ALLOC(x))
+#define QCOW_OFLAG_SUB_ZERO_RANGE(x, y) \
+    (QCOW_OFLAG_SUB_ALLOC_RANGE(x, y) << 32)
+#define QCOW_L2_BITMAP_ALL_ALLOC  QCOW_OFLAG_SUB_ALLOC_RANGE(0, 32)
+#define QCOW_L2_BITMAP_ALL_ZEROES QCOW_OFLAG_SUB_ZERO_RANGE(0, 32)
+
+#define QCOW_EXTL2_SUBCLUSTERS 32
+
 #define REFCOUNT_SHIFT 1 /* refcount size is 2 bytes */
 
 #define MIN_CLUSTER_BITS 9
 #define MAX_CLUSTER_BITS 21
+/* Subclusters must be at least one sector */
+#define MIN_CLUSTER_BITS_EXTL2 14
+
+#define QCOW2_MAX_BITMAPS                   65535
+#define QCOW2_MAX_BITMAP_DIRECTORY_SIZE     (64 * 1024 * 1024)
+#define QCOW2_MAX_BITMAP_NAME_SIZE          1023
+#define QCOW2_MAX_BITMAP_GRANULARITY_BITS   31
 
+/* Default number of cached tables, overridden by the cache size options */
 #define L2_CACHE_SIZE 16
 
 /* Must be at least 4 to cover all cases of refcount table growth */
 #define REFCOUNT_CACHE_SIZE 4
 
+/* Allocating an L2 table uses the old and the new table at the same time */
+#define MIN_L2_CACHE_SIZE 2
+
 #define DEFAULT_CLUSTER_SIZE 65536
 
 
 #define QCOW2_OPT_LAZY_REFCOUNTS "lazy_refcounts"
+#define QCOW2_OPT_L2_CACHE_SIZE "l2-cache-size"
+#define QCOW2_OPT_REFCOUNT_CACHE_SIZE "refcount-cache-size"
 
 typedef struct QCowHeader {
     uint32_t magic;
@@ -97,6 +123,13 @@ typedef struct QCowSnapshot {
     uint64_t vm_clock_nsec;
 } QCowSnapshot;
 
+typedef struct Qcow2Bitmap {
+    uint64_t table_offset;
+    uint32_t table_size;
+    uint8_t granularity_bits;
+    char *name;
+} Qcow2Bitmap;
+
 struct Qcow2Cache;
 typedef struct Qcow2Cache Qcow2Cache;
 
@@ -117,8 +150,11 @@ enum {
 enum {
     QCOW2_INCOMPAT_DIRTY_BITNR   = 0,
     QCOW2_INCOMPAT_DIRTY         = 1 << QCOW2_INCOMPAT_DIRTY_BITNR,
+    QCOW2_INCOMPAT_EXTL2_BITNR   = 1,
+    QCOW2_INCOMPAT_EXTL2         = 1 << QCOW2_INCOMPAT_EXTL2_BITNR,
 
-    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY,
+    QCOW2_INCOMPAT_MASK          = QCOW2_INCOMPAT_DIRTY
+                                 | QCOW2_INCOMPAT_EXTL2,
 };
 
 /* Compatible feature bits */
@@ -129,6 +165,14 @@ enum {
     QCOW2_COMPAT_FEAT_MASK            = QCOW2_COMPAT_LAZY_REFCOUNTS,
 };
 
+/* Autoclear feature bits */
+enum {
+    QCOW2_AUTOCLEAR_BITMAPS_BITNR = 0,
+    QCOW2_AUTOCLEAR_BITMAPS       = 1 << QCOW2_AUTOCLEAR_BITMAPS_BITNR,
+
+    QCOW2_AUTOCLEAR_MASK          = QCOW2_AUTOCLEAR_BITMAPS,
+};
+
 typedef struct Qcow2Feature {
     uint8_t type;
     uint8_t bit;
@@ -141,6 +185,11 @@ typedef struct BDRVQcowState {
     int cluster_sectors;
     int l2_bits;
     int l2_size;
+    int l2_entry_size;
+    int subcluster_bits;
+    int subcluster_size;
+    int subcluster_sectors;
+    int subclusters_per_cluster;
     int l1_size;
     int l1_vm_state_index;
     int csize_shift;
@@ -165,6 +214,11 @@ typedef struct BDRVQcowState {
 
     CoMutex lock;
 
+    /* compressed clusters are allocated in submission order */
+    uint64_t compress_ticket_next;
+    uint64_t compress_ticket_write;
+    CoQueue compress_queue;
+
     uint32_t crypt_method; /* current crypt method, 0 if no key yet */
     uint32_t crypt_method_header;
     AES_KEY aes_encrypt_key;
@@ -174,6 +228,10 @@ typedef struct BDRVQcowState {
     int nb_snapshots;
     QCowSnapshot *snapshots;
 
+    uint32_t nb_bitmaps;
+    uint64_t bitmap_directory_offset;
+    uint64_t bitmap_directory_size;
+
     int flags;
     int qcow_version;
     bool use_lazy_refcounts;
@@ -203,7 +261,8 @@ struct QCowAIOCB;
 typedef struct Qcow2COWRegion {
     /**
      * Offset of the COW region in bytes from the start of the first cluster
-     * touched by the request.
+     * touched by the request. With extended L2 entries, COW regions of
+     * unallocated clusters only extend to the next subcluster boundary.
      */
     uint64_t    offset;
 
@@ -264,6 +323,7 @@ enum {
 };
 
 #define L1E_OFFSET_MASK 0x00ffffffffffff00ULL
+#define BME_TABLE_ENTRY_OFFSET_MASK 0x00fffffffffffe00ULL
 #define L2E_OFFSET_MASK 0x00ffffffffffff00ULL
 #define L2E_COMPRESSED_OFFSET_SIZE_MASK 0x3fffffffffffffffULL
 
@@ -279,11 +339,55 @@ static inline int64_t offset_into_cluster(BDRVQcowState *s, int64_t offset)
     return offset & (s->cluster_size - 1);
 }
 
+static inline int offset_to_sc_index(BDRVQcowState *s, int64_t offset)
+{
+    return offset_into_cluster(s, offset) >> s->subcluster_bits;
+}
+
+static inline bool has_subclusters(BDRVQcowState *s)
+{
+    return s->incompatible_features & QCOW2_INCOMPAT_EXTL2;
+}
+
+/* Accessors for L2 entry i of a table in the image's byte order */
+static inline uint64_t get_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                    int i)
+{
+    return be64_to_cpu(l2_table[i * (s->l2_entry_size / sizeof(uint64_t))]);
+}
+
+static inline void set_l2_entry(BDRVQcowState *s, uint64_t *l2_table,
+                                int i, uint64_t entry)
+{
+    l2_table[i * (s->l2_entry_size / sizeof(uint64_t))] = cpu_to_be64(entry);
+}
+
+static inline uint64_t get_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                     int i)
+{
+    if (!has_subclusters(s)) {
+        return 0;
+    }
+    return be64_to_cpu(l2_table[i * 2 + 1]);
+}
+
+static inline void set_l2_bitmap(BDRVQcowState *s, uint64_t *l2_table,
+                                 int i, uint64_t bitmap)
+{
+    assert(has_subclusters(s));
+    l2_table[i * 2 + 1] = cpu_to_be64(bitmap);
+}
+
 static inline int size_to_clusters(BDRVQcowState *s, int64_t size)
 {
     return (size + (s->cluster_size - 1)) >> s->cluster_bits;
 }
 
+static inline int size_to_subclusters(BDRVQcowState *s, int64_t size)
+{
+    return (size + (s->subcluster_size - 1)) >> s->subcluster_bits;
+}
+
 static inline int size_to_l1(BDRVQcowState *s, int64_t size)
 {
     int shift = s->cluster_bits + s->l2_bits;
@@ -314,21 +418,45 @@ static inline int qcow2_get_cluster_type(uint64_t l2_entry)
     }
 }
 
+/*
+ * Returns the type of subcluster sc_index of a cluster with extended L2 entry
+ * (l2_entry, l2_bitmap) as one of the QCOW2_CLUSTER_* values.
+ * QCOW2_CLUSTER_UNALLOCATED means that the data comes from the backing file.
+ */
+static inline int qcow2_get_subcluster_type(uint64_t l2_entry,
+                                            uint64_t l2_bitmap, int sc_index)
+{
+    if (l2_entry & QCOW_OFLAG_COMPRESSED) {
+        return QCOW2_CLUSTER_COMPRESSED;
+    } else if (l2_bitmap & QCOW_OFLAG_SUB_ZERO(sc_index)) {
+        return QCOW2_CLUSTER_ZERO;
+    } else if ((l2_entry & L2E_OFFSET_MASK) &&
+               (l2_bitmap & QCOW_OFLAG_SUB_ALLOC(sc_index))) {
+        return QCOW2_CLUSTER_NORMAL;
+    } else {
+        return QCOW2_CLUSTER_UNALLOCATED;
+    }
+}
+
 /* Check whether refcounts are eager or lazy */
 static inline bool qcow2_need_accurate_refcounts(BDRVQcowState *s)
 {
     return !(s->incompatible_features & QCOW2_INCOMPAT_DIRTY);
 }
 
+/*
+ * The guest area that is locked by an in-flight allocation. This is always
+ * whole clusters, even if COW is limited to subclusters: the L2 entry of the
+ * cluster is only valid once the allocation has completed.
+ */
 static inline uint64_t l2meta_cow_start(QCowL2Meta *m)
 {
-    return m->offset + m->cow_start.offset;
+    return m->offset;
 }
 
-static inline uint64_t l2meta_cow_end(QCowL2Meta *m)
+static inline uint64_t l2meta_cow_end(BDRVQcowState *s, QCowL2Meta *m)
 {
-    return m->offset + m->cow_end.offset
-        + (m->cow_end.nb_sectors << BDRV_SECTOR_BITS);
+    return m->offset + ((uint64_t) m->nb_clusters << s->cluster_bits);
 }
 
 // FIXME Need qcow2_ prefix to global functions
@@ -370,6 +498,8 @@ void qcow2_encrypt_sectors(BDRVQcowState *s, int64_t sector_num,
 
 int qcow2_get_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int *num, uint64_t *cluster_offset);
+int qcow2_get_host_offset_fast(BlockDriverState *bs, uint64_t guest_offset,
+    uint64_t *bytes, uint64_t *host_offset, bool write);
 int qcow2_alloc_cluster_offset(BlockDriverState *bs, uint64_t offset,
     int n_start, int n_end, int *num, uint64_t *host_offset, QCowL2Meta **m);
 uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
@@ -379,7 +509,8 @@ uint64_t qcow2_alloc_compressed_cluster_offset(BlockDriverState *bs,
 int qcow2_alloc_cluster_link_l2(BlockDriverState *bs, QCowL2Meta *m);
 int qcow2_discard_clusters(BlockDriverState *bs, uint64_t offset,
     int nb_sectors);
-int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors);
+int qcow2_zero_clusters(BlockDriverState *bs, uint64_t offset, int nb_sectors,
+    int flags);
 
 /* qcow2-snapshot.c functions */
 int qcow2_snapshot_create(BlockDriverState *bs, QEMUSnapshotInfo *sn_info);
@@ -391,6 +522,16 @@ int qcow2_snapshot_load_tmp(BlockDriverState *bs, const char *snapshot_name);
 void qcow2_free_snapshots(BlockDriverState *bs);
 int qcow2_read_snapshots(BlockDriverState *bs);
 
+/* qcow2-bitmap.c functions */
+int qcow2_read_bitmap_list(BlockDriverState *bs, Qcow2Bitmap **pbitmaps);
+int qcow2_read_bitmap_table(BlockDriverState *bs, Qcow2Bitmap *bm,
+                            uint64_t **ptable);
+void qcow2_free_bitmap_list(Qcow2Bitmap *bitmaps, int nb_bitmaps);
+int qcow2_load_dirty_bitmaps(BlockDriverState *bs);
+int qcow2_store_dirty_bitmaps(BlockDriverState *bs);
+bool qcow2_can_store_new_dirty_bitmap(BlockDriverState *bs, const char *name,
+                                      Error **errp);
+
 /* qcow2-cache.c functions */
 Qcow2Cache *qcow2_cache_create(BlockDriverState *bs, int num_tables);
 int qcow2_cache_destroy(BlockDriverState* bs, Qcow2Cache *c);
@@ -405,6 +546,8 @@ int qcow2_cache_get(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
 int qcow2_cache_get_empty(BlockDriverState *bs, Qcow2Cache *c, uint64_t offset,
     void **table);
+int qcow2_cache_get_cached(Qcow2Cache *c, uint64_t offset, void **table);
 int qcow2_cache_put(BlockDriverState *bs, Qcow2Cache *c, void **table);
+void qcow2_cache_get_stats(Qcow2Cache *c, BlockCacheStats *stats);
 
 #endif
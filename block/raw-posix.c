@@ -138,6 +138,10 @@ typedef struct BDRVRawState {
     int use_aio;
     void *aio_ctx;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_uring;
+    void *uring_ctx;
+#endif
 #ifdef CONFIG_XFS
     bool is_xfs : 1;
 #endif
@@ -150,6 +154,9 @@ typedef struct BDRVRawReopenState {
 #ifdef CONFIG_LINUX_AIO
     int use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    int use_uring;
+#endif
 } BDRVRawReopenState;
 
 static int fd_open(BlockDriverState *bs);
@@ -262,6 +269,31 @@ error:
 }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+static int raw_set_uring(BlockDriverState *bs, void **uring_ctx,
+                         int *use_uring, int bdrv_flags)
+{
+    assert(uring_ctx != NULL);
+    assert(use_uring != NULL);
+
+    /* Unlike Linux AIO, io_uring is asynchronous without O_DIRECT too */
+    if (bdrv_flags & BDRV_O_IO_URING) {
+        /* if non-NULL, luring_init() has already been run */
+        if (*uring_ctx == NULL) {
+            *uring_ctx = luring_init(bdrv_get_aio_context(bs));
+            if (!*uring_ctx) {
+                return -1;
+            }
+        }
+        *use_uring = 1;
+    } else {
+        *use_uring = 0;
+    }
+
+    return 0;
+}
+#endif
+
 static QemuOptsList raw_runtime_opts = {
     .name = "raw",
     .head = QTAILQ_HEAD_INITIALIZER(raw_runtime_opts.head),
@@ -322,6 +354,14 @@ static int raw_open_common(BlockDriverState *bs, QDict *options,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (raw_set_uring(bs, &s->uring_ctx, &s->use_uring, bdrv_flags)) {
+        qemu_close(fd);
+        ret = -errno;
+        goto fail;
+    }
+#endif
+
     s->has_discard = 1;
 #ifdef CONFIG_XFS
     if (platform_test_xfs_fd(s->fd)) {
@@ -369,6 +409,14 @@ static int raw_reopen_prepare(BDRVReopenState *state,
     }
 #endif
 
+#ifdef CONFIG_LINUX_IO_URING
+    raw_s->use_uring = s->use_uring;
+    if (raw_set_uring(state->bs, &s->uring_ctx, &raw_s->use_uring,
+                      state->flags)) {
+        return -1;
+    }
+#endif
+
     if (s->type == FTYPE_FD || s->type == FTYPE_CD) {
         raw_s->open_flags |= O_NONBLOCK;
     }
@@ -435,6 +483,9 @@ static void raw_reopen_commit(BDRVReopenState *state)
 #ifdef CONFIG_LINUX_AIO
     s->use_aio = raw_s->use_aio;
 #endif
+#ifdef CONFIG_LINUX_IO_URING
+    s->use_uring = raw_s->use_uring;
+#endif
 
     g_free(state->opaque);
     state->opaque = NULL;
@@ -730,6 +781,46 @@ static ssize_t handle_aiocb_discard(RawPosixAIOData *aiocb)
     return ret;
 }
 
+/*
+ * Unlike discard, which may leave any data behind, this must only succeed
+ * if the range reads back as zeroes afterwards.  Deallocating is the only
+ * efficient way to do that here, so fail with -ENOTSUP for everything else
+ * and let the block layer write a zeroed buffer instead.
+ */
+static ssize_t handle_aiocb_write_zeroes(RawPosixAIOData *aiocb)
+{
+    int ret = -ENOTSUP;
+    BDRVRawState *s = aiocb->bs->opaque;
+
+    if (s->has_discard == 0 || (aiocb->aio_type & QEMU_AIO_BLKDEV)) {
+        return -ENOTSUP;
+    }
+
+#ifdef CONFIG_XFS
+    if (s->is_xfs) {
+        ret = xfs_discard(s, aiocb->aio_offset, aiocb->aio_nbytes);
+        return ret < 0 ? -ENOTSUP : 0;
+    }
+#endif
+
+#ifdef CONFIG_FALLOCATE_PUNCH_HOLE
+    do {
+        if (fallocate(s->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+                      aiocb->aio_offset, aiocb->aio_nbytes) == 0) {
+            return 0;
+        }
+    } while (errno == EINTR);
+
+    ret = -errno;
+    if (ret == -ENODEV || ret == -ENOSYS || ret == -EOPNOTSUPP) {
+        s->has_discard = 0;
+    }
+    ret = -ENOTSUP;
+#endif
+
+    return ret;
+}
+
 static int aio_worker(void *arg)
 {
     RawPosixAIOData *aiocb = arg;
@@ -767,6 +858,9 @@ static int aio_worker(void *arg)
     case QEMU_AIO_DISCARD:
         ret = handle_aiocb_discard(aiocb);
         break;
+    case QEMU_AIO_WRITE_ZEROES:
+        ret = handle_aiocb_write_zeroes(aiocb);
+        break;
     default:
         fprintf(stderr, "invalid aio request (0x%x)\n", aiocb->aio_type);
         ret = -EINVAL;
@@ -777,6 +871,29 @@ static int aio_worker(void *arg)
     return ret;
 }
 
+static int coroutine_fn paio_submit_co(BlockDriverState *bs, int fd,
+        int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
+        int type)
+{
+    RawPosixAIOData *acb = g_slice_new(RawPosixAIOData);
+    ThreadPool *pool;
+
+    acb->bs = bs;
+    acb->aio_type = type;
+    acb->aio_fildes = fd;
+
+    if (qiov) {
+        acb->aio_iov = qiov->iov;
+        acb->aio_niov = qiov->niov;
+    }
+    acb->aio_nbytes = nb_sectors * 512;
+    acb->aio_offset = sector_num * 512;
+
+    trace_paio_submit_co(sector_num, nb_sectors, type);
+    pool = aio_get_thread_pool(bdrv_get_aio_context(bs));
+    return thread_pool_submit_co(pool, aio_worker, acb);
+}
+
 static BlockDriverAIOCB *paio_submit(BlockDriverState *bs, int fd,
         int64_t sector_num, QEMUIOVector *qiov, int nb_sectors,
         BlockDriverCompletionFunc *cb, void *opaque, int type)
@@ -825,6 +942,13 @@ static BlockDriverAIOCB *raw_aio_submit(BlockDriverState *bs,
         }
     }
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring && !(type & QEMU_AIO_MISALIGNED)) {
+        return luring_submit(bs, s->uring_ctx, s->fd, sector_num, qiov,
+                             nb_sectors, cb, opaque, type);
+    }
+#endif
+
     return paio_submit(bs, s->fd, sector_num, qiov, nb_sectors,
                        cb, opaque, type);
 }
@@ -845,6 +969,40 @@ static BlockDriverAIOCB *raw_aio_writev(BlockDriverState *bs,
                           cb, opaque, QEMU_AIO_WRITE);
 }
 
+static void raw_aio_plug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_plug(bs, s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_io_plug(bs, s->uring_ctx);
+    }
+#endif
+}
+
+static void raw_aio_unplug(BlockDriverState *bs)
+{
+#if defined(CONFIG_LINUX_AIO) || defined(CONFIG_LINUX_IO_URING)
+    BDRVRawState *s = bs->opaque;
+#endif
+#ifdef CONFIG_LINUX_AIO
+    if (s->use_aio) {
+        laio_io_unplug(bs, s->aio_ctx);
+    }
+#endif
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        luring_io_unplug(bs, s->uring_ctx);
+    }
+#endif
+}
+
 static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
         BlockDriverCompletionFunc *cb, void *opaque)
 {
@@ -853,12 +1011,25 @@ static BlockDriverAIOCB *raw_aio_flush(BlockDriverState *bs,
     if (fd_open(bs) < 0)
         return NULL;
 
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->use_uring) {
+        return luring_submit(bs, s->uring_ctx, s->fd, 0, NULL, 0,
+                             cb, opaque, QEMU_AIO_FLUSH);
+    }
+#endif
+
     return paio_submit(bs, s->fd, 0, NULL, 0, cb, opaque, QEMU_AIO_FLUSH);
 }
 
 static void raw_close(BlockDriverState *bs)
 {
     BDRVRawState *s = bs->opaque;
+#ifdef CONFIG_LINUX_IO_URING
+    if (s->uring_ctx) {
+        luring_cleanup(s->uring_ctx);
+        s->uring_ctx = NULL;
+    }
+#endif
     if (s->fd >= 0) {
         qemu_close(s->fd);
         s->fd = -1;
@@ -1179,6 +1350,19 @@ static coroutine_fn BlockDriverAIOCB *raw_aio_discard(BlockDriverState *bs,
                        cb, opaque, QEMU_AIO_DISCARD);
 }
 
+static int coroutine_fn raw_co_write_zeroes(BlockDriverState *bs,
+    int64_t sector_num, int nb_sectors, BdrvRequestFlags flags)
+{
+    BDRVRawState *s = bs->opaque;
+
+    if (!(flags & BDRV_REQ_MAY_UNMAP)) {
+        return -ENOTSUP;
+    }
+
+    return paio_submit_co(bs, s->fd, sector_num, NULL, nb_sectors,
+                          QEMU_AIO_WRITE_ZEROES);
+}
+
 static QEMUOptionParameter raw_create_options[] = {
     {
         .name = BLOCK_OPT_SIZE,
@@ -1205,6 +1389,9 @@ static BlockDriver bdrv_file = {
     .bdrv_aio_writev = raw_aio_writev,
     .bdrv_aio_flush = raw_aio_flush,
     .bdrv_aio_discard = raw_aio_discard,
+    .bdrv_co_write_zeroes = raw_co_write_zeroes,
+    .bdrv_io_plug = raw_aio_plug,
+    .bdrv_io_unplug = raw_aio_unplug,
 
     .bdrv_truncate = raw_truncate,
     .bdrv_getlength = raw_getlength,
@@ -1549,6 +1736,8 @@ static BlockDriver bdrv_host_device = {
     .bdrv_aio_writev	= raw_aio_writev,
     .bdrv_aio_flush	= raw_aio_flush,
     .bdrv_aio_discard   = hdev_aio_discard,
+    .bdrv_io_plug       = raw_aio_plug,
+    .bdrv_io_unplug     = raw_aio_unplug,
 
     .bdrv_truncate      = raw_truncate,
     .bdrv_getlength	= raw_getlength,
@@ -0,0 +1,396 @@
+/*
+ * QEMU block throttling group infrastructure
+ *
+ * Copyright Red Hat, Inc. 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or
+ * later.  See the COPYING file in the top-level directory.
+ */
+
+#include "block/throttle-groups.h"
+#include "qemu/queue.h"
+
+/* The ThrottleGroup structure (with its ThrottleState) is shared
+ * among different BlockDriverStates.  Throttling only runs in the main
+ * loop, so it needs no locking.
+ *
+ * Each ThrottleGroup has the following fields:
+ *
+ * - name: the name of the group, used by -drive group= and by the
+ *   block_set_io_throttle command.
+ *
+ * - ts: the ThrottleState, with the configuration and the levels of the
+ *   leaky buckets.  All members of the group consume from them.
+ *
+ * - head: the list of members.  Requests are scheduled in a round-robin
+ *   fashion among the members that have pending requests, so that one
+ *   busy drive cannot starve the others.
+ *
+ * - tokens: the member whose turn it is to issue a request, per direction.
+ *
+ * - any_timer_armed: whether one of the members' timers is armed.  Only
+ *   one timer per direction is armed at a time, the one of the member
+ *   that holds the token.
+ */
+typedef struct ThrottleGroup {
+    char *name;
+    ThrottleState ts;
+    QLIST_HEAD(, BlockDriverState) head;
+    BlockDriverState *tokens[2];
+    bool any_timer_armed[2];
+    unsigned refcount;
+    QTAILQ_ENTRY(ThrottleGroup) list;
+} ThrottleGroup;
+
+static QTAILQ_HEAD(, ThrottleGroup) throttle_groups =
+    QTAILQ_HEAD_INITIALIZER(throttle_groups);
+
+/* Increments the reference count of a ThrottleGroup given its name.
+ *
+ * If no ThrottleGroup is found with the given name a new one is
+ * created.
+ *
+ * @name: the name of the ThrottleGroup
+ * @ret:  the ThrottleGroup
+ */
+static ThrottleGroup *throttle_group_incref(const char *name)
+{
+    ThrottleGroup *tg;
+
+    QTAILQ_FOREACH(tg, &throttle_groups, list) {
+        if (!strcmp(name, tg->name)) {
+            break;
+        }
+    }
+
+    if (!tg) {
+        tg = g_new0(ThrottleGroup, 1);
+        tg->name = g_strdup(name);
+        throttle_init(&tg->ts);
+        QLIST_INIT(&tg->head);
+        QTAILQ_INSERT_TAIL(&throttle_groups, tg, list);
+    }
+
+    tg->refcount++;
+    return tg;
+}
+
+/* Decrease the reference count of a ThrottleGroup and free it if there
+ * are no more members.
+ *
+ * @tg: the ThrottleGroup
+ */
+static void throttle_group_unref(ThrottleGroup *tg)
+{
+    if (--tg->refcount == 0) {
+        QTAILQ_REMOVE(&throttle_groups, tg, list);
+        g_free(tg->name);
+        g_free(tg);
+    }
+}
+
+static ThrottleGroup *throttle_group_of(BlockDriverState *bs)
+{
+    return container_of(bs->throttle_state, ThrottleGroup, ts);
+}
+
+/* Get the name from a BlockDriverState's ThrottleGroup.
+ *
+ * @bs:   a BlockDriverState that is member of a group
+ * @ret:  the name of the group.
+ */
+const char *throttle_group_get_name(BlockDriverState *bs)
+{
+    return throttle_group_of(bs)->name;
+}
+
+/* Return the next BlockDriverState in the round-robin sequence,
+ * simulating a circular list.
+ *
+ * @bs:  the current BlockDriverState
+ * @ret: the next BlockDriverState in the sequence
+ */
+static BlockDriverState *throttle_group_next_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    BlockDriverState *next = QLIST_NEXT(bs, round_robin);
+
+    if (!next) {
+        return QLIST_FIRST(&tg->head);
+    }
+
+    return next;
+}
+
+/* Return the next BlockDriverState in the round-robin sequence with
+ * pending I/O requests.
+ *
+ * @bs:        the current BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ * @ret:       the next BlockDriverState with pending requests, or bs
+ *             if there is none.
+ */
+static BlockDriverState *next_throttle_token(BlockDriverState *bs,
+                                             bool is_write)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    BlockDriverState *token, *start;
+
+    start = token = tg->tokens[is_write];
+
+    /* get next bs round in round robin style */
+    token = throttle_group_next_bs(token);
+    while (token != start && !token->pending_reqs[is_write]) {
+        token = throttle_group_next_bs(token);
+    }
+
+    /* If no I/O is queued for scheduling on the next round robin token
+     * then decide the token is the current bs because chances are
+     * the current bs gets the current request queued.
+     */
+    if (token == start && !token->pending_reqs[is_write]) {
+        token = bs;
+    }
+
+    return token;
+}
+
+/* Check if the next I/O request for a BlockDriverState needs to be
+ * throttled or not.  If there's no timer set in this group, set one
+ * and update the token accordingly.
+ *
+ * @bs:         the current BlockDriverState
+ * @is_write:   the type of operation (read/write)
+ * @ret:        whether the I/O request needs to be throttled or not
+ */
+static bool throttle_group_schedule_timer(BlockDriverState *bs,
+                                          bool is_write)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    bool must_wait;
+
+    /* Check if any of the timers in this group is already armed */
+    if (tg->any_timer_armed[is_write]) {
+        return true;
+    }
+
+    must_wait = throttle_schedule_timer(&tg->ts, &bs->throttle_timers,
+                                        is_write);
+
+    /* If a timer just got armed, set bs as the current token */
+    if (must_wait) {
+        tg->tokens[is_write] = bs;
+        tg->any_timer_armed[is_write] = true;
+    }
+
+    return must_wait;
+}
+
+/* Look for the next pending I/O request and schedule it.
+ *
+ * @bs:        the current BlockDriverState
+ * @is_write:  the type of operation (read/write)
+ */
+static void schedule_next_request(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    BlockDriverState *token;
+    bool must_wait;
+
+    /* Check if there's any pending request to schedule next */
+    token = next_throttle_token(bs, is_write);
+    if (!token->pending_reqs[is_write]) {
+        return;
+    }
+
+    /* Set a timer for the request if it needs to be throttled */
+    must_wait = throttle_group_schedule_timer(token, is_write);
+
+    /* If it doesn't have to wait, queue it for immediate execution */
+    if (!must_wait) {
+        /* Give preference to requests from the current bs */
+        if (qemu_in_coroutine() &&
+            qemu_co_queue_next(&bs->throttled_reqs[is_write])) {
+            token = bs;
+        } else {
+            ThrottleTimers *tt = &token->throttle_timers;
+            int64_t now = qemu_get_clock_ns(tt->clock);
+
+            qemu_mod_timer(tt->timers[is_write], now + 1);
+            tg->any_timer_armed[is_write] = true;
+        }
+        tg->tokens[is_write] = token;
+    }
+}
+
+/* Check if an I/O request needs to be throttled, wait and set a timer
+ * if necessary, and schedule the next request using a round robin
+ * algorithm.
+ *
+ * @bs:        the current BlockDriverState
+ * @bytes:     the number of bytes for this I/O
+ * @is_write:  the type of operation (read/write)
+ */
+void coroutine_fn throttle_group_co_io_limits_intercept(BlockDriverState *bs,
+                                                        unsigned int bytes,
+                                                        bool is_write)
+{
+    BlockDriverState *token;
+    bool must_wait;
+
+    /* First we check if this I/O has to be throttled. */
+    token = next_throttle_token(bs, is_write);
+    must_wait = throttle_group_schedule_timer(token, is_write);
+
+    /* Wait if there's a timer set or queued requests of this type */
+    if (must_wait || bs->pending_reqs[is_write]) {
+        bs->pending_reqs[is_write]++;
+        qemu_co_queue_wait(&bs->throttled_reqs[is_write]);
+        bs->pending_reqs[is_write]--;
+    }
+
+    /* The I/O will be executed, so do the accounting */
+    throttle_account(bs->throttle_state, is_write, bytes);
+
+    /* Schedule the next request */
+    schedule_next_request(bs, is_write);
+}
+
+static void timer_cb(BlockDriverState *bs, bool is_write)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    bool empty_queue;
+
+    /* The timer has just been fired, so we can update the flag */
+    tg->any_timer_armed[is_write] = false;
+
+    /* Run the request that was waiting for this timer */
+    empty_queue = !qemu_co_enter_next(&bs->throttled_reqs[is_write]);
+
+    /* If the request queue was empty then we have to take care of
+     * scheduling the next one */
+    if (empty_queue) {
+        schedule_next_request(bs, is_write);
+    }
+}
+
+static void read_timer_cb(void *opaque)
+{
+    timer_cb(opaque, false);
+}
+
+static void write_timer_cb(void *opaque)
+{
+    timer_cb(opaque, true);
+}
+
+/* Register a BlockDriverState in the throttling group, also
+ * initializing its timers and updating its throttle_state pointer to
+ * point to it.  If a throttling group with that name does not exist
+ * yet, it will be created.
+ *
+ * @bs:        the BlockDriverState to insert
+ * @groupname: the name of the group
+ */
+void throttle_group_register_bs(BlockDriverState *bs, const char *groupname)
+{
+    ThrottleGroup *tg = throttle_group_incref(groupname);
+    int i;
+
+    bs->throttle_state = &tg->ts;
+
+    /* If the ThrottleGroup is new set this BlockDriverState as the token */
+    for (i = 0; i < 2; i++) {
+        if (!tg->tokens[i]) {
+            tg->tokens[i] = bs;
+        }
+    }
+
+    QLIST_INSERT_HEAD(&tg->head, bs, round_robin);
+
+    throttle_timers_init(&bs->throttle_timers, vm_clock,
+                         read_timer_cb, write_timer_cb, bs);
+}
+
+/* Unregister a BlockDriverState from its group, removing it from the
+ * list, destroying the timers and setting the throttle_state pointer
+ * to NULL.
+ *
+ * The BlockDriverState must not have pending throttled requests, so the
+ * caller has to drain them first.
+ *
+ * The group will be destroyed if it's empty after this operation.
+ *
+ * @bs: the BlockDriverState to remove
+ */
+void throttle_group_unregister_bs(BlockDriverState *bs)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    bool timer_armed[2];
+    int i;
+
+    assert(bs->pending_reqs[0] == 0 && bs->pending_reqs[1] == 0);
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[0]));
+    assert(qemu_co_queue_empty(&bs->throttled_reqs[1]));
+
+    for (i = 0; i < 2; i++) {
+        /* If this bs held the group's timer, someone else has to take over */
+        timer_armed[i] = qemu_timer_pending(bs->throttle_timers.timers[i]);
+        if (timer_armed[i]) {
+            tg->any_timer_armed[i] = false;
+        }
+
+        if (tg->tokens[i] == bs) {
+            BlockDriverState *token = throttle_group_next_bs(bs);
+            /* Take care of the case where this is the last bs in the group */
+            if (token == bs) {
+                token = NULL;
+            }
+            tg->tokens[i] = token;
+        }
+    }
+
+    /* remove the current bs from the list */
+    QLIST_REMOVE(bs, round_robin);
+    throttle_timers_destroy(&bs->throttle_timers);
+    bs->throttle_state = NULL;
+
+    for (i = 0; i < 2; i++) {
+        if (timer_armed[i] && tg->tokens[i]) {
+            schedule_next_request(tg->tokens[i], i);
+        }
+    }
+
+    throttle_group_unref(tg);
+}
+
+/* Update the throttle configuration for a particular group.  Since it
+ * is shared among all group members, the change affects all of them.
+ *
+ * @bs:  a BlockDriverState that is member of the group
+ * @cfg: the configuration to set
+ */
+void throttle_group_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    ThrottleGroup *tg = throttle_group_of(bs);
+    ThrottleTimers *tt = &bs->throttle_timers;
+    int i;
+
+    /* throttle_config() cancels the timers */
+    for (i = 0; i < 2; i++) {
+        if (qemu_timer_pending(tt->timers[i])) {
+            tg->any_timer_armed[i] = false;
+        }
+    }
+    throttle_config(&tg->ts, tt, cfg);
+}
+
+/* Get the throttle configuration from a particular group.
+ *
+ * @bs:  a BlockDriverState that is member of the group
+ * @cfg: the configuration will be written here
+ */
+void throttle_group_get_config(BlockDriverState *bs, ThrottleConfig *cfg)
+{
+    throttle_get_config(bs->throttle_state, cfg);
+}
@@ -35,6 +35,9 @@
 #include "qmp-commands.h"
 #include "qemu/timer.h"
 
+/* Length of a throughput sample */
+#define BLOCK_JOB_RATE_PERIOD 1000000000LL /* ns */
+
 void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
                        int64_t speed, BlockDriverCompletionFunc *cb,
                        void *opaque, Error **errp)
@@ -205,6 +208,32 @@ void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns)
     job->busy = true;
 }
 
+/* Bytes per second copied since the start of the current sample.  */
+static int64_t block_job_rate(BlockJob *job, int64_t now)
+{
+    int64_t elapsed_us = (now - job->rate_start_ns) / SCALE_US;
+
+    if (elapsed_us <= 0) {
+        return 0;
+    }
+    return job->rate_bytes * 1000000 / elapsed_us;
+}
+
+void block_job_account(BlockJob *job, int64_t bytes)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+
+    if (job->rate_start_ns == 0) {
+        job->rate_start_ns = now;
+    }
+    job->rate_bytes += bytes;
+    if (now - job->rate_start_ns >= BLOCK_JOB_RATE_PERIOD) {
+        job->throughput = block_job_rate(job, now);
+        job->rate_bytes = 0;
+        job->rate_start_ns = now;
+    }
+}
+
 BlockJobInfo *block_job_query(BlockJob *job)
 {
     BlockJobInfo *info = g_new0(BlockJobInfo, 1);
@@ -216,6 +245,16 @@ BlockJobInfo *block_job_query(BlockJob *job)
     info->offset    = job->offset;
     info->speed     = job->speed;
     info->io_status = job->iostatus;
+    if (job->rate_start_ns) {
+        int64_t now = qemu_get_clock_ns(rt_clock);
+
+        /* Let the value decay if the job stopped accounting I/O */
+        info->has_throughput = true;
+        info->throughput = job->throughput;
+        if (now - job->rate_start_ns >= BLOCK_JOB_RATE_PERIOD) {
+            info->throughput = block_job_rate(job, now);
+        }
+    }
     return info;
 }
 
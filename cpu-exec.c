@@ -84,14 +84,18 @@ static void cpu_exec_nocache(CPUArchState *env, int max_cycles,
     if (max_cycles > CF_COUNT_MASK)
         max_cycles = CF_COUNT_MASK;
 
+    tb_lock();
     tb = tb_gen_code(env, orig_tb->pc, orig_tb->cs_base, orig_tb->flags,
                      max_cycles);
+    tb_unlock();
     cpu->current_tb = tb;
     /* execute the generated code */
     cpu_tb_exec(cpu, tb->tc_ptr);
     cpu->current_tb = NULL;
+    tb_lock();
     tb_phys_invalidate(tb, -1);
     tb_free(tb);
+    tb_unlock();
 }
 
 static TranslationBlock *tb_find_slow(CPUArchState *env,
@@ -163,7 +167,16 @@ static inline TranslationBlock *tb_find_fast(CPUArchState *env)
     tb = env->tb_jmp_cache[tb_jmp_cache_hash_func(pc)];
     if (unlikely(!tb || tb->pc != pc || tb->cs_base != cs_base ||
                  tb->flags != flags)) {
+        /* With one thread per vCPU, filling the TLB for the code page and
+           translating need the iothread mutex, which nests outside
+           tb_lock.  */
+        bool locked;
+
+        tb_unlock();
+        locked = tcg_iothread_lock();
+        tb_lock();
         tb = tb_find_slow(env, pc, cs_base, flags);
+        tcg_iothread_unlock(locked);
     }
     return tb;
 }
@@ -289,8 +302,17 @@ int cpu_exec(CPUArchState *env)
 
             next_tb = 0; /* force lookup of first TB */
             for(;;) {
+#if !defined(CONFIG_USER_ONLY)
+                if (unlikely(env->tlb_flush_pending)) {
+                    tlb_run_pending_flush(env);
+                    next_tb = 0;
+                }
+#endif
                 interrupt_request = cpu->interrupt_request;
                 if (unlikely(interrupt_request)) {
+                    /* Interrupt controllers are device state */
+                    bool locked = tcg_iothread_lock();
+
                     if (unlikely(env->singlestep_enabled & SSTEP_NOIRQ)) {
                         /* Mask out external interrupts for this step. */
                         interrupt_request &= ~CPU_INTERRUPT_SSTEP_MASK;
@@ -567,6 +589,7 @@ int cpu_exec(CPUArchState *env)
                            the program flow was changed */
                         next_tb = 0;
                     }
+                    tcg_iothread_unlock(locked);
                 }
                 if (unlikely(cpu->exit_request)) {
                     cpu->exit_request = 0;
@@ -589,7 +612,7 @@ int cpu_exec(CPUArchState *env)
 #endif
                 }
 #endif /* DEBUG_DISAS */
-                spin_lock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_lock();
                 tb = tb_find_fast(env);
                 /* Note: we do it here to avoid a gcc bug on Mac OS X when
                    doing it in tb_find_slow */
@@ -611,7 +634,7 @@ int cpu_exec(CPUArchState *env)
                     tb_add_jump((TranslationBlock *)(next_tb & ~TB_EXIT_MASK),
                                 next_tb & TB_EXIT_MASK, tb);
                 }
-                spin_unlock(&tcg_ctx.tb_ctx.tb_lock);
+                tb_unlock();
 
                 /* cpu_interrupt might be called while translating the
                    TB, but before it is linked into a potentially
@@ -674,6 +697,13 @@ int cpu_exec(CPUArchState *env)
             /* Reload env after longjmp - the compiler may have smashed all
              * local variables as longjmp is marked 'noreturn'. */
             env = cpu_single_env;
+            /* We may have faulted while translating or invalidating TBs,
+               or left device emulation or a locked instruction early.  */
+            tb_lock_reset();
+            tcg_iothread_lock_reset();
+#if defined(TARGET_I386)
+            cpu_x86_lock_reset();
+#endif
         }
     } /* for(;;) */
 
@@ -37,6 +37,7 @@
 #include "sysemu/qtest.h"
 #include "qemu/main-loop.h"
 #include "qemu/bitmap.h"
+#include "qemu/tls.h"
 
 #ifndef _WIN32
 #include "qemu/compatfd.h"
@@ -62,6 +63,9 @@
 
 static CPUArchState *next_cpu;
 
+/* Run each TCG vCPU on its own host thread, see docs/multi-thread-tcg.txt */
+static bool tcg_multithread;
+
 static bool cpu_thread_is_idle(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -385,6 +389,38 @@ void configure_icount(const char *option)
                    qemu_get_clock_ns(vm_clock) + get_ticks_per_sec() / 10);
 }
 
+void configure_tcg_thread(const char *option)
+{
+    if (!option || !strcmp(option, "single")) {
+        return;
+    }
+    if (strcmp(option, "multi") != 0) {
+        fprintf(stderr, "Invalid tcg-thread mode '%s', "
+                "use 'single' or 'multi'\n", option);
+        exit(1);
+    }
+#if defined(TARGET_I386) && defined(__x86_64__)
+    if (!tcg_enabled()) {
+        fprintf(stderr, "tcg-thread=multi requires the TCG accelerator\n");
+        exit(1);
+    }
+    if (use_icount) {
+        fprintf(stderr, "tcg-thread=multi is not allowed with -icount\n");
+        exit(1);
+    }
+    tcg_multithread = true;
+#else
+    fprintf(stderr, "tcg-thread=multi is not supported for this target "
+            "on this host\n");
+    exit(1);
+#endif
+}
+
+bool tcg_multithread_enabled(void)
+{
+    return tcg_multithread;
+}
+
 /***********************************************************/
 void hw_error(const char *fmt, ...)
 {
@@ -618,6 +654,12 @@ static void qemu_tcg_init_cpu_signals(void)
 static QemuMutex qemu_global_mutex;
 static QemuCond qemu_io_proceeded_cond;
 static bool iothread_requesting_mutex;
+static DEFINE_TLS(bool, iothread_locked);
+
+/* vCPU threads inside cpu_exec(), and a tb_flush() waiting for them to
+ * leave.  Both are protected by the global mutex.  */
+static int tcg_running_cpus;
+static bool tcg_tb_flush_pending;
 
 static QemuThread io_thread;
 
@@ -719,6 +761,17 @@ static void qemu_tcg_wait_io_event(void)
     }
 }
 
+static void qemu_tcg_multi_wait_io_event(CPUArchState *env)
+{
+    CPUState *cpu = ENV_GET_CPU(env);
+
+    while (cpu_thread_is_idle(env)) {
+        qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+    }
+
+    qemu_wait_io_event_common(cpu);
+}
+
 static void qemu_kvm_wait_io_event(CPUArchState *env)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -851,6 +904,53 @@ static void *qemu_tcg_cpu_thread_fn(void *arg)
     return NULL;
 }
 
+static int tcg_cpu_exec(CPUArchState *env);
+
+static void *qemu_tcg_multi_cpu_thread_fn(void *arg)
+{
+    CPUState *cpu = arg;
+    CPUArchState *env = cpu->env_ptr;
+    int r;
+
+    qemu_mutex_lock_iothread();
+    qemu_thread_get_self(cpu->thread);
+    cpu->thread_id = qemu_get_thread_id();
+
+    /* signal CPU creation */
+    cpu->created = true;
+    qemu_cond_signal(&qemu_cpu_cond);
+
+    while (1) {
+        /* stop requests must still be served while the flush waits */
+        while (tcg_tb_flush_pending) {
+            qemu_wait_io_event_common(cpu);
+            qemu_cond_wait(cpu->halt_cond, &qemu_global_mutex);
+        }
+        if (cpu_can_run(cpu)) {
+            tcg_running_cpus++;
+            qemu_mutex_unlock_iothread();
+            r = tcg_cpu_exec(env);
+            qemu_mutex_lock_iothread();
+            /* the last vCPU to leave performs a deferred flush */
+            if (--tcg_running_cpus == 0 && tcg_tb_flush_pending) {
+                CPUArchState *penv;
+
+                tcg_tb_flush_pending = false;
+                tb_flush(env);
+                for (penv = first_cpu; penv != NULL; penv = penv->next_cpu) {
+                    qemu_cond_broadcast(ENV_GET_CPU(penv)->halt_cond);
+                }
+            }
+            if (r == EXCP_DEBUG) {
+                cpu_handle_guest_debug(env);
+            }
+        }
+        qemu_tcg_multi_wait_io_event(env);
+    }
+
+    return NULL;
+}
+
 static void qemu_cpu_kick_thread(CPUState *cpu)
 {
 #ifndef _WIN32
@@ -893,7 +993,9 @@ static void qemu_cpu_kick_thread(CPUState *cpu)
 void qemu_cpu_kick(CPUState *cpu)
 {
     qemu_cond_broadcast(cpu->halt_cond);
-    if (!tcg_enabled() && !cpu->thread_kicked) {
+    if (tcg_multithread) {
+        cpu_exit(cpu->env_ptr);
+    } else if (!tcg_enabled() && !cpu->thread_kicked) {
         qemu_cpu_kick_thread(cpu);
         cpu->thread_kicked = true;
     }
@@ -926,7 +1028,7 @@ static bool qemu_in_vcpu_thread(void)
 
 void qemu_mutex_lock_iothread(void)
 {
-    if (!tcg_enabled()) {
+    if (!tcg_enabled() || tcg_multithread) {
         qemu_mutex_lock(&qemu_global_mutex);
     } else {
         iothread_requesting_mutex = true;
@@ -937,13 +1039,59 @@ void qemu_mutex_lock_iothread(void)
         iothread_requesting_mutex = false;
         qemu_cond_broadcast(&qemu_io_proceeded_cond);
     }
+    tls_var(iothread_locked) = true;
 }
 
 void qemu_mutex_unlock_iothread(void)
 {
+    tls_var(iothread_locked) = false;
     qemu_mutex_unlock(&qemu_global_mutex);
 }
 
+/* With tcg-thread=multi, vCPU threads run translated code without the
+ * global mutex and take it around accesses to device state.  Returns
+ * whether the caller has to pass true to tcg_iothread_unlock().  */
+bool tcg_iothread_lock(void)
+{
+    if (!tcg_multithread || !cpu_single_env || tls_var(iothread_locked)) {
+        return false;
+    }
+    qemu_mutex_lock_iothread();
+    return true;
+}
+
+void tcg_iothread_unlock(bool locked)
+{
+    if (locked) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Called by cpu_exec() after a longjmp out of a locked section */
+void tcg_iothread_lock_reset(void)
+{
+    if (tcg_multithread && tls_var(iothread_locked)) {
+        qemu_mutex_unlock_iothread();
+    }
+}
+
+/* Translated code may not be freed while other vCPU threads execute it.
+ * Ask them to leave cpu_exec() instead; the last one to leave flushes.
+ * Called with the global mutex held.  */
+bool tcg_defer_tb_flush(void)
+{
+    CPUArchState *env;
+
+    if (!tcg_multithread || tcg_running_cpus == 0) {
+        return false;
+    }
+    tcg_tb_flush_pending = true;
+    for (env = first_cpu; env != NULL; env = env->next_cpu) {
+        qemu_cpu_kick(ENV_GET_CPU(env));
+    }
+    return true;
+}
+
 static int all_vcpus_paused(void)
 {
     CPUArchState *penv = first_cpu;
@@ -973,7 +1121,12 @@ void pause_all_vcpus(void)
 
     if (qemu_in_vcpu_thread()) {
         cpu_stop_current();
-        if (!kvm_enabled()) {
+        if (tcg_multithread) {
+            /* we are in device emulation and hold the global mutex */
+            CPUState *cpu_single_cpu = ENV_GET_CPU(cpu_single_env);
+            cpu_single_cpu->stop = false;
+            cpu_single_cpu->stopped = true;
+        } else if (!kvm_enabled()) {
             penv = first_cpu;
             while (penv) {
                 CPUState *pcpu = ENV_GET_CPU(penv);
@@ -1016,6 +1169,18 @@ void resume_all_vcpus(void)
 
 static void qemu_tcg_init_vcpu(CPUState *cpu)
 {
+    if (tcg_multithread) {
+        cpu->thread = g_malloc0(sizeof(QemuThread));
+        cpu->halt_cond = g_malloc0(sizeof(QemuCond));
+        qemu_cond_init(cpu->halt_cond);
+        qemu_thread_create(cpu->thread, qemu_tcg_multi_cpu_thread_fn, cpu,
+                           QEMU_THREAD_JOINABLE);
+        while (!cpu->created) {
+            qemu_cond_wait(&qemu_cpu_cond, &qemu_global_mutex);
+        }
+        return;
+    }
+
     /* share a single thread for all cpus with TCG */
     if (!tcg_cpu_thread) {
         cpu->thread = g_malloc0(sizeof(QemuThread));
@@ -1086,6 +1251,13 @@ void cpu_stop_current(void)
 {
     if (cpu_single_env) {
         CPUState *cpu_single_cpu = ENV_GET_CPU(cpu_single_env);
+        if (tcg_multithread) {
+            /* The rest of the TB still runs without the global mutex.
+             * Report the vCPU as stopped once it has left cpu_exec.  */
+            cpu_single_cpu->stop = true;
+            cpu_exit(cpu_single_env);
+            return;
+        }
         cpu_single_cpu->stop = false;
         cpu_single_cpu->stopped = true;
         cpu_exit(cpu_single_env);
@@ -52,6 +52,18 @@ static const CPUTLBEntry s_cputlb_empty_entry = {
  * entries from the TLB at any time, so flushing more entries than
  * required is only an efficiency issue, not a correctness issue.
  */
+/* With one thread per vCPU, a running vCPU's TLB belongs to its own
+ * thread.  Other threads only post a request in tlb_flush_pending and
+ * make the vCPU leave the current TB; the vCPU carries the flush out
+ * with tlb_run_pending_flush() before executing the next one.  Before
+ * the vCPU thread exists, the caller owns the TLB.
+ */
+static bool tlb_flush_is_remote(CPUState *cpu)
+{
+    return tcg_multithread_enabled() && cpu->created &&
+           !qemu_cpu_is_self(cpu);
+}
+
 void tlb_flush(CPUArchState *env, int flush_global)
 {
     CPUState *cpu = ENV_GET_CPU(env);
@@ -60,6 +72,13 @@ void tlb_flush(CPUArchState *env, int flush_global)
 #if defined(DEBUG_TLB)
     printf("tlb_flush:\n");
 #endif
+    if (tlb_flush_is_remote(cpu)) {
+        env->tlb_flush_pending = 1;
+        smp_wmb();
+        cpu->tcg_exit_req = 1;
+        return;
+    }
+
     /* must reset current TB so that interrupts cannot modify the
        links while we are modifying them */
     cpu->current_tb = NULL;
@@ -79,6 +98,34 @@ void tlb_flush(CPUArchState *env, int flush_global)
     tlb_flush_count++;
 }
 
+void tlb_run_pending_flush(CPUArchState *env)
+{
+    /* Clear the request first: one that arrives during the flush
+       is then carried out the next time round.  */
+    if (__sync_lock_test_and_set(&env->tlb_flush_pending, 0)) {
+        tlb_flush(env, 1);
+    }
+}
+
+/* Take the iothread mutex for an I/O access from translated code.
+ * With one thread per vCPU, another thread may have changed the memory
+ * map while we waited for the mutex.  The TLB entry that led here then
+ * refers to a stale section, so carry out the pending flush and restart
+ * the instruction.  Returns true if the caller must release the mutex
+ * with tcg_iothread_unlock().
+ */
+bool cpu_io_lock(CPUArchState *env, uintptr_t retaddr)
+{
+    bool locked = tcg_iothread_lock();
+
+    if (unlikely(env->tlb_flush_pending)) {
+        tlb_run_pending_flush(env);
+        cpu_restore_state(env, retaddr);
+        cpu_resume_from_signal(env, NULL);
+    }
+    return locked;
+}
+
 static inline void tlb_flush_entry(CPUTLBEntry *tlb_entry, target_ulong addr)
 {
     if (addr == (tlb_entry->addr_read &
@@ -100,6 +147,10 @@ void tlb_flush_page(CPUArchState *env, target_ulong addr)
 #if defined(DEBUG_TLB)
     printf("tlb_flush_page: " TARGET_FMT_lx "\n", addr);
 #endif
+    if (tlb_flush_is_remote(cpu)) {
+        tlb_flush(env, 1);
+        return;
+    }
     /* Check if we need to flush due to large pages.  */
     if ((addr & env->tlb_flush_mask) == env->tlb_flush_addr) {
 #if defined(DEBUG_TLB)
@@ -153,7 +204,14 @@ void tlb_reset_dirty_range(CPUTLBEntry *tlb_entry, uintptr_t start,
     if (tlb_is_dirty_ram(tlb_entry)) {
         addr = (tlb_entry->addr_write & TARGET_PAGE_MASK) + tlb_entry->addend;
         if ((addr - start) < length) {
+#if defined(__x86_64__)
+            /* The entry may belong to a vCPU running on another thread,
+               which can flush it concurrently: do not write back a
+               stale address.  */
+            __sync_fetch_and_or(&tlb_entry->addr_write, TLB_NOTDIRTY);
+#else
             tlb_entry->addr_write |= TLB_NOTDIRTY;
+#endif
         }
     }
 }
@@ -57,6 +57,8 @@
 int phys_ram_fd;
 static int in_migration;
 
+DirtyPageLog dirty_page_log;
+
 RAMList ram_list = { .blocks = QTAILQ_HEAD_INITIALIZER(ram_list.blocks) };
 
 static MemoryRegion *system_memory;
@@ -616,9 +618,68 @@ static int cpu_physical_memory_set_dirty_tracking(int enable)
 {
     int ret = 0;
     in_migration = enable;
+
+    g_free(dirty_page_log.pages);
+    dirty_page_log.pages = NULL;
+    dirty_page_log.len = dirty_page_log.size = 0;
+    /* pages dirtied before the log was enabled can only be found by a scan */
+    dirty_page_log.overflow = true;
+    dirty_page_log.enabled = enable;
     return ret;
 }
 
+/* Past this many entries, walking phys_dirty is about as cheap as the log */
+#define DIRTY_PAGE_LOG_RATIO 32
+
+void cpu_physical_memory_log_dirty_page(ram_addr_t addr)
+{
+    DirtyPageLog *log = &dirty_page_log;
+
+    if (log->overflow) {
+        return;
+    }
+    if (log->len == log->size) {
+        ram_addr_t max = (last_ram_offset() >> TARGET_PAGE_BITS)
+                         / DIRTY_PAGE_LOG_RATIO;
+
+        if (log->size >= max) {
+            log->overflow = true;
+            return;
+        }
+        log->size = MIN(MAX(log->size * 2, 1024), max);
+        log->pages = g_renew(ram_addr_t, log->pages, log->size);
+    }
+    log->pages[log->len++] = addr >> TARGET_PAGE_BITS;
+}
+
+bool cpu_physical_memory_drain_dirty_log(DirtyPageFunc *func, void *opaque)
+{
+    DirtyPageLog *log = &dirty_page_log;
+    size_t i;
+
+    if (!log->enabled || log->overflow) {
+        log->len = 0;
+        log->overflow = false;
+        return false;
+    }
+
+    for (i = 0; i < log->len; i++) {
+        ram_addr_t addr = log->pages[i] << TARGET_PAGE_BITS;
+
+        /* Clear the flag before reporting the page, so that a new write
+         * logs it again.  Pages can be logged twice if another client
+         * cleared the flag in between.
+         */
+        if (cpu_physical_memory_get_dirty_flags(addr) & MIGRATION_DIRTY_FLAG) {
+            cpu_physical_memory_reset_dirty(addr, addr + TARGET_PAGE_SIZE,
+                                            MIGRATION_DIRTY_FLAG);
+            func(addr, opaque);
+        }
+    }
+    log->len = 0;
+    return true;
+}
+
 hwaddr memory_region_section_get_iotlb(CPUArchState *env,
                                                    MemoryRegionSection *section,
                                                    target_ulong vaddr,
@@ -1103,6 +1164,8 @@ ram_addr_t qemu_ram_alloc_from_ptr(ram_addr_t size, void *host,
                                        last_ram_offset() >> TARGET_PAGE_BITS);
     memset(ram_list.phys_dirty + (new_block->offset >> TARGET_PAGE_BITS),
            0, size >> TARGET_PAGE_BITS);
+    /* the new block is not in the dirty page log */
+    dirty_page_log.overflow = true;
     cpu_physical_memory_set_dirty_range(new_block->offset, size, 0xff);
 
     qemu_ram_setup_dump(new_block->host, size);
@@ -1386,6 +1449,30 @@ ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr)
     return ram_addr;
 }
 
+/* Call @func on every RAM block, stopping at the first non-zero return
+ * value, which is passed back to the caller.  Blocks without host memory
+ * (Xen) are skipped.
+ */
+int qemu_ram_foreach_block(RAMBlockIterFunc *func, void *opaque)
+{
+    RAMBlock *block;
+    int ret = 0;
+
+    qemu_mutex_lock_ramlist();
+    QTAILQ_FOREACH(block, &ram_list.blocks, next) {
+        if (block->host == NULL) {
+            continue;
+        }
+        ret = func(block->idstr, block->host, block->offset, block->length,
+                   !(block->flags & RAM_PREALLOC_MASK) && !mem_path, opaque);
+        if (ret) {
+            break;
+        }
+    }
+    qemu_mutex_unlock_ramlist();
+    return ret;
+}
+
 static uint64_t unassigned_mem_read(void *opaque, hwaddr addr,
                                     unsigned size)
 {
@@ -1500,13 +1587,16 @@ static void check_watchpoint(int offset, int len_mask, int flags)
             wp->flags |= BP_WATCHPOINT_HIT;
             if (!env->watchpoint_hit) {
                 env->watchpoint_hit = wp;
+                tb_lock();
                 tb_check_watchpoint(env);
                 if (wp->flags & BP_STOP_BEFORE_ACCESS) {
+                    tb_unlock();
                     env->exception_index = EXCP_DEBUG;
                     cpu_loop_exit(env);
                 } else {
                     cpu_get_tb_cpu_state(env, &pc, &cs_base, &cpu_flags);
                     tb_gen_code(env, pc, cs_base, cpu_flags, 1);
+                    tb_unlock();
                     cpu_resume_from_signal(env, NULL);
                 }
             }
@@ -1900,6 +1990,7 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
     uint32_t val;
     hwaddr page;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     while (len > 0) {
         page = addr & TARGET_PAGE_MASK;
@@ -1975,6 +2066,7 @@ void address_space_rw(AddressSpace *as, hwaddr addr, uint8_t *buf,
         buf += l;
         addr += l;
     }
+    tcg_iothread_unlock(locked);
 }
 
 void address_space_write(AddressSpace *as, hwaddr addr,
@@ -2195,6 +2287,7 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint32_t val;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2229,6 +2322,7 @@ static inline uint32_t ldl_phys_internal(hwaddr addr,
             break;
         }
     }
+    tcg_iothread_unlock(locked);
     return val;
 }
 
@@ -2254,6 +2348,7 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint64_t val;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2288,6 +2383,7 @@ static inline uint64_t ldq_phys_internal(hwaddr addr,
             break;
         }
     }
+    tcg_iothread_unlock(locked);
     return val;
 }
 
@@ -2321,6 +2417,7 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
     uint8_t *ptr;
     uint64_t val;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2355,6 +2452,7 @@ static inline uint32_t lduw_phys_internal(hwaddr addr,
             break;
         }
     }
+    tcg_iothread_unlock(locked);
     return val;
 }
 
@@ -2380,6 +2478,7 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2406,12 +2505,14 @@ void stl_phys_notdirty(hwaddr addr, uint32_t val)
             }
         }
     }
+    tcg_iothread_unlock(locked);
 }
 
 void stq_phys_notdirty(hwaddr addr, uint64_t val)
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2433,6 +2534,7 @@ void stq_phys_notdirty(hwaddr addr, uint64_t val)
                                + memory_region_section_addr(section, addr));
         stq_p(ptr, val);
     }
+    tcg_iothread_unlock(locked);
 }
 
 /* warning: addr must be aligned */
@@ -2441,6 +2543,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2478,6 +2581,7 @@ static inline void stl_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 4);
     }
+    tcg_iothread_unlock(locked);
 }
 
 void stl_phys(hwaddr addr, uint32_t val)
@@ -2508,6 +2612,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
 {
     uint8_t *ptr;
     MemoryRegionSection *section;
+    bool locked = tcg_iothread_lock();
 
     section = phys_page_find(address_space_memory.dispatch, addr >> TARGET_PAGE_BITS);
 
@@ -2545,6 +2650,7 @@ static inline void stw_phys_internal(hwaddr addr, uint32_t val,
         }
         invalidate_and_set_dirty(addr1, 2);
     }
+    tcg_iothread_unlock(locked);
 }
 
 void stw_phys(hwaddr addr, uint32_t val)
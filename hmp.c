@@ -203,10 +203,36 @@ void hmp_info_migrate(Monitor *mon, const QDict *qdict)
                        info->xbzrle_cache->pages);
         monitor_printf(mon, "xbzrle cache miss: %" PRIu64 "\n",
                        info->xbzrle_cache->cache_miss);
+        monitor_printf(mon, "xbzrle cache hit: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_hit);
+        monitor_printf(mon, "xbzrle cache eviction: %" PRIu64 "\n",
+                       info->xbzrle_cache->cache_eviction);
         monitor_printf(mon, "xbzrle overflow : %" PRIu64 "\n",
                        info->xbzrle_cache->overflow);
     }
 
+    if (info->has_postcopy_requests) {
+        monitor_printf(mon, "postcopy requests: %" PRIu64 "\n",
+                       info->postcopy_requests);
+    }
+
+    if (info->has_compression) {
+        CompressThreadStatsList *t;
+
+        monitor_printf(mon, "compressed pages: %" PRIu64 " pages\n",
+                       info->compression->pages);
+        monitor_printf(mon, "compressed bytes: %" PRIu64 " kbytes\n",
+                       info->compression->bytes >> 10);
+        monitor_printf(mon, "compression busy: %" PRIu64 "\n",
+                       info->compression->busy);
+        for (t = info->compression->threads; t; t = t->next) {
+            monitor_printf(mon, "compress thread %" PRId64 ": %" PRIu64
+                           " pages, %" PRIu64 " kbytes, busy %" PRIu64
+                           " milliseconds\n", t->value->id, t->value->pages,
+                           t->value->bytes >> 10, t->value->busy_time);
+        }
+    }
+
     qapi_free_MigrationInfo(info);
     qapi_free_MigrationCapabilityStatusList(caps);
 }
@@ -236,6 +262,22 @@ void hmp_info_migrate_cache_size(Monitor *mon, const QDict *qdict)
                    qmp_query_migrate_cache_size(NULL) >> 10);
 }
 
+void hmp_info_migrate_parameters(Monitor *mon, const QDict *qdict)
+{
+    MigrationParameters *params;
+
+    params = qmp_query_migrate_parameters(NULL);
+    monitor_printf(mon, "compress-level: %" PRId64 "\n",
+                   params->compress_level);
+    monitor_printf(mon, "compress-threads: %" PRId64 "\n",
+                   params->compress_threads);
+    monitor_printf(mon, "decompress-threads: %" PRId64 "\n",
+                   params->decompress_threads);
+    monitor_printf(mon, "postcopy-after-passes: %" PRId64 "\n",
+                   params->postcopy_after_passes);
+    qapi_free_MigrationParameters(params);
+}
+
 void hmp_info_cpus(Monitor *mon, const QDict *qdict)
 {
     CpuInfoList *cpu_list, *cpu;
@@ -318,6 +360,11 @@ void hmp_info_block(Monitor *mon, const QDict *qdict)
                             info->value->inserted->iops,
                             info->value->inserted->iops_rd,
                             info->value->inserted->iops_wr);
+
+            if (info->value->inserted->has_group) {
+                monitor_printf(mon, " group=%s",
+                               info->value->inserted->group);
+            }
         } else {
             monitor_printf(mon, " [not inserted]");
         }
@@ -347,8 +394,7 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        " flush_operations=%" PRId64
                        " wr_total_time_ns=%" PRId64
                        " rd_total_time_ns=%" PRId64
-                       " flush_total_time_ns=%" PRId64
-                       "\n",
+                       " flush_total_time_ns=%" PRId64,
                        stats->value->stats->rd_bytes,
                        stats->value->stats->wr_bytes,
                        stats->value->stats->rd_operations,
@@ -357,6 +403,19 @@ void hmp_info_blockstats(Monitor *mon, const QDict *qdict)
                        stats->value->stats->wr_total_time_ns,
                        stats->value->stats->rd_total_time_ns,
                        stats->value->stats->flush_total_time_ns);
+        if (stats->value->stats->has_l2_cache) {
+            monitor_printf(mon, " l2_cache_hits=%" PRId64
+                           " l2_cache_misses=%" PRId64,
+                           stats->value->stats->l2_cache->hits,
+                           stats->value->stats->l2_cache->misses);
+        }
+        if (stats->value->stats->has_refcount_cache) {
+            monitor_printf(mon, " refcount_cache_hits=%" PRId64
+                           " refcount_cache_misses=%" PRId64,
+                           stats->value->stats->refcount_cache->hits,
+                           stats->value->stats->refcount_cache->misses);
+        }
+        monitor_printf(mon, "\n");
     }
 
     qapi_free_BlockStatsList(stats_list);
@@ -605,6 +664,10 @@ void hmp_info_block_jobs(Monitor *mon, const QDict *qdict)
                            list->value->len,
                            list->value->speed);
         }
+        if (list->value->has_throughput) {
+            monitor_printf(mon, "    Current throughput %" PRId64 " bytes/s\n",
+                           list->value->throughput);
+        }
         list = list->next;
     }
 }
@@ -863,6 +926,35 @@ void hmp_drive_mirror(Monitor *mon, const QDict *qdict)
     qmp_drive_mirror(device, filename, !!format, format,
                      full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
                      true, mode, false, 0, false, 0, false, 0,
+                     false, 0, false, 0, false, NULL, &errp);
+    hmp_handle_error(mon, &errp);
+}
+
+void hmp_drive_backup(Monitor *mon, const QDict *qdict)
+{
+    const char *device = qdict_get_str(qdict, "device");
+    const char *filename = qdict_get_str(qdict, "target");
+    const char *format = qdict_get_try_str(qdict, "format");
+    int reuse = qdict_get_try_bool(qdict, "reuse", 0);
+    int full = qdict_get_try_bool(qdict, "full", 0);
+    enum NewImageMode mode;
+    Error *errp = NULL;
+
+    if (!filename) {
+        error_set(&errp, QERR_MISSING_PARAMETER, "target");
+        hmp_handle_error(mon, &errp);
+        return;
+    }
+
+    if (reuse) {
+        mode = NEW_IMAGE_MODE_EXISTING;
+    } else {
+        mode = NEW_IMAGE_MODE_ABSOLUTE_PATHS;
+    }
+
+    qmp_drive_backup(device, filename, !!format, format,
+                     full ? MIRROR_SYNC_MODE_FULL : MIRROR_SYNC_MODE_TOP,
+                     true, mode, false, 0, false, NULL,
                      false, 0, false, 0, &errp);
     hmp_handle_error(mon, &errp);
 }
@@ -895,6 +987,14 @@ void hmp_migrate_cancel(Monitor *mon, const QDict *qdict)
     qmp_migrate_cancel(NULL);
 }
 
+void hmp_migrate_start_postcopy(Monitor *mon, const QDict *qdict)
+{
+    Error *err = NULL;
+
+    qmp_migrate_start_postcopy(&err);
+    hmp_handle_error(mon, &err);
+}
+
 void hmp_migrate_set_downtime(Monitor *mon, const QDict *qdict)
 {
     double value = qdict_get_double(qdict, "value");
@@ -952,6 +1052,35 @@ void hmp_migrate_set_capability(Monitor *mon, const QDict *qdict)
     }
 }
 
+void hmp_migrate_set_parameter(Monitor *mon, const QDict *qdict)
+{
+    const char *param = qdict_get_str(qdict, "parameter");
+    int64_t value = qdict_get_int(qdict, "value");
+    Error *err = NULL;
+
+    if (strcmp(param, "compress-level") == 0) {
+        qmp_migrate_set_parameters(true, value, false, 0, false, 0,
+                                   false, 0, &err);
+    } else if (strcmp(param, "compress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, true, value, false, 0,
+                                   false, 0, &err);
+    } else if (strcmp(param, "decompress-threads") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, true, value,
+                                   false, 0, &err);
+    } else if (strcmp(param, "postcopy-after-passes") == 0) {
+        qmp_migrate_set_parameters(false, 0, false, 0, false, 0,
+                                   true, value, &err);
+    } else {
+        error_set(&err, QERR_INVALID_PARAMETER, param);
+    }
+
+    if (err) {
+        monitor_printf(mon, "migrate_set_parameter: %s\n",
+                       error_get_pretty(err));
+        error_free(err);
+    }
+}
+
 void hmp_set_password(Monitor *mon, const QDict *qdict)
 {
     const char *protocol  = qdict_get_str(qdict, "protocol");
@@ -1026,7 +1155,12 @@ void hmp_block_set_io_throttle(Monitor *mon, const QDict *qdict)
                               qdict_get_int(qdict, "bps_wr"),
                               qdict_get_int(qdict, "iops"),
                               qdict_get_int(qdict, "iops_rd"),
-                              qdict_get_int(qdict, "iops_wr"), &err);
+                              qdict_get_int(qdict, "iops_wr"),
+                              false, 0, false, 0, false, 0, /* bps_max */
+                              false, 0, false, 0, false, 0, /* iops_max */
+                              false, 0, /* iops_size */
+                              false, NULL, /* group */
+                              &err);
     hmp_handle_error(mon, &err);
 }
 
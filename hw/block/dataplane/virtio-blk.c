@@ -41,16 +41,14 @@ typedef struct {
     QEMUIOVector *read_qiov;        /* for read completion /w bounce buffer */
 } VirtIOBlockRequest;
 
-struct VirtIOBlockDataPlane {
-    bool started;
-    bool stopping;
-    QEMUBH *start_bh;
+/* Each virtqueue is processed by its own thread with its own AioContext and
+ * Linux AIO context, so that queues used by different guest CPUs complete
+ * requests in parallel.
+ */
+typedef struct {
+    VirtIOBlockDataPlane *s;
     QemuThread thread;
 
-    VirtIOBlkConf *blk;
-    int fd;                         /* image file descriptor */
-
-    VirtIODevice *vdev;
     Vring vring;                    /* virtqueue vring */
     EventNotifier *guest_notifier;  /* irq */
 
@@ -63,29 +61,41 @@ struct VirtIOBlockDataPlane {
     EventNotifier io_notifier;      /* Linux AIO completion */
     EventNotifier host_notifier;    /* doorbell */
 
-    IOQueue ioqueue;                /* Linux AIO queue (should really be per
-                                       dataplane thread) */
+    IOQueue ioqueue;                /* Linux AIO queue */
     VirtIOBlockRequest requests[REQ_MAX]; /* pool of requests, managed by the
                                              queue */
 
     unsigned int num_reqs;
+} VirtIOBlockQueue;
+
+struct VirtIOBlockDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIOBlkConf *blk;
+    int fd;                         /* image file descriptor */
+
+    VirtIODevice *vdev;
+    VirtIOBlockQueue *queues;
+    unsigned int num_queues;
 
     Error *migration_blocker;
 };
 
 /* Raise an interrupt to signal guest, if necessary */
-static void notify_guest(VirtIOBlockDataPlane *s)
+static void notify_guest(VirtIOBlockQueue *q)
 {
-    if (!vring_should_notify(s->vdev, &s->vring)) {
+    if (!vring_should_notify(q->s->vdev, &q->vring)) {
         return;
     }
 
-    event_notifier_set(s->guest_notifier);
+    event_notifier_set(q->guest_notifier);
 }
 
 static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockQueue *q = opaque;
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
     struct virtio_blk_inhdr hdr;
     int len;
@@ -98,7 +108,7 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
         len = 0;
     }
 
-    trace_virtio_blk_data_plane_complete_request(s, req->head, ret);
+    trace_virtio_blk_data_plane_complete_request(q->s, req->head, ret);
 
     if (req->read_qiov) {
         assert(req->bounce_iov);
@@ -120,12 +130,12 @@ static void complete_request(struct iocb *iocb, ssize_t ret, void *opaque)
      * written to, but for virtio-blk it seems to be the number of bytes
      * transferred plus the status bytes.
      */
-    vring_push(&s->vring, req->head, len + sizeof(hdr));
+    vring_push(&q->vring, req->head, len + sizeof(hdr));
 
-    s->num_reqs--;
+    q->num_reqs--;
 }
 
-static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
+static void complete_request_early(VirtIOBlockQueue *q, unsigned int head,
                                    QEMUIOVector *inhdr, unsigned char status)
 {
     struct virtio_blk_inhdr hdr = {
@@ -136,36 +146,38 @@ static void complete_request_early(VirtIOBlockDataPlane *s, unsigned int head,
     qemu_iovec_destroy(inhdr);
     g_slice_free(QEMUIOVector, inhdr);
 
-    vring_push(&s->vring, head, sizeof(hdr));
-    notify_guest(s);
+    vring_push(&q->vring, head, sizeof(hdr));
+    notify_guest(q);
 }
 
 /* Get disk serial number */
-static void do_get_id_cmd(VirtIOBlockDataPlane *s,
+static void do_get_id_cmd(VirtIOBlockQueue *q,
                           struct iovec *iov, unsigned int iov_cnt,
                           unsigned int head, QEMUIOVector *inhdr)
 {
+    VirtIOBlkConf *blk = q->s->blk;
     char id[VIRTIO_BLK_ID_BYTES];
 
     /* Serial number not NUL-terminated when shorter than buffer */
-    strncpy(id, s->blk->serial ? s->blk->serial : "", sizeof(id));
+    strncpy(id, blk->serial ? blk->serial : "", sizeof(id));
     iov_from_buf(iov, iov_cnt, 0, id, sizeof(id));
-    complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+    complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
 }
 
-static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
+static int do_rdwr_cmd(VirtIOBlockQueue *q, bool read,
                        struct iovec *iov, unsigned int iov_cnt,
                        long long offset, unsigned int head,
                        QEMUIOVector *inhdr)
 {
+    BlockDriverState *bs = q->s->blk->conf.bs;
     struct iocb *iocb;
     QEMUIOVector qiov;
     struct iovec *bounce_iov = NULL;
     QEMUIOVector *read_qiov = NULL;
 
     qemu_iovec_init_external(&qiov, iov, iov_cnt);
-    if (!bdrv_qiov_is_aligned(s->blk->conf.bs, &qiov)) {
-        void *bounce_buffer = qemu_blockalign(s->blk->conf.bs, qiov.size);
+    if (!bdrv_qiov_is_aligned(bs, &qiov)) {
+        void *bounce_buffer = qemu_blockalign(bs, qiov.size);
 
         if (read) {
             /* Need to copy back from bounce buffer on completion */
@@ -184,7 +196,7 @@ static int do_rdwr_cmd(VirtIOBlockDataPlane *s, bool read,
         iov_cnt = 1;
     }
 
-    iocb = ioq_rdwr(&s->ioqueue, read, iov, iov_cnt, offset);
+    iocb = ioq_rdwr(&q->ioqueue, read, iov, iov_cnt, offset);
 
     /* Fill in virtio block metadata needed for completion */
     VirtIOBlockRequest *req = container_of(iocb, VirtIOBlockRequest, iocb);
@@ -199,7 +211,7 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
                            unsigned int out_num, unsigned int in_num,
                            unsigned int head)
 {
-    VirtIOBlockDataPlane *s = container_of(ioq, VirtIOBlockDataPlane, ioqueue);
+    VirtIOBlockQueue *q = container_of(ioq, VirtIOBlockQueue, ioqueue);
     struct iovec *in_iov = &iov[out_num];
     struct virtio_blk_outhdr outhdr;
     QEMUIOVector *inhdr;
@@ -231,29 +243,29 @@ static int process_request(IOQueue *ioq, struct iovec iov[],
 
     switch (outhdr.type) {
     case VIRTIO_BLK_T_IN:
-        do_rdwr_cmd(s, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, true, in_iov, in_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_OUT:
-        do_rdwr_cmd(s, false, iov, out_num, outhdr.sector * 512, head, inhdr);
+        do_rdwr_cmd(q, false, iov, out_num, outhdr.sector * 512, head, inhdr);
         return 0;
 
     case VIRTIO_BLK_T_SCSI_CMD:
         /* TODO support SCSI commands */
-        complete_request_early(s, head, inhdr, VIRTIO_BLK_S_UNSUPP);
+        complete_request_early(q, head, inhdr, VIRTIO_BLK_S_UNSUPP);
         return 0;
 
     case VIRTIO_BLK_T_FLUSH:
         /* TODO fdsync not supported by Linux AIO, do it synchronously here! */
-        if (qemu_fdatasync(s->fd) < 0) {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_IOERR);
+        if (qemu_fdatasync(q->s->fd) < 0) {
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_IOERR);
         } else {
-            complete_request_early(s, head, inhdr, VIRTIO_BLK_S_OK);
+            complete_request_early(q, head, inhdr, VIRTIO_BLK_S_OK);
         }
         return 0;
 
     case VIRTIO_BLK_T_GET_ID:
-        do_get_id_cmd(s, in_iov, in_num, head, inhdr);
+        do_get_id_cmd(q, in_iov, in_num, head, inhdr);
         return 0;
 
     default:
@@ -271,8 +283,8 @@ static int flush_true(EventNotifier *e)
 
 static void handle_notify(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           host_notifier);
+    VirtIOBlockQueue *q = container_of(e, VirtIOBlockQueue, host_notifier);
+    VirtIODevice *vdev = q->s->vdev;
 
     /* There is one array of iovecs into which all new requests are extracted
      * from the vring.  Requests are read from the vring and the translated
@@ -299,22 +311,22 @@ static void handle_notify(EventNotifier *e)
     unsigned int out_num = 0, in_num = 0;
     unsigned int num_queued;
 
-    event_notifier_test_and_clear(&s->host_notifier);
+    event_notifier_test_and_clear(&q->host_notifier);
     for (;;) {
         /* Disable guest->host notifies to avoid unnecessary vmexits */
-        vring_disable_notification(s->vdev, &s->vring);
+        vring_disable_notification(vdev, &q->vring);
 
         for (;;) {
-            head = vring_pop(s->vdev, &s->vring, iov, end, &out_num, &in_num);
+            head = vring_pop(vdev, &q->vring, iov, end, &out_num, &in_num);
             if (head < 0) {
                 break; /* no more requests */
             }
 
-            trace_virtio_blk_data_plane_process_request(s, out_num, in_num,
+            trace_virtio_blk_data_plane_process_request(q->s, out_num, in_num,
                                                         head);
 
-            if (process_request(&s->ioqueue, iov, out_num, in_num, head) < 0) {
-                vring_set_broken(&s->vring);
+            if (process_request(&q->ioqueue, iov, out_num, in_num, head) < 0) {
+                vring_set_broken(&q->vring);
                 break;
             }
             iov += out_num + in_num;
@@ -324,7 +336,7 @@ static void handle_notify(EventNotifier *e)
             /* Re-enable guest->host notifies and stop processing the vring.
              * But if the guest has snuck in more descriptors, keep processing.
              */
-            if (vring_enable_notification(s->vdev, &s->vring)) {
+            if (vring_enable_notification(vdev, &q->vring)) {
                 break;
             }
         } else { /* head == -ENOBUFS or fatal error, iovecs[] is depleted */
@@ -336,11 +348,11 @@ static void handle_notify(EventNotifier *e)
         }
     }
 
-    num_queued = ioq_num_queued(&s->ioqueue);
+    num_queued = ioq_num_queued(&q->ioqueue);
     if (num_queued > 0) {
-        s->num_reqs += num_queued;
+        q->num_reqs += num_queued;
 
-        int rc = ioq_submit(&s->ioqueue);
+        int rc = ioq_submit(&q->ioqueue);
         if (unlikely(rc < 0)) {
             fprintf(stderr, "ioq_submit failed %d\n", rc);
             exit(1);
@@ -350,55 +362,57 @@ static void handle_notify(EventNotifier *e)
 
 static int flush_io(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+    VirtIOBlockQueue *q = container_of(e, VirtIOBlockQueue, io_notifier);
 
-    return s->num_reqs > 0;
+    return q->num_reqs > 0;
 }
 
 static void handle_io(EventNotifier *e)
 {
-    VirtIOBlockDataPlane *s = container_of(e, VirtIOBlockDataPlane,
-                                           io_notifier);
+    VirtIOBlockQueue *q = container_of(e, VirtIOBlockQueue, io_notifier);
 
-    event_notifier_test_and_clear(&s->io_notifier);
-    if (ioq_run_completion(&s->ioqueue, complete_request, s) > 0) {
-        notify_guest(s);
+    event_notifier_test_and_clear(&q->io_notifier);
+    if (ioq_run_completion(&q->ioqueue, complete_request, q) > 0) {
+        notify_guest(q);
     }
 
     /* If there were more requests than iovecs, the vring will not be empty yet
      * so check again.  There should now be enough resources to process more
      * requests.
      */
-    if (unlikely(vring_more_avail(&s->vring))) {
-        handle_notify(&s->host_notifier);
+    if (unlikely(vring_more_avail(&q->vring))) {
+        handle_notify(&q->host_notifier);
     }
 }
 
 static void *data_plane_thread(void *opaque)
 {
-    VirtIOBlockDataPlane *s = opaque;
+    VirtIOBlockQueue *q = opaque;
 
     do {
-        aio_poll(s->ctx, true);
-    } while (!s->stopping || s->num_reqs > 0);
+        aio_poll(q->ctx, true);
+    } while (!q->s->stopping || q->num_reqs > 0);
     return NULL;
 }
 
 static void start_data_plane_bh(void *opaque)
 {
     VirtIOBlockDataPlane *s = opaque;
+    unsigned int i;
 
     qemu_bh_delete(s->start_bh);
     s->start_bh = NULL;
-    qemu_thread_create(&s->thread, data_plane_thread,
-                       s, QEMU_THREAD_JOINABLE);
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
 }
 
 bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
                                   VirtIOBlockDataPlane **dataplane)
 {
     VirtIOBlockDataPlane *s;
+    unsigned int i;
     int fd;
 
     *dataplane = NULL;
@@ -429,6 +443,11 @@ bool virtio_blk_data_plane_create(VirtIODevice *vdev, VirtIOBlkConf *blk,
     s->vdev = vdev;
     s->fd = fd;
     s->blk = blk;
+    s->num_queues = blk->num_queues;
+    s->queues = g_new0(VirtIOBlockQueue, s->num_queues);
+    for (i = 0; i < s->num_queues; i++) {
+        s->queues[i].s = s;
+    }
 
     /* Prevent block operations that conflict with data plane thread */
     bdrv_set_in_use(blk->conf.bs, 1);
@@ -451,6 +470,7 @@ void virtio_blk_data_plane_destroy(VirtIOBlockDataPlane *s)
     migrate_del_blocker(s->migration_blocker);
     error_free(s->migration_blocker);
     bdrv_set_in_use(s->blk->conf.bs, 0);
+    g_free(s->queues);
     g_free(s);
 }
 
@@ -458,86 +478,121 @@ void virtio_blk_data_plane_start(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockQueue *q;
     VirtQueue *vq;
-    int i;
+    int i, j;
 
     if (s->started) {
         return;
     }
 
-    vq = virtio_get_queue(s->vdev, 0);
-    if (!vring_setup(&s->vring, s->vdev, 0)) {
-        return;
+    for (i = 0; i < s->num_queues; i++) {
+        if (!vring_setup(&s->queues[i].vring, s->vdev, i)) {
+            while (--i >= 0) {
+                vring_teardown(&s->queues[i].vring, s->vdev, i);
+            }
+            return;
+        }
     }
 
-    s->ctx = aio_context_new();
-
-    /* Set up guest notifier (irq) */
-    if (k->set_guest_notifiers(qbus->parent, 1, true) != 0) {
+    /* Set up guest notifiers (irq) */
+    if (k->set_guest_notifiers(qbus->parent, s->num_queues, true) != 0) {
         fprintf(stderr, "virtio-blk failed to set guest notifier, "
                 "ensure -enable-kvm is set\n");
         exit(1);
     }
-    s->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up virtqueue notify */
-    if (k->set_host_notifier(qbus->parent, 0, true) != 0) {
-        fprintf(stderr, "virtio-blk failed to set host notifier\n");
-        exit(1);
-    }
-    s->host_notifier = *virtio_queue_get_host_notifier(vq);
-    aio_set_event_notifier(s->ctx, &s->host_notifier, handle_notify, flush_true);
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        vq = virtio_get_queue(s->vdev, i);
+        q->ctx = aio_context_new();
+        q->guest_notifier = virtio_queue_get_guest_notifier(vq);
 
-    /* Set up ioqueue */
-    ioq_init(&s->ioqueue, s->fd, REQ_MAX);
-    for (i = 0; i < ARRAY_SIZE(s->requests); i++) {
-        ioq_put_iocb(&s->ioqueue, &s->requests[i].iocb);
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, i, true) != 0) {
+            fprintf(stderr, "virtio-blk failed to set host notifier\n");
+            exit(1);
+        }
+        q->host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, handle_notify,
+                               flush_true);
+
+        /* Set up ioqueue */
+        ioq_init(&q->ioqueue, s->fd, REQ_MAX);
+        for (j = 0; j < ARRAY_SIZE(q->requests); j++) {
+            ioq_put_iocb(&q->ioqueue, &q->requests[j].iocb);
+        }
+        q->io_notifier = *ioq_get_notifier(&q->ioqueue);
+        aio_set_event_notifier(q->ctx, &q->io_notifier, handle_io, flush_io);
     }
-    s->io_notifier = *ioq_get_notifier(&s->ioqueue);
-    aio_set_event_notifier(s->ctx, &s->io_notifier, handle_io, flush_io);
 
     s->started = true;
     trace_virtio_blk_data_plane_start(s);
 
     /* Kick right away to begin processing requests already in vring */
-    event_notifier_set(virtio_queue_get_host_notifier(vq));
+    for (i = 0; i < s->num_queues; i++) {
+        vq = virtio_get_queue(s->vdev, i);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
 
-    /* Spawn thread in BH so it inherits iothread cpusets */
+    /* Spawn threads in BH so they inherit iothread cpusets */
     s->start_bh = qemu_bh_new(start_data_plane_bh, s);
     qemu_bh_schedule(s->start_bh);
 }
 
+/* Pass on a kick that reached the device model instead of the host
+ * notifier, which happens when ioeventfd is not backed by KVM.
+ */
+void virtio_blk_data_plane_notify(VirtIOBlockDataPlane *s, VirtQueue *vq)
+{
+    if (s->started) {
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+}
+
 void virtio_blk_data_plane_stop(VirtIOBlockDataPlane *s)
 {
     BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
     VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIOBlockQueue *q;
+    unsigned int i;
+
     if (!s->started || s->stopping) {
         return;
     }
     s->stopping = true;
     trace_virtio_blk_data_plane_stop(s);
 
-    /* Stop thread or cancel pending thread creation BH */
+    /* Stop threads or cancel pending thread creation BH */
     if (s->start_bh) {
         qemu_bh_delete(s->start_bh);
         s->start_bh = NULL;
     } else {
-        aio_notify(s->ctx);
-        qemu_thread_join(&s->thread);
+        for (i = 0; i < s->num_queues; i++) {
+            aio_notify(s->queues[i].ctx);
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            qemu_thread_join(&s->queues[i].thread);
+        }
     }
 
-    aio_set_event_notifier(s->ctx, &s->io_notifier, NULL, NULL);
-    ioq_cleanup(&s->ioqueue);
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        aio_set_event_notifier(q->ctx, &q->io_notifier, NULL, NULL);
+        ioq_cleanup(&q->ioqueue);
 
-    aio_set_event_notifier(s->ctx, &s->host_notifier, NULL, NULL);
-    k->set_host_notifier(qbus->parent, 0, false);
+        aio_set_event_notifier(q->ctx, &q->host_notifier, NULL, NULL);
+        k->set_host_notifier(qbus->parent, i, false);
 
-    aio_context_unref(s->ctx);
+        aio_context_unref(q->ctx);
+    }
 
-    /* Clean up guest notifier (irq) */
-    k->set_guest_notifiers(qbus->parent, 1, false);
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues, false);
 
-    vring_teardown(&s->vring);
+    for (i = 0; i < s->num_queues; i++) {
+        vring_teardown(&s->queues[i].vring, s->vdev, i);
+    }
     s->started = false;
     s->stopping = false;
 }
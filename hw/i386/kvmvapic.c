@@ -444,7 +444,9 @@ static void patch_instruction(VAPICROMState *s, X86CPU *cpu, target_ulong ip)
 
     if (!kvm_enabled()) {
         cs->current_tb = NULL;
+        tb_lock();
         tb_gen_code(env, current_pc, current_cs_base, current_flags, 1);
+        tb_unlock();
         cpu_resume_from_signal(env, NULL);
     }
 }
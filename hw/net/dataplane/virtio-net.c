@@ -0,0 +1,626 @@
+/*
+ * Dedicated threads for virtio-net packet processing
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "trace.h"
+#include "qemu/iov.h"
+#include "qemu/thread.h"
+#include "qemu/error-report.h"
+#include "hw/virtio/dataplane/vring.h"
+#include "migration/migration.h"
+#include "net/net.h"
+#include "net/tap.h"
+#include "hw/virtio/virtio-net.h"
+#include "virtio-net.h"
+#include "block/aio.h"
+#include "hw/virtio/virtio-bus.h"
+
+enum {
+    RX_BURST = 256,                 /* packets read from the tap per wakeup */
+};
+
+typedef struct {
+    Vring vring;
+
+    /* Note that host_notifier is assigned by value.  This is fine as long
+     * as you do not call event_notifier_cleanup on it (because you don't own
+     * the file descriptor or handle; you just use it).
+     */
+    EventNotifier host_notifier;    /* doorbell */
+    EventNotifier *guest_notifier;  /* irq, or masked_notifier while masked */
+    EventNotifier masked_notifier;
+} VirtIONetDataPlaneVq;
+
+/* Each queue pair is processed by its own thread with its own AioContext.
+ * The thread reads packets from the tap file descriptor into the RX vring
+ * and writes the TX vring to it, so neither direction goes through the net
+ * layer or takes the global mutex.
+ *
+ * Like vhost-net, and unlike the device model, the dataplane does not apply
+ * the receive filters that the guest sets up through the control virtqueue.
+ */
+typedef struct {
+    VirtIONetDataPlane *s;
+    QemuThread thread;
+    AioContext *ctx;
+
+    VirtIONetDataPlaneVq rx;
+    VirtIONetDataPlaneVq tx;
+
+    NetClientState *peer;
+    int tap_fd;
+    bool rx_polling;                /* waiting for packets from the tap */
+    bool tx_blocked;                /* waiting for the tap to be writable */
+
+    /* Packet read from the tap that is waiting for RX buffers */
+    uint8_t buf[NET_BUFSIZE];
+    ssize_t buf_len;
+
+    struct iovec iov[VIRTQUEUE_MAX_SIZE];
+    struct iovec sg[VIRTQUEUE_MAX_SIZE];
+    unsigned int heads[VIRTQUEUE_MAX_SIZE];
+    unsigned int lens[VIRTQUEUE_MAX_SIZE];
+} VirtIONetDataPlaneQueue;
+
+struct VirtIONetDataPlane {
+    bool started;
+    bool stopping;
+    QEMUBH *start_bh;
+
+    VirtIONet *n;
+    VirtIODevice *vdev;
+    VirtIONetDataPlaneQueue *queues;
+    unsigned int max_queues;
+    unsigned int num_queues;        /* queue pairs in use while started */
+
+    /* Copied from the device on start, they only change during feature
+     * negotiation when the dataplane is stopped.
+     */
+    size_t host_hdr_len;
+    size_t guest_hdr_len;
+    bool mergeable_rx_bufs;
+    int tx_burst;
+
+    Error *migration_blocker;
+};
+
+static VirtIONetDataPlaneVq *get_vq(VirtIONetDataPlane *s, int idx)
+{
+    VirtIONetDataPlaneQueue *q = &s->queues[idx / 2];
+
+    return idx % 2 ? &q->tx : &q->rx;
+}
+
+/* Raise an interrupt to signal guest, if necessary */
+static void notify_guest(VirtIONetDataPlane *s, VirtIONetDataPlaneVq *vq)
+{
+    if (!vring_should_notify(s->vdev, &vq->vring)) {
+        return;
+    }
+
+    event_notifier_set(vq->guest_notifier);
+}
+
+static int flush_true(EventNotifier *e)
+{
+    return true;
+}
+
+static int flush_tap(void *opaque)
+{
+    return true;
+}
+
+static void handle_tap_read(void *opaque);
+static void handle_tap_write(void *opaque);
+
+static void update_tap_handler(VirtIONetDataPlaneQueue *q)
+{
+    bool poll = q->rx_polling || q->tx_blocked;
+
+    aio_set_fd_handler(q->ctx, q->tap_fd,
+                       q->rx_polling ? handle_tap_read : NULL,
+                       q->tx_blocked ? handle_tap_write : NULL,
+                       poll ? flush_tap : NULL, q);
+}
+
+/* Copy the packet in q->buf to the RX vring, replacing the tap's header
+ * with the one the guest expects.  Returns false if the guest has not made
+ * enough buffers available yet; packets that can never fit are dropped.
+ */
+static bool receive_packet(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    Vring *vring = &q->rx.vring;
+    struct virtio_net_hdr_mrg_rxbuf mhdr = { };
+    struct iovec *iov = q->iov;
+    struct iovec *end = &q->iov[ARRAY_SIZE(q->iov)];
+    const uint8_t *data = q->buf + s->host_hdr_len;
+    size_t size = q->buf_len - s->host_hdr_len;
+    size_t offset = 0;
+    unsigned int out_num, in_num, first_in_num = 0, num = 0, i;
+    int head;
+
+    if (q->buf_len < s->host_hdr_len) {
+        return true;
+    }
+    memcpy(&mhdr, q->buf, s->host_hdr_len);
+
+    while (num == 0 || offset < size) {
+        size_t hdr_len = 0, len;
+
+        head = vring_pop(s->vdev, vring, iov, end, &out_num, &in_num);
+        if (head < 0) {
+            vring_unpop(vring, num);
+            return head != -EAGAIN;
+        }
+
+        if (unlikely(out_num || in_num == 0)) {
+            error_report("virtio-net receive queue contains no in buffers");
+            vring_set_broken(vring);
+            return true;
+        }
+
+        if (num == 0) {
+            first_in_num = in_num;
+            hdr_len = iov_from_buf(iov, in_num, 0, &mhdr, s->guest_hdr_len);
+        }
+        len = iov_from_buf(iov, in_num, hdr_len, data + offset,
+                           size - offset);
+        q->heads[num] = head;
+        q->lens[num++] = hdr_len + len;
+        offset += len;
+        iov += in_num;
+
+        /* Without mergeable buffers the packet must fit in one chain */
+        if (offset < size &&
+            (!s->mergeable_rx_bufs || num == ARRAY_SIZE(q->heads))) {
+            vring_unpop(vring, num);
+            return true;
+        }
+    }
+
+    if (s->mergeable_rx_bufs) {
+        uint16_t num_buffers;
+
+        stw_p(&num_buffers, num);
+        iov_from_buf(q->iov, first_in_num,
+                     offsetof(struct virtio_net_hdr_mrg_rxbuf, num_buffers),
+                     &num_buffers, sizeof(num_buffers));
+    }
+
+    /* Publish all buffers of the packet at once */
+    for (i = 0; i < num; i++) {
+        vring_fill(vring, q->heads[i], q->lens[i], i);
+    }
+    vring_flush(vring, num);
+    return true;
+}
+
+static void handle_rx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    unsigned int packets = 0;
+    ssize_t len;
+
+    while (packets < RX_BURST) {
+        if (!q->buf_len) {
+            do {
+                len = read(q->tap_fd, q->buf, sizeof(q->buf));
+            } while (len < 0 && errno == EINTR);
+            if (len <= 0) {
+                break;
+            }
+            q->buf_len = len;
+        }
+
+        if (!receive_packet(q)) {
+            /* Stop reading the tap until the guest adds RX buffers.  But if
+             * it has snuck in more buffers, keep going.
+             */
+            if (vring_enable_notification(s->vdev, &q->rx.vring)) {
+                q->rx_polling = false;
+                update_tap_handler(q);
+                break;
+            }
+            vring_disable_notification(s->vdev, &q->rx.vring);
+            continue;
+        }
+        q->buf_len = 0;
+        packets++;
+    }
+
+    if (packets) {
+        trace_virtio_net_data_plane_rx(s, q - s->queues, packets);
+        notify_guest(s, &q->rx);
+    }
+}
+
+static void handle_tap_read(void *opaque)
+{
+    handle_rx(opaque);
+}
+
+static void handle_rx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              rx.host_notifier);
+
+    event_notifier_test_and_clear(e);
+
+    /* The guest only kicks the RX queue when we ran out of buffers */
+    vring_disable_notification(q->s->vdev, &q->rx.vring);
+    if (!q->rx_polling) {
+        q->rx_polling = true;
+        update_tap_handler(q);
+    }
+    handle_rx(q);
+}
+
+/* Write the packet in q->iov to the tap, passing on only the part of the
+ * guest's header that the tap expects.  Returns a negative errno on failure.
+ */
+static ssize_t transmit_packet(VirtIONetDataPlaneQueue *q,
+                               unsigned int out_num)
+{
+    VirtIONetDataPlane *s = q->s;
+    struct iovec *sg = q->iov;
+    unsigned int sg_num = out_num;
+    ssize_t ret;
+
+    if (s->host_hdr_len != s->guest_hdr_len) {
+        sg_num = iov_copy(q->sg, ARRAY_SIZE(q->sg), q->iov, out_num,
+                          0, s->host_hdr_len);
+        sg_num += iov_copy(q->sg + sg_num, ARRAY_SIZE(q->sg) - sg_num,
+                           q->iov, out_num, s->guest_hdr_len, -1);
+        sg = q->sg;
+    }
+
+    do {
+        ret = writev(q->tap_fd, sg, sg_num);
+    } while (ret < 0 && errno == EINTR);
+
+    return ret < 0 ? -errno : ret;
+}
+
+static void handle_tx(VirtIONetDataPlaneQueue *q)
+{
+    VirtIONetDataPlane *s = q->s;
+    Vring *vring = &q->tx.vring;
+    struct iovec *end = &q->iov[ARRAY_SIZE(q->iov)];
+    unsigned int out_num, in_num, num = 0;
+    int head;
+
+    if (q->tx_blocked) {
+        return;
+    }
+
+    /* Disable guest->host notifies to avoid unnecessary vmexits */
+    vring_disable_notification(s->vdev, vring);
+
+    while (num < s->tx_burst) {
+        head = vring_pop(s->vdev, vring, q->iov, end, &out_num, &in_num);
+        if (head == -EAGAIN) {
+            /* Re-enable guest->host notifies and stop processing the vring.
+             * But if the guest has snuck in more descriptors, keep going.
+             */
+            if (vring_enable_notification(s->vdev, vring)) {
+                break;
+            }
+            vring_disable_notification(s->vdev, vring);
+            continue;
+        } else if (head < 0) {
+            break;
+        }
+
+        if (unlikely(out_num == 0)) {
+            error_report("virtio-net header not in first element");
+            vring_set_broken(vring);
+            break;
+        }
+
+        if (transmit_packet(q, out_num) == -EAGAIN) {
+            /* The tap is full, retry the packet once it is writable */
+            vring_unpop(vring, 1);
+            q->tx_blocked = true;
+            update_tap_handler(q);
+            break;
+        }
+        vring_fill(vring, head, 0, num++);
+    }
+
+    if (num == s->tx_burst) {
+        /* Give the RX side a chance before flushing the rest */
+        event_notifier_set(&q->tx.host_notifier);
+    }
+
+    if (num) {
+        vring_flush(vring, num);
+        trace_virtio_net_data_plane_tx(s, q - s->queues, num);
+        notify_guest(s, &q->tx);
+    }
+}
+
+static void handle_tap_write(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    q->tx_blocked = false;
+    update_tap_handler(q);
+    handle_tx(q);
+}
+
+static void handle_tx_notify(EventNotifier *e)
+{
+    VirtIONetDataPlaneQueue *q = container_of(e, VirtIONetDataPlaneQueue,
+                                              tx.host_notifier);
+
+    event_notifier_test_and_clear(e);
+    handle_tx(q);
+}
+
+static void *data_plane_thread(void *opaque)
+{
+    VirtIONetDataPlaneQueue *q = opaque;
+
+    do {
+        aio_poll(q->ctx, true);
+    } while (!q->s->stopping);
+    return NULL;
+}
+
+static void start_data_plane_bh(void *opaque)
+{
+    VirtIONetDataPlane *s = opaque;
+    unsigned int i;
+
+    qemu_bh_delete(s->start_bh);
+    s->start_bh = NULL;
+    for (i = 0; i < s->num_queues; i++) {
+        qemu_thread_create(&s->queues[i].thread, data_plane_thread,
+                           &s->queues[i], QEMU_THREAD_JOINABLE);
+    }
+}
+
+bool virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane)
+{
+    VirtIONetDataPlane *s;
+    NetClientState *peer;
+    unsigned int i;
+
+    *dataplane = NULL;
+
+    if (!n->net_conf.data_plane) {
+        return true;
+    }
+
+    for (i = 0; i < n->max_queues; i++) {
+        peer = qemu_get_subqueue(n->nic, i)->peer;
+        if (!peer || peer->info->type != NET_CLIENT_OPTIONS_KIND_TAP) {
+            error_report("x-data-plane requires a tap netdev");
+            return false;
+        }
+        if (tap_get_vhost_net(peer)) {
+            error_report("x-data-plane is incompatible with vhost=on");
+            return false;
+        }
+    }
+
+    s = g_new0(VirtIONetDataPlane, 1);
+    s->n = n;
+    s->vdev = VIRTIO_DEVICE(n);
+    s->max_queues = n->max_queues;
+    s->queues = g_new0(VirtIONetDataPlaneQueue, s->max_queues);
+    for (i = 0; i < s->max_queues; i++) {
+        s->queues[i].s = s;
+        event_notifier_init(&s->queues[i].rx.masked_notifier, 0);
+        event_notifier_init(&s->queues[i].tx.masked_notifier, 0);
+    }
+
+    error_setg(&s->migration_blocker,
+            "x-data-plane does not support migration");
+    migrate_add_blocker(s->migration_blocker);
+
+    *dataplane = s;
+    return true;
+}
+
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s)
+{
+    unsigned int i;
+
+    if (!s) {
+        return;
+    }
+
+    virtio_net_data_plane_stop(s);
+    migrate_del_blocker(s->migration_blocker);
+    error_free(s->migration_blocker);
+    for (i = 0; i < s->max_queues; i++) {
+        event_notifier_cleanup(&s->queues[i].rx.masked_notifier);
+        event_notifier_cleanup(&s->queues[i].tx.masked_notifier);
+    }
+    g_free(s->queues);
+    g_free(s);
+}
+
+int virtio_net_data_plane_start(VirtIONetDataPlane *s,
+                                unsigned int num_queues)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONet *n = s->n;
+    VirtIONetDataPlaneQueue *q;
+    VirtQueue *vq;
+    int i, r;
+
+    if (s->started) {
+        return 0;
+    }
+
+    assert(num_queues <= s->max_queues);
+    for (i = 0; i < num_queues * 2; i++) {
+        if (!vring_setup(&get_vq(s, i)->vring, s->vdev, i)) {
+            while (--i >= 0) {
+                vring_teardown(&get_vq(s, i)->vring, s->vdev, i);
+            }
+            return -EFAULT;
+        }
+        vq = virtio_get_queue(s->vdev, i);
+        get_vq(s, i)->guest_notifier = virtio_queue_get_guest_notifier(vq);
+    }
+
+    /* Set up guest notifiers (irq) */
+    r = k->set_guest_notifiers(qbus->parent, num_queues * 2, true);
+    if (r < 0) {
+        for (i = 0; i < num_queues * 2; i++) {
+            vring_teardown(&get_vq(s, i)->vring, s->vdev, i);
+        }
+        return r;
+    }
+
+    s->num_queues = num_queues;
+    s->host_hdr_len = n->host_hdr_len;
+    s->guest_hdr_len = n->guest_hdr_len;
+    s->mergeable_rx_bufs = n->mergeable_rx_bufs;
+    s->tx_burst = n->tx_burst;
+
+    for (i = 0; i < num_queues; i++) {
+        q = &s->queues[i];
+        q->ctx = aio_context_new();
+        q->peer = qemu_get_subqueue(n->nic, i)->peer;
+        q->tap_fd = tap_get_fd(q->peer);
+        q->buf_len = 0;
+
+        /* Take the tap away from the main loop */
+        q->peer->info->poll(q->peer, false);
+
+        /* Set up virtqueue notify */
+        if (k->set_host_notifier(qbus->parent, i * 2, true) != 0 ||
+            k->set_host_notifier(qbus->parent, i * 2 + 1, true) != 0) {
+            fprintf(stderr, "virtio-net failed to set host notifier\n");
+            exit(1);
+        }
+        vq = virtio_get_queue(s->vdev, i * 2);
+        q->rx.host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->rx.host_notifier,
+                               handle_rx_notify, flush_true);
+        vq = virtio_get_queue(s->vdev, i * 2 + 1);
+        q->tx.host_notifier = *virtio_queue_get_host_notifier(vq);
+        aio_set_event_notifier(q->ctx, &q->tx.host_notifier,
+                               handle_tx_notify, flush_true);
+
+        q->rx_polling = true;
+        q->tx_blocked = false;
+        update_tap_handler(q);
+    }
+
+    s->started = true;
+    trace_virtio_net_data_plane_start(s, num_queues);
+
+    /* Kick right away to begin processing buffers already in the vrings */
+    for (i = 0; i < num_queues * 2; i++) {
+        vq = virtio_get_queue(s->vdev, i);
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+
+    /* Spawn threads in BH so they inherit iothread cpusets */
+    s->start_bh = qemu_bh_new(start_data_plane_bh, s);
+    qemu_bh_schedule(s->start_bh);
+    return 0;
+}
+
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s)
+{
+    BusState *qbus = BUS(qdev_get_parent_bus(DEVICE(s->vdev)));
+    VirtioBusClass *k = VIRTIO_BUS_GET_CLASS(qbus);
+    VirtIONetDataPlaneQueue *q;
+    unsigned int i;
+
+    if (!s->started || s->stopping) {
+        return;
+    }
+    s->stopping = true;
+    trace_virtio_net_data_plane_stop(s);
+
+    /* Stop threads or cancel pending thread creation BH */
+    if (s->start_bh) {
+        qemu_bh_delete(s->start_bh);
+        s->start_bh = NULL;
+    } else {
+        for (i = 0; i < s->num_queues; i++) {
+            aio_notify(s->queues[i].ctx);
+        }
+        for (i = 0; i < s->num_queues; i++) {
+            qemu_thread_join(&s->queues[i].thread);
+        }
+    }
+
+    for (i = 0; i < s->num_queues; i++) {
+        q = &s->queues[i];
+        q->rx_polling = false;
+        q->tx_blocked = false;
+        update_tap_handler(q);
+
+        aio_set_event_notifier(q->ctx, &q->rx.host_notifier, NULL, NULL);
+        k->set_host_notifier(qbus->parent, i * 2, false);
+        aio_set_event_notifier(q->ctx, &q->tx.host_notifier, NULL, NULL);
+        k->set_host_notifier(qbus->parent, i * 2 + 1, false);
+
+        aio_context_unref(q->ctx);
+
+        /* Give the tap back to the main loop */
+        q->peer->info->poll(q->peer, true);
+    }
+
+    /* Clean up guest notifiers (irq) */
+    k->set_guest_notifiers(qbus->parent, s->num_queues * 2, false);
+
+    for (i = 0; i < s->num_queues * 2; i++) {
+        vring_teardown(&get_vq(s, i)->vring, s->vdev, i);
+    }
+    s->started = false;
+    s->stopping = false;
+}
+
+/* Pass on a kick that reached the device model instead of the host
+ * notifier, which happens when ioeventfd is not backed by KVM.
+ */
+void virtio_net_data_plane_notify(VirtIONetDataPlane *s, VirtQueue *vq)
+{
+    if (s->started && virtio_get_queue_index(vq) < s->num_queues * 2) {
+        event_notifier_set(virtio_queue_get_host_notifier(vq));
+    }
+}
+
+/* While the guest masks a vector, interrupts for its virtqueue go to a
+ * private notifier instead of the irqfd, as vhost does.
+ */
+void virtio_net_data_plane_mask(VirtIONetDataPlane *s, int idx, bool mask)
+{
+    VirtIONetDataPlaneVq *vq = get_vq(s, idx);
+
+    if (mask) {
+        vq->guest_notifier = &vq->masked_notifier;
+    } else {
+        vq->guest_notifier =
+            virtio_queue_get_guest_notifier(virtio_get_queue(s->vdev, idx));
+    }
+}
+
+bool virtio_net_data_plane_pending(VirtIONetDataPlane *s, int idx)
+{
+    /* The thread may signal the masked notifier it loaded just before the
+     * vector was unmasked, so report an event unconditionally: a spurious
+     * interrupt is harmless, a lost one is not.
+     */
+    event_notifier_test_and_clear(&get_vq(s, idx)->masked_notifier);
+    return true;
+}
@@ -0,0 +1,29 @@
+/*
+ * Dedicated threads for virtio-net packet processing
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#ifndef HW_DATAPLANE_VIRTIO_NET_H
+#define HW_DATAPLANE_VIRTIO_NET_H
+
+#include "hw/virtio/virtio.h"
+#include "hw/virtio/virtio-net.h"
+
+typedef struct VirtIONetDataPlane VirtIONetDataPlane;
+
+bool virtio_net_data_plane_create(VirtIONet *n,
+                                  VirtIONetDataPlane **dataplane);
+void virtio_net_data_plane_destroy(VirtIONetDataPlane *s);
+int virtio_net_data_plane_start(VirtIONetDataPlane *s,
+                                unsigned int num_queues);
+void virtio_net_data_plane_stop(VirtIONetDataPlane *s);
+void virtio_net_data_plane_notify(VirtIONetDataPlane *s, VirtQueue *vq);
+void virtio_net_data_plane_mask(VirtIONetDataPlane *s, int idx, bool mask);
+bool virtio_net_data_plane_pending(VirtIONetDataPlane *s, int idx);
+
+#endif /* HW_DATAPLANE_VIRTIO_NET_H */
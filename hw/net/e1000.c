@@ -132,9 +132,23 @@ typedef struct E1000State_st {
 
     QEMUTimer *autoneg_timer;
 
+    /* Interrupt moderation (ITR, RDTR/RADV, TIDV/TADV), not migrated */
+    QEMUTimer *mit_timer;
+    bool mit_irq_level;         /* level last driven on the interrupt line */
+    bool mit_held;              /* an interrupt is held back by ITR */
+    int64_t mit_itr_end;        /* ns; no new interrupt before this time */
+    struct e1000_mit_delay {
+        uint32_t cause;         /* delayed causes, not yet in ICR */
+        int64_t deadline;       /* ns */
+        int64_t abs_deadline;   /* ns */
+    } mit_rx, mit_tx;
+    bool adaptive_itr;
+
 /* Compatibility flags for migration to/from qemu 1.3.0 and older */
 #define E1000_FLAG_AUTONEG_BIT 0
+#define E1000_FLAG_MIT_BIT 1
 #define E1000_FLAG_AUTONEG (1 << E1000_FLAG_AUTONEG_BIT)
+#define E1000_FLAG_MIT (1 << E1000_FLAG_MIT_BIT)
     uint32_t compat_flags;
 } E1000State;
 
@@ -150,7 +164,8 @@ enum {
     defreg(TORH),	defreg(TORL),	defreg(TOTH),	defreg(TOTL),
     defreg(TPR),	defreg(TPT),	defreg(TXDCTL),	defreg(WUFC),
     defreg(RA),		defreg(MTA),	defreg(CRCERRS),defreg(VFTA),
-    defreg(VET),
+    defreg(VET),	defreg(ITR),	defreg(RDTR),	defreg(RADV),
+    defreg(TADV),	defreg(TIDV),
 };
 
 static void
@@ -237,9 +252,50 @@ static const uint32_t mac_reg_init[] = {
                 E1000_MANC_RMCP_EN,
 };
 
+/* Minimum interval between two interrupts, in ns */
+static int64_t
+e1000_itr_interval(E1000State *s)
+{
+    int64_t interval = 0;
+
+    if (s->mac_reg[ITR]) {
+        /* ITR counts in 256 ns units */
+        interval = (int64_t)s->mac_reg[ITR] * 256;
+    } else if (s->adaptive_itr) {
+        interval = qemu_nic_adaptive_delay(s->nic);
+    }
+    s->nic->stats.moderation_delay = interval;
+    return interval;
+}
+
+static void
+e1000_mit_arm(E1000State *s)
+{
+    int64_t next = INT64_MAX;
+
+    if (s->mit_held) {
+        next = s->mit_itr_end;
+    }
+    if (s->mit_rx.cause) {
+        next = MIN(next, s->mit_rx.deadline);
+    }
+    if (s->mit_tx.cause) {
+        next = MIN(next, s->mit_tx.deadline);
+    }
+
+    if (next == INT64_MAX) {
+        qemu_del_timer(s->mit_timer);
+    } else {
+        qemu_mod_timer(s->mit_timer, next);
+    }
+}
+
 static void
 set_interrupt_cause(E1000State *s, int index, uint32_t val)
 {
+    bool level;
+    int64_t now;
+
     if (val && (E1000_DEVID >= E1000_DEV_ID_82547EI_MOBILE)) {
         /* Only for 8257x */
         val |= E1000_ICR_INT_ASSERTED;
@@ -256,7 +312,24 @@ set_interrupt_cause(E1000State *s, int index, uint32_t val)
      */
     s->mac_reg[ICS] = val;
 
-    qemu_set_irq(s->dev.irq[0], (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0);
+    level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    if (level && !s->mit_irq_level) {
+        if (s->compat_flags & E1000_FLAG_MIT) {
+            /* ITR: hold the interrupt until the interval has elapsed */
+            now = qemu_get_clock_ns(vm_clock);
+            if (now < s->mit_itr_end) {
+                s->mit_held = true;
+                e1000_mit_arm(s);
+                return;
+            }
+            s->mit_itr_end = now + e1000_itr_interval(s);
+        }
+        s->nic->stats.interrupts++;
+    }
+    s->mit_held = false;
+    s->mit_irq_level = level;
+
+    qemu_set_irq(s->dev.irq[0], level);
 }
 
 static void
@@ -264,9 +337,57 @@ set_ics(E1000State *s, int index, uint32_t val)
 {
     DBGOUT(INTERRUPT, "set_ics %x, ICR %x, IMR %x\n", val, s->mac_reg[ICR],
         s->mac_reg[IMS]);
+    if ((val & s->mac_reg[IMS]) && (s->mit_irq_level || s->mit_held)) {
+        s->nic->stats.coalesced++;
+    }
     set_interrupt_cause(s, 0, val | s->mac_reg[ICR]);
 }
 
+/*
+ * Delay @cause by @rel units of 1.024 us, but not beyond @abs units after the
+ * first delayed event (0: no absolute limit).  Further events postpone the
+ * interrupt again, as with the RDTR/RADV and TIDV/TADV timers.
+ */
+static void
+e1000_mit_delay(E1000State *s, struct e1000_mit_delay *d, uint32_t cause,
+                uint32_t rel, uint32_t abs)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+
+    if (!d->cause) {
+        d->abs_deadline = abs ? now + abs * 1024LL : INT64_MAX;
+    } else {
+        s->nic->stats.coalesced++;
+    }
+    d->cause |= cause;
+    d->deadline = MIN(now + rel * 1024LL, d->abs_deadline);
+    e1000_mit_arm(s);
+}
+
+static uint32_t
+e1000_mit_take(struct e1000_mit_delay *d, int64_t now)
+{
+    uint32_t cause = 0;
+
+    if (d->cause && now >= d->deadline) {
+        cause = d->cause;
+        d->cause = 0;
+    }
+    return cause;
+}
+
+static void
+e1000_mit_timer(void *opaque)
+{
+    E1000State *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint32_t cause;
+
+    cause = e1000_mit_take(&s->mit_rx, now) | e1000_mit_take(&s->mit_tx, now);
+    set_interrupt_cause(s, 0, s->mac_reg[ICR] | cause);
+    e1000_mit_arm(s);
+}
+
 static int
 rxbufsize(uint32_t v)
 {
@@ -297,6 +418,12 @@ static void e1000_reset(void *opaque)
     int i;
 
     qemu_del_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    d->mit_irq_level = false;
+    d->mit_held = false;
+    d->mit_itr_end = 0;
+    memset(&d->mit_rx, 0, sizeof d->mit_rx);
+    memset(&d->mit_tx, 0, sizeof d->mit_tx);
     memset(d->phy_reg, 0, sizeof d->phy_reg);
     memmove(d->phy_reg, phy_reg_init, sizeof phy_reg_init);
     memset(d->mac_reg, 0, sizeof d->mac_reg);
@@ -671,6 +798,7 @@ start_xmit(E1000State *s)
     dma_addr_t base;
     struct e1000_tx_desc desc;
     uint32_t tdh_start = s->mac_reg[TDH], cause = E1000_ICS_TXQE;
+    bool ide = false;
 
     if (!(s->mac_reg[TCTL] & E1000_TCTL_EN)) {
         DBGOUT(TX, "tx disabled\n");
@@ -688,6 +816,7 @@ start_xmit(E1000State *s)
 
         process_tx_desc(s, &desc);
         cause |= txdesc_writeback(s, base, &desc);
+        ide |= (le32_to_cpu(desc.lower.data) & E1000_TXD_CMD_IDE) != 0;
 
         if (++s->mac_reg[TDH] * sizeof(desc) >= s->mac_reg[TDLEN])
             s->mac_reg[TDH] = 0;
@@ -702,6 +831,12 @@ start_xmit(E1000State *s)
             break;
         }
     }
+
+    if (ide && (s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[TIDV]) {
+        e1000_mit_delay(s, &s->mit_tx, cause,
+                        s->mac_reg[TIDV], s->mac_reg[TADV]);
+        cause = 0;
+    }
     set_ics(s, 0, cause);
 }
 
@@ -927,6 +1062,11 @@ e1000_receive(NetClientState *nc, const uint8_t *buf, size_t size)
         s->rxbuf_min_shift)
         n |= E1000_ICS_RXDMT0;
 
+    if ((s->compat_flags & E1000_FLAG_MIT) && s->mac_reg[RDTR]) {
+        e1000_mit_delay(s, &s->mit_rx, E1000_ICS_RXT0,
+                        s->mac_reg[RDTR], s->mac_reg[RADV]);
+        n &= ~E1000_ICS_RXT0;
+    }
     set_ics(s, 0, n);
 
     return size;
@@ -988,6 +1128,19 @@ set_16bit(E1000State *s, int index, uint32_t val)
     s->mac_reg[index] = val & 0xffff;
 }
 
+static void
+set_rdtr(E1000State *s, int index, uint32_t val)
+{
+    s->mac_reg[index] = val & E1000_RDT_DELAY;
+    if ((val & E1000_RDT_FPDB) && s->mit_rx.cause) {
+        /* Flush Partial Descriptor Block: post the delayed RXT0 now */
+        val = s->mit_rx.cause;
+        s->mit_rx.cause = 0;
+        e1000_mit_arm(s);
+        set_ics(s, 0, val);
+    }
+}
+
 static void
 set_dlen(E1000State *s, int index, uint32_t val)
 {
@@ -1031,7 +1184,8 @@ static uint32_t (*macreg_readops[])(E1000State *, int) = {
     getreg(TORL),	getreg(TOTL),	getreg(IMS),	getreg(TCTL),
     getreg(RDH),	getreg(RDT),	getreg(VET),	getreg(ICS),
     getreg(TDBAL),	getreg(TDBAH),	getreg(RDBAH),	getreg(RDBAL),
-    getreg(TDLEN),	getreg(RDLEN),
+    getreg(TDLEN),	getreg(RDLEN),	getreg(ITR),	getreg(RDTR),
+    getreg(RADV),	getreg(TADV),	getreg(TIDV),
 
     [TOTH] = mac_read_clr8,	[TORH] = mac_read_clr8,	[GPRC] = mac_read_clr4,
     [GPTC] = mac_read_clr4,	[TPR] = mac_read_clr4,	[TPT] = mac_read_clr4,
@@ -1053,6 +1207,8 @@ static void (*macreg_writeops[])(E1000State *, int, uint32_t) = {
     [TDH] = set_16bit,	[RDH] = set_16bit,	[RDT] = set_rdt,
     [IMC] = set_imc,	[IMS] = set_ims,	[ICR] = set_icr,
     [EECD] = set_eecd,	[RCTL] = set_rx_control, [CTRL] = set_ctrl,
+    [RDTR] = set_rdtr,	[RADV] = set_16bit,	[TADV] = set_16bit,
+    [TIDV] = set_16bit,	[ITR] = set_16bit,
     [RA ... RA+31] = &mac_writereg,
     [MTA ... MTA+127] = &mac_writereg,
     [VFTA ... VFTA+127] = &mac_writereg,
@@ -1134,6 +1290,19 @@ static void e1000_pre_save(void *opaque)
     E1000State *s = opaque;
     NetClientState *nc = qemu_get_queue(s->nic);
 
+    /*
+     * The moderation timers are not migrated: post whatever they hold
+     * back, so that the destination does not lose an interrupt.
+     */
+    if (s->mit_held || s->mit_rx.cause || s->mit_tx.cause) {
+        uint32_t cause = s->mit_rx.cause | s->mit_tx.cause;
+
+        s->mit_rx.cause = s->mit_tx.cause = 0;
+        s->mit_itr_end = 0;
+        qemu_del_timer(s->mit_timer);
+        set_interrupt_cause(s, 0, s->mac_reg[ICR] | cause);
+    }
+
     if (!(s->compat_flags & E1000_FLAG_AUTONEG)) {
         return;
     }
@@ -1160,6 +1329,17 @@ static int e1000_post_load(void *opaque, int version_id)
      * Alternatively, restart link negotiation if it was in progress. */
     nc->link_down = (s->mac_reg[STATUS] & E1000_STATUS_LU) == 0;
 
+    s->mit_irq_level = (s->mac_reg[IMS] & s->mac_reg[ICR]) != 0;
+    s->mit_held = false;
+    s->mit_itr_end = 0;
+    if (!(s->compat_flags & E1000_FLAG_MIT)) {
+        s->mac_reg[ITR] = 0;
+        s->mac_reg[RDTR] = 0;
+        s->mac_reg[RADV] = 0;
+        s->mac_reg[TADV] = 0;
+        s->mac_reg[TIDV] = 0;
+    }
+
     if (!(s->compat_flags & E1000_FLAG_AUTONEG)) {
         return 0;
     }
@@ -1174,6 +1354,28 @@ static int e1000_post_load(void *opaque, int version_id)
     return 0;
 }
 
+static bool e1000_mit_state_needed(void *opaque)
+{
+    E1000State *s = opaque;
+
+    return s->compat_flags & E1000_FLAG_MIT;
+}
+
+static const VMStateDescription vmstate_e1000_mit_state = {
+    .name = "e1000/mit_state",
+    .version_id = 1,
+    .minimum_version_id = 1,
+    .minimum_version_id_old = 1,
+    .fields    = (VMStateField[]) {
+        VMSTATE_UINT32(mac_reg[RDTR], E1000State),
+        VMSTATE_UINT32(mac_reg[RADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TADV], E1000State),
+        VMSTATE_UINT32(mac_reg[TIDV], E1000State),
+        VMSTATE_UINT32(mac_reg[ITR], E1000State),
+        VMSTATE_END_OF_LIST()
+    }
+};
+
 static const VMStateDescription vmstate_e1000 = {
     .name = "e1000",
     .version_id = 2,
@@ -1251,6 +1453,14 @@ static const VMStateDescription vmstate_e1000 = {
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, MTA, 128),
         VMSTATE_UINT32_SUB_ARRAY(mac_reg, E1000State, VFTA, 128),
         VMSTATE_END_OF_LIST()
+    },
+    .subsections = (VMStateSubsection[]) {
+        {
+            .vmsd = &vmstate_e1000_mit_state,
+            .needed = e1000_mit_state_needed,
+        }, {
+            /* empty */
+        }
     }
 };
 
@@ -1300,6 +1510,8 @@ pci_e1000_uninit(PCIDevice *dev)
 
     qemu_del_timer(d->autoneg_timer);
     qemu_free_timer(d->autoneg_timer);
+    qemu_del_timer(d->mit_timer);
+    qemu_free_timer(d->mit_timer);
     memory_region_destroy(&d->mmio);
     memory_region_destroy(&d->io);
     qemu_del_nic(d->nic);
@@ -1354,6 +1566,8 @@ static int pci_e1000_init(PCIDevice *pci_dev)
     add_boot_device_path(d->conf.bootindex, &pci_dev->qdev, "/ethernet-phy@0");
 
     d->autoneg_timer = qemu_new_timer_ms(vm_clock, e1000_autoneg_timer, d);
+    d->mit_timer = qemu_new_timer_ns(vm_clock, e1000_mit_timer, d);
+    d->nic->stats.counts_interrupts = true;
 
     return 0;
 }
@@ -1368,6 +1582,9 @@ static Property e1000_properties[] = {
     DEFINE_NIC_PROPERTIES(E1000State, conf),
     DEFINE_PROP_BIT("autonegotiation", E1000State,
                     compat_flags, E1000_FLAG_AUTONEG_BIT, true),
+    DEFINE_PROP_BIT("mitigation", E1000State,
+                    compat_flags, E1000_FLAG_MIT_BIT, true),
+    DEFINE_PROP_BOOL("adaptive-itr", E1000State, adaptive_itr, false),
     DEFINE_PROP_END_OF_LIST(),
 };
 
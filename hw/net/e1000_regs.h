@@ -762,6 +762,10 @@ struct e1000_rx_desc {
     uint16_t special;
 };
 
+/* Receive Delay Timer Register */
+#define E1000_RDT_DELAY         0x0000ffff  /* Delay timer (1=1.024us) */
+#define E1000_RDT_FPDB          0x80000000  /* Flush descriptor block */
+
 /* Receive Descriptor bit definitions */
 #define E1000_RXD_STAT_DD       0x01    /* Descriptor Done */
 #define E1000_RXD_STAT_EOP      0x02    /* End of Packet */
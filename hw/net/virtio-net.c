@@ -16,15 +16,20 @@
 #include "net/net.h"
 #include "net/checksum.h"
 #include "net/tap.h"
+#include "net/gro.h"
 #include "qemu/error-report.h"
 #include "qemu/timer.h"
 #include "hw/virtio/virtio-net.h"
 #include "net/vhost_net.h"
 #include "hw/virtio/virtio-bus.h"
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+# include "dataplane/virtio-net.h"
+#endif
 
 #define VIRTIO_NET_VM_VERSION    11
 
 #define MAC_TABLE_ENTRIES    64
+#define VIRTIO_NET_TX_BATCH  32   /* packets handed to the peer at once */
 #define MAX_VLAN    (1 << 12)   /* Per 802.1Q definition */
 
 /*
@@ -136,6 +141,49 @@ static void virtio_net_vhost_status(VirtIONet *n, uint8_t status)
     }
 }
 
+/* Returns true if vhost or the dataplane own the virtqueues */
+static bool virtio_net_backend_started(VirtIONet *n)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        return true;
+    }
+#endif
+    return n->vhost_started;
+}
+
+static void virtio_net_dataplane_status(VirtIONet *n, uint8_t status)
+{
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    int queues = n->multiqueue ? n->curr_queues : 1;
+    bool run = virtio_net_started(n, status);
+    int r;
+
+    if (!n->dataplane) {
+        return;
+    }
+
+    /* Restart when the guest changes the number of queues */
+    if (n->dataplane_queues == (run ? queues : 0)) {
+        return;
+    }
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_stop(n->dataplane);
+        n->dataplane_queues = 0;
+    }
+    if (run) {
+        /* Set before starting, masking the guest notifiers needs it */
+        n->dataplane_queues = queues;
+        r = virtio_net_data_plane_start(n->dataplane, queues);
+        if (r < 0) {
+            error_report("unable to start virtio-net dataplane: %d: "
+                         "falling back on userspace virtio", -r);
+            n->dataplane_queues = 0;
+        }
+    }
+#endif
+}
+
 static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
@@ -144,6 +192,7 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
     uint8_t queue_status;
 
     virtio_net_vhost_status(n, status);
+    virtio_net_dataplane_status(n, status);
 
     for (i = 0; i < n->max_queues; i++) {
         q = &n->vqs[i];
@@ -158,7 +207,8 @@ static void virtio_net_set_status(struct VirtIODevice *vdev, uint8_t status)
             continue;
         }
 
-        if (virtio_net_started(n, queue_status) && !n->vhost_started) {
+        if (virtio_net_started(n, queue_status) &&
+            !virtio_net_backend_started(n)) {
             if (q->tx_timer) {
                 qemu_mod_timer(q->tx_timer,
                                qemu_get_clock_ns(vm_clock) + n->tx_timeout);
@@ -195,6 +245,21 @@ static void virtio_net_set_link_status(NetClientState *nc)
 static void virtio_net_reset(VirtIODevice *vdev)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
+    int i;
+
+    /* A queued tx packet still points into guest memory, drop it */
+    for (i = 0; i < n->max_queues; i++) {
+        VirtIONetQueue *q = &n->vqs[i];
+
+        qemu_purge_queued_packets(qemu_get_subqueue(n->nic, i));
+        if (q->gro) {
+            net_gro_purge(q->gro);
+        }
+        if (q->async_tx.elem.out_num) {
+            virtqueue_discard(q->tx_vq, &q->async_tx.elem, 0);
+            q->async_tx.elem.out_num = 0;
+        }
+    }
 
     /* Reset back to compatibility mode */
     n->promisc = 1;
@@ -324,9 +389,12 @@ static uint32_t virtio_net_get_features(VirtIODevice *vdev, uint32_t features)
         features &= ~(0x1 << VIRTIO_NET_F_HOST_TSO6);
         features &= ~(0x1 << VIRTIO_NET_F_HOST_ECN);
 
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
-        features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO6);
+        /* Unless we build large frames ourselves */
+        if (!n->net_conf.gro) {
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_CSUM);
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO4);
+            features &= ~(0x1 << VIRTIO_NET_F_GUEST_TSO6);
+        }
         features &= ~(0x1 << VIRTIO_NET_F_GUEST_ECN);
     }
 
@@ -607,6 +675,13 @@ static void virtio_net_handle_rx(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     int queue_index = vq2q(virtio_get_queue_index(vq));
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_notify(n->dataplane, vq);
+        return;
+    }
+#endif
+
     qemu_flush_queued_packets(qemu_get_subqueue(n->nic, queue_index));
 }
 
@@ -683,7 +758,8 @@ static void work_around_broken_dhclient(struct virtio_net_hdr *hdr,
 }
 
 static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
-                           const void *buf, size_t size)
+                           const void *buf, size_t size,
+                           const struct virtio_net_hdr *gro_hdr)
 {
     if (n->has_vnet_hdr) {
         /* FIXME this cast is evil */
@@ -691,6 +767,8 @@ static void receive_header(VirtIONet *n, const struct iovec *iov, int iov_cnt,
         work_around_broken_dhclient(wbuf, wbuf + n->host_hdr_len,
                                     size - n->host_hdr_len);
         iov_from_buf(iov, iov_cnt, 0, buf, sizeof(struct virtio_net_hdr));
+    } else if (gro_hdr) {
+        iov_from_buf(iov, iov_cnt, 0, gro_hdr, sizeof(*gro_hdr));
     } else {
         struct virtio_net_hdr hdr = {
             .flags = 0,
@@ -751,7 +829,13 @@ static int receive_filter(VirtIONet *n, const uint8_t *buf, int size)
     return 0;
 }
 
-static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+/* Copy one packet into the rx queue.  The used elements are filled but not
+ * flushed; *filled counts them across the packets of a burst.  @gro_hdr
+ * describes a frame built by receive coalescing, NULL otherwise.
+ */
+static ssize_t virtio_net_receive_one(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, unsigned *filled,
+                                      const struct virtio_net_hdr *gro_hdr)
 {
     VirtIONet *n = qemu_get_nic_opaque(nc);
     VirtIONetQueue *q = virtio_net_get_subqueue(nc);
@@ -807,7 +891,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                                     sizeof(mhdr.num_buffers));
             }
 
-            receive_header(n, sg, elem.in_num, buf, size);
+            receive_header(n, sg, elem.in_num, buf, size, gro_hdr);
             offset = n->host_hdr_len;
             total += n->guest_hdr_len;
             guest_offset = n->guest_hdr_len;
@@ -835,7 +919,7 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
         }
 
         /* signal other side */
-        virtqueue_fill(q->rx_vq, &elem, total, i++);
+        virtqueue_fill(q->rx_vq, &elem, total, *filled + i++);
     }
 
     if (mhdr_cnt) {
@@ -845,12 +929,179 @@ static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t
                      &mhdr.num_buffers, sizeof mhdr.num_buffers);
     }
 
-    virtqueue_flush(q->rx_vq, i);
-    virtio_notify(vdev, q->rx_vq);
-
+    *filled += i;
     return size;
 }
 
+/* Software receive coalescing is only worth it when the peer cannot hand
+ * us large frames itself, and only possible if the guest takes them.
+ */
+static int virtio_net_gro_types(VirtIONet *n)
+{
+    uint32_t features = VIRTIO_DEVICE(n)->guest_features;
+    int types = 0;
+
+    if (!n->net_conf.gro || n->has_vnet_hdr || !n->mergeable_rx_bufs ||
+        !(features & (1 << VIRTIO_NET_F_GUEST_CSUM))) {
+        return 0;
+    }
+    if (features & (1 << VIRTIO_NET_F_GUEST_TSO4)) {
+        types |= NET_GRO_TCPV4;
+    }
+    if (features & (1 << VIRTIO_NET_F_GUEST_TSO6)) {
+        types |= NET_GRO_TCPV6;
+    }
+    return types;
+}
+
+typedef struct VirtIONetGROFlush {
+    NetClientState *nc;
+    unsigned *filled;
+} VirtIONetGROFlush;
+
+static void virtio_net_gro_output(void *opaque, const uint8_t *buf,
+                                  size_t size, const struct virtio_net_hdr *hdr)
+{
+    VirtIONetGROFlush *s = opaque;
+
+    virtio_net_receive_one(s->nc, buf, size, s->filled, hdr);
+}
+
+static void virtio_net_gro_flush(VirtIONetQueue *q, unsigned *filled)
+{
+    VirtIONet *n = q->n;
+    VirtIONetGROFlush s = {
+        .nc = qemu_get_subqueue(n->nic, q - n->vqs),
+        .filled = filled,
+    };
+
+    net_gro_flush(q->gro, virtio_net_gro_types(n), virtio_net_gro_output, &s);
+}
+
+/* Frames from peers that deliver one at a time are held until the main
+ * loop has run the other handlers, so a burst can still be coalesced.
+ */
+static void virtio_net_gro_bh(void *opaque)
+{
+    VirtIONetQueue *q = opaque;
+    unsigned filled = 0;
+
+    virtio_net_gro_flush(q, &filled);
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(VIRTIO_DEVICE(q->n), q->rx_vq);
+    }
+}
+
+/* Hold a frame for coalescing if the rx queue has room for it and for
+ * everything held before; held frames are accepted as received.
+ */
+static bool virtio_net_gro_hold(VirtIONetQueue *q, const uint8_t *buf,
+                                size_t size, unsigned *filled)
+{
+    VirtIONet *n = q->n;
+    size_t need;
+
+    if (!q->gro) {
+        q->gro = net_gro_new();
+        q->gro_bh = qemu_bh_new(virtio_net_gro_bh, q);
+    }
+
+    need = net_gro_pending_bytes(q->gro) + size +
+           (net_gro_pending(q->gro) + 1) * n->guest_hdr_len;
+    if (virtio_net_has_buffers(q, need) && net_gro_add(q->gro, buf, size)) {
+        return true;
+    }
+    if (!net_gro_pending(q->gro)) {
+        return false;
+    }
+
+    virtio_net_gro_flush(q, filled);
+    return virtio_net_has_buffers(q, size + n->guest_hdr_len) &&
+           net_gro_add(q->gro, buf, size);
+}
+
+static ssize_t virtio_net_receive_gro(NetClientState *nc, const uint8_t *buf,
+                                      size_t size, unsigned *filled)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+
+    if (!virtio_net_can_receive(nc)) {
+        return -1;
+    }
+    if (!receive_filter(n, buf, size)) {
+        return size;
+    }
+    if (virtio_net_gro_hold(q, buf, size, filled)) {
+        return size;
+    }
+    return virtio_net_receive_one(nc, buf, size, filled, NULL);
+}
+
+static ssize_t virtio_net_receive(NetClientState *nc, const uint8_t *buf, size_t size)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    unsigned filled = 0;
+    ssize_t ret;
+
+    if (virtio_net_gro_types(n)) {
+        ret = virtio_net_receive_gro(nc, buf, size, &filled);
+        if (q->gro && net_gro_pending(q->gro)) {
+            qemu_bh_schedule(q->gro_bh);
+        }
+    } else {
+        ret = virtio_net_receive_one(nc, buf, size, &filled, NULL);
+    }
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+    return ret;
+}
+
+/* Receive a burst with a single used ring update and notification */
+static int virtio_net_receive_iov_batch(NetClientState *nc,
+                                        const NetBatchPacket *pkts, int count)
+{
+    VirtIONet *n = qemu_get_nic_opaque(nc);
+    VirtIONetQueue *q = virtio_net_get_subqueue(nc);
+    bool gro = virtio_net_gro_types(n) != 0;
+    unsigned filled = 0;
+    ssize_t ret;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        const uint8_t *buf = pkts[i].iov[0].iov_base;
+        size_t size = pkts[i].iov[0].iov_len;
+        uint8_t buffer[NET_BUFSIZE];
+
+        if (pkts[i].iovcnt != 1) {
+            size = iov_to_buf(pkts[i].iov, pkts[i].iovcnt, 0,
+                              buffer, sizeof(buffer));
+            buf = buffer;
+        }
+        if (gro) {
+            ret = virtio_net_receive_gro(nc, buf, size, &filled);
+        } else {
+            ret = virtio_net_receive_one(nc, buf, size, &filled, NULL);
+        }
+        if (ret == 0) {
+            break;
+        }
+    }
+
+    if (q->gro && net_gro_pending(q->gro)) {
+        virtio_net_gro_flush(q, &filled);
+    }
+    if (filled) {
+        virtqueue_flush(q->rx_vq, filled);
+        virtio_notify(VIRTIO_DEVICE(n), q->rx_vq);
+    }
+    return i;
+}
+
 static int32_t virtio_net_flush_tx(VirtIONetQueue *q);
 
 static void virtio_net_tx_complete(NetClientState *nc, ssize_t len)
@@ -873,7 +1124,6 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
 {
     VirtIONet *n = q->n;
     VirtIODevice *vdev = VIRTIO_DEVICE(n);
-    VirtQueueElement elem;
     int32_t num_packets = 0;
     int queue_index = vq2q(virtio_get_queue_index(q->tx_vq));
     if (!(vdev->status & VIRTIO_CONFIG_S_DRIVER_OK)) {
@@ -887,52 +1137,89 @@ static int32_t virtio_net_flush_tx(VirtIONetQueue *q)
         return num_packets;
     }
 
-    while (virtqueue_pop(q->tx_vq, &elem)) {
-        ssize_t ret, len;
-        unsigned int out_num = elem.out_num;
-        struct iovec *out_sg = &elem.out_sg[0];
+    /* Hand the packets to the peer in bursts of up to VIRTIO_NET_TX_BATCH */
+    while (num_packets < n->tx_burst) {
+        VirtQueueElement *elems = n->tx_elems;
+        NetBatchPacket pkts[VIRTIO_NET_TX_BATCH];
         struct iovec sg[VIRTQUEUE_MAX_SIZE];
+        unsigned int sg_num = 0;
+        int count = 0, sent, i;
 
-        if (out_num < 1) {
-            error_report("virtio-net header not in first element");
-            exit(1);
-        }
+        while (count < VIRTIO_NET_TX_BATCH &&
+               num_packets + count < n->tx_burst) {
+            VirtQueueElement *elem = &elems[count];
+            unsigned int out_num;
+            struct iovec *out_sg;
 
-        /*
-         * If host wants to see the guest header as is, we can
-         * pass it on unchanged. Otherwise, copy just the parts
-         * that host is interested in.
-         */
-        assert(n->host_hdr_len <= n->guest_hdr_len);
-        if (n->host_hdr_len != n->guest_hdr_len) {
-            unsigned sg_num = iov_copy(sg, ARRAY_SIZE(sg),
-                                       out_sg, out_num,
-                                       0, n->host_hdr_len);
-            sg_num += iov_copy(sg + sg_num, ARRAY_SIZE(sg) - sg_num,
-                             out_sg, out_num,
-                             n->guest_hdr_len, -1);
-            out_num = sg_num;
-            out_sg = sg;
-        }
+            if (!virtqueue_pop(q->tx_vq, elem)) {
+                break;
+            }
+            out_num = elem->out_num;
+            out_sg = &elem->out_sg[0];
 
-        len = n->guest_hdr_len;
+            if (out_num < 1) {
+                error_report("virtio-net header not in first element");
+                exit(1);
+            }
 
-        ret = qemu_sendv_packet_async(qemu_get_subqueue(n->nic, queue_index),
-                                      out_sg, out_num, virtio_net_tx_complete);
-        if (ret == 0) {
-            virtio_queue_set_notification(q->tx_vq, 0);
-            q->async_tx.elem = elem;
-            q->async_tx.len  = len;
-            return -EBUSY;
+            /*
+             * If host wants to see the guest header as is, we can
+             * pass it on unchanged. Otherwise, copy just the parts
+             * that host is interested in.
+             */
+            assert(n->host_hdr_len <= n->guest_hdr_len);
+            if (n->host_hdr_len != n->guest_hdr_len) {
+                /* leave it for the next burst if sg[] is used up */
+                if (count && sg_num + out_num + 1 > ARRAY_SIZE(sg)) {
+                    virtqueue_discard(q->tx_vq, elem, 0);
+                    break;
+                }
+                out_sg = sg + sg_num;
+                out_num = iov_copy(out_sg, ARRAY_SIZE(sg) - sg_num,
+                                   elem->out_sg, elem->out_num,
+                                   0, n->host_hdr_len);
+                out_num += iov_copy(out_sg + out_num,
+                                    ARRAY_SIZE(sg) - sg_num - out_num,
+                                    elem->out_sg, elem->out_num,
+                                    n->guest_hdr_len, -1);
+                sg_num += out_num;
+            }
+
+            pkts[count].iov = out_sg;
+            pkts[count].iovcnt = out_num;
+            count++;
+        }
+
+        if (!count) {
+            break;
         }
 
-        len += ret;
+        /* The elements stay mapped until virtio_net_tx_complete(), so a
+         * packet that has to be queued need not be copied.
+         */
+        sent = qemu_sendv_packet_batch_async(
+                   qemu_get_subqueue(n->nic, queue_index),
+                   QEMU_NET_PACKET_FLAG_ZEROCOPY,
+                   pkts, count, virtio_net_tx_complete);
 
-        virtqueue_push(q->tx_vq, &elem, 0);
-        virtio_notify(vdev, q->tx_vq);
+        for (i = 0; i < sent; i++) {
+            virtqueue_fill(q->tx_vq, &elems[i], 0, i);
+        }
+        if (sent) {
+            virtqueue_flush(q->tx_vq, sent);
+            virtio_notify(vdev, q->tx_vq);
+        }
+        num_packets += sent;
 
-        if (++num_packets >= n->tx_burst) {
-            break;
+        if (sent < count) {
+            /* elems[sent] was queued, the rest goes back to the ring */
+            for (i = count - 1; i > sent; i--) {
+                virtqueue_discard(q->tx_vq, &elems[i], 0);
+            }
+            virtio_queue_set_notification(q->tx_vq, 0);
+            q->async_tx.elem = elems[sent];
+            q->async_tx.len  = n->guest_hdr_len;
+            return -EBUSY;
         }
     }
     return num_packets;
@@ -943,6 +1230,13 @@ static void virtio_net_handle_tx_timer(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_notify(n->dataplane, vq);
+        return;
+    }
+#endif
+
     /* This happens when device was stopped but VCPU wasn't. */
     if (!vdev->vm_running) {
         q->tx_waiting = 1;
@@ -967,6 +1261,13 @@ static void virtio_net_handle_tx_bh(VirtIODevice *vdev, VirtQueue *vq)
     VirtIONet *n = VIRTIO_NET(vdev);
     VirtIONetQueue *q = &n->vqs[vq2q(virtio_get_queue_index(vq))];
 
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_notify(n->dataplane, vq);
+        return;
+    }
+#endif
+
     if (unlikely(q->tx_waiting)) {
         return;
     }
@@ -1241,6 +1542,7 @@ static NetClientInfo net_virtio_info = {
     .size = sizeof(NICState),
     .can_receive = virtio_net_can_receive,
     .receive = virtio_net_receive,
+    .receive_iov_batch = virtio_net_receive_iov_batch,
         .cleanup = virtio_net_cleanup,
     .link_status_changed = virtio_net_set_link_status,
 };
@@ -1249,6 +1551,11 @@ static bool virtio_net_guest_notifier_pending(VirtIODevice *vdev, int idx)
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        return virtio_net_data_plane_pending(n->dataplane, idx);
+    }
+#endif
     assert(n->vhost_started);
     return vhost_net_virtqueue_pending(tap_get_vhost_net(nc->peer), idx);
 }
@@ -1258,6 +1565,12 @@ static void virtio_net_guest_notifier_mask(VirtIODevice *vdev, int idx,
 {
     VirtIONet *n = VIRTIO_NET(vdev);
     NetClientState *nc = qemu_get_subqueue(n->nic, vq2q(idx));
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (n->dataplane_queues) {
+        virtio_net_data_plane_mask(n->dataplane, idx, mask);
+        return;
+    }
+#endif
     assert(n->vhost_started);
     vhost_net_virtqueue_mask(tap_get_vhost_net(nc->peer),
                              vdev, idx, mask);
@@ -1287,6 +1600,7 @@ static int virtio_net_device_init(VirtIODevice *vdev)
 
     n->max_queues = MAX(n->nic_conf.queues, 1);
     n->vqs = g_malloc0(sizeof(VirtIONetQueue) * n->max_queues);
+    n->tx_elems = g_new(VirtQueueElement, VIRTIO_NET_TX_BATCH);
     n->vqs[0].rx_vq = virtio_add_queue(vdev, 256, virtio_net_handle_rx);
     n->curr_queues = 1;
     n->vqs[0].n = n;
@@ -1317,6 +1631,20 @@ static int virtio_net_device_init(VirtIODevice *vdev)
 
     n->nic = qemu_new_nic(&net_virtio_info, &n->nic_conf,
                           object_get_typename(OBJECT(qdev)), qdev->id, n);
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    if (!virtio_net_data_plane_create(n, &n->dataplane)) {
+        qemu_del_nic(n->nic);
+        if (n->vqs[0].tx_timer) {
+            qemu_free_timer(n->vqs[0].tx_timer);
+        } else {
+            qemu_bh_delete(n->vqs[0].tx_bh);
+        }
+        g_free(n->tx_elems);
+        g_free(n->vqs);
+        virtio_cleanup(vdev);
+        return -1;
+    }
+#endif
     peer_test_vnet_hdr(n);
     if (peer_has_vnet_hdr(n)) {
         for (i = 0; i < n->max_queues; i++) {
@@ -1354,6 +1682,10 @@ static int virtio_net_device_exit(DeviceState *qdev)
 
     /* This will stop vhost backend if appropriate. */
     virtio_net_set_status(vdev, 0);
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    virtio_net_data_plane_destroy(n->dataplane);
+    n->dataplane = NULL;
+#endif
 
     unregister_savevm(qdev, "virtio-net", n);
 
@@ -1365,6 +1697,10 @@ static int virtio_net_device_exit(DeviceState *qdev)
         NetClientState *nc = qemu_get_subqueue(n->nic, i);
 
         qemu_purge_queued_packets(nc);
+        if (q->gro) {
+            qemu_bh_delete(q->gro_bh);
+            net_gro_free(q->gro);
+        }
 
         if (q->tx_timer) {
             qemu_del_timer(q->tx_timer);
@@ -1374,6 +1710,7 @@ static int virtio_net_device_exit(DeviceState *qdev)
         }
     }
 
+    g_free(n->tx_elems);
     g_free(n->vqs);
     qemu_del_nic(n->nic);
     virtio_cleanup(vdev);
@@ -1398,6 +1735,10 @@ static Property virtio_net_properties[] = {
                                                TX_TIMER_INTERVAL),
     DEFINE_PROP_INT32("x-txburst", VirtIONet, net_conf.txburst, TX_BURST),
     DEFINE_PROP_STRING("tx", VirtIONet, net_conf.tx),
+    DEFINE_PROP_BIT("x-gro", VirtIONet, net_conf.gro, 0, false),
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    DEFINE_PROP_BIT("x-data-plane", VirtIONet, net_conf.data_plane, 0, false),
+#endif
     DEFINE_PROP_END_OF_LIST(),
 };
 
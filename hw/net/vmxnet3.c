@@ -236,6 +236,13 @@ typedef struct {
     bool is_asserted;
 } Vmxnet3IntState;
 
+/* Interrupt moderation state, re-read from the driver after migration */
+typedef struct {
+    uint8_t level;      /* UPT1_IML_* requested by the driver */
+    bool is_deferred;   /* assertion postponed until next */
+    int64_t next;       /* ns; no assertion before this time */
+} Vmxnet3IntModeration;
+
 typedef struct {
         PCIDevice parent_obj;
         NICState *nic;
@@ -300,6 +307,9 @@ typedef struct {
         uint32_t link_status_and_speed;
 
         Vmxnet3IntState interrupt_states[VMXNET3_MAX_INTRS];
+        Vmxnet3IntModeration int_moderation[VMXNET3_MAX_INTRS];
+        QEMUTimer *int_moderation_timer;
+        bool mitigation;
 
         uint32_t temp_mac;   /* To store the low part first */
 
@@ -359,6 +369,81 @@ static void _vmxnet3_deassert_interrupt_line(VMXNET3State *s, int lidx)
     qemu_set_irq(d->irq[lidx], 0);
 }
 
+/* Minimum interval between interrupts for moderation levels 1..7, in ns */
+static const int64_t vmxnet3_int_mod_interval[UPT1_IML_HIGHEST + 1] = {
+    [UPT1_IML_NONE] = 0,
+    [1] = 10 * SCALE_US,
+    [2] = 20 * SCALE_US,
+    [3] = 33 * SCALE_US,
+    [4] = 50 * SCALE_US,
+    [5] = 83 * SCALE_US,
+    [6] = 125 * SCALE_US,
+    [UPT1_IML_HIGHEST] = 250 * SCALE_US,
+};
+
+static int64_t vmxnet3_int_mod_interval_ns(VMXNET3State *s, int lidx)
+{
+    uint8_t level = s->int_moderation[lidx].level;
+    int64_t interval;
+
+    if (level == UPT1_IML_ADAPTIVE) {
+        interval = qemu_nic_adaptive_delay(s->nic);
+    } else if (level <= UPT1_IML_HIGHEST) {
+        interval = vmxnet3_int_mod_interval[level];
+    } else {
+        interval = 0;
+    }
+    s->nic->stats.moderation_delay = interval;
+    return interval;
+}
+
+static void vmxnet3_arm_int_moderation_timer(VMXNET3State *s)
+{
+    int64_t next = INT64_MAX;
+    int i;
+
+    for (i = 0; i < VMXNET3_MAX_INTRS; i++) {
+        if (s->int_moderation[i].is_deferred) {
+            next = MIN(next, s->int_moderation[i].next);
+        }
+    }
+
+    if (next == INT64_MAX) {
+        qemu_del_timer(s->int_moderation_timer);
+    } else {
+        qemu_mod_timer(s->int_moderation_timer, next);
+    }
+}
+
+/*
+ * Returns true if asserting interrupt @lidx now would exceed the rate
+ * allowed by its moderation level; the timer asserts it later.
+ */
+static bool vmxnet3_defer_interrupt(VMXNET3State *s, int lidx)
+{
+    Vmxnet3IntModeration *m = &s->int_moderation[lidx];
+    int64_t now;
+
+    if (!s->mitigation || m->level == UPT1_IML_NONE) {
+        return false;
+    }
+
+    now = qemu_get_clock_ns(vm_clock);
+    if (now < m->next) {
+        if (!m->is_deferred) {
+            VMW_IRPRN("Deferring interrupt %d by %" PRId64 " ns",
+                      lidx, m->next - now);
+            m->is_deferred = true;
+            vmxnet3_arm_int_moderation_timer(s);
+        }
+        return true;
+    }
+
+    m->is_deferred = false;
+    m->next = now + vmxnet3_int_mod_interval_ns(s, lidx);
+    return false;
+}
+
 static void vmxnet3_update_interrupt_line_state(VMXNET3State *s, int lidx)
 {
     if (!s->interrupt_states[lidx].is_pending &&
@@ -372,7 +457,11 @@ static void vmxnet3_update_interrupt_line_state(VMXNET3State *s, int lidx)
     if (s->interrupt_states[lidx].is_pending &&
        !s->interrupt_states[lidx].is_masked &&
        !s->interrupt_states[lidx].is_asserted) {
+        if (vmxnet3_defer_interrupt(s, lidx)) {
+            return;
+        }
         VMW_IRPRN("New interrupt line state for index %d is UP", lidx);
+        s->nic->stats.interrupts++;
         s->interrupt_states[lidx].is_asserted =
             _vmxnet3_assert_interrupt_line(s, lidx);
         s->interrupt_states[lidx].is_pending = false;
@@ -383,6 +472,11 @@ static void vmxnet3_update_interrupt_line_state(VMXNET3State *s, int lidx)
 static void vmxnet3_trigger_interrupt(VMXNET3State *s, int lidx)
 {
     PCIDevice *d = PCI_DEVICE(s);
+
+    if (s->interrupt_states[lidx].is_pending ||
+        s->interrupt_states[lidx].is_asserted) {
+        s->nic->stats.coalesced++;
+    }
     s->interrupt_states[lidx].is_pending = true;
     vmxnet3_update_interrupt_line_state(s, lidx);
 
@@ -401,6 +495,22 @@ do_automask:
     vmxnet3_update_interrupt_line_state(s, lidx);
 }
 
+static void vmxnet3_int_moderation_timer(void *opaque)
+{
+    VMXNET3State *s = opaque;
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    int i;
+
+    for (i = 0; i < VMXNET3_MAX_INTRS; i++) {
+        if (s->int_moderation[i].is_deferred &&
+            now >= s->int_moderation[i].next) {
+            s->int_moderation[i].is_deferred = false;
+            vmxnet3_update_interrupt_line_state(s, i);
+        }
+    }
+    vmxnet3_arm_int_moderation_timer(s);
+}
+
 static bool vmxnet3_interrupt_asserted(VMXNET3State *s, int lidx)
 {
     return s->interrupt_states[lidx].is_asserted;
@@ -1121,6 +1231,23 @@ static void vmxnet3_reset_interrupt_states(VMXNET3State *s)
         s->interrupt_states[i].is_pending = false;
         s->interrupt_states[i].is_masked = true;
     }
+    memset(s->int_moderation, 0, sizeof(s->int_moderation));
+    qemu_del_timer(s->int_moderation_timer);
+}
+
+static void vmxnet3_read_int_moderation_levels(VMXNET3State *s)
+{
+    uint8_t levels[VMXNET3_MAX_INTRS];
+    int i;
+
+    VMXNET3_READ_DRV_SHARED(s->drv_shmem, devRead.intrConf.modLevels,
+                            levels, sizeof(levels));
+    for (i = 0; i < VMXNET3_MAX_INTRS; i++) {
+        s->int_moderation[i].level = levels[i];
+        s->int_moderation[i].is_deferred = false;
+        s->int_moderation[i].next = 0;
+    }
+    qemu_del_timer(s->int_moderation_timer);
 }
 
 static void vmxnet3_reset_mac(VMXNET3State *s)
@@ -1338,6 +1465,8 @@ static void vmxnet3_activate_device(VMXNET3State *s)
         VMXNET3_READ_DRV_SHARED8(s->drv_shmem, devRead.intrConf.autoMask);
     VMW_CFPRN("Automatic interrupt masking is %d", (int)s->auto_int_masking);
 
+    vmxnet3_read_int_moderation_levels(s);
+
     s->txq_num =
         VMXNET3_READ_DRV_SHARED8(s->drv_shmem, devRead.misc.numTxQueues);
     s->rxq_num =
@@ -1916,6 +2045,7 @@ static void vmxnet3_net_init(VMXNET3State *s)
     s->nic = qemu_new_nic(&net_vmxnet3_info, &s->conf,
                           object_get_typename(OBJECT(s)),
                           d->id, s);
+    s->nic->stats.counts_interrupts = true;
 
     s->peer_has_vhdr = vmxnet3_peer_has_vnet_hdr(s);
     s->tx_sop = true;
@@ -2088,6 +2218,8 @@ static int vmxnet3_pci_init(PCIDevice *pci_dev)
     pci_register_bar(pci_dev, VMXNET3_MSIX_BAR_IDX,
                      PCI_BASE_ADDRESS_SPACE_MEMORY, &s->msix_bar);
 
+    s->int_moderation_timer =
+        qemu_new_timer_ns(vm_clock, vmxnet3_int_moderation_timer, s);
     vmxnet3_reset_interrupt_states(s);
 
     /* Interrupt pin A */
@@ -2123,6 +2255,9 @@ static void vmxnet3_pci_uninit(PCIDevice *pci_dev)
 
     vmxnet3_net_uninit(s);
 
+    qemu_del_timer(s->int_moderation_timer);
+    qemu_free_timer(s->int_moderation_timer);
+
     vmxnet3_cleanup_msix(s);
 
     vmxnet3_cleanup_msi(s);
@@ -2322,6 +2457,7 @@ static int vmxnet3_post_load(void *opaque, int version_id)
 {
     VMXNET3State *s = opaque;
     PCIDevice *d = PCI_DEVICE(s);
+    int i;
 
     vmxnet_tx_pkt_init(&s->tx_pkt, s->max_tx_frags, s->peer_has_vhdr);
     vmxnet_rx_pkt_init(&s->rx_pkt, s->peer_has_vhdr);
@@ -2335,6 +2471,17 @@ static int vmxnet3_post_load(void *opaque, int version_id)
         }
     }
 
+    /*
+     * Moderation levels live in guest memory; interrupts that were held
+     * back when the state was saved are delivered now.
+     */
+    if (s->device_active) {
+        vmxnet3_read_int_moderation_levels(s);
+        for (i = 0; i < VMXNET3_MAX_INTRS; i++) {
+            vmxnet3_update_interrupt_line_state(s, i);
+        }
+    }
+
     return 0;
 }
 
@@ -2432,6 +2579,7 @@ vmxnet3_write_config(PCIDevice *pci_dev, uint32_t addr, uint32_t val, int len)
 
 static Property vmxnet3_properties[] = {
     DEFINE_NIC_PROPERTIES(VMXNET3State, conf),
+    DEFINE_PROP_BOOL("mitigation", VMXNET3State, mitigation, true),
     DEFINE_PROP_END_OF_LIST(),
 };
 
@@ -39,8 +39,11 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
 
     vring_init(&vring->vr, virtio_queue_get_num(vdev, n), vring_ptr, 4096);
 
-    vring->last_avail_idx = 0;
-    vring->last_used_idx = 0;
+    /* Pick up where the device model left off, it may have run the
+     * virtqueue before (e.g. across a stop/cont of the dataplane).
+     */
+    vring->last_avail_idx = virtio_queue_get_last_avail_idx(vdev, n);
+    vring->last_used_idx = vring->vr.used->idx;
     vring->signalled_used = 0;
     vring->signalled_used_valid = false;
 
@@ -49,8 +52,9 @@ bool vring_setup(Vring *vring, VirtIODevice *vdev, int n)
     return true;
 }
 
-void vring_teardown(Vring *vring)
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n)
 {
+    virtio_queue_set_last_avail_idx(vdev, n, vring->last_avail_idx);
     hostmem_finalize(&vring->hostmem);
 }
 
@@ -337,10 +341,12 @@ int vring_pop(VirtIODevice *vdev, Vring *vring,
  *
  * Stolen from linux/drivers/vhost/vhost.c.
  */
-void vring_push(Vring *vring, unsigned int head, int len)
+/* Fill in the @idx-th used element of a batch; the guest sees it only after
+ * vring_flush()
+ */
+void vring_fill(Vring *vring, unsigned int head, int len, unsigned int idx)
 {
     struct vring_used_elem *used;
-    uint16_t new;
 
     /* Don't touch vring if a fatal error occurred */
     if (vring->broken) {
@@ -349,15 +355,35 @@ void vring_push(Vring *vring, unsigned int head, int len)
 
     /* The virtqueue contains a ring of used buffers.  Get a pointer to the
      * next entry in that used ring. */
-    used = &vring->vr.used->ring[vring->last_used_idx % vring->vr.num];
+    idx = (uint16_t)(vring->last_used_idx + idx);
+    used = &vring->vr.used->ring[idx % vring->vr.num];
     used->id = head;
     used->len = len;
+}
+
+/* Make @count used elements filled with vring_fill() visible to the guest */
+void vring_flush(Vring *vring, unsigned int count)
+{
+    uint16_t old, new;
+
+    /* Don't touch vring if a fatal error occurred */
+    if (vring->broken) {
+        return;
+    }
 
     /* Make sure buffer is written before we update index. */
     smp_wmb();
 
-    new = vring->vr.used->idx = ++vring->last_used_idx;
-    if (unlikely((int16_t)(new - vring->signalled_used) < (uint16_t)1)) {
+    old = vring->last_used_idx;
+    new = vring->vr.used->idx = vring->last_used_idx = old + count;
+    if (unlikely((int16_t)(new - vring->signalled_used) <
+                 (uint16_t)(new - old))) {
         vring->signalled_used_valid = false;
     }
 }
+
+void vring_push(Vring *vring, unsigned int head, int len)
+{
+    vring_fill(vring, head, len, 0);
+    vring_flush(vring, 1);
+}
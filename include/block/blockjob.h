@@ -103,6 +103,15 @@ struct BlockJob {
     /** Speed that was set with @block_job_set_speed.  */
     int64_t speed;
 
+    /** Throughput that is published by the query-block-jobs QMP API */
+    int64_t throughput;
+
+    /** Bytes accounted with @block_job_account since @rate_start_ns.  */
+    int64_t rate_bytes;
+
+    /** Start of the current throughput sample, or 0 if none was taken.  */
+    int64_t rate_start_ns;
+
     /** The completion function that will be called when the job completes.  */
     BlockDriverCompletionFunc *cb;
 
@@ -143,6 +152,17 @@ void *block_job_create(const BlockJobType *job_type, BlockDriverState *bs,
  */
 void block_job_sleep_ns(BlockJob *job, QEMUClock *clock, int64_t ns);
 
+/**
+ * block_job_account:
+ * @job: The job that calls the function.
+ * @bytes: How many bytes were copied.
+ *
+ * Account @bytes towards the throughput that query-block-jobs reports
+ * for @job.  Jobs that never call this function do not report any
+ * throughput.
+ */
+void block_job_account(BlockJob *job, int64_t bytes);
+
 /**
  * block_job_completed:
  * @job: The job being completed.
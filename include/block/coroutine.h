@@ -137,6 +137,14 @@ bool qemu_co_queue_next(CoQueue *queue);
  */
 void qemu_co_queue_restart_all(CoQueue *queue);
 
+/**
+ * Enter the next coroutine in the queue right away, instead of scheduling
+ * it like qemu_co_queue_next() does.
+ *
+ * Returns true if a coroutine was entered, false if the queue is empty.
+ */
+bool qemu_co_enter_next(CoQueue *queue);
+
 /**
  * Checks if the CoQueue is empty.
  */
@@ -55,7 +55,21 @@ void qemu_put_ram_ptr(void *addr);
 /* This should not be used by devices.  */
 int qemu_ram_addr_from_host(void *ptr, ram_addr_t *ram_addr);
 ram_addr_t qemu_ram_addr_from_host_nofail(void *ptr);
+/* @anonymous is true if the block is private anonymous memory that QEMU
+ * allocated itself, as opposed to -mem-path or preallocated device memory.
+ */
+typedef int (RAMBlockIterFunc)(const char *idstr, void *host_addr,
+                               ram_addr_t offset, ram_addr_t length,
+                               bool anonymous, void *opaque);
+int qemu_ram_foreach_block(RAMBlockIterFunc *func, void *opaque);
 void qemu_ram_set_idstr(ram_addr_t addr, const char *name, DeviceState *dev);
+/* Call @func on every page whose migration dirty flag was set since the
+ * previous call, clearing the flag.  Returns false, without calling @func,
+ * if the pages are not known; the caller must then scan all of RAM.
+ * Needs the iothread lock.
+ */
+typedef void (DirtyPageFunc)(ram_addr_t addr, void *opaque);
+bool cpu_physical_memory_drain_dirty_log(DirtyPageFunc *func, void *opaque);
 
 void cpu_physical_memory_rw(hwaddr addr, uint8_t *buf,
                             int len, int is_write);
@@ -98,11 +98,38 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
 /* cputlb.c */
 void tlb_flush_page(CPUArchState *env, target_ulong addr);
 void tlb_flush(CPUArchState *env, int flush_global);
+void tlb_run_pending_flush(CPUArchState *env);
+bool cpu_io_lock(CPUArchState *env, uintptr_t retaddr);
 void tlb_set_page(CPUArchState *env, target_ulong vaddr,
                   hwaddr paddr, int prot,
                   int mmu_idx, target_ulong size);
 void tb_invalidate_phys_addr(hwaddr addr);
+
+/* cpus.c */
+bool tcg_multithread_enabled(void);
+bool tcg_iothread_lock(void);
+void tcg_iothread_unlock(bool locked);
+void tcg_iothread_lock_reset(void);
+bool tcg_defer_tb_flush(void);
 #else
+static inline bool tcg_iothread_lock(void)
+{
+    return false;
+}
+
+static inline void tcg_iothread_unlock(bool locked)
+{
+}
+
+static inline void tcg_iothread_lock_reset(void)
+{
+}
+
+static inline bool tcg_defer_tb_flush(void)
+{
+    return false;
+}
+
 static inline void tlb_flush_page(CPUArchState *env, target_ulong addr)
 {
 }
@@ -169,6 +196,7 @@ struct TranslationBlock {
 };
 
 #include "exec/spinlock.h"
+#include "qemu/thread.h"
 
 typedef struct TBContext TBContext;
 
@@ -178,7 +206,7 @@ struct TBContext {
     TranslationBlock *tb_phys_hash[CODE_GEN_PHYS_HASH_SIZE];
     int nb_tbs;
     /* any access to the tbs or the page table must use this lock */
-    spinlock_t tb_lock;
+    QemuMutex tb_lock;
 
     /* statistics */
     int tb_flush_count;
@@ -207,6 +235,9 @@ static inline unsigned int tb_phys_hash_func(tb_page_addr_t pc)
     return (pc >> 2) & (CODE_GEN_PHYS_HASH_SIZE - 1);
 }
 
+void tb_lock(void);
+void tb_unlock(void);
+void tb_lock_reset(void);
 void tb_free(TranslationBlock *tb);
 void tb_flush(CPUArchState *env);
 void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr);
@@ -226,8 +257,10 @@ void ppc_tb_set_jmp_target(unsigned long jmp_addr, unsigned long addr);
 #elif defined(__i386__) || defined(__x86_64__)
 static inline void tb_set_jmp_target1(uintptr_t jmp_addr, uintptr_t addr)
 {
-    /* patch the branch destination */
-    *(uint32_t *)jmp_addr = addr - (jmp_addr + 4);
+    /* patch the branch destination.  The backend emits the displacement
+       4-byte aligned, so another thread running the jump sees either the
+       old or the new target, never a mix of both.  */
+    *(volatile uint32_t *)jmp_addr = addr - (jmp_addr + 4);
     /* no need to flush icache explicitly */
 }
 #elif defined(__arm__)
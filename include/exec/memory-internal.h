@@ -79,10 +79,34 @@ static inline int cpu_physical_memory_get_dirty(ram_addr_t start,
     return ret;
 }
 
+/* While migration tracks dirty memory, pages whose MIGRATION_DIRTY_FLAG
+ * goes from clear to set are logged, so that a bitmap sync only has to
+ * visit the pages dirtied since the previous one.  Like phys_dirty, the
+ * log is protected by the iothread lock.  If it grows too large, it is
+ * dropped and the next sync walks phys_dirty instead.
+ */
+typedef struct DirtyPageLog {
+    ram_addr_t *pages;  /* page frame numbers */
+    size_t len;
+    size_t size;
+    bool enabled;
+    bool overflow;
+} DirtyPageLog;
+
+extern DirtyPageLog dirty_page_log;
+
+void cpu_physical_memory_log_dirty_page(ram_addr_t addr);
+
 static inline int cpu_physical_memory_set_dirty_flags(ram_addr_t addr,
                                                       int dirty_flags)
 {
-    return ram_list.phys_dirty[addr >> TARGET_PAGE_BITS] |= dirty_flags;
+    uint8_t *flags = &ram_list.phys_dirty[addr >> TARGET_PAGE_BITS];
+
+    if (unlikely(dirty_page_log.enabled) &&
+        (dirty_flags & ~*flags & MIGRATION_DIRTY_FLAG)) {
+        cpu_physical_memory_log_dirty_page(addr);
+    }
+    return *flags |= dirty_flags;
 }
 
 static inline void cpu_physical_memory_set_dirty(ram_addr_t addr)
@@ -29,21 +29,26 @@
 
 #else
 
-/* Empty implementations, on the theory that system mode emulation
- * is single-threaded. This means that these functions should only
- * be used from code run in the TCG cpu thread, and cannot protect
- * data structures which might also be accessed from the IO thread
- * or from signal handlers.
+/* System mode can run TCG vCPUs on several threads, but pthreads are
+ * not available on every host.  These locks are only meant for short
+ * sections run by vCPU threads; they cannot protect data structures
+ * which might also be accessed from signal handlers.
  */
 typedef int spinlock_t;
 #define SPIN_LOCK_UNLOCKED 0
 
 static inline void spin_lock(spinlock_t *lock)
 {
+    while (__sync_lock_test_and_set(lock, 1)) {
+        while (*(volatile spinlock_t *)lock) {
+            /* wait until it looks free */
+        }
+    }
 }
 
 static inline void spin_unlock(spinlock_t *lock)
 {
+    __sync_lock_release(lock);
 }
 
 #endif
@@ -49,14 +49,24 @@ static inline void vring_set_broken(Vring *vring)
     vring->broken = true;
 }
 
+/* Give back the last @num descriptor chains returned by vring_pop(), for
+ * devices that find out only later that they cannot use them yet
+ */
+static inline void vring_unpop(Vring *vring, unsigned int num)
+{
+    vring->last_avail_idx -= num;
+}
+
 bool vring_setup(Vring *vring, VirtIODevice *vdev, int n);
-void vring_teardown(Vring *vring);
+void vring_teardown(Vring *vring, VirtIODevice *vdev, int n);
 void vring_disable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_enable_notification(VirtIODevice *vdev, Vring *vring);
 bool vring_should_notify(VirtIODevice *vdev, Vring *vring);
 int vring_pop(VirtIODevice *vdev, Vring *vring,
               struct iovec iov[], struct iovec *iov_end,
               unsigned int *out_num, unsigned int *in_num);
+void vring_fill(Vring *vring, unsigned int head, int len, unsigned int idx);
+void vring_flush(Vring *vring, unsigned int count);
 void vring_push(Vring *vring, unsigned int head, int len);
 
 #endif /* VRING_H */
@@ -68,6 +68,8 @@ typedef struct virtio_net_conf
     uint32_t txtimer;
     int32_t txburst;
     char *tx;
+    uint32_t data_plane;
+    uint32_t gro;
 } virtio_net_conf;
 
 /* Maximum packet size we can receive from tap device: header + 64k */
@@ -149,6 +151,8 @@ typedef struct VirtIONetQueue {
         VirtQueueElement elem;
         ssize_t len;
     } async_tx;
+    struct NetGRO *gro;
+    QEMUBH *gro_bh;
     struct VirtIONet *n;
 } VirtIONetQueue;
 
@@ -161,6 +165,7 @@ typedef struct VirtIONet {
     NICState *nic;
     uint32_t tx_timeout;
     int32_t tx_burst;
+    VirtQueueElement *tx_elems; /* VIRTIO_NET_TX_BATCH elements */
     uint32_t has_vnet_hdr;
     size_t host_hdr_len;
     size_t guest_hdr_len;
@@ -188,6 +193,10 @@ typedef struct VirtIONet {
     uint16_t max_queues;
     uint16_t curr_queues;
     size_t config_size;
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    struct VirtIONetDataPlane *dataplane;
+    uint16_t dataplane_queues;  /* queue pairs run by the dataplane, or 0 */
+#endif
 } VirtIONet;
 
 #define VIRTIO_NET_CTRL_MAC    1
@@ -252,7 +261,8 @@ struct virtio_net_ctrl_mq {
 #define DEFINE_VIRTIO_NET_PROPERTIES(_state, _field)                           \
     DEFINE_PROP_UINT32("x-txtimer", _state, _field.txtimer, TX_TIMER_INTERVAL),\
     DEFINE_PROP_INT32("x-txburst", _state, _field.txburst, TX_BURST),          \
-    DEFINE_PROP_STRING("tx", _state, _field.tx)
+    DEFINE_PROP_STRING("tx", _state, _field.tx),                              \
+    DEFINE_PROP_BIT("x-gro", _state, _field.gro, 0, false)
 
 void virtio_net_set_config_size(VirtIONet *n, uint32_t host_features);
 
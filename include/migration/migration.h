@@ -47,6 +47,19 @@ struct MigrationState
     int64_t dirty_bytes_rate;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size;
+    int compress_level;
+    int compress_thread_count;
+    int decompress_thread_count;
+    int64_t postcopy_after_passes;
+
+    /* post-copy: set by migrate-start-postcopy, read by the migration thread */
+    bool start_postcopy;
+    bool postcopy_running;
+    int64_t postcopy_requests;
+    /* receives page requests from the destination */
+    QemuThread rp_thread;
+    bool rp_thread_created;
+    QemuSemaphore rp_sem;
 };
 
 void process_incoming_migration(QEMUFile *f);
@@ -104,6 +117,14 @@ uint64_t xbzrle_mig_bytes_transferred(void);
 uint64_t xbzrle_mig_pages_transferred(void);
 uint64_t xbzrle_mig_pages_overflow(void);
 uint64_t xbzrle_mig_pages_cache_miss(void);
+uint64_t xbzrle_mig_pages_cache_hit(void);
+uint64_t xbzrle_mig_cache_evictions(void);
+CompressionStats *compress_mig_stats(void);
+uint64_t ram_dirty_sync_count(void);
+
+/* post-copy support in arch_init.c */
+int ram_postcopy_send_discard(QEMUFile *f);
+int ram_save_queue_pages(const char *idstr, uint64_t start, uint64_t len);
 
 /**
  * @migrate_add_blocker - prevent migration from proceeding
@@ -121,10 +142,34 @@ void migrate_del_blocker(Error *reason);
 
 int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
                          uint8_t *dst, int dlen);
+/* xbzrle_encode_buffer uses the fastest of these that the host supports;
+ * they all produce the same stream.
+ */
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                 uint8_t *dst, int dlen);
+#ifdef __SSE2__
+int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen);
+#endif
+#ifdef CONFIG_AVX2_OPT
+int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen);
+bool xbzrle_can_use_avx2(void);
+#endif
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen);
 
 int migrate_use_xbzrle(void);
 int64_t migrate_xbzrle_cache_size(void);
 
+int migrate_use_compression(void);
+int migrate_compress_level(void);
+int migrate_compress_threads(void);
+int migrate_decompress_threads(void);
+void migrate_decompress_threads_join(void);
+
+int migrate_postcopy_ram(void);
+int migrate_send_rp_req_pages(int fd, const char *idstr, uint64_t start,
+                              uint64_t len);
+
 int64_t xbzrle_cache_resize(int64_t new_size);
 #endif
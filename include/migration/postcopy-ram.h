@@ -0,0 +1,42 @@
+/*
+ * Post-copy live migration, destination side RAM handling
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_POSTCOPY_RAM_H
+#define QEMU_POSTCOPY_RAM_H
+
+#include "qemu-common.h"
+
+/* Return true if userfaultfd works and all of guest RAM can be registered */
+bool postcopy_ram_supported_by_host(void);
+
+/* Drop pages of a RAM block that are stale because the source dirtied them
+ * after sending them.  They will be refetched when they are touched.
+ */
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length);
+
+/* Register guest RAM with userfaultfd and start forwarding faults to the
+ * source as page requests on @rp_fd.
+ */
+int postcopy_ram_incoming_init(int rp_fd);
+
+/* Stop catching faults; any page that never arrived reads as zero. */
+void postcopy_ram_incoming_cleanup(void);
+
+/* True between postcopy_ram_incoming_init and postcopy_ram_incoming_cleanup.
+ * Received pages must then be placed with the functions below, because a
+ * plain write to missing guest memory would fault.
+ */
+bool postcopy_ram_incoming_active(void);
+
+/* Atomically fill a missing guest page and wake up any thread waiting on it.
+ * Pages that are already present are left alone.
+ */
+int postcopy_place_page(void *host, const void *from);
+int postcopy_place_zero_page(void *host);
+
+#endif
@@ -42,6 +42,12 @@ typedef struct SaveVMHandlers {
     /* This runs both outside and inside the iothread lock.  */
     bool (*is_active)(void *opaque);
 
+    /* True if the handler can keep iterating after the guest has started
+     * on the destination (post-copy).  Other handlers are completed at
+     * the switch.  This runs both outside and inside the iothread lock.
+     */
+    bool (*has_postcopy)(void *opaque);
+
     /* This runs outside the iothread lock in the migration case, and
      * within the lock in the savevm case.  The callback had better only
      * use data that is local to the migration thread or protected
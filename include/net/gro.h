@@ -0,0 +1,58 @@
+/*
+ * Receive segment coalescing
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#ifndef QEMU_NET_GRO_H
+#define QEMU_NET_GRO_H
+
+#include "qemu-common.h"
+#include "net/tap.h"
+
+/*
+ * A NetGRO collects the frames of a receive burst and coalesces in-order
+ * TCP segments of the same flow into a single large frame, described by a
+ * virtio-net header (NEEDS_CSUM plus TCPV4 or TCPV6 GSO) the way a tap
+ * device with offloads would have delivered it.  Everything else is passed
+ * through unchanged and in order.
+ */
+
+typedef struct NetGRO NetGRO;
+
+typedef struct NetGROStats {
+    uint64_t frames_in;     /* frames added */
+    uint64_t frames_out;    /* frames passed to the output callback */
+    uint64_t merged;        /* large frames built from several segments */
+    uint64_t segments;      /* segments absorbed into those frames */
+    uint64_t bad_csum;      /* TCP segments passed through for bad checksum */
+} NetGROStats;
+
+/* GSO types the receiver accepts, for net_gro_flush */
+#define NET_GRO_TCPV4 (1 << 0)
+#define NET_GRO_TCPV6 (1 << 1)
+
+/* @hdr is NULL for frames that are passed through unchanged */
+typedef void (NetGROOutput)(void *opaque, const uint8_t *buf, size_t size,
+                            const struct virtio_net_hdr *hdr);
+
+NetGRO *net_gro_new(void);
+void net_gro_free(NetGRO *gro);
+
+/* Copy a frame into the pending burst; false if it does not fit */
+bool net_gro_add(NetGRO *gro, const uint8_t *buf, size_t size);
+
+int net_gro_pending(NetGRO *gro);
+size_t net_gro_pending_bytes(NetGRO *gro);
+
+/* Coalesce the pending frames, pass them to @output and empty the burst */
+void net_gro_flush(NetGRO *gro, int gso_types,
+                   NetGROOutput *output, void *opaque);
+void net_gro_purge(NetGRO *gro);
+
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats);
+
+#endif /* QEMU_NET_GRO_H */
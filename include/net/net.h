@@ -46,6 +46,7 @@ typedef void (NetPoll)(NetClientState *, bool enable);
 typedef int (NetCanReceive)(NetClientState *);
 typedef ssize_t (NetReceive)(NetClientState *, const uint8_t *, size_t);
 typedef ssize_t (NetReceiveIOV)(NetClientState *, const struct iovec *, int);
+typedef int (NetReceiveIOVBatch)(NetClientState *, const NetBatchPacket *, int);
 typedef void (NetCleanup) (NetClientState *);
 typedef void (LinkStatusChanged)(NetClientState *);
 typedef void (NetClientDestructor)(NetClientState *);
@@ -56,6 +57,7 @@ typedef struct NetClientInfo {
     NetReceive *receive;
     NetReceive *receive_raw;
     NetReceiveIOV *receive_iov;
+    NetReceiveIOVBatch *receive_iov_batch;
     NetCanReceive *can_receive;
     NetCleanup *cleanup;
     LinkStatusChanged *link_status_changed;
@@ -76,11 +78,28 @@ struct NetClientState {
     unsigned int queue_index;
 };
 
+/* Counters reported by query-nic-stats.  Packets are counted by the net
+ * layer; interrupts only by models that set counts_interrupts.
+ */
+typedef struct NICStats {
+    uint64_t rx_packets;
+    uint64_t tx_packets;
+    uint64_t interrupts;
+    uint64_t coalesced;         /* interrupt causes folded into a pending one */
+    uint64_t moderation_delay;  /* current minimum interval, in ns */
+    bool counts_interrupts;
+} NICStats;
+
 typedef struct NICState {
     NetClientState *ncs;
     NICConf *conf;
     void *opaque;
     bool peer_deleted;
+    NICStats stats;
+    /* packet rate estimate for qemu_nic_adaptive_delay() */
+    int64_t adaptive_time;
+    uint64_t adaptive_packets;
+    int64_t adaptive_delay;
 } NICState;
 
 NetClientState *qemu_find_netdev(const char *id);
@@ -100,6 +119,7 @@ NetClientState *qemu_get_subqueue(NICState *nic, int queue_index);
 NetClientState *qemu_get_queue(NICState *nic);
 NICState *qemu_get_nic(NetClientState *nc);
 void *qemu_get_nic_opaque(NetClientState *nc);
+int64_t qemu_nic_adaptive_delay(NICState *nic);
 void qemu_del_net_client(NetClientState *nc);
 NetClientState *qemu_find_vlan_client_by_name(Monitor *mon, int vlan_id,
                                               const char *client_str);
@@ -110,6 +130,12 @@ ssize_t qemu_sendv_packet(NetClientState *nc, const struct iovec *iov,
                           int iovcnt);
 ssize_t qemu_sendv_packet_async(NetClientState *nc, const struct iovec *iov,
                                 int iovcnt, NetPacketSent *sent_cb);
+int qemu_sendv_packet_batch_async(NetClientState *nc, unsigned flags,
+                                  const NetBatchPacket *pkts, int count,
+                                  NetPacketSent *sent_cb);
+ssize_t qemu_sendv_packet_shared(NetClientState *nc,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketData **shared);
 void qemu_send_packet(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_raw(NetClientState *nc, const uint8_t *buf, int size);
 ssize_t qemu_send_packet_async(NetClientState *nc, const uint8_t *buf,
@@ -133,6 +159,11 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
                             const struct iovec *iov,
                             int iovcnt,
                             void *opaque);
+int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                  unsigned flags,
+                                  const NetBatchPacket *pkts,
+                                  int count,
+                                  void *opaque);
 
 void print_net_client(Monitor *mon, NetClientState *nc);
 void do_info_network(Monitor *mon, const QDict *qdict);
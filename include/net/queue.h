@@ -27,12 +27,28 @@
 #include "qemu-common.h"
 
 typedef struct NetPacket NetPacket;
+typedef struct NetPacketData NetPacketData;
 typedef struct NetQueue NetQueue;
 
+typedef struct NetQueueStats {
+    uint64_t queued;        /* packets that had to be queued */
+    uint64_t zerocopy;      /* ... and were left in the sender's buffers */
+    uint64_t shared;        /* ... and reused a copy made for another queue */
+    uint64_t allocs;        /* allocations for queued packets */
+    uint64_t bytes_copied;  /* payload bytes copied into the queue */
+} NetQueueStats;
+
 typedef void (NetPacketSent) (NetClientState *sender, ssize_t ret);
 
+/* One packet of a burst handed over with qemu_net_queue_send_iov_batch() */
+typedef struct NetBatchPacket {
+    const struct iovec *iov;
+    int iovcnt;
+} NetBatchPacket;
+
 #define QEMU_NET_PACKET_FLAG_NONE  0
 #define QEMU_NET_PACKET_FLAG_RAW  (1<<0)
+#define QEMU_NET_PACKET_FLAG_ZEROCOPY  (1<<1)
 
 NetQueue *qemu_new_net_queue(void *opaque);
 
@@ -52,6 +68,23 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
                                 int iovcnt,
                                 NetPacketSent *sent_cb);
 
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetBatchPacket *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb);
+
+ssize_t qemu_net_queue_send_iov_shared(NetQueue *queue,
+                                       NetClientState *sender,
+                                       unsigned flags,
+                                       const struct iovec *iov,
+                                       int iovcnt,
+                                       NetPacketData **shared);
+
+void qemu_net_packet_data_unref(NetPacketData *shared);
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats);
+
 void qemu_net_queue_purge(NetQueue *queue, NetClientState *from);
 bool qemu_net_queue_flush(NetQueue *queue);
 
@@ -106,6 +106,7 @@ static inline char *realpath(const char *path, char *resolved_path)
 
 /* icount */
 void configure_icount(const char *option);
+void configure_tcg_thread(const char *option);
 extern int use_icount;
 
 #include "qemu/osdep.h"
@@ -337,6 +338,7 @@ void qemu_iovec_concat_iov(QEMUIOVector *dst,
                            size_t soffset, size_t sbytes);
 void qemu_iovec_destroy(QEMUIOVector *qiov);
 void qemu_iovec_reset(QEMUIOVector *qiov);
+bool qemu_iovec_is_zero(QEMUIOVector *qiov);
 size_t qemu_iovec_to_buf(QEMUIOVector *qiov, size_t offset,
                          void *buf, size_t bytes);
 size_t qemu_iovec_from_buf(QEMUIOVector *qiov, size_t offset,
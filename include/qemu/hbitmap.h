@@ -117,6 +117,36 @@ void hbitmap_reset(HBitmap *hb, uint64_t start, uint64_t count);
  */
 bool hbitmap_get(const HBitmap *hb, uint64_t item);
 
+/**
+ * hbitmap_serialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer to store the bits in.
+ * @start: First bit to store (0-based).  Must be a multiple of eight
+ * times 2^granularity.
+ * @count: Number of bits to store.
+ *
+ * Store a range of an HBitmap in @buf, one bit per group of 2^granularity
+ * bits, starting with the least significant bit of the first byte.  @buf
+ * must have room for DIV_ROUND_UP(@count >> granularity, 8) bytes; bits
+ * past the end of the HBitmap are stored as zeros.
+ */
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf,
+                       uint64_t start, uint64_t count);
+
+/**
+ * hbitmap_deserialize:
+ * @hb: HBitmap to operate on.
+ * @buf: Buffer that was filled by hbitmap_serialize.
+ * @start: First bit to load (0-based).  Must be a multiple of eight
+ * times 2^granularity.
+ * @count: Number of bits to load.
+ *
+ * Set the bits of an HBitmap that are set in @buf, which is in the format
+ * used by hbitmap_serialize.  Bits that are clear in @buf are not modified.
+ */
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf,
+                         uint64_t start, uint64_t count);
+
 /**
  * hbitmap_free:
  * @hb: HBitmap to operate on.
@@ -93,6 +93,10 @@ static inline void os_set_proc_name(const char *dummy) {}
 # define EPROTONOSUPPORT EINVAL
 #endif
 
+#if !defined(SHUT_RD)
+# define SHUT_RD SD_RECEIVE
+#endif
+
 int setenv(const char *name, const char *value, int overwrite);
 
 typedef struct {
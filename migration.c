@@ -53,6 +53,19 @@ enum {
 /* Migration XBZRLE default cache size */
 #define DEFAULT_MIGRATE_CACHE_SIZE (64 * 1024 * 1024)
 
+/* Migration compression defaults */
+#define DEFAULT_MIGRATE_COMPRESS_LEVEL 1
+#define DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT 8
+#define DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT 2
+#define MAX_MIGRATE_COMPRESS_THREAD_COUNT 255
+
+/* Messages on the return path from the destination to the source:
+ * be16 type, be16 length, payload
+ */
+enum {
+    MIG_RP_MSG_REQ_PAGES = 1, /* be64 start, be64 length, u8 idlen, idstr */
+};
+
 static NotifierList migration_state_notifiers =
     NOTIFIER_LIST_INITIALIZER(migration_state_notifiers);
 
@@ -66,6 +79,9 @@ MigrationState *migrate_get_current(void)
         .state = MIG_STATE_SETUP,
         .bandwidth_limit = MAX_THROTTLE,
         .xbzrle_cache_size = DEFAULT_MIGRATE_CACHE_SIZE,
+        .compress_level = DEFAULT_MIGRATE_COMPRESS_LEVEL,
+        .compress_thread_count = DEFAULT_MIGRATE_COMPRESS_THREAD_COUNT,
+        .decompress_thread_count = DEFAULT_MIGRATE_DECOMPRESS_THREAD_COUNT,
     };
 
     return &current_migration;
@@ -96,7 +112,11 @@ static void process_incoming_migration_co(void *opaque)
     int ret;
 
     ret = qemu_loadvm_state(f);
-    qemu_fclose(f);
+    /* in post-copy, f is closed once the rest of RAM has arrived */
+    if (ret != 1) {
+        qemu_fclose(f);
+        migrate_decompress_threads_join();
+    }
     if (ret < 0) {
         fprintf(stderr, "load of migration failed\n");
         exit(EXIT_FAILURE);
@@ -169,10 +189,28 @@ static void get_xbzrle_cache_stats(MigrationInfo *info)
         info->xbzrle_cache->bytes = xbzrle_mig_bytes_transferred();
         info->xbzrle_cache->pages = xbzrle_mig_pages_transferred();
         info->xbzrle_cache->cache_miss = xbzrle_mig_pages_cache_miss();
+        info->xbzrle_cache->cache_hit = xbzrle_mig_pages_cache_hit();
+        info->xbzrle_cache->cache_eviction = xbzrle_mig_cache_evictions();
         info->xbzrle_cache->overflow = xbzrle_mig_pages_overflow();
     }
 }
 
+static void get_compression_stats(MigrationInfo *info)
+{
+    if (migrate_use_compression()) {
+        info->has_compression = true;
+        info->compression = compress_mig_stats();
+    }
+}
+
+static void get_postcopy_stats(MigrationState *s, MigrationInfo *info)
+{
+    if (s->postcopy_running) {
+        info->has_postcopy_requests = true;
+        info->postcopy_requests = s->postcopy_requests;
+    }
+}
+
 MigrationInfo *qmp_query_migrate(Error **errp)
 {
     MigrationInfo *info = g_malloc0(sizeof(*info));
@@ -184,7 +222,8 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         break;
     case MIG_STATE_ACTIVE:
         info->has_status = true;
-        info->status = g_strdup("active");
+        info->status = g_strdup(s->postcopy_running ? "postcopy-active"
+                                                    : "active");
         info->has_total_time = true;
         info->total_time = qemu_get_clock_ms(rt_clock)
             - s->total_time;
@@ -211,9 +250,13 @@ MigrationInfo *qmp_query_migrate(Error **errp)
         }
 
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_postcopy_stats(s, info);
         break;
     case MIG_STATE_COMPLETED:
         get_xbzrle_cache_stats(info);
+        get_compression_stats(info);
+        get_postcopy_stats(s, info);
 
         info->has_status = true;
         info->status = g_strdup("completed");
@@ -260,6 +303,69 @@ void qmp_migrate_set_capabilities(MigrationCapabilityStatusList *params,
     }
 }
 
+void qmp_migrate_set_parameters(bool has_compress_level,
+                                int64_t compress_level,
+                                bool has_compress_threads,
+                                int64_t compress_threads,
+                                bool has_decompress_threads,
+                                int64_t decompress_threads,
+                                bool has_postcopy_after_passes,
+                                int64_t postcopy_after_passes, Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (has_compress_level && (compress_level < 0 || compress_level > 9)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-level",
+                  "an integer in the range of 0 to 9");
+        return;
+    }
+    if (has_compress_threads &&
+        (compress_threads < 1 ||
+         compress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "compress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_decompress_threads &&
+        (decompress_threads < 1 ||
+         decompress_threads > MAX_MIGRATE_COMPRESS_THREAD_COUNT)) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "decompress-threads",
+                  "an integer in the range of 1 to 255");
+        return;
+    }
+    if (has_postcopy_after_passes && postcopy_after_passes < 0) {
+        error_set(errp, QERR_INVALID_PARAMETER_VALUE, "postcopy-after-passes",
+                  "a non-negative integer");
+        return;
+    }
+
+    if (has_compress_level) {
+        s->compress_level = compress_level;
+    }
+    if (has_compress_threads) {
+        s->compress_thread_count = compress_threads;
+    }
+    if (has_decompress_threads) {
+        s->decompress_thread_count = decompress_threads;
+    }
+    if (has_postcopy_after_passes) {
+        s->postcopy_after_passes = postcopy_after_passes;
+    }
+}
+
+MigrationParameters *qmp_query_migrate_parameters(Error **errp)
+{
+    MigrationParameters *params = g_malloc0(sizeof(*params));
+    MigrationState *s = migrate_get_current();
+
+    params->compress_level = s->compress_level;
+    params->compress_threads = s->compress_thread_count;
+    params->decompress_threads = s->decompress_thread_count;
+    params->postcopy_after_passes = s->postcopy_after_passes;
+
+    return params;
+}
+
 /* shared migration helpers */
 
 static void migrate_fd_cleanup(void *opaque)
@@ -344,6 +450,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     int64_t bandwidth_limit = s->bandwidth_limit;
     bool enabled_capabilities[MIGRATION_CAPABILITY_MAX];
     int64_t xbzrle_cache_size = s->xbzrle_cache_size;
+    int compress_level = s->compress_level;
+    int compress_thread_count = s->compress_thread_count;
+    int decompress_thread_count = s->decompress_thread_count;
+    int64_t postcopy_after_passes = s->postcopy_after_passes;
 
     memcpy(enabled_capabilities, s->enabled_capabilities,
            sizeof(enabled_capabilities));
@@ -354,6 +464,10 @@ static MigrationState *migrate_init(const MigrationParams *params)
     memcpy(s->enabled_capabilities, enabled_capabilities,
            sizeof(enabled_capabilities));
     s->xbzrle_cache_size = xbzrle_cache_size;
+    s->compress_level = compress_level;
+    s->compress_thread_count = compress_thread_count;
+    s->decompress_thread_count = decompress_thread_count;
+    s->postcopy_after_passes = postcopy_after_passes;
 
     s->bandwidth_limit = bandwidth_limit;
     s->state = MIG_STATE_SETUP;
@@ -401,6 +515,13 @@ void qmp_migrate(const char *uri, bool has_blk, bool blk,
         return;
     }
 
+    /* pages are requested over the same connection */
+    if (migrate_postcopy_ram() &&
+        !strstart(uri, "tcp:", NULL) && !strstart(uri, "unix:", NULL)) {
+        error_setg(errp, "post-copy migration needs a tcp: or unix: URI");
+        return;
+    }
+
     s = migrate_init(&params);
 
     if (strstart(uri, "tcp:", &p)) {
@@ -430,6 +551,23 @@ void qmp_migrate_cancel(Error **errp)
     migrate_fd_cancel(migrate_get_current());
 }
 
+void qmp_migrate_start_postcopy(Error **errp)
+{
+    MigrationState *s = migrate_get_current();
+
+    if (!migrate_postcopy_ram()) {
+        error_setg(errp, "enable the postcopy-ram capability before "
+                   "starting the migration");
+        return;
+    }
+    if (s->state != MIG_STATE_ACTIVE) {
+        error_setg(errp, "no migration in progress");
+        return;
+    }
+
+    s->start_postcopy = true;
+}
+
 void qmp_migrate_set_cache_size(int64_t value, Error **errp)
 {
     MigrationState *s = migrate_get_current();
@@ -492,6 +630,200 @@ int64_t migrate_xbzrle_cache_size(void)
     return s->xbzrle_cache_size;
 }
 
+int migrate_use_compression(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_COMPRESS];
+}
+
+int migrate_compress_level(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_level;
+}
+
+int migrate_compress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->compress_thread_count;
+}
+
+int migrate_decompress_threads(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->decompress_thread_count;
+}
+
+int migrate_postcopy_ram(void)
+{
+    MigrationState *s;
+
+    s = migrate_get_current();
+
+    return s->enabled_capabilities[MIGRATION_CAPABILITY_POSTCOPY_RAM];
+}
+
+/* post-copy return path */
+
+/* Called on the destination when the guest touches a missing page */
+int migrate_send_rp_req_pages(int fd, const char *idstr, uint64_t start,
+                              uint64_t len)
+{
+    uint8_t buf[4 + 17 + 255];
+    size_t idlen = strlen(idstr);
+    size_t msglen = 17 + idlen;
+
+    stw_be_p(buf, MIG_RP_MSG_REQ_PAGES);
+    stw_be_p(buf + 2, msglen);
+    stq_be_p(buf + 4, start);
+    stq_be_p(buf + 12, len);
+    buf[20] = idlen;
+    memcpy(buf + 21, idstr, idlen);
+
+    if (qemu_write_full(fd, buf, 4 + msglen) != 4 + msglen) {
+        return -errno;
+    }
+    return 0;
+}
+
+static int rp_read(int fd, uint8_t *buf, size_t len)
+{
+    while (len) {
+        ssize_t ret = qemu_recv(fd, buf, len, 0);
+
+        if (ret < 0 && socket_error() == EINTR) {
+            continue;
+        }
+        if (ret <= 0) {
+            return -1;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return 0;
+}
+
+static void *source_return_path_thread(void *opaque)
+{
+    MigrationState *s = opaque;
+    int fd = qemu_get_fd(s->file);
+    uint8_t buf[512];
+
+    for (;;) {
+        uint16_t type, len;
+        uint64_t start, pages_len;
+        char idstr[256];
+
+        if (rp_read(fd, buf, 4) < 0) {
+            /* end of migration, or the destination went away */
+            break;
+        }
+        type = lduw_be_p(buf);
+        len = lduw_be_p(buf + 2);
+        if (len > sizeof(buf) || rp_read(fd, buf, len) < 0) {
+            break;
+        }
+
+        switch (type) {
+        case MIG_RP_MSG_REQ_PAGES:
+            if (len < 17 || len != 17 + buf[16]) {
+                goto bad;
+            }
+            start = ldq_be_p(buf);
+            pages_len = ldq_be_p(buf + 8);
+            memcpy(idstr, buf + 17, buf[16]);
+            idstr[buf[16]] = 0;
+
+            trace_migrate_rp_req_pages(idstr, start, pages_len);
+            if (ram_save_queue_pages(idstr, start, pages_len) < 0) {
+                goto bad;
+            }
+            s->postcopy_requests++;
+            qemu_sem_post(&s->rp_sem);
+            break;
+        default:
+            goto bad;
+        }
+    }
+    return NULL;
+
+bad:
+    fprintf(stderr, "migration: bad message on the return path\n");
+    migrate_finish_set_state(s, MIG_STATE_ERROR);
+    return NULL;
+}
+
+static void source_return_path_stop(MigrationState *s)
+{
+    if (!s->rp_thread_created) {
+        return;
+    }
+
+    /* makes the thread's recv() return */
+    shutdown(qemu_get_fd(s->file), SHUT_RD);
+    qemu_thread_join(&s->rp_thread);
+    qemu_sem_destroy(&s->rp_sem);
+    s->rp_thread_created = false;
+}
+
+static bool migration_should_start_postcopy(MigrationState *s)
+{
+    if (!migrate_postcopy_ram()) {
+        return false;
+    }
+    /* the first synchronization happens before the first pass */
+    return s->start_postcopy ||
+           (s->postcopy_after_passes &&
+            ram_dirty_sync_count() > s->postcopy_after_passes);
+}
+
+/*
+ * Stop the guest, tell the destination which of the pages it already has
+ * are stale, and send it the device state so that it can start the guest.
+ * The remaining pages are sent afterwards, those the destination asks for
+ * first.
+ */
+static int postcopy_start(MigrationState *s, bool *old_vm_running)
+{
+    int64_t start_time = qemu_get_clock_ms(rt_clock);
+    int ret;
+
+    trace_migrate_postcopy_start();
+    qemu_mutex_lock_iothread();
+    qemu_system_wakeup_request(QEMU_WAKEUP_REASON_OTHER);
+    *old_vm_running = runstate_is_running();
+    vm_stop_force_state(RUN_STATE_FINISH_MIGRATE);
+
+    ret = ram_postcopy_send_discard(s->file);
+    if (ret == 0) {
+        ret = qemu_savevm_send_postcopy_run(s->file);
+    }
+    qemu_mutex_unlock_iothread();
+
+    if (ret == 0) {
+        ret = qemu_file_get_error(s->file);
+    }
+    if (ret < 0) {
+        return ret;
+    }
+
+    s->postcopy_running = true;
+    s->downtime = qemu_get_clock_ms(rt_clock) - start_time;
+    return 0;
+}
+
 /* migration thread support */
 
 static void *migration_thread(void *opaque)
@@ -506,16 +838,40 @@ static void *migration_thread(void *opaque)
 
     DPRINTF("beginning savevm\n");
     qemu_savevm_state_begin(s->file, &s->params);
+    if (migrate_postcopy_ram()) {
+        qemu_savevm_send_postcopy_advise(s->file);
+    }
 
     while (s->state == MIG_STATE_ACTIVE) {
         int64_t current_time;
         uint64_t pending_size;
 
-        if (!qemu_file_rate_limit(s->file)) {
+        if (s->postcopy_running) {
+            /* requested pages go out even when rate limited */
+            if (qemu_savevm_state_pending(s->file, 0)) {
+                qemu_savevm_state_iterate(s->file);
+            } else {
+                DPRINTF("post-copy done\n");
+                qemu_mutex_lock_iothread();
+                qemu_savevm_state_complete(s->file);
+                qemu_mutex_unlock_iothread();
+                if (!qemu_file_get_error(s->file)) {
+                    migrate_finish_set_state(s, MIG_STATE_COMPLETED);
+                    break;
+                }
+            }
+        } else if (!qemu_file_rate_limit(s->file)) {
             DPRINTF("iterate\n");
             pending_size = qemu_savevm_state_pending(s->file, max_size);
             DPRINTF("pending size %lu max %lu\n", pending_size, max_size);
-            if (pending_size && pending_size >= max_size) {
+            if (pending_size && pending_size >= max_size &&
+                migration_should_start_postcopy(s)) {
+                DPRINTF("switching to post-copy\n");
+                if (postcopy_start(s, &old_vm_running) < 0) {
+                    migrate_finish_set_state(s, MIG_STATE_ERROR);
+                    break;
+                }
+            } else if (pending_size && pending_size >= max_size) {
                 qemu_savevm_state_iterate(s->file);
             } else {
                 DPRINTF("done iterating\n");
@@ -542,16 +898,21 @@ static void *migration_thread(void *opaque)
         if (current_time >= initial_time + BUFFER_DELAY) {
             uint64_t transferred_bytes = qemu_ftell(s->file) - initial_bytes;
             uint64_t time_spent = current_time - initial_time - sleep_time;
-            double bandwidth = transferred_bytes / time_spent;
-            max_size = bandwidth * migrate_max_downtime() / 1000000;
-
-            DPRINTF("transferred %" PRIu64 " time_spent %" PRIu64
-                    " bandwidth %g max_size %" PRId64 "\n",
-                    transferred_bytes, time_spent, bandwidth, max_size);
-            /* if we haven't sent anything, we don't want to recalculate
-               10000 is a small enough number for our purposes */
-            if (s->dirty_bytes_rate && transferred_bytes > 10000) {
-                s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+
+            /* when rate limited, the whole period may have been spent
+               sleeping; keep the previous estimate then */
+            if (time_spent) {
+                double bandwidth = (double)transferred_bytes / time_spent;
+                max_size = bandwidth * migrate_max_downtime() / 1000000;
+
+                DPRINTF("transferred %" PRIu64 " time_spent %" PRIu64
+                        " bandwidth %g max_size %" PRId64 "\n",
+                        transferred_bytes, time_spent, bandwidth, max_size);
+                /* if we haven't sent anything, we don't want to recalculate
+                   10000 is a small enough number for our purposes */
+                if (s->dirty_bytes_rate && transferred_bytes > 10000) {
+                    s->expected_downtime = s->dirty_bytes_rate / bandwidth;
+                }
             }
 
             qemu_file_reset_rate_limit(s->file);
@@ -560,20 +921,32 @@ static void *migration_thread(void *opaque)
             initial_bytes = qemu_ftell(s->file);
         }
         if (qemu_file_rate_limit(s->file)) {
-            /* usleep expects microseconds */
-            g_usleep((initial_time + BUFFER_DELAY - current_time)*1000);
+            int64_t delay = initial_time + BUFFER_DELAY - current_time;
+
+            if (s->postcopy_running) {
+                /* wake up early when the destination asks for a page */
+                qemu_sem_timedwait(&s->rp_sem, MAX(delay, 1));
+            } else {
+                /* usleep expects microseconds */
+                g_usleep(delay * 1000);
+            }
             sleep_time += qemu_get_clock_ms(rt_clock) - current_time;
         }
     }
 
+    source_return_path_stop(s);
+
     qemu_mutex_lock_iothread();
     if (s->state == MIG_STATE_COMPLETED) {
         int64_t end_time = qemu_get_clock_ms(rt_clock);
         s->total_time = end_time - s->total_time;
-        s->downtime = end_time - start_time;
+        if (!s->postcopy_running) {
+            s->downtime = end_time - start_time;
+        }
         runstate_set(RUN_STATE_POSTMIGRATE);
     } else {
-        if (old_vm_running) {
+        /* after the switch the guest may already run on the destination */
+        if (old_vm_running && !s->postcopy_running) {
             vm_start();
         }
     }
@@ -595,6 +968,13 @@ void migrate_fd_connect(MigrationState *s)
     qemu_file_set_rate_limit(s->file,
                              s->bandwidth_limit / XFER_LIMIT_RATIO);
 
+    if (migrate_postcopy_ram()) {
+        qemu_sem_init(&s->rp_sem, 0);
+        qemu_thread_create(&s->rp_thread, source_return_path_thread, s,
+                           QEMU_THREAD_JOINABLE);
+        s->rp_thread_created = true;
+    }
+
     qemu_thread_create(&s->thread, migration_thread, s,
                        QEMU_THREAD_JOINABLE);
     notifier_list_notify(&migration_state_notifiers, s);
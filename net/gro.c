@@ -0,0 +1,424 @@
+/*
+ * Receive segment coalescing
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include "net/gro.h"
+#include "net/checksum.h"
+#include "qemu/bswap.h"
+
+#define GRO_MAX_FRAMES  64
+#define GRO_BUF_SIZE    (128 * 1024)
+#define GRO_MAX_FLOWS   8
+
+#define ETH_HDR_LEN     14
+#define ETH_P_IP        0x0800
+#define ETH_P_IPV6      0x86dd
+#define IP_HDR_LEN      20
+#define IP6_HDR_LEN     40
+#define IP_PROTO_TCP    6
+#define IP_MF           0x2000
+#define IP_OFFMASK      0x1fff
+#define TCP_HDR_LEN     20
+#define TCP_CSUM_OFFSET 16
+
+#define TCP_FLAG_PSH    0x08
+#define TCP_FLAG_ACK    0x10
+
+#define GRO_MAX_IP_LEN  0xffff
+
+typedef enum {
+    GRO_PASS,           /* not TCP, leave alone */
+    GRO_FLOW,           /* TCP but not mergeable, ends its flow */
+    GRO_SEGMENT,        /* mergeable TCP segment */
+} NetGROKind;
+
+typedef struct NetGROFrame {
+    uint32_t offset;
+    uint32_t size;
+    NetGROKind kind;
+    bool ipv6;
+    uint8_t tcp_flags;
+    uint16_t l4_off;        /* start of the TCP header */
+    uint16_t hdr_len;       /* start of the TCP payload */
+    uint32_t payload_len;
+    uint32_t seq;
+    int next;               /* next segment of the same flow, or -1 */
+    bool absorbed;          /* part of an earlier frame's flow */
+} NetGROFrame;
+
+typedef struct NetGROFlow {
+    int head;               /* frame index of the first segment */
+    int tail;
+    uint32_t next_seq;
+    uint32_t len;           /* TCP payload bytes so far */
+    uint16_t mss;
+    int segs;
+} NetGROFlow;
+
+struct NetGRO {
+    uint8_t *buf;
+    size_t used;
+    uint8_t *out;
+    NetGROFrame frames[GRO_MAX_FRAMES];
+    int count;
+    NetGROStats stats;
+};
+
+NetGRO *net_gro_new(void)
+{
+    NetGRO *gro = g_new0(NetGRO, 1);
+
+    gro->buf = g_malloc(GRO_BUF_SIZE);
+    gro->out = g_malloc(ETH_HDR_LEN + IP6_HDR_LEN + GRO_MAX_IP_LEN);
+    return gro;
+}
+
+void net_gro_free(NetGRO *gro)
+{
+    if (!gro) {
+        return;
+    }
+    g_free(gro->buf);
+    g_free(gro->out);
+    g_free(gro);
+}
+
+bool net_gro_add(NetGRO *gro, const uint8_t *buf, size_t size)
+{
+    NetGROFrame *f;
+
+    if (gro->count == GRO_MAX_FRAMES || gro->used + size > GRO_BUF_SIZE) {
+        return false;
+    }
+
+    f = &gro->frames[gro->count++];
+    f->offset = gro->used;
+    f->size = size;
+    memcpy(gro->buf + gro->used, buf, size);
+    gro->used += size;
+    gro->stats.frames_in++;
+    return true;
+}
+
+int net_gro_pending(NetGRO *gro)
+{
+    return gro->count;
+}
+
+size_t net_gro_pending_bytes(NetGRO *gro)
+{
+    return gro->used;
+}
+
+void net_gro_purge(NetGRO *gro)
+{
+    gro->count = 0;
+    gro->used = 0;
+}
+
+void net_gro_get_stats(NetGRO *gro, NetGROStats *stats)
+{
+    *stats = gro->stats;
+}
+
+static uint32_t gro_pseudo_sum(const uint8_t *ip, bool ipv6, uint32_t l4_len)
+{
+    /* FIXME net_checksum_* takes non-const buffers */
+    uint8_t *addrs = (uint8_t *)ip + (ipv6 ? 8 : 12);
+
+    return net_checksum_add(ipv6 ? 32 : 8, addrs) + IP_PROTO_TCP + l4_len;
+}
+
+/* Classify a frame.  Only TCP over IPv4 without options or fragments, or
+ * over IPv6 without extension headers, can be merged, and only segments
+ * with payload, no flags but ACK and PSH, and a good checksum.
+ */
+static void gro_parse(NetGRO *gro, NetGROFrame *f, int gso_types)
+{
+    uint8_t *p = gro->buf + f->offset;
+    uint8_t *ip = p + ETH_HDR_LEN;
+    uint8_t *tcp;
+    uint32_t l4_len, doff;
+
+    f->kind = GRO_PASS;
+    f->next = -1;
+    f->absorbed = false;
+
+    if (f->size < ETH_HDR_LEN + IP_HDR_LEN + TCP_HDR_LEN) {
+        return;
+    }
+
+    switch (lduw_be_p(p + 12)) {
+    case ETH_P_IP:
+        if (ip[0] != 0x45 || ip[9] != IP_PROTO_TCP ||
+            (lduw_be_p(ip + 6) & (IP_MF | IP_OFFMASK))) {
+            return;
+        }
+        l4_len = lduw_be_p(ip + 2);
+        if (l4_len < IP_HDR_LEN + TCP_HDR_LEN ||
+            ETH_HDR_LEN + l4_len > f->size) {
+            return;
+        }
+        l4_len -= IP_HDR_LEN;
+        f->ipv6 = false;
+        f->l4_off = ETH_HDR_LEN + IP_HDR_LEN;
+        break;
+    case ETH_P_IPV6:
+        if (f->size < ETH_HDR_LEN + IP6_HDR_LEN + TCP_HDR_LEN ||
+            (ip[0] >> 4) != 6 || ip[6] != IP_PROTO_TCP) {
+            return;
+        }
+        l4_len = lduw_be_p(ip + 4);
+        if (l4_len < TCP_HDR_LEN ||
+            ETH_HDR_LEN + IP6_HDR_LEN + l4_len > f->size) {
+            return;
+        }
+        f->ipv6 = true;
+        f->l4_off = ETH_HDR_LEN + IP6_HDR_LEN;
+        break;
+    default:
+        return;
+    }
+
+    tcp = p + f->l4_off;
+    doff = (tcp[12] >> 4) * 4;
+    if (doff < TCP_HDR_LEN || doff > l4_len) {
+        return;
+    }
+
+    f->kind = GRO_FLOW;
+    f->tcp_flags = tcp[13];
+    f->hdr_len = f->l4_off + doff;
+    f->payload_len = l4_len - doff;
+    f->seq = ldl_be_p(tcp + 4);
+
+    if (!(gso_types & (f->ipv6 ? NET_GRO_TCPV6 : NET_GRO_TCPV4)) ||
+        (f->tcp_flags & ~TCP_FLAG_PSH) != TCP_FLAG_ACK ||
+        f->payload_len == 0) {
+        return;
+    }
+    if (!f->ipv6 && net_raw_checksum(ip, IP_HDR_LEN) != 0) {
+        return;
+    }
+    if (net_checksum_finish(gro_pseudo_sum(ip, f->ipv6, l4_len) +
+                            net_checksum_add(l4_len, tcp)) != 0) {
+        gro->stats.bad_csum++;
+        return;
+    }
+    f->kind = GRO_SEGMENT;
+}
+
+/* Same addresses and ports */
+static bool gro_same_flow(NetGRO *gro, NetGROFrame *a, NetGROFrame *b)
+{
+    uint8_t *pa = gro->buf + a->offset;
+    uint8_t *pb = gro->buf + b->offset;
+
+    if (a->ipv6 != b->ipv6) {
+        return false;
+    }
+    if (a->ipv6) {
+        if (memcmp(pa + ETH_HDR_LEN + 8, pb + ETH_HDR_LEN + 8, 32)) {
+            return false;
+        }
+    } else if (memcmp(pa + ETH_HDR_LEN + 12, pb + ETH_HDR_LEN + 12, 8)) {
+        return false;
+    }
+    return !memcmp(pa + a->l4_off, pb + b->l4_off, 4);
+}
+
+/* Everything but the sequence number and length must match the head for
+ * the merged frame's headers to describe each of the segments.
+ */
+static bool gro_can_append(NetGRO *gro, NetGROFlow *flow, NetGROFrame *f)
+{
+    NetGROFrame *head = &gro->frames[flow->head];
+    uint8_t *ph = gro->buf + head->offset;
+    uint8_t *pf = gro->buf + f->offset;
+    uint32_t l3_len;
+
+    if (f->kind != GRO_SEGMENT || f->seq != flow->next_seq ||
+        f->payload_len > flow->mss || f->hdr_len != head->hdr_len) {
+        return false;
+    }
+
+    /* Source MAC, TOS/traffic class, TTL/hop limit */
+    if (memcmp(ph + 6, pf + 6, 6)) {
+        return false;
+    }
+    if (f->ipv6) {
+        if (memcmp(ph + ETH_HDR_LEN, pf + ETH_HDR_LEN, 4) ||
+            ph[ETH_HDR_LEN + 7] != pf[ETH_HDR_LEN + 7]) {
+            return false;
+        }
+    } else if (ph[ETH_HDR_LEN + 1] != pf[ETH_HDR_LEN + 1] ||
+               ph[ETH_HDR_LEN + 8] != pf[ETH_HDR_LEN + 8]) {
+        return false;
+    }
+
+    /* Ack, window and options */
+    if (memcmp(ph + head->l4_off + 8, pf + f->l4_off + 8, 4) ||
+        memcmp(ph + head->l4_off + 14, pf + f->l4_off + 14, 2) ||
+        memcmp(ph + head->l4_off + TCP_HDR_LEN, pf + f->l4_off + TCP_HDR_LEN,
+               head->hdr_len - head->l4_off - TCP_HDR_LEN)) {
+        return false;
+    }
+
+    l3_len = head->hdr_len - ETH_HDR_LEN - (f->ipv6 ? IP6_HDR_LEN : 0);
+    return l3_len + flow->len + f->payload_len <= GRO_MAX_IP_LEN;
+}
+
+static void gro_append(NetGRO *gro, NetGROFlow *flow, int i)
+{
+    NetGROFrame *f = &gro->frames[i];
+
+    gro->frames[flow->tail].next = i;
+    f->absorbed = true;
+    flow->tail = i;
+    flow->next_seq += f->payload_len;
+    flow->len += f->payload_len;
+    flow->segs++;
+}
+
+/* A short segment or PSH marks the end of what the sender had queued */
+static bool gro_flow_done(NetGROFlow *flow, NetGROFrame *f)
+{
+    return f->payload_len < flow->mss || (f->tcp_flags & TCP_FLAG_PSH);
+}
+
+/* Build the merged frame for a flow in gro->out */
+static size_t gro_build(NetGRO *gro, NetGROFrame *head,
+                        struct virtio_net_hdr *hdr)
+{
+    uint8_t *out = gro->out;
+    uint8_t *ip = out + ETH_HDR_LEN;
+    uint8_t *tcp = out + head->l4_off;
+    size_t len = head->hdr_len;
+    uint8_t flags = 0;
+    uint32_t l4_len;
+    int i;
+
+    memcpy(out, gro->buf + head->offset, head->hdr_len);
+    for (i = head - gro->frames; i >= 0; i = gro->frames[i].next) {
+        NetGROFrame *f = &gro->frames[i];
+
+        memcpy(out + len, gro->buf + f->offset + f->hdr_len, f->payload_len);
+        len += f->payload_len;
+        flags |= f->tcp_flags;
+    }
+    tcp[13] |= flags & TCP_FLAG_PSH;
+
+    l4_len = len - head->l4_off;
+    if (head->ipv6) {
+        stw_be_p(ip + 4, l4_len);
+    } else {
+        stw_be_p(ip + 2, IP_HDR_LEN + l4_len);
+        stw_be_p(ip + 10, 0);
+        stw_be_p(ip + 10, net_raw_checksum(ip, IP_HDR_LEN));
+    }
+
+    /* The guest completes the checksum from the pseudo-header sum */
+    stw_be_p(tcp + TCP_CSUM_OFFSET, 0);
+    stw_be_p(tcp + TCP_CSUM_OFFSET,
+             ~net_checksum_finish(gro_pseudo_sum(ip, head->ipv6, l4_len)));
+
+    hdr->flags = VIRTIO_NET_HDR_F_NEEDS_CSUM;
+    hdr->gso_type = head->ipv6 ? VIRTIO_NET_HDR_GSO_TCPV6 :
+                                 VIRTIO_NET_HDR_GSO_TCPV4;
+    hdr->hdr_len = head->hdr_len;
+    hdr->gso_size = head->payload_len;
+    hdr->csum_start = head->l4_off;
+    hdr->csum_offset = TCP_CSUM_OFFSET;
+    return len;
+}
+
+void net_gro_flush(NetGRO *gro, int gso_types,
+                   NetGROOutput *output, void *opaque)
+{
+    NetGROFlow flows[GRO_MAX_FRAMES];
+    int open[GRO_MAX_FLOWS];
+    int nflows = 0, nopen = 0;
+    int i, j;
+
+    /* Pass 1: chain each segment to the open flow it continues */
+    for (i = 0; i < gro->count; i++) {
+        NetGROFrame *f = &gro->frames[i];
+        NetGROFlow *flow = NULL;
+
+        gro_parse(gro, f, gso_types);
+        if (f->kind == GRO_PASS) {
+            continue;
+        }
+
+        for (j = 0; j < nopen; j++) {
+            if (gro_same_flow(gro, &gro->frames[flows[open[j]].head], f)) {
+                flow = &flows[open[j]];
+                break;
+            }
+        }
+
+        if (flow && gro_can_append(gro, flow, f)) {
+            gro_append(gro, flow, i);
+            if (!gro_flow_done(flow, f)) {
+                continue;
+            }
+        } else if (f->kind == GRO_SEGMENT) {
+            /* Start a new flow, replacing the old one or the oldest */
+            if (!flow && nopen == GRO_MAX_FLOWS) {
+                j = 0;
+            }
+            if (flow || nopen == GRO_MAX_FLOWS) {
+                memmove(&open[j], &open[j + 1],
+                        (nopen - j - 1) * sizeof(open[0]));
+                nopen--;
+            }
+            flow = &flows[nflows];
+            flow->head = flow->tail = i;
+            flow->next_seq = f->seq + f->payload_len;
+            flow->len = f->payload_len;
+            flow->mss = f->payload_len;
+            flow->segs = 1;
+            if (gro_flow_done(flow, f)) {
+                continue;
+            }
+            open[nopen++] = nflows++;
+            continue;
+        } else if (!flow) {
+            continue;
+        }
+
+        /* The flow is complete or broken by f */
+        memmove(&open[j], &open[j + 1], (nopen - j - 1) * sizeof(open[0]));
+        nopen--;
+    }
+
+    /* Pass 2: emit in arrival order of the first segment */
+    for (i = 0; i < gro->count; i++) {
+        NetGROFrame *f = &gro->frames[i];
+
+        if (f->absorbed) {
+            continue;
+        }
+        if (f->kind == GRO_SEGMENT && f->next >= 0) {
+            struct virtio_net_hdr hdr;
+            size_t len = gro_build(gro, f, &hdr);
+
+            gro->stats.merged++;
+            for (j = i; j >= 0; j = gro->frames[j].next) {
+                gro->stats.segments++;
+            }
+            output(opaque, gro->out, len, &hdr);
+        } else {
+            output(opaque, gro->buf + f->offset, f->size, NULL);
+        }
+        gro->stats.frames_out++;
+    }
+
+    net_gro_purge(gro);
+}
@@ -42,35 +42,34 @@ struct NetHub {
 
 static QLIST_HEAD(, NetHub) hubs = QLIST_HEAD_INITIALIZER(&hubs);
 
-static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
-                               const uint8_t *buf, size_t len)
+static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
+                                   const struct iovec *iov, int iovcnt)
 {
     NetHubPort *port;
+    NetPacketData *shared = NULL;
+    ssize_t len = iov_size(iov, iovcnt);
 
+    /* Busy ports share one copy of the packet */
     QLIST_FOREACH(port, &hub->ports, next) {
         if (port == source_port) {
             continue;
         }
 
-        qemu_send_packet(&port->nc, buf, len);
+        qemu_sendv_packet_shared(&port->nc, iov, iovcnt, &shared);
     }
+    qemu_net_packet_data_unref(shared);
     return len;
 }
 
-static ssize_t net_hub_receive_iov(NetHub *hub, NetHubPort *source_port,
-                                   const struct iovec *iov, int iovcnt)
+static ssize_t net_hub_receive(NetHub *hub, NetHubPort *source_port,
+                               const uint8_t *buf, size_t len)
 {
-    NetHubPort *port;
-    ssize_t len = iov_size(iov, iovcnt);
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = len,
+    };
 
-    QLIST_FOREACH(port, &hub->ports, next) {
-        if (port == source_port) {
-            continue;
-        }
-
-        qemu_sendv_packet(&port->nc, iov, iovcnt);
-    }
-    return len;
+    return net_hub_receive_iov(hub, source_port, &iov, 1);
 }
 
 static NetHub *net_hub_new(int id)
@@ -36,6 +36,7 @@
 #include "qmp-commands.h"
 #include "hw/qdev.h"
 #include "qemu/iov.h"
+#include "qemu/timer.h"
 #include "qapi-visit.h"
 #include "qapi/opts-visitor.h"
 #include "qapi/dealloc-visitor.h"
@@ -277,6 +278,55 @@ void *qemu_get_nic_opaque(NetClientState *nc)
     return nic->opaque;
 }
 
+/* Minimum interval between interrupts, in ns, for NIC models that moderate
+ * them adaptively.  The packet rate is sampled once per millisecond: below
+ * 10000 packets/s interrupts are not delayed at all, so latency does not
+ * suffer; above that the interrupt rate is capped at 20000/s, and at 8000/s
+ * under heavy load.
+ */
+#define NIC_ADAPTIVE_PERIOD     (SCALE_MS)
+#define NIC_ADAPTIVE_LOW_PPS    10000
+#define NIC_ADAPTIVE_HIGH_PPS   50000
+
+int64_t qemu_nic_adaptive_delay(NICState *nic)
+{
+    int64_t now = qemu_get_clock_ns(vm_clock);
+    uint64_t packets = nic->stats.rx_packets + nic->stats.tx_packets;
+    int64_t elapsed = now - nic->adaptive_time;
+    uint64_t pps;
+
+    if (elapsed < NIC_ADAPTIVE_PERIOD) {
+        return nic->adaptive_delay;
+    }
+
+    pps = (packets - nic->adaptive_packets) * get_ticks_per_sec() / elapsed;
+    nic->adaptive_time = now;
+    nic->adaptive_packets = packets;
+
+    if (pps < NIC_ADAPTIVE_LOW_PPS) {
+        nic->adaptive_delay = 0;
+    } else if (pps < NIC_ADAPTIVE_HIGH_PPS) {
+        nic->adaptive_delay = get_ticks_per_sec() / 20000;
+    } else {
+        nic->adaptive_delay = get_ticks_per_sec() / 8000;
+    }
+    return nic->adaptive_delay;
+}
+
+static void qemu_nic_count_rx(NetClientState *nc, int packets)
+{
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC && packets > 0) {
+        qemu_get_nic(nc)->stats.rx_packets += packets;
+    }
+}
+
+static void qemu_nic_count_tx(NetClientState *nc, int packets)
+{
+    if (nc->info->type == NET_CLIENT_OPTIONS_KIND_NIC) {
+        qemu_get_nic(nc)->stats.tx_packets += packets;
+    }
+}
+
 static void qemu_cleanup_net_client(NetClientState *nc)
 {
     QTAILQ_REMOVE(&net_clients, nc, next);
@@ -419,7 +469,9 @@ ssize_t qemu_deliver_packet(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
-    };
+    } else if (ret > 0) {
+        qemu_nic_count_rx(nc, 1);
+    }
 
     return ret;
 }
@@ -467,6 +519,7 @@ static ssize_t qemu_send_packet_async_with_flags(NetClientState *sender,
         return size;
     }
 
+    qemu_nic_count_tx(sender, 1);
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send(queue, sender, flags, buf, size, sent_cb);
@@ -497,6 +550,10 @@ static ssize_t nc_sendv_compat(NetClientState *nc, const struct iovec *iov,
     uint8_t buffer[NET_BUFSIZE];
     size_t offset;
 
+    if (iovcnt == 1) {
+        return nc->info->receive(nc, iov[0].iov_base, iov[0].iov_len);
+    }
+
     offset = iov_to_buf(iov, iovcnt, 0, buffer, sizeof(buffer));
 
     return nc->info->receive(nc, buffer, offset);
@@ -527,11 +584,55 @@ ssize_t qemu_deliver_packet_iov(NetClientState *sender,
 
     if (ret == 0) {
         nc->receive_disabled = 1;
+    } else if (ret > 0) {
+        qemu_nic_count_rx(nc, 1);
     }
 
     return ret;
 }
 
+int qemu_deliver_packet_iov_batch(NetClientState *sender,
+                                  unsigned flags,
+                                  const NetBatchPacket *pkts,
+                                  int count,
+                                  void *opaque)
+{
+    NetClientState *nc = opaque;
+    ssize_t len;
+    int ret;
+
+    if (nc->link_down) {
+        return count;
+    }
+
+    if (nc->receive_disabled) {
+        return 0;
+    }
+
+    if (nc->info->receive_iov_batch) {
+        ret = nc->info->receive_iov_batch(nc, pkts, count);
+    } else {
+        for (ret = 0; ret < count; ret++) {
+            if (nc->info->receive_iov) {
+                len = nc->info->receive_iov(nc, pkts[ret].iov,
+                                            pkts[ret].iovcnt);
+            } else {
+                len = nc_sendv_compat(nc, pkts[ret].iov, pkts[ret].iovcnt);
+            }
+            if (len == 0) {
+                break;
+            }
+        }
+    }
+
+    if (ret < count) {
+        nc->receive_disabled = 1;
+    }
+    qemu_nic_count_rx(nc, ret);
+
+    return ret;
+}
+
 ssize_t qemu_sendv_packet_async(NetClientState *sender,
                                 const struct iovec *iov, int iovcnt,
                                 NetPacketSent *sent_cb)
@@ -542,6 +643,7 @@ ssize_t qemu_sendv_packet_async(NetClientState *sender,
         return iov_size(iov, iovcnt);
     }
 
+    qemu_nic_count_tx(sender, 1);
     queue = sender->peer->send_queue;
 
     return qemu_net_queue_send_iov(queue, sender,
@@ -555,6 +657,46 @@ qemu_sendv_packet(NetClientState *nc, const struct iovec *iov, int iovcnt)
     return qemu_sendv_packet_async(nc, iov, iovcnt, NULL);
 }
 
+/* Send a burst of packets and return how many of them were delivered.
+ * See qemu_net_queue_send_iov_batch() for what happens to the others.
+ */
+int qemu_sendv_packet_batch_async(NetClientState *sender, unsigned flags,
+                                  const NetBatchPacket *pkts, int count,
+                                  NetPacketSent *sent_cb)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return count;
+    }
+
+    qemu_nic_count_tx(sender, count);
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_iov_batch(queue, sender, flags,
+                                         pkts, count, sent_cb);
+}
+
+/* Send the same packet from several clients, e.g. the ports of a hub.  If
+ * more than one peer is busy, the queued copies share a single buffer.
+ */
+ssize_t qemu_sendv_packet_shared(NetClientState *sender,
+                                 const struct iovec *iov, int iovcnt,
+                                 NetPacketData **shared)
+{
+    NetQueue *queue;
+
+    if (sender->link_down || !sender->peer) {
+        return iov_size(iov, iovcnt);
+    }
+
+    queue = sender->peer->send_queue;
+
+    return qemu_net_queue_send_iov_shared(queue, sender,
+                                          QEMU_NET_PACKET_FLAG_NONE,
+                                          iov, iovcnt, shared);
+}
+
 NetClientState *qemu_find_netdev(const char *id)
 {
     NetClientState *nc;
@@ -955,10 +1097,21 @@ void qmp_netdev_del(const char *id, Error **errp)
 
 void print_net_client(Monitor *mon, NetClientState *nc)
 {
+    NetQueueStats stats;
+
     monitor_printf(mon, "%s: index=%d,type=%s,%s\n", nc->name,
                    nc->queue_index,
                    NetClientOptionsKind_lookup[nc->info->type],
                    nc->info_str);
+
+    qemu_net_queue_get_stats(nc->send_queue, &stats);
+    if (stats.queued) {
+        monitor_printf(mon, "    queued %" PRIu64 " packets (%" PRIu64
+                       " zero-copy, %" PRIu64 " shared), %" PRIu64
+                       " allocations, %" PRIu64 " bytes copied\n",
+                       stats.queued, stats.zerocopy, stats.shared,
+                       stats.allocs, stats.bytes_copied);
+    }
 }
 
 void do_info_network(Monitor *mon, const QDict *qdict)
@@ -1023,6 +1176,45 @@ void qmp_set_link(const char *name, bool up, Error **errp)
     }
 }
 
+NicStatsList *qmp_query_nic_stats(Error **errp)
+{
+    NicStatsList *head = NULL, **tail = &head;
+    NetClientState *nc;
+
+    QTAILQ_FOREACH(nc, &net_clients, next) {
+        NicStatsList *entry;
+        NicStats *info;
+        NICState *nic;
+
+        if (nc->info->type != NET_CLIENT_OPTIONS_KIND_NIC ||
+            nc->queue_index != 0) {
+            continue;
+        }
+        nic = qemu_get_nic(nc);
+
+        info = g_malloc0(sizeof(*info));
+        info->name = g_strdup(nc->name);
+        info->model = g_strdup(nc->model);
+        info->rx_packets = nic->stats.rx_packets;
+        info->tx_packets = nic->stats.tx_packets;
+        if (nic->stats.counts_interrupts) {
+            info->has_interrupts = true;
+            info->interrupts = nic->stats.interrupts;
+            info->has_coalesced = true;
+            info->coalesced = nic->stats.coalesced;
+            info->has_moderation_delay = true;
+            info->moderation_delay = nic->stats.moderation_delay;
+        }
+
+        entry = g_malloc0(sizeof(*entry));
+        entry->value = info;
+        *tail = entry;
+        tail = &entry->next;
+    }
+
+    return head;
+}
+
 void net_cleanup(void)
 {
     NetClientState *nc;
@@ -24,6 +24,7 @@
 #include "net/queue.h"
 #include "qemu/queue.h"
 #include "net/net.h"
+#include "qemu/iov.h"
 
 /* The delivery handler may only return zero if it will call
  * qemu_net_queue_flush() when it determines that it is once again able
@@ -37,7 +38,27 @@
  *
  * If a sent callback isn't provided, we just drop the packet to avoid
  * unbounded queueing.
+ *
+ * send_iov_batch() hands a burst of packets to the delivery handler in one
+ * go and returns how many of them were delivered.  If that is less than the
+ * burst, the first undelivered packet is queued like a zero return from
+ * send() would; with a sent callback the remaining packets are left to the
+ * caller, which must not send any more until the callback is invoked.
+ * Without a callback the caller cannot retry, so they are queued as well.
+ *
+ * Packets are normally copied when they are queued.  A sender that passes
+ * QEMU_NET_PACKET_FLAG_ZEROCOPY together with a sent callback promises to
+ * keep its buffers untouched until the callback, so only the iovec array
+ * is saved.
+ */
+
+/* Payload of a packet that a hub fans out to several busy queues, so that
+ * it is copied once rather than once per queue.
  */
+struct NetPacketData {
+    int refcnt;
+    uint8_t data[0];
+};
 
 struct NetPacket {
     QTAILQ_ENTRY(NetPacket) entry;
@@ -45,7 +66,11 @@ struct NetPacket {
     unsigned flags;
     int size;
     NetPacketSent *sent_cb;
-    uint8_t data[0];
+    NetPacketData *shared;      /* reference to a shared payload, or NULL */
+    const uint8_t *data;        /* flat payload (copied or shared) */
+    struct iovec *iov;          /* zero-copy payload in the sender's memory */
+    int iovcnt;
+    uint8_t payload[0];
 };
 
 struct NetQueue {
@@ -55,6 +80,8 @@ struct NetQueue {
 
     QTAILQ_HEAD(packets, NetPacket) packets;
 
+    NetQueueStats stats;
+
     unsigned delivering : 1;
 };
 
@@ -75,76 +102,112 @@ NetQueue *qemu_new_net_queue(void *opaque)
     return queue;
 }
 
+void qemu_net_packet_data_unref(NetPacketData *shared)
+{
+    if (shared && --shared->refcnt == 0) {
+        g_free(shared);
+    }
+}
+
+static void qemu_net_packet_free(NetPacket *packet)
+{
+    qemu_net_packet_data_unref(packet->shared);
+    g_free(packet);
+}
+
 void qemu_del_net_queue(NetQueue *queue)
 {
     NetPacket *packet, *next;
 
     QTAILQ_FOREACH_SAFE(packet, &queue->packets, entry, next) {
         QTAILQ_REMOVE(&queue->packets, packet, entry);
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
 
     g_free(queue);
 }
 
-static void qemu_net_queue_append(NetQueue *queue,
-                                  NetClientState *sender,
-                                  unsigned flags,
-                                  const uint8_t *buf,
-                                  size_t size,
-                                  NetPacketSent *sent_cb)
+void qemu_net_queue_get_stats(NetQueue *queue, NetQueueStats *stats)
 {
-    NetPacket *packet;
-
-    if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
-        return; /* drop if queue full and no callback */
-    }
-    packet = g_malloc(sizeof(NetPacket) + size);
-    packet->sender = sender;
-    packet->flags = flags;
-    packet->size = size;
-    packet->sent_cb = sent_cb;
-    memcpy(packet->data, buf, size);
-
-    queue->nq_count++;
-    QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
+    *stats = queue->stats;
 }
 
+/* Queue a packet.  Zero-copy packets keep pointing at the sender's buffers,
+ * which stay valid until the sent callback runs; with @shared the payload
+ * copy is shared with the other queues the same packet is appended to.
+ */
 static void qemu_net_queue_append_iov(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
                                       const struct iovec *iov,
                                       int iovcnt,
-                                      NetPacketSent *sent_cb)
+                                      NetPacketSent *sent_cb,
+                                      NetPacketData **shared)
 {
     NetPacket *packet;
-    size_t max_len = 0;
-    int i;
+    size_t size = iov_size(iov, iovcnt);
 
     if (queue->nq_count >= queue->nq_maxlen && !sent_cb) {
         return; /* drop if queue full and no callback */
     }
-    for (i = 0; i < iovcnt; i++) {
-        max_len += iov[i].iov_len;
-    }
 
-    packet = g_malloc(sizeof(NetPacket) + max_len);
+    if ((flags & QEMU_NET_PACKET_FLAG_ZEROCOPY) && sent_cb) {
+        packet = g_malloc(sizeof(NetPacket) + iovcnt * sizeof(*iov));
+        packet->shared = NULL;
+        packet->data = NULL;
+        packet->iov = (struct iovec *)packet->payload;
+        packet->iovcnt = iovcnt;
+        memcpy(packet->iov, iov, iovcnt * sizeof(*iov));
+        queue->stats.zerocopy++;
+    } else if (shared) {
+        packet = g_malloc(sizeof(NetPacket));
+        if (!*shared) {
+            *shared = g_malloc(sizeof(NetPacketData) + size);
+            (*shared)->refcnt = 1;    /* the caller's reference */
+            iov_to_buf(iov, iovcnt, 0, (*shared)->data, size);
+            queue->stats.allocs++;
+            queue->stats.bytes_copied += size;
+        } else {
+            queue->stats.shared++;
+        }
+        (*shared)->refcnt++;
+        packet->shared = *shared;
+        packet->data = (*shared)->data;
+        packet->iov = NULL;
+    } else {
+        packet = g_malloc(sizeof(NetPacket) + size);
+        packet->shared = NULL;
+        packet->data = packet->payload;
+        packet->iov = NULL;
+        iov_to_buf(iov, iovcnt, 0, packet->payload, size);
+        queue->stats.bytes_copied += size;
+    }
     packet->sender = sender;
+    packet->flags = flags & ~QEMU_NET_PACKET_FLAG_ZEROCOPY;
+    packet->size = size;
     packet->sent_cb = sent_cb;
-    packet->flags = flags;
-    packet->size = 0;
-
-    for (i = 0; i < iovcnt; i++) {
-        size_t len = iov[i].iov_len;
-
-        memcpy(packet->data + packet->size, iov[i].iov_base, len);
-        packet->size += len;
-    }
 
+    queue->stats.queued++;
+    queue->stats.allocs++;
     queue->nq_count++;
     QTAILQ_INSERT_TAIL(&queue->packets, packet, entry);
 }
 
+static void qemu_net_queue_append(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const uint8_t *buf,
+                                  size_t size,
+                                  NetPacketSent *sent_cb)
+{
+    struct iovec iov = {
+        .iov_base = (void *)buf,
+        .iov_len = size,
+    };
+
+    qemu_net_queue_append_iov(queue, sender, flags, &iov, 1, sent_cb, NULL);
+}
+
 static ssize_t qemu_net_queue_deliver(NetQueue *queue,
                                       NetClientState *sender,
                                       unsigned flags,
@@ -175,6 +238,22 @@ static ssize_t qemu_net_queue_deliver_iov(NetQueue *queue,
     return ret;
 }
 
+static int qemu_net_queue_deliver_iov_batch(NetQueue *queue,
+                                            NetClientState *sender,
+                                            unsigned flags,
+                                            const NetBatchPacket *pkts,
+                                            int count)
+{
+    int ret;
+
+    queue->delivering = 1;
+    ret = qemu_deliver_packet_iov_batch(sender, flags, pkts, count,
+                                        queue->opaque);
+    queue->delivering = 0;
+
+    return ret;
+}
+
 ssize_t qemu_net_queue_send(NetQueue *queue,
                             NetClientState *sender,
                             unsigned flags,
@@ -210,13 +289,76 @@ ssize_t qemu_net_queue_send_iov(NetQueue *queue,
     ssize_t ret;
 
     if (queue->delivering || !qemu_can_send_packet(sender)) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb,
+                                  NULL);
+        return 0;
+    }
+
+    ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
+    if (ret == 0) {
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb,
+                                  NULL);
+        return 0;
+    }
+
+    qemu_net_queue_flush(queue);
+
+    return ret;
+}
+
+int qemu_net_queue_send_iov_batch(NetQueue *queue,
+                                  NetClientState *sender,
+                                  unsigned flags,
+                                  const NetBatchPacket *pkts,
+                                  int count,
+                                  NetPacketSent *sent_cb)
+{
+    int ret = 0;
+    int i;
+
+    if (!queue->delivering && qemu_can_send_packet(sender)) {
+        ret = qemu_net_queue_deliver_iov_batch(queue, sender, flags,
+                                               pkts, count);
+        if (ret == count) {
+            qemu_net_queue_flush(queue);
+            return ret;
+        }
+    }
+
+    for (i = ret; i < count; i++) {
+        qemu_net_queue_append_iov(queue, sender, flags,
+                                  pkts[i].iov, pkts[i].iovcnt, sent_cb, NULL);
+        if (sent_cb) {
+            break;
+        }
+    }
+
+    return ret;
+}
+
+/* Like send_iov() without a sent callback, for hubs fanning a packet out to
+ * several queues.  *shared must be NULL for the first queue; the caller
+ * drops its reference with qemu_net_packet_data_unref() afterwards.
+ */
+ssize_t qemu_net_queue_send_iov_shared(NetQueue *queue,
+                                       NetClientState *sender,
+                                       unsigned flags,
+                                       const struct iovec *iov,
+                                       int iovcnt,
+                                       NetPacketData **shared)
+{
+    ssize_t ret;
+
+    if (queue->delivering || !qemu_can_send_packet(sender)) {
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL,
+                                  shared);
         return 0;
     }
 
     ret = qemu_net_queue_deliver_iov(queue, sender, flags, iov, iovcnt);
     if (ret == 0) {
-        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, sent_cb);
+        qemu_net_queue_append_iov(queue, sender, flags, iov, iovcnt, NULL,
+                                  shared);
         return 0;
     }
 
@@ -233,7 +375,7 @@ void qemu_net_queue_purge(NetQueue *queue, NetClientState *from)
         if (packet->sender == from) {
             QTAILQ_REMOVE(&queue->packets, packet, entry);
             queue->nq_count--;
-            g_free(packet);
+            qemu_net_packet_free(packet);
         }
     }
 }
@@ -248,11 +390,19 @@ bool qemu_net_queue_flush(NetQueue *queue)
         QTAILQ_REMOVE(&queue->packets, packet, entry);
         queue->nq_count--;
 
-        ret = qemu_net_queue_deliver(queue,
-                                     packet->sender,
-                                     packet->flags,
-                                     packet->data,
-                                     packet->size);
+        if (packet->iov) {
+            ret = qemu_net_queue_deliver_iov(queue,
+                                             packet->sender,
+                                             packet->flags,
+                                             packet->iov,
+                                             packet->iovcnt);
+        } else {
+            ret = qemu_net_queue_deliver(queue,
+                                         packet->sender,
+                                         packet->flags,
+                                         packet->data,
+                                         packet->size);
+        }
         if (ret == 0) {
             queue->nq_count++;
             QTAILQ_INSERT_HEAD(&queue->packets, packet, entry);
@@ -263,7 +413,7 @@ bool qemu_net_queue_flush(NetQueue *queue)
             packet->sent_cb(packet->sender, ret);
         }
 
-        g_free(packet);
+        qemu_net_packet_free(packet);
     }
     return true;
 }
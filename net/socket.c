@@ -45,8 +45,14 @@ typedef struct NetSocketState {
     IOHandler *send_fn;           /* differs between SOCK_STREAM/SOCK_DGRAM */
     bool read_poll;               /* waiting to receive data? */
     bool write_poll;              /* waiting to transmit data? */
+#ifdef CONFIG_SENDMMSG
+    uint8_t *batch_buf;           /* SOCKET_BATCH datagrams (only SOCK_DGRAM) */
+#endif
 } NetSocketState;
 
+/* Maximum number of datagrams moved by one recvmmsg/sendmmsg call */
+#define SOCKET_BATCH 32
+
 static void net_socket_accept(void *opaque);
 static void net_socket_writable(void *opaque);
 
@@ -141,6 +147,41 @@ static ssize_t net_socket_receive_dgram(NetClientState *nc, const uint8_t *buf,
     return ret;
 }
 
+#ifdef CONFIG_SENDMMSG
+static int net_socket_receive_dgram_batch(NetClientState *nc,
+                                          const NetBatchPacket *pkts,
+                                          int count)
+{
+    NetSocketState *s = DO_UPCAST(NetSocketState, nc, nc);
+    struct mmsghdr msgs[SOCKET_BATCH];
+    int sent = 0, n, i, ret;
+
+    while (sent < count) {
+        n = MIN(count - sent, SOCKET_BATCH);
+        for (i = 0; i < n; i++) {
+            msgs[i].msg_hdr = (struct msghdr) {
+                .msg_name = &s->dgram_dst,
+                .msg_namelen = sizeof(s->dgram_dst),
+                .msg_iov = (struct iovec *)pkts[sent + i].iov,
+                .msg_iovlen = pkts[sent + i].iovcnt,
+            };
+        }
+
+        do {
+            ret = sendmmsg(s->fd, msgs, n, 0);
+        } while (ret == -1 && errno == EINTR);
+
+        if (ret == -1 && errno == EAGAIN) {
+            net_socket_write_poll(s, true);
+            break;
+        }
+        /* like sendto() errors, a failing datagram is dropped */
+        sent += ret == -1 ? 1 : ret;
+    }
+    return sent;
+}
+#endif
+
 static void net_socket_send(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -219,6 +260,44 @@ static void net_socket_send(void *opaque)
     }
 }
 
+#ifdef CONFIG_SENDMMSG
+static void net_socket_send_dgram(void *opaque)
+{
+    NetSocketState *s = opaque;
+    struct mmsghdr msgs[SOCKET_BATCH];
+    struct iovec iov[SOCKET_BATCH];
+    NetBatchPacket pkts[SOCKET_BATCH];
+    int i, n;
+
+    for (i = 0; i < SOCKET_BATCH; i++) {
+        iov[i].iov_base = s->batch_buf + i * NET_BUFSIZE;
+        iov[i].iov_len = NET_BUFSIZE;
+        msgs[i].msg_hdr = (struct msghdr) {
+            .msg_iov = &iov[i],
+            .msg_iovlen = 1,
+        };
+    }
+
+    n = recvmmsg(s->fd, msgs, SOCKET_BATCH, MSG_DONTWAIT, NULL);
+    if (n <= 0) {
+        return;
+    }
+    if (msgs[0].msg_len == 0) {
+        /* end of connection */
+        net_socket_read_poll(s, false);
+        net_socket_write_poll(s, false);
+        return;
+    }
+
+    for (i = 0; i < n; i++) {
+        iov[i].iov_len = msgs[i].msg_len;
+        pkts[i].iov = &iov[i];
+        pkts[i].iovcnt = 1;
+    }
+    qemu_sendv_packet_batch_async(&s->nc, QEMU_NET_PACKET_FLAG_NONE,
+                                  pkts, n, NULL);
+}
+#else
 static void net_socket_send_dgram(void *opaque)
 {
     NetSocketState *s = opaque;
@@ -235,6 +314,7 @@ static void net_socket_send_dgram(void *opaque)
     }
     qemu_send_packet(&s->nc, s->buf, size);
 }
+#endif
 
 static int net_socket_mcast_create(struct sockaddr_in *mcastaddr, struct in_addr *localaddr)
 {
@@ -330,12 +410,19 @@ static void net_socket_cleanup(NetClientState *nc)
         closesocket(s->listen_fd);
         s->listen_fd = -1;
     }
+#ifdef CONFIG_SENDMMSG
+    g_free(s->batch_buf);
+    s->batch_buf = NULL;
+#endif
 }
 
 static NetClientInfo net_dgram_socket_info = {
     .type = NET_CLIENT_OPTIONS_KIND_SOCKET,
     .size = sizeof(NetSocketState),
     .receive = net_socket_receive_dgram,
+#ifdef CONFIG_SENDMMSG
+    .receive_iov_batch = net_socket_receive_dgram_batch,
+#endif
     .cleanup = net_socket_cleanup,
 };
 
@@ -393,6 +480,10 @@ static NetSocketState *net_socket_fd_init_dgram(NetClientState *peer,
     s->fd = fd;
     s->listen_fd = -1;
     s->send_fn = net_socket_send_dgram;
+#ifdef CONFIG_SENDMMSG
+    /* only the pages that datagrams are written to get touched */
+    s->batch_buf = g_malloc(SOCKET_BATCH * NET_BUFSIZE);
+#endif
     net_socket_read_poll(s, true);
 
     /* mcast: save bound address as dst */
@@ -44,12 +44,21 @@
 
 #include "net/vhost_net.h"
 
+/* Maximum number of frames read from the tap device in one go */
+#define TAP_BATCH 64
+
 typedef struct TAPState {
     NetClientState nc;
     int fd;
     char down_script[1024];
     char down_script_arg[128];
-    uint8_t buf[NET_BUFSIZE];
+    /* Frames are read back to back, as long as a maximum sized one fits */
+    uint8_t buf[2 * NET_BUFSIZE];
+    struct iovec batch_iov[TAP_BATCH];
+    NetBatchPacket batch[TAP_BATCH];
+    int batch_count;
+    int batch_sent;
+    QEMUBH *send_bh;
     bool read_poll;
     bool write_poll;
     bool using_vnet_hdr;
@@ -183,31 +192,81 @@ static void tap_send_completed(NetClientState *nc, ssize_t len)
 {
     TAPState *s = DO_UPCAST(TAPState, nc, nc);
     tap_read_poll(s, true);
+
+    /* The fd may not become readable again, so flush leftovers now */
+    if (s->batch_sent < s->batch_count) {
+        qemu_bh_schedule(s->send_bh);
+    }
 }
 
-static void tap_send(void *opaque)
+static void tap_read_batch(TAPState *s)
 {
-    TAPState *s = opaque;
+    uint8_t *buf = s->buf;
     int size;
 
-    do {
-        uint8_t *buf = s->buf;
+    s->batch_count = s->batch_sent = 0;
+
+    while (s->batch_count < TAP_BATCH &&
+           buf + NET_BUFSIZE <= s->buf + sizeof(s->buf)) {
+        struct iovec *iov = &s->batch_iov[s->batch_count];
 
-        size = tap_read_packet(s->fd, s->buf, sizeof(s->buf));
+        size = tap_read_packet(s->fd, buf, NET_BUFSIZE);
         if (size <= 0) {
             break;
         }
 
+        iov->iov_base = buf;
+        iov->iov_len = size;
         if (s->host_vnet_hdr_len && !s->using_vnet_hdr) {
-            buf  += s->host_vnet_hdr_len;
-            size -= s->host_vnet_hdr_len;
+            iov->iov_base += s->host_vnet_hdr_len;
+            iov->iov_len -= s->host_vnet_hdr_len;
+        }
+        s->batch[s->batch_count].iov = iov;
+        s->batch[s->batch_count].iovcnt = 1;
+        s->batch_count++;
+
+        buf += QEMU_ALIGN_UP(size, sizeof(uint64_t));
+    }
+}
+
+/* Read a burst of frames and hand it to the peer in one call.  Frames that
+ * the peer could not take yet stay in s->buf until tap_send_completed().
+ */
+static void tap_send(void *opaque)
+{
+    TAPState *s = opaque;
+    int sent;
+
+    do {
+        if (s->batch_sent == s->batch_count) {
+            tap_read_batch(s);
+            if (!s->batch_count) {
+                break;
+            }
         }
 
-        size = qemu_send_packet_async(&s->nc, buf, size, tap_send_completed);
-        if (size == 0) {
+        sent = qemu_sendv_packet_batch_async(&s->nc,
+                                             QEMU_NET_PACKET_FLAG_NONE,
+                                             s->batch + s->batch_sent,
+                                             s->batch_count - s->batch_sent,
+                                             tap_send_completed);
+        s->batch_sent += sent;
+        if (s->batch_sent < s->batch_count) {
+            /* the first frame that was not delivered has been queued */
+            s->batch_sent++;
             tap_read_poll(s, false);
+            break;
         }
-    } while (size > 0 && qemu_can_send_packet(&s->nc));
+    } while (qemu_can_send_packet(&s->nc));
+}
+
+static void tap_send_bh(void *opaque)
+{
+    TAPState *s = opaque;
+
+    if (s->read_poll && s->enabled && qemu_can_send_packet(&s->nc)) {
+        tap_send(s);
+    }
 }
 
 bool tap_has_ufo(NetClientState *nc)
@@ -286,6 +345,7 @@ static void tap_cleanup(NetClientState *nc)
 
     tap_read_poll(s, false);
     tap_write_poll(s, false);
+    qemu_bh_delete(s->send_bh);
     close(s->fd);
     s->fd = -1;
 }
@@ -334,6 +394,7 @@ static TAPState *net_tap_fd_init(NetClientState *peer,
     s->using_vnet_hdr = false;
     s->has_ufo = tap_probe_has_ufo(s->fd);
     s->enabled = true;
+    s->send_bh = qemu_bh_new(tap_send_bh, s);
     tap_set_offload(&s->nc, 0, 0, 0, 0, 0);
     /*
      * Make sure host header length is set correctly in tap:
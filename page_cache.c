@@ -42,10 +42,20 @@ struct CacheItem {
     uint8_t *it_data;
 };
 
+/*
+ * The cache is set-associative: a page can live in any of the ways of the
+ * set its address maps to.  When the set is full, the least recently used
+ * page of the set is replaced, so a few hot pages that map to the same set
+ * no longer keep evicting each other.
+ */
+#define CACHE_WAYS 8
+
 struct PageCache {
     CacheItem *page_cache;
     unsigned int page_size;
     int64_t max_num_items;
+    int64_t num_sets;
+    unsigned int num_ways;
     uint64_t max_item_age;
     int64_t num_items;
 };
@@ -72,8 +82,11 @@ PageCache *cache_init(int64_t num_pages, unsigned int page_size)
     cache->num_items = 0;
     cache->max_item_age = 0;
     cache->max_num_items = num_pages;
+    cache->num_ways = MIN(num_pages, CACHE_WAYS);
+    cache->num_sets = num_pages / cache->num_ways;
 
-    DPRINTF("Setting cache buckets to %" PRId64 "\n", cache->max_num_items);
+    DPRINTF("Setting cache buckets to %" PRId64 " sets of %u\n",
+            cache->num_sets, cache->num_ways);
 
     cache->page_cache = g_malloc((cache->max_num_items) *
                                  sizeof(*cache->page_cache));
@@ -102,72 +115,105 @@ void cache_fini(PageCache *cache)
     cache->page_cache = NULL;
 }
 
-static size_t cache_get_cache_pos(const PageCache *cache,
-                                  uint64_t address)
+/* Returns the first way of the set that addr maps to */
+static CacheItem *cache_get_set(const PageCache *cache, uint64_t address)
 {
     size_t pos;
 
     g_assert(cache->max_num_items);
-    pos = (address / cache->page_size) & (cache->max_num_items - 1);
-    return pos;
+    pos = (address / cache->page_size) & (cache->num_sets - 1);
+    return &cache->page_cache[pos * cache->num_ways];
 }
 
-bool cache_is_cached(const PageCache *cache, uint64_t addr)
+static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
+    CacheItem *set;
+    unsigned int i;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    pos = cache_get_cache_pos(cache, addr);
-
-    return (cache->page_cache[pos].it_addr == addr);
+    set = cache_get_set(cache, addr);
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+    }
+    return NULL;
 }
 
-static CacheItem *cache_get_by_addr(const PageCache *cache, uint64_t addr)
+bool cache_is_cached(const PageCache *cache, uint64_t addr)
 {
-    size_t pos;
-
-    g_assert(cache);
-    g_assert(cache->page_cache);
+    return cache_get_by_addr(cache, addr) != NULL;
+}
 
-    pos = cache_get_cache_pos(cache, addr);
+uint8_t *get_cached_data(PageCache *cache, uint64_t addr)
+{
+    CacheItem *it = cache_get_by_addr(cache, addr);
 
-    return &cache->page_cache[pos];
+    if (!it) {
+        return NULL;
+    }
+    it->it_age = ++cache->max_item_age;
+    return it->it_data;
 }
 
-uint8_t *get_cached_data(const PageCache *cache, uint64_t addr)
+/* Returns the way that addr should be stored in: its current one, a free
+ * one, or the least recently used one of the set.
+ */
+static CacheItem *cache_get_victim(const PageCache *cache, uint64_t addr)
 {
-    return cache_get_by_addr(cache, addr)->it_data;
+    CacheItem *set = cache_get_set(cache, addr);
+    CacheItem *victim = &set[0];
+    unsigned int i;
+
+    for (i = 0; i < cache->num_ways; i++) {
+        if (set[i].it_addr == addr) {
+            return &set[i];
+        }
+        if (victim->it_data && (!set[i].it_data ||
+                                set[i].it_age < victim->it_age)) {
+            victim = &set[i];
+        }
+    }
+    return victim;
 }
 
-void cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
+bool cache_insert(PageCache *cache, uint64_t addr, uint8_t *pdata)
 {
-
-    CacheItem *it = NULL;
+    CacheItem *it;
+    bool evicted;
 
     g_assert(cache);
     g_assert(cache->page_cache);
 
-    /* actual update of entry */
-    it = cache_get_by_addr(cache, addr);
-
-    /* free old cached data if any */
-    g_free(it->it_data);
+    it = cache_get_victim(cache, addr);
+    evicted = it->it_data && it->it_addr != addr;
 
     if (!it->it_data) {
+        it->it_data = g_malloc(cache->page_size);
         cache->num_items++;
     }
-
-    it->it_data = g_memdup(pdata, cache->page_size);
+    memcpy(it->it_data, pdata, cache->page_size);
     it->it_age = ++cache->max_item_age;
     it->it_addr = addr;
+
+    return evicted;
+}
+
+static int cache_item_age_cmp(const void *a, const void *b)
+{
+    const CacheItem *ia = *(CacheItem * const *)a;
+    const CacheItem *ib = *(CacheItem * const *)b;
+
+    return ia->it_age < ib->it_age ? -1 : ia->it_age > ib->it_age;
 }
 
 int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
 {
     PageCache *new_cache;
-    int64_t i;
+    CacheItem **items;
+    int64_t i, nr = 0;
 
     CacheItem *old_it, *new_it;
 
@@ -189,30 +235,35 @@ int64_t cache_resize(PageCache *cache, int64_t new_num_pages)
         return -1;
     }
 
-    /* move all data from old cache */
+    /* move all data from old cache, least recently used first, so that
+     * the MRU pages win when a set overflows
+     */
+    items = g_malloc(cache->max_num_items * sizeof(*items));
     for (i = 0; i < cache->max_num_items; i++) {
-        old_it = &cache->page_cache[i];
-        if (old_it->it_addr != -1) {
-            /* check for collision, if there is, keep MRU page */
-            new_it = cache_get_by_addr(new_cache, old_it->it_addr);
-            if (new_it->it_data && new_it->it_age >= old_it->it_age) {
-                /* keep the MRU page */
-                g_free(old_it->it_data);
-            } else {
-                if (!new_it->it_data) {
-                    new_cache->num_items++;
-                }
-                g_free(new_it->it_data);
-                new_it->it_data = old_it->it_data;
-                new_it->it_age = old_it->it_age;
-                new_it->it_addr = old_it->it_addr;
-            }
+        if (cache->page_cache[i].it_data) {
+            items[nr++] = &cache->page_cache[i];
+        }
+    }
+    qsort(items, nr, sizeof(*items), cache_item_age_cmp);
+
+    for (i = 0; i < nr; i++) {
+        old_it = items[i];
+        new_it = cache_get_victim(new_cache, old_it->it_addr);
+        if (!new_it->it_data) {
+            new_cache->num_items++;
         }
+        g_free(new_it->it_data);
+        new_it->it_data = old_it->it_data;
+        new_it->it_age = old_it->it_age;
+        new_it->it_addr = old_it->it_addr;
     }
+    g_free(items);
 
     g_free(cache->page_cache);
     cache->page_cache = new_cache->page_cache;
     cache->max_num_items = new_cache->max_num_items;
+    cache->num_sets = new_cache->num_sets;
+    cache->num_ways = new_cache->num_ways;
     cache->num_items = new_cache->num_items;
 
     g_free(new_cache);
@@ -0,0 +1,380 @@
+/*
+ * Post-copy live migration, destination side RAM handling
+ *
+ * After the switch to post-copy the guest runs on the destination while
+ * part of its RAM is still on the source.  Guest RAM is registered with
+ * userfaultfd, so that touching a missing page blocks the faulting thread
+ * until the page is requested from the source and placed atomically.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <stdint.h>
+#include <unistd.h>
+#include "qemu-common.h"
+#include "exec/cpu-all.h"
+#include "migration/migration.h"
+#include "migration/postcopy-ram.h"
+#include "qemu/event_notifier.h"
+#include "qemu/thread.h"
+#include "trace.h"
+
+#ifdef CONFIG_USERFAULTFD
+
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/userfaultfd.h>
+
+typedef struct PostcopyBlock {
+    char *idstr;
+    uint8_t *host;
+    ram_addr_t length;
+} PostcopyBlock;
+
+static int uffd = -1;
+static int rp_fd = -1;
+static EventNotifier fault_quit;
+static QemuThread fault_thread;
+static PostcopyBlock *blocks;
+static int nb_blocks;
+
+static int check_block(const char *idstr, void *host, ram_addr_t offset,
+                       ram_addr_t length, bool anonymous, void *opaque)
+{
+    if (!anonymous) {
+        fprintf(stderr, "postcopy: RAM block %s is not anonymous memory\n",
+                idstr);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+bool postcopy_ram_supported_by_host(void)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    bool ret = false;
+    int fd;
+
+    if (getpagesize() != TARGET_PAGE_SIZE) {
+        fprintf(stderr, "postcopy: host page size %d differs from target "
+                "page size %d\n", getpagesize(), TARGET_PAGE_SIZE);
+        return false;
+    }
+    if (qemu_ram_foreach_block(check_block, NULL)) {
+        return false;
+    }
+
+    fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: userfaultfd not available: %s\n",
+                strerror(errno));
+        return false;
+    }
+    if (ioctl(fd, UFFDIO_API, &api)) {
+        fprintf(stderr, "postcopy: UFFDIO_API failed: %s\n", strerror(errno));
+    } else {
+        ret = true;
+    }
+    close(fd);
+    return ret;
+}
+
+typedef struct DiscardRange {
+    const char *idstr;
+    uint64_t start;
+    uint64_t length;
+} DiscardRange;
+
+static int discard_block(const char *idstr, void *host, ram_addr_t offset,
+                         ram_addr_t length, bool anonymous, void *opaque)
+{
+    DiscardRange *range = opaque;
+
+    if (strcmp(idstr, range->idstr)) {
+        return 0;
+    }
+    if (range->start > length || range->length > length - range->start ||
+        (range->start | range->length) & (TARGET_PAGE_SIZE - 1)) {
+        return -EINVAL;
+    }
+    if (qemu_madvise((uint8_t *)host + range->start, range->length,
+                     QEMU_MADV_DONTNEED)) {
+        return -errno;
+    }
+    return 1;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    DiscardRange range = {
+        .idstr = idstr,
+        .start = start,
+        .length = length,
+    };
+    int ret;
+
+    ret = qemu_ram_foreach_block(discard_block, &range);
+    if (ret == 0) {
+        fprintf(stderr, "postcopy: unknown RAM block %s\n", idstr);
+        return -EINVAL;
+    }
+    return ret < 0 ? ret : 0;
+}
+
+static PostcopyBlock *find_block(uint64_t addr)
+{
+    int i;
+
+    for (i = 0; i < nb_blocks; i++) {
+        if (addr - (uintptr_t)blocks[i].host < blocks[i].length) {
+            return &blocks[i];
+        }
+    }
+    return NULL;
+}
+
+static void *postcopy_ram_fault_thread(void *opaque)
+{
+    struct pollfd pfd[2] = {
+        { .fd = uffd, .events = POLLIN },
+        { .fd = event_notifier_get_fd(&fault_quit), .events = POLLIN },
+    };
+
+    for (;;) {
+        struct uffd_msg msg;
+        PostcopyBlock *block;
+        uint64_t addr;
+
+        if (poll(pfd, ARRAY_SIZE(pfd), -1) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            fprintf(stderr, "postcopy: poll failed: %s\n", strerror(errno));
+            break;
+        }
+        if (pfd[1].revents) {
+            break;
+        }
+        if (read(uffd, &msg, sizeof(msg)) != sizeof(msg)) {
+            /* another thread may have woken up the faulting thread */
+            continue;
+        }
+        if (msg.event != UFFD_EVENT_PAGEFAULT) {
+            continue;
+        }
+
+        addr = msg.arg.pagefault.address & ~(uint64_t)(TARGET_PAGE_SIZE - 1);
+        block = find_block(addr);
+        if (!block) {
+            fprintf(stderr, "postcopy: fault at unknown address 0x%" PRIx64
+                    "\n", addr);
+            continue;
+        }
+        trace_postcopy_ram_fault_request(addr, block->idstr,
+                                         addr - (uintptr_t)block->host);
+
+        /* This fails once the source has sent everything and closed the
+         * connection.  The page is then zero on the source and will be
+         * filled in when the registration is dropped.
+         */
+        migrate_send_rp_req_pages(rp_fd, block->idstr,
+                                  addr - (uintptr_t)block->host,
+                                  TARGET_PAGE_SIZE);
+    }
+    return NULL;
+}
+
+static int register_block(const char *idstr, void *host, ram_addr_t offset,
+                          ram_addr_t length, bool anonymous, void *opaque)
+{
+    struct uffdio_register reg = {
+        .range = { .start = (uintptr_t)host, .len = length },
+        .mode = UFFDIO_REGISTER_MODE_MISSING,
+    };
+    uint64_t needed = ((uint64_t)1 << _UFFDIO_COPY) |
+                      ((uint64_t)1 << _UFFDIO_ZEROPAGE);
+    PostcopyBlock *block;
+
+    if (ioctl(uffd, UFFDIO_REGISTER, &reg)) {
+        fprintf(stderr, "postcopy: cannot register RAM block %s: %s\n",
+                idstr, strerror(errno));
+        return -errno;
+    }
+
+    blocks = g_realloc(blocks, (nb_blocks + 1) * sizeof(*blocks));
+    block = &blocks[nb_blocks++];
+    block->idstr = g_strdup(idstr);
+    block->host = host;
+    block->length = length;
+
+    if ((reg.ioctls & needed) != needed) {
+        fprintf(stderr, "postcopy: cannot place pages in RAM block %s\n",
+                idstr);
+        return -ENOSYS;
+    }
+    return 0;
+}
+
+int postcopy_ram_incoming_init(int fd)
+{
+    struct uffdio_api api = { .api = UFFD_API };
+    int ret;
+
+    uffd = syscall(__NR_userfaultfd, O_CLOEXEC | O_NONBLOCK);
+    if (uffd < 0) {
+        ret = -errno;
+        fprintf(stderr, "postcopy: userfaultfd not available: %s\n",
+                strerror(errno));
+        return ret;
+    }
+    if (ioctl(uffd, UFFDIO_API, &api)) {
+        ret = -errno;
+        fprintf(stderr, "postcopy: UFFDIO_API failed: %s\n", strerror(errno));
+        goto fail;
+    }
+
+    ret = qemu_ram_foreach_block(register_block, NULL);
+    if (ret < 0) {
+        goto fail;
+    }
+
+    ret = event_notifier_init(&fault_quit, false);
+    if (ret < 0) {
+        goto fail;
+    }
+    rp_fd = fd;
+    qemu_thread_create(&fault_thread, postcopy_ram_fault_thread, NULL,
+                       QEMU_THREAD_JOINABLE);
+    return 0;
+
+fail:
+    postcopy_ram_incoming_cleanup();
+    return ret;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+    int i;
+
+    if (uffd < 0) {
+        return;
+    }
+
+    if (rp_fd >= 0) {
+        event_notifier_set(&fault_quit);
+        qemu_thread_join(&fault_thread);
+        event_notifier_cleanup(&fault_quit);
+        rp_fd = -1;
+    }
+
+    /* Threads still waiting for a page are woken up and see zeroes.  */
+    for (i = 0; i < nb_blocks; i++) {
+        struct uffdio_range range = {
+            .start = (uintptr_t)blocks[i].host,
+            .len = blocks[i].length,
+        };
+
+        ioctl(uffd, UFFDIO_UNREGISTER, &range);
+        g_free(blocks[i].idstr);
+    }
+    g_free(blocks);
+    blocks = NULL;
+    nb_blocks = 0;
+
+    close(uffd);
+    uffd = -1;
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return uffd >= 0;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    struct uffdio_copy copy = {
+        .dst = (uintptr_t)host,
+        .src = (uintptr_t)from,
+        .len = TARGET_PAGE_SIZE,
+    };
+    int ret;
+
+    do {
+        ret = ioctl(uffd, UFFDIO_COPY, &copy);
+    } while (ret < 0 && errno == EAGAIN);
+
+    /* EEXIST: the page was requested and sent again in the meantime */
+    if (ret < 0 && errno != EEXIST) {
+        ret = -errno;
+        fprintf(stderr, "postcopy: cannot place page at %p: %s\n",
+                host, strerror(errno));
+        return ret;
+    }
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    struct uffdio_zeropage zero = {
+        .range = { .start = (uintptr_t)host, .len = TARGET_PAGE_SIZE },
+    };
+    int ret;
+
+    do {
+        ret = ioctl(uffd, UFFDIO_ZEROPAGE, &zero);
+    } while (ret < 0 && errno == EAGAIN);
+
+    if (ret < 0 && errno != EEXIST) {
+        ret = -errno;
+        fprintf(stderr, "postcopy: cannot place zero page at %p: %s\n",
+                host, strerror(errno));
+        return ret;
+    }
+    trace_postcopy_place_page(host);
+    return 0;
+}
+
+#else
+
+bool postcopy_ram_supported_by_host(void)
+{
+    fprintf(stderr, "postcopy: userfaultfd not supported on this host\n");
+    return false;
+}
+
+int postcopy_ram_discard_range(const char *idstr, uint64_t start,
+                               uint64_t length)
+{
+    return -ENOSYS;
+}
+
+int postcopy_ram_incoming_init(int rp_fd)
+{
+    return -ENOSYS;
+}
+
+void postcopy_ram_incoming_cleanup(void)
+{
+}
+
+bool postcopy_ram_incoming_active(void)
+{
+    return false;
+}
+
+int postcopy_place_page(void *host, const void *from)
+{
+    return -ENOSYS;
+}
+
+int postcopy_place_zero_page(void *host)
+{
+    return -ENOSYS;
+}
+
+#endif
@@ -100,6 +100,7 @@ static void help(void)
            "  '-q' use Quiet mode - do not print any output (except errors)\n"
            "  '-S' indicates the consecutive number of bytes that must contain only zeros\n"
            "       for qemu-img to create a sparse image during conversion\n"
+           "  '-m' number of parallel coroutines for the conversion (1 to 16, default 1)\n"
            "  '--output' takes the format in which the output must be done (human or json)\n"
            "\n"
            "Parameters to check subcommand:\n"
@@ -1108,25 +1109,286 @@ out3:
     return ret;
 }
 
+#define MAX_COROUTINES 16
+
+typedef struct ImgConvertState {
+    BlockDriverState **src;
+    int64_t *src_sectors;
+    int src_num;
+    int64_t total_sectors;
+    BlockDriverState *target;
+    bool compressed;
+    bool has_zero_init;
+    bool target_has_backing;
+    int min_sparse;
+    int buf_sectors;
+    int num_coroutines;
+    int running_coroutines;
+
+    /* next sector to hand out to a coroutine */
+    int64_t sector_num;
+
+    /* compressed output is issued in order; wr_offs is the first sector that
+     * has not been issued yet and wr_queue holds the coroutines waiting for
+     * their turn */
+    int64_t wr_offs;
+    CoQueue wr_queue;
+
+    int ret;
+} ImgConvertState;
+
+static int convert_find_src(ImgConvertState *s, int64_t sector_num,
+                            int64_t *src_sector)
+{
+    int i;
+
+    for (i = 0; i < s->src_num; i++) {
+        if (sector_num < s->src_sectors[i]) {
+            *src_sector = sector_num;
+            return i;
+        }
+        sector_num -= s->src_sectors[i];
+    }
+    abort();
+}
+
+/* Number of sectors starting at sector_num that one coroutine handles */
+static int convert_chunk_sectors(ImgConvertState *s, int64_t sector_num)
+{
+    int64_t n = MIN(s->total_sectors - sector_num, s->buf_sectors);
+    int64_t src_sector;
+    int i;
+
+    if (!s->compressed) {
+        /* allocation status is queried per source image */
+        i = convert_find_src(s, sector_num, &src_sector);
+        n = MIN(n, s->src_sectors[i] - src_sector);
+    }
+    return n;
+}
+
+static int coroutine_fn convert_co_read(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t src_sector;
+    int i, n, ret;
+
+    while (nb_sectors > 0) {
+        i = convert_find_src(s, sector_num, &src_sector);
+        n = MIN(nb_sectors, s->src_sectors[i] - src_sector);
+
+        iov.iov_base = buf;
+        iov.iov_len = n * BDRV_SECTOR_SIZE;
+        qemu_iovec_init_external(&qiov, &iov, 1);
+
+        ret = bdrv_co_readv(s->src[i], src_sector, n, &qiov);
+        if (ret < 0) {
+            error_report("error while reading sector %" PRId64 ": %s",
+                         src_sector, strerror(-ret));
+            return ret;
+        }
+
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_write(ImgConvertState *s, int64_t sector_num,
+                                         int nb_sectors, uint8_t *buf)
+{
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int n, ret;
+
+    while (nb_sectors > 0) {
+        /* If the output image is being created as a copy on write image,
+           copy all sectors even the ones containing only NUL bytes,
+           because they may differ from the sectors in the base image.
+
+           If the output is to a host device, we also write out
+           sectors that are entirely 0, since whatever data was
+           already there is garbage, not 0s. */
+        if (!s->has_zero_init || s->target_has_backing ||
+            is_allocated_sectors_min(buf, nb_sectors, &n, s->min_sparse)) {
+            if (!s->has_zero_init || s->target_has_backing) {
+                n = nb_sectors;
+            }
+
+            iov.iov_base = buf;
+            iov.iov_len = n * BDRV_SECTOR_SIZE;
+            qemu_iovec_init_external(&qiov, &iov, 1);
+
+            ret = bdrv_co_writev(s->target, sector_num, n, &qiov);
+            if (ret < 0) {
+                error_report("error while writing sector %" PRId64
+                             ": %s", sector_num, strerror(-ret));
+                return ret;
+            }
+        }
+        sector_num += n;
+        nb_sectors -= n;
+        buf += n * BDRV_SECTOR_SIZE;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_copy(ImgConvertState *s, int64_t sector_num,
+                                        int nb_sectors, uint8_t *buf)
+{
+    int64_t src_sector;
+    int i, n, ret;
+
+    i = convert_find_src(s, sector_num, &src_sector);
+    while (nb_sectors > 0) {
+        n = nb_sectors;
+
+        /* If the output image is being created as a copy on write image,
+           assume that sectors which are unallocated in the input image
+           are present in both the output's and input's base images (no
+           need to copy them). */
+        if (s->has_zero_init && s->target_has_backing) {
+            ret = bdrv_co_is_allocated(s->src[i], src_sector, nb_sectors, &n);
+            if (ret < 0) {
+                error_report("error while checking allocation of sector %"
+                             PRId64 ": %s", src_sector, strerror(-ret));
+                return ret;
+            }
+            if (!ret) {
+                goto next;
+            }
+        }
+
+        ret = convert_co_read(s, sector_num, n, buf);
+        if (ret < 0) {
+            return ret;
+        }
+        ret = convert_co_write(s, sector_num, n, buf);
+        if (ret < 0) {
+            return ret;
+        }
+next:
+        sector_num += n;
+        src_sector += n;
+        nb_sectors -= n;
+    }
+    return 0;
+}
+
+static int coroutine_fn convert_co_compress(ImgConvertState *s,
+                                            int64_t sector_num,
+                                            int nb_sectors, uint8_t *buf)
+{
+    int ret;
+
+    ret = convert_co_read(s, sector_num, nb_sectors, buf);
+    if (ret < 0) {
+        return ret;
+    }
+
+    /* Compressed clusters are appended to the image, so issue them in guest
+     * order to keep the output sequential.  The block driver deflates
+     * concurrently issued clusters in parallel. */
+    while (s->wr_offs != sector_num && !s->ret) {
+        qemu_co_queue_wait(&s->wr_queue);
+    }
+    if (s->ret) {
+        return s->ret;
+    }
+    s->wr_offs = sector_num + nb_sectors;
+    qemu_co_queue_restart_all(&s->wr_queue);
+
+    if (!buffer_is_zero(buf, nb_sectors * BDRV_SECTOR_SIZE)) {
+        ret = bdrv_write_compressed(s->target, sector_num, buf, nb_sectors);
+        if (ret < 0) {
+            error_report("error while compressing sector %" PRId64
+                         ": %s", sector_num, strerror(-ret));
+            return ret;
+        }
+    }
+    return 0;
+}
+
+static void coroutine_fn convert_co_do_copy(void *opaque)
+{
+    ImgConvertState *s = opaque;
+    uint8_t *buf;
+    int64_t sector_num;
+    int n, ret;
+
+    buf = qemu_blockalign(s->target, s->buf_sectors * BDRV_SECTOR_SIZE);
+
+    while (!s->ret && s->sector_num < s->total_sectors) {
+        sector_num = s->sector_num;
+        n = convert_chunk_sectors(s, sector_num);
+        s->sector_num += n;
+
+        if (s->compressed) {
+            ret = convert_co_compress(s, sector_num, n, buf);
+        } else {
+            ret = convert_co_copy(s, sector_num, n, buf);
+        }
+        if (ret < 0) {
+            if (!s->ret) {
+                s->ret = ret;
+            }
+            qemu_co_queue_restart_all(&s->wr_queue);
+            break;
+        }
+
+        qemu_progress_print(100.0f * n / s->total_sectors, 100);
+    }
+
+    qemu_vfree(buf);
+    s->running_coroutines--;
+}
+
+/* Copy all sources to the target with s->num_coroutines requests in flight */
+static int convert_do_copy(ImgConvertState *s)
+{
+    Coroutine *co;
+    int i;
+
+    qemu_co_queue_init(&s->wr_queue);
+    s->running_coroutines = s->num_coroutines;
+    for (i = 0; i < s->num_coroutines; i++) {
+        co = qemu_coroutine_create(convert_co_do_copy);
+        qemu_coroutine_enter(co, s);
+    }
+
+    while (s->running_coroutines) {
+        qemu_aio_wait();
+    }
+
+    if (s->compressed && !s->ret) {
+        /* signal EOF to align */
+        bdrv_write_compressed(s->target, 0, NULL, 0);
+    }
+    return s->ret;
+}
+
 static int img_convert(int argc, char **argv)
 {
-    int c, ret = 0, n, n1, bs_n, bs_i, compress, cluster_size, cluster_sectors;
+    int c, ret = 0, bs_n, bs_i, compress, cluster_size, cluster_sectors;
     int progress = 0, flags;
     const char *fmt, *out_fmt, *cache, *out_baseimg, *out_filename;
     BlockDriver *drv, *proto_drv;
     BlockDriverState **bs = NULL, *out_bs = NULL;
-    int64_t total_sectors, nb_sectors, sector_num, bs_offset;
-    uint64_t bs_sectors;
-    uint8_t * buf = NULL;
-    const uint8_t *buf1;
+    int64_t total_sectors;
+    int64_t *bs_sectors = NULL;
+    uint64_t sectors;
     BlockDriverInfo bdi;
     QEMUOptionParameter *param = NULL, *create_options = NULL;
     QEMUOptionParameter *out_baseimg_param;
     char *options = NULL;
     const char *snapshot_name = NULL;
-    float local_progress = 0;
     int min_sparse = 8; /* Need at least 4k of zeros for sparse detection */
+    int num_coroutines = 1;
     bool quiet = false;
+    ImgConvertState state;
 
     fmt = NULL;
     out_fmt = "raw";
@@ -1134,7 +1396,7 @@ static int img_convert(int argc, char **argv)
     out_baseimg = NULL;
     compress = 0;
     for(;;) {
-        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:q");
+        c = getopt(argc, argv, "f:O:B:s:hce6o:pS:t:qm:");
         if (c == -1) {
             break;
         }
@@ -1191,6 +1453,19 @@ static int img_convert(int argc, char **argv)
         case 'q':
             quiet = true;
             break;
+        case 'm':
+        {
+            char *end;
+            num_coroutines = strtol(optarg, &end, 10);
+            if (*end || num_coroutines < 1 ||
+                num_coroutines > MAX_COROUTINES) {
+                error_report("Invalid number of coroutines. Allowed number of"
+                             " coroutines is between 1 and %d",
+                             MAX_COROUTINES);
+                return 1;
+            }
+            break;
+        }
         }
     }
 
@@ -1223,6 +1498,7 @@ static int img_convert(int argc, char **argv)
     qemu_progress_print(0, 100);
 
     bs = g_malloc0(bs_n * sizeof(BlockDriverState *));
+    bs_sectors = g_malloc0(bs_n * sizeof(int64_t));
 
     total_sectors = 0;
     for (bs_i = 0; bs_i < bs_n; bs_i++) {
@@ -1233,8 +1509,9 @@ static int img_convert(int argc, char **argv)
             ret = -1;
             goto out;
         }
-        bdrv_get_geometry(bs[bs_i], &bs_sectors);
-        total_sectors += bs_sectors;
+        bdrv_get_geometry(bs[bs_i], &sectors);
+        bs_sectors[bs_i] = sectors;
+        total_sectors += sectors;
     }
 
     if (snapshot_name != NULL) {
@@ -1352,10 +1629,19 @@ static int img_convert(int argc, char **argv)
         goto out;
     }
 
-    bs_i = 0;
-    bs_offset = 0;
-    bdrv_get_geometry(bs[0], &bs_sectors);
-    buf = qemu_blockalign(out_bs, IO_BUF_SIZE);
+    state = (ImgConvertState) {
+        .src                = bs,
+        .src_sectors        = bs_sectors,
+        .src_num            = bs_n,
+        .total_sectors      = total_sectors,
+        .target             = out_bs,
+        .compressed         = compress,
+        .has_zero_init      = bdrv_has_zero_init(out_bs),
+        .target_has_backing = (out_baseimg != NULL),
+        .min_sparse         = min_sparse,
+        .buf_sectors        = IO_BUF_SIZE / BDRV_SECTOR_SIZE,
+        .num_coroutines     = num_coroutines,
+    };
 
     if (compress) {
         ret = bdrv_get_info(out_bs, &bdi);
@@ -1370,167 +1656,16 @@ static int img_convert(int argc, char **argv)
             goto out;
         }
         cluster_sectors = cluster_size >> 9;
-        sector_num = 0;
-
-        nb_sectors = total_sectors;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, cluster_sectors));
-        }
-
-        for(;;) {
-            int64_t bs_num;
-            int remainder;
-            uint8_t *buf2;
-
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0)
-                break;
-            if (nb_sectors >= cluster_sectors)
-                n = cluster_sectors;
-            else
-                n = nb_sectors;
-
-            bs_num = sector_num - bs_offset;
-            assert (bs_num >= 0);
-            remainder = n;
-            buf2 = buf;
-            while (remainder > 0) {
-                int nlow;
-                while (bs_num == bs_sectors) {
-                    bs_i++;
-                    assert (bs_i < bs_n);
-                    bs_offset += bs_sectors;
-                    bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                    bs_num = 0;
-                    /* printf("changing part: sector_num=%" PRId64 ", "
-                       "bs_i=%d, bs_offset=%" PRId64 ", bs_sectors=%" PRId64
-                       "\n", sector_num, bs_i, bs_offset, bs_sectors); */
-                }
-                assert (bs_num < bs_sectors);
-
-                nlow = (remainder > bs_sectors - bs_num) ? bs_sectors - bs_num : remainder;
-
-                ret = bdrv_read(bs[bs_i], bs_num, buf2, nlow);
-                if (ret < 0) {
-                    error_report("error while reading sector %" PRId64 ": %s",
-                                 bs_num, strerror(-ret));
-                    goto out;
-                }
-
-                buf2 += nlow * 512;
-                bs_num += nlow;
-
-                remainder -= nlow;
-            }
-            assert (remainder == 0);
-
-            if (!buffer_is_zero(buf, n * BDRV_SECTOR_SIZE)) {
-                ret = bdrv_write_compressed(out_bs, sector_num, buf, n);
-                if (ret != 0) {
-                    error_report("error while compressing sector %" PRId64
-                                 ": %s", sector_num, strerror(-ret));
-                    goto out;
-                }
-            }
-            sector_num += n;
-            qemu_progress_print(local_progress, 100);
-        }
-        /* signal EOF to align */
-        bdrv_write_compressed(out_bs, 0, NULL, 0);
-    } else {
-        int has_zero_init = bdrv_has_zero_init(out_bs);
-
-        sector_num = 0; // total number of sectors converted so far
-        nb_sectors = total_sectors - sector_num;
-        if (nb_sectors != 0) {
-            local_progress = (float)100 /
-                (nb_sectors / MIN(nb_sectors, IO_BUF_SIZE / 512));
-        }
-
-        for(;;) {
-            nb_sectors = total_sectors - sector_num;
-            if (nb_sectors <= 0) {
-                break;
-            }
-            if (nb_sectors >= (IO_BUF_SIZE / 512)) {
-                n = (IO_BUF_SIZE / 512);
-            } else {
-                n = nb_sectors;
-            }
-
-            while (sector_num - bs_offset >= bs_sectors) {
-                bs_i ++;
-                assert (bs_i < bs_n);
-                bs_offset += bs_sectors;
-                bdrv_get_geometry(bs[bs_i], &bs_sectors);
-                /* printf("changing part: sector_num=%" PRId64 ", bs_i=%d, "
-                  "bs_offset=%" PRId64 ", bs_sectors=%" PRId64 "\n",
-                   sector_num, bs_i, bs_offset, bs_sectors); */
-            }
-
-            if (n > bs_offset + bs_sectors - sector_num) {
-                n = bs_offset + bs_sectors - sector_num;
-            }
+        state.buf_sectors = cluster_sectors;
+    }
 
-            if (has_zero_init) {
-                /* If the output image is being created as a copy on write image,
-                   assume that sectors which are unallocated in the input image
-                   are present in both the output's and input's base images (no
-                   need to copy them). */
-                if (out_baseimg) {
-                    if (!bdrv_is_allocated(bs[bs_i], sector_num - bs_offset,
-                                           n, &n1)) {
-                        sector_num += n1;
-                        continue;
-                    }
-                    /* The next 'n1' sectors are allocated in the input image. Copy
-                       only those as they may be followed by unallocated sectors. */
-                    n = n1;
-                }
-            } else {
-                n1 = n;
-            }
+    ret = convert_do_copy(&state);
 
-            ret = bdrv_read(bs[bs_i], sector_num - bs_offset, buf, n);
-            if (ret < 0) {
-                error_report("error while reading sector %" PRId64 ": %s",
-                             sector_num - bs_offset, strerror(-ret));
-                goto out;
-            }
-            /* NOTE: at the same time we convert, we do not write zero
-               sectors to have a chance to compress the image. Ideally, we
-               should add a specific call to have the info to go faster */
-            buf1 = buf;
-            while (n > 0) {
-                /* If the output image is being created as a copy on write image,
-                   copy all sectors even the ones containing only NUL bytes,
-                   because they may differ from the sectors in the base image.
-
-                   If the output is to a host device, we also write out
-                   sectors that are entirely 0, since whatever data was
-                   already there is garbage, not 0s. */
-                if (!has_zero_init || out_baseimg ||
-                    is_allocated_sectors_min(buf1, n, &n1, min_sparse)) {
-                    ret = bdrv_write(out_bs, sector_num, buf1, n1);
-                    if (ret < 0) {
-                        error_report("error while writing sector %" PRId64
-                                     ": %s", sector_num, strerror(-ret));
-                        goto out;
-                    }
-                }
-                sector_num += n1;
-                n -= n1;
-                buf1 += n1 * 512;
-            }
-            qemu_progress_print(local_progress, 100);
-        }
-    }
 out:
     qemu_progress_end();
     free_option_parameters(create_options);
     free_option_parameters(param);
-    qemu_vfree(buf);
+    g_free(bs_sectors);
     if (out_bs) {
         bdrv_delete(out_bs);
     }
@@ -1660,6 +1795,10 @@ static void collect_image_info(BlockDriverState *bs,
             info->cluster_size = bdi.cluster_size;
             info->has_cluster_size = true;
         }
+        if (bdi.subcluster_size != 0) {
+            info->subcluster_size = bdi.subcluster_size;
+            info->has_subcluster_size = true;
+        }
         info->dirty_flag = bdi.is_dirty;
         info->has_dirty_flag = true;
     }
@@ -1709,6 +1848,10 @@ static void dump_human_image_info(ImageInfo *info)
         printf("cluster_size: %" PRId64 "\n", info->cluster_size);
     }
 
+    if (info->has_subcluster_size) {
+        printf("subcluster_size: %" PRId64 "\n", info->subcluster_size);
+    }
+
     if (info->has_dirty_flag && info->dirty_flag) {
         printf("cleanly shut down: no\n");
     }
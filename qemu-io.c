@@ -233,7 +233,7 @@ static void coroutine_fn co_write_zeroes_entry(void *opaque)
     CoWriteZeroes *data = opaque;
 
     data->ret = bdrv_co_write_zeroes(bs, data->offset / BDRV_SECTOR_SIZE,
-                                     data->count / BDRV_SECTOR_SIZE);
+                                     data->count / BDRV_SECTOR_SIZE, 0);
     data->done = true;
     if (data->ret < 0) {
         *data->total = data->ret;
@@ -1391,6 +1391,281 @@ static const cmdinfo_t aio_flush_cmd = {
     .oneline    = "completes all outstanding aio requests"
 };
 
+static int aio_plug_f(int argc, char **argv)
+{
+    bdrv_io_plug(bs);
+    return 0;
+}
+
+static const cmdinfo_t aio_plug_cmd = {
+    .name       = "aio_plug",
+    .cfunc      = aio_plug_f,
+    .oneline    = "holds back aio requests until aio_unplug"
+};
+
+static int aio_unplug_f(int argc, char **argv)
+{
+    bdrv_io_unplug(bs);
+    return 0;
+}
+
+static const cmdinfo_t aio_unplug_cmd = {
+    .name       = "aio_unplug",
+    .cfunc      = aio_unplug_f,
+    .oneline    = "submits the aio requests held back since aio_plug"
+};
+
+/* Latency histogram buckets: [0, 1) us, then powers of two up to ~1 s */
+#define BENCH_BUCKETS 22
+
+typedef struct BenchState {
+    int is_write;
+    int64_t offset;
+    int64_t nb_blocks;      /* number of request-sized blocks in the range */
+    int size;
+    int count;              /* requests not yet submitted */
+    int in_flight;
+    int errors;
+    uint32_t rand_state;
+    int64_t min_ns;
+    int64_t max_ns;
+    int64_t total_ns;
+    int64_t done;
+    int64_t hist[BENCH_BUCKETS];
+} BenchState;
+
+typedef struct BenchReq {
+    BenchState *state;
+    QEMUIOVector qiov;
+    struct iovec iov;
+    int64_t start_ns;
+} BenchReq;
+
+/* xorshift, so that a run can be repeated with the same offsets */
+static uint32_t bench_rand(BenchState *b)
+{
+    b->rand_state ^= b->rand_state << 13;
+    b->rand_state ^= b->rand_state >> 17;
+    b->rand_state ^= b->rand_state << 5;
+    return b->rand_state;
+}
+
+static void bench_cb(void *opaque, int ret);
+
+static void bench_submit(BenchReq *req)
+{
+    BenchState *b = req->state;
+    int64_t sector;
+
+    sector = (b->offset + (bench_rand(b) % b->nb_blocks) * b->size) >> 9;
+    b->count--;
+    b->in_flight++;
+    req->start_ns = get_clock();
+    if (b->is_write) {
+        bdrv_aio_writev(bs, sector, &req->qiov, b->size >> 9, bench_cb, req);
+    } else {
+        bdrv_aio_readv(bs, sector, &req->qiov, b->size >> 9, bench_cb, req);
+    }
+}
+
+static void bench_cb(void *opaque, int ret)
+{
+    BenchReq *req = opaque;
+    BenchState *b = req->state;
+    int64_t ns = get_clock() - req->start_ns;
+    int64_t us = ns / 1000;
+    int bucket = 0;
+
+    b->in_flight--;
+    if (ret < 0) {
+        b->errors++;
+    }
+
+    while (us && bucket < BENCH_BUCKETS - 1) {
+        us >>= 1;
+        bucket++;
+    }
+    b->hist[bucket]++;
+    b->min_ns = MIN(b->min_ns, ns);
+    b->max_ns = MAX(b->max_ns, ns);
+    b->total_ns += ns;
+    b->done++;
+
+    if (b->count > 0 && !b->errors) {
+        bench_submit(req);
+    }
+}
+
+static int64_t bench_bucket_limit_us(int bucket)
+{
+    return bucket ? 1LL << bucket : 1;
+}
+
+static int64_t bench_percentile_us(BenchState *b, int percent)
+{
+    int64_t sum = 0;
+    int i;
+
+    for (i = 0; i < BENCH_BUCKETS; i++) {
+        sum += b->hist[i];
+        if (sum * 100 >= b->done * percent) {
+            break;
+        }
+    }
+    return bench_bucket_limit_us(MIN(i, BENCH_BUCKETS - 1));
+}
+
+static void bench_help(void)
+{
+    printf(
+"\n"
+" measures request latency and throughput of the open file\n"
+"\n"
+" Example:\n"
+" 'bench -d 32 -c 100000 0 1G' - 100000 random 4k reads in the first\n"
+"                                gigabyte, with 32 requests in flight\n"
+"\n"
+" Submits asynchronous requests of the given size at random offsets in the\n"
+" range, keeping the given number of requests in flight, and prints the\n"
+" throughput and a histogram of the request latencies.\n"
+" -w, -- write instead of read\n"
+" -c, -- number of requests (default 10000)\n"
+" -d, -- queue depth (default 1)\n"
+" -s, -- request size (default 4k)\n"
+" -q, -- only print the summary, not the histogram\n"
+"\n");
+}
+
+static int bench_f(int argc, char **argv);
+
+static const cmdinfo_t bench_cmd = {
+    .name       = "bench",
+    .cfunc      = bench_f,
+    .argmin     = 2,
+    .argmax     = -1,
+    .args       = "[-wq] [-c count] [-d depth] [-s size] off len",
+    .oneline    = "measures request latency and throughput",
+    .help       = bench_help,
+};
+
+static int bench_f(int argc, char **argv)
+{
+    BenchState b = { 0 };
+    BenchReq *reqs;
+    struct timeval t1, t2;
+    int64_t len, count = 10000, depth = 1, size = 4096;
+    int c, i, qflag = 0;
+    char s1[64], s2[64], ts[64];
+
+    while ((c = getopt(argc, argv, "c:d:qs:w")) != EOF) {
+        switch (c) {
+        case 'c':
+            count = cvtnum(optarg);
+            break;
+        case 'd':
+            depth = cvtnum(optarg);
+            break;
+        case 'q':
+            qflag = 1;
+            break;
+        case 's':
+            size = cvtnum(optarg);
+            break;
+        case 'w':
+            b.is_write = 1;
+            break;
+        default:
+            return command_usage(&bench_cmd);
+        }
+    }
+
+    if (optind != argc - 2) {
+        return command_usage(&bench_cmd);
+    }
+
+    b.offset = cvtnum(argv[optind]);
+    len = cvtnum(argv[optind + 1]);
+    if (b.offset < 0 || len < 0) {
+        printf("non-numeric offset or length argument\n");
+        return 0;
+    }
+    if (count <= 0 || count > INT_MAX || depth <= 0 || depth > 1024) {
+        printf("count must be positive and depth between 1 and 1024\n");
+        return 0;
+    }
+    if (size <= 0 || size > INT_MAX || (size & 0x1ff) || (b.offset & 0x1ff)) {
+        printf("offset and request size must be sector aligned\n");
+        return 0;
+    }
+    if (len < size) {
+        printf("range is smaller than the request size\n");
+        return 0;
+    }
+
+    b.size = size;
+    b.nb_blocks = len / size;
+    b.count = count;
+    b.rand_state = 0x12345678;
+    b.min_ns = INT64_MAX;
+    depth = MIN(depth, count);
+
+    reqs = g_new0(BenchReq, depth);
+    for (i = 0; i < depth; i++) {
+        reqs[i].state = &b;
+        reqs[i].iov.iov_base = qemu_io_alloc(size, 0xcd);
+        reqs[i].iov.iov_len = size;
+        qemu_iovec_init_external(&reqs[i].qiov, &reqs[i].iov, 1);
+    }
+
+    gettimeofday(&t1, NULL);
+    bdrv_io_plug(bs);
+    for (i = 0; i < depth; i++) {
+        bench_submit(&reqs[i]);
+    }
+    bdrv_io_unplug(bs);
+    while (b.in_flight > 0) {
+        qemu_aio_wait();
+    }
+    gettimeofday(&t2, NULL);
+
+    for (i = 0; i < depth; i++) {
+        qemu_io_free(reqs[i].iov.iov_base);
+    }
+    g_free(reqs);
+
+    if (b.errors) {
+        printf("bench failed: %d of %" PRId64 " requests returned an error\n",
+               b.errors, b.done);
+        return 0;
+    }
+
+    t2 = tsub(t2, t1);
+    timestr(&t2, ts, sizeof(ts), 0);
+    cvtstr((double)b.done * size, s1, sizeof(s1));
+    cvtstr(tdiv((double)b.done * size, t2), s2, sizeof(s2));
+    printf("%s %" PRId64 " x %d bytes, queue depth %" PRId64 "\n",
+           b.is_write ? "wrote" : "read", b.done, b.size, depth);
+    printf("%s, %" PRId64 " ops; %s (%s/sec and %.4f ops/sec)\n",
+           s1, b.done, ts, s2, tdiv((double)b.done, t2));
+    printf("latency (us): min %" PRId64 " avg %" PRId64 " max %" PRId64
+           " p50 < %" PRId64 " p99 < %" PRId64 "\n",
+           b.min_ns / 1000, b.total_ns / b.done / 1000, b.max_ns / 1000,
+           bench_percentile_us(&b, 50), bench_percentile_us(&b, 99));
+
+    if (qflag) {
+        return 0;
+    }
+    printf("       usecs         : count\n");
+    for (i = 0; i < BENCH_BUCKETS; i++) {
+        if (b.hist[i]) {
+            printf("%8" PRId64 " - %-8" PRId64 " : %" PRId64 "\n",
+                   i ? bench_bucket_limit_us(i - 1) : 0,
+                   bench_bucket_limit_us(i), b.hist[i]);
+        }
+    }
+    return 0;
+}
+
 static int flush_f(int argc, char **argv)
 {
     bdrv_flush(bs);
@@ -1886,6 +2161,7 @@ static void usage(const char *name)
 "  -g, --growable       allow file to grow (only applies to protocols)\n"
 "  -m, --misalign       misalign allocations for O_DIRECT\n"
 "  -k, --native-aio     use kernel AIO implementation (on Linux only)\n"
+"  -i, --aio=MODE       use AIO mode (threads, native or io_uring)\n"
 "  -t, --cache=MODE     use the given cache mode for the image\n"
 "  -T, --trace FILE     enable trace events listed in the given file\n"
 "  -h, --help           display this help and exit\n"
@@ -1899,7 +2175,7 @@ int main(int argc, char **argv)
 {
     int readonly = 0;
     int growable = 0;
-    const char *sopt = "hVc:d:rsnmgkt:T:";
+    const char *sopt = "hVc:d:rsnmgki:t:T:";
     const struct option lopt[] = {
         { "help", 0, NULL, 'h' },
         { "version", 0, NULL, 'V' },
@@ -1911,6 +2187,7 @@ int main(int argc, char **argv)
         { "misalign", 0, NULL, 'm' },
         { "growable", 0, NULL, 'g' },
         { "native-aio", 0, NULL, 'k' },
+        { "aio", 1, NULL, 'i' },
         { "discard", 1, NULL, 'd' },
         { "cache", 1, NULL, 't' },
         { "trace", 1, NULL, 'T' },
@@ -1951,6 +2228,17 @@ int main(int argc, char **argv)
         case 'k':
             flags |= BDRV_O_NATIVE_AIO;
             break;
+        case 'i':
+            flags &= ~(BDRV_O_NATIVE_AIO | BDRV_O_IO_URING);
+            if (!strcmp(optarg, "native")) {
+                flags |= BDRV_O_NATIVE_AIO;
+            } else if (!strcmp(optarg, "io_uring")) {
+                flags |= BDRV_O_IO_URING;
+            } else if (strcmp(optarg, "threads")) {
+                error_report("Invalid aio option: %s", optarg);
+                exit(1);
+            }
+            break;
         case 't':
             if (bdrv_parse_cache_flags(optarg, &flags) < 0) {
                 error_report("Invalid cache option: %s", optarg);
@@ -1995,6 +2283,9 @@ int main(int argc, char **argv)
     add_command(&aio_read_cmd);
     add_command(&aio_write_cmd);
     add_command(&aio_flush_cmd);
+    add_command(&aio_plug_cmd);
+    add_command(&aio_unplug_cmd);
+    add_command(&bench_cmd);
     add_command(&flush_cmd);
     add_command(&truncate_cmd);
     add_command(&length_cmd);
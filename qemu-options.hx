@@ -35,7 +35,8 @@ DEF("machine", HAS_ARG, QEMU_OPTION_machine, \
     "                kernel_irqchip=on|off controls accelerated irqchip support\n"
     "                kvm_shadow_mem=size of KVM shadow MMU\n"
     "                dump-guest-core=on|off include guest memory in a core dump (default=on)\n"
-    "                mem-merge=on|off controls memory merge support (default: on)\n",
+    "                mem-merge=on|off controls memory merge support (default: on)\n"
+    "                tcg-thread=single|multi runs TCG vCPUs on one host thread or one each (default: single)\n",
     QEMU_ARCH_ALL)
 STEXI
 @item -machine [type=]@var{name}[,prop=@var{value}[,...]]
@@ -58,6 +59,10 @@ Include guest memory in a core dump. The default is on.
 Enables or disables memory merge support. This feature, when supported by
 the host, de-duplicates identical memory pages among VMs instances
 (enabled by default).
+@item tcg-thread=single|multi
+Runs all TCG vCPUs on a single host thread (the default), or each vCPU on
+its own host thread.  @code{multi} is only available for x86 guests on
+x86-64 hosts and cannot be combined with @option{-icount}.
 @end table
 ETEXI
 
@@ -407,9 +412,14 @@ DEF("drive", HAS_ARG, QEMU_OPTION_drive,
     "-drive [file=file][,if=type][,bus=n][,unit=m][,media=d][,index=i]\n"
     "       [,cyls=c,heads=h,secs=s[,trans=t]][,snapshot=on|off]\n"
     "       [,cache=writethrough|writeback|none|directsync|unsafe][,format=f]\n"
-    "       [,serial=s][,addr=A][,id=name][,aio=threads|native]\n"
+    "       [,serial=s][,addr=A][,id=name][,aio=threads|native|io_uring]\n"
     "       [,readonly=on|off][,copy-on-read=on|off]\n"
-    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]][[,iops=i]|[[,iops_rd=r][,iops_wr=w]]\n"
+    "       [,discard=ignore|unmap][,detect-zeroes=on|off|unmap]\n"
+    "       [[,bps=b]|[[,bps_rd=r][,bps_wr=w]]]\n"
+    "       [[,iops=i]|[[,iops_rd=r][,iops_wr=w]]]\n"
+    "       [[,bps_max=bm]|[[,bps_rd_max=rm][,bps_wr_max=wm]]]\n"
+    "       [[,iops_max=im]|[[,iops_rd_max=irm][,iops_wr_max=iwm]]]\n"
+    "       [[,iops_size=is]][[,group=g]]\n"
     "                use 'file' as a drive image\n", QEMU_ARCH_ALL)
 STEXI
 @item -drive @var{option}[,@var{option}[,@var{option}[,...]]]
@@ -443,9 +453,14 @@ These options have the same definition as they have in @option{-hdachs}.
 @item cache=@var{cache}
 @var{cache} is "none", "writeback", "unsafe", "directsync" or "writethrough" and controls how the host cache is used to access block data.
 @item aio=@var{aio}
-@var{aio} is "threads", or "native" and selects between pthread based disk I/O and native Linux AIO.
+@var{aio} is "threads", "native" or "io_uring" and selects between pthread based disk I/O, native Linux AIO and Linux io_uring.  Unlike native Linux AIO, io_uring does not need @option{cache=none} to be asynchronous.
 @item discard=@var{discard}
 @var{discard} is one of "ignore" (or "off") or "unmap" (or "on") and controls whether @dfn{discard} (also known as @dfn{trim} or @dfn{unmap}) requests are ignored or passed to the filesystem.  Some machine types may not support discard requests.
+@item detect-zeroes=@var{detect-zeroes}
+@var{detect-zeroes} is "off", "on" or "unmap" and enables the automatic
+conversion of plain zero writes by the OS to driver specific optimized
+zero write commands. You may even choose "unmap" if @var{discard} is set
+to "unmap" to allow a zero write to be converted to an UNMAP operation.
 @item format=@var{format}
 Specify which disk @var{format} will be used rather than detecting
 the format.  Can be used to specifiy format=raw to avoid interpreting
@@ -465,8 +480,32 @@ Open drive @option{file} as read-only. Guest write attempts will fail.
 @item copy-on-read=@var{copy-on-read}
 @var{copy-on-read} is "on" or "off" and enables whether to copy read backing
 file sectors into the image file.
+@item bps=@var{b},bps_rd=@var{r},bps_wr=@var{w}
+Limit the total, read or write throughput in bytes per second.  A total
+limit cannot be combined with a read or write limit.
+@item iops=@var{i},iops_rd=@var{r},iops_wr=@var{w}
+Limit the total, read or write number of I/O operations per second.
+@item bps_max=@var{bm},bps_rd_max=@var{rm},bps_wr_max=@var{wm}
+@itemx iops_max=@var{im},iops_rd_max=@var{irm},iops_wr_max=@var{iwm}
+Allow bursts of up to the given number of bytes or operations on top of the
+corresponding average limit, which must be set.  Once the burst is used up,
+I/O proceeds at the average rate until the device has been idle long enough
+to refill it.
+@item iops_size=@var{is}
+Count requests larger than @var{is} bytes as several operations for the iops
+limits, so that large requests cannot bypass them.
+@item group=@var{g}
+Put the drive in the throttling group @var{g}.  All drives in a group share
+one set of limits, and pending requests are served in round-robin order.
+By default each drive gets a group of its own, named after the drive.
 @end table
 
+Options that are not listed above are passed to the image format driver.
+For qcow2, @option{l2-cache-size} and @option{refcount-cache-size} set the
+size in bytes of the L2 table and refcount block caches.  The defaults hold
+16 L2 tables and 4 refcount blocks.  Each L2 table maps cluster size / 8
+clusters, so with 64k clusters an L2 cache of 1M covers an 8G image.
+
 By default, the @option{cache=writeback} mode is used. It will report data
 writes as completed as soon as the data is present in the host page cache.
 This is safe as long as your guest OS makes sure to correctly flush disk caches
@@ -45,7 +45,12 @@
 #define QEMU_CLOCK_HOST     2
 
 struct QEMUClock {
-    QEMUTimer *active_timers;
+    /* Pending timers, kept as a binary min-heap ordered by expire time
+       (and by arming order for equal expire times).  */
+    QEMUTimer **active_timers;
+    int nb_active_timers;
+    int max_active_timers;
+    uint64_t timer_seq;
 
     NotifierList reset_notifiers;
     int64_t last;
@@ -59,7 +64,8 @@ struct QEMUTimer {
     QEMUClock *clock;
     QEMUTimerCB *cb;
     void *opaque;
-    QEMUTimer *next;
+    uint64_t seq;               /* arming order, breaks expire_time ties */
+    int heap_index;             /* position in active_timers, -1 if idle */
     int scale;
 };
 
@@ -85,25 +91,119 @@ static bool qemu_timer_expired_ns(QEMUTimer *timer_head, int64_t current_time)
     return timer_head && (timer_head->expire_time <= current_time);
 }
 
+/* Return the timer that expires first on @clock, or NULL.  */
+static QEMUTimer *qemu_clock_first_timer(QEMUClock *clock)
+{
+    return clock->nb_active_timers ? clock->active_timers[0] : NULL;
+}
+
+static bool qemu_timer_before(QEMUTimer *a, QEMUTimer *b)
+{
+    return a->expire_time < b->expire_time ||
+           (a->expire_time == b->expire_time && a->seq < b->seq);
+}
+
+static void timer_heap_set(QEMUClock *clock, int i, QEMUTimer *ts)
+{
+    clock->active_timers[i] = ts;
+    ts->heap_index = i;
+}
+
+static void timer_heap_sift_up(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+
+        if (!qemu_timer_before(ts, clock->active_timers[parent])) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->active_timers[parent]);
+        i = parent;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+static void timer_heap_sift_down(QEMUClock *clock, int i)
+{
+    QEMUTimer *ts = clock->active_timers[i];
+    int n = clock->nb_active_timers;
+
+    for (;;) {
+        int child = 2 * i + 1;
+
+        if (child >= n) {
+            break;
+        }
+        if (child + 1 < n &&
+            qemu_timer_before(clock->active_timers[child + 1],
+                              clock->active_timers[child])) {
+            child++;
+        }
+        if (!qemu_timer_before(clock->active_timers[child], ts)) {
+            break;
+        }
+        timer_heap_set(clock, i, clock->active_timers[child]);
+        i = child;
+    }
+    timer_heap_set(clock, i, ts);
+}
+
+/* Restore the heap property after the key of the timer at @i changed.  */
+static void timer_heap_update(QEMUClock *clock, int i)
+{
+    if (i > 0 && qemu_timer_before(clock->active_timers[i],
+                                   clock->active_timers[(i - 1) / 2])) {
+        timer_heap_sift_up(clock, i);
+    } else {
+        timer_heap_sift_down(clock, i);
+    }
+}
+
+static void timer_heap_insert(QEMUClock *clock, QEMUTimer *ts)
+{
+    if (clock->nb_active_timers == clock->max_active_timers) {
+        clock->max_active_timers = MAX(16, clock->max_active_timers * 2);
+        clock->active_timers = g_renew(QEMUTimer *, clock->active_timers,
+                                       clock->max_active_timers);
+    }
+    timer_heap_set(clock, clock->nb_active_timers++, ts);
+    timer_heap_sift_up(clock, ts->heap_index);
+}
+
+static void timer_heap_remove(QEMUClock *clock, QEMUTimer *ts)
+{
+    int i = ts->heap_index;
+    QEMUTimer *last = clock->active_timers[--clock->nb_active_timers];
+
+    ts->heap_index = -1;
+    if (last != ts) {
+        timer_heap_set(clock, i, last);
+        timer_heap_update(clock, i);
+    }
+}
+
 static int64_t qemu_next_alarm_deadline(void)
 {
     int64_t delta = INT64_MAX;
     int64_t rtdelta;
+    QEMUTimer *ts;
 
-    if (!use_icount && vm_clock->enabled && vm_clock->active_timers) {
-        delta = vm_clock->active_timers->expire_time -
-                     qemu_get_clock_ns(vm_clock);
+    ts = qemu_clock_first_timer(vm_clock);
+    if (!use_icount && vm_clock->enabled && ts) {
+        delta = ts->expire_time - qemu_get_clock_ns(vm_clock);
     }
-    if (host_clock->enabled && host_clock->active_timers) {
-        int64_t hdelta = host_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(host_clock);
+    ts = qemu_clock_first_timer(host_clock);
+    if (host_clock->enabled && ts) {
+        int64_t hdelta = ts->expire_time - qemu_get_clock_ns(host_clock);
         if (hdelta < delta) {
             delta = hdelta;
         }
     }
-    if (rt_clock->enabled && rt_clock->active_timers) {
-        rtdelta = (rt_clock->active_timers->expire_time -
-                 qemu_get_clock_ns(rt_clock));
+    ts = qemu_clock_first_timer(rt_clock);
+    if (rt_clock->enabled && ts) {
+        rtdelta = ts->expire_time - qemu_get_clock_ns(rt_clock);
         if (rtdelta < delta) {
             delta = rtdelta;
         }
@@ -254,22 +354,24 @@ void qemu_clock_enable(QEMUClock *clock, bool enabled)
 
 int64_t qemu_clock_has_timers(QEMUClock *clock)
 {
-    return !!clock->active_timers;
+    return clock->nb_active_timers != 0;
 }
 
 int64_t qemu_clock_expired(QEMUClock *clock)
 {
-    return (clock->active_timers &&
-            clock->active_timers->expire_time < qemu_get_clock_ns(clock));
+    QEMUTimer *ts = qemu_clock_first_timer(clock);
+
+    return ts && ts->expire_time < qemu_get_clock_ns(clock);
 }
 
 int64_t qemu_clock_deadline(QEMUClock *clock)
 {
     /* To avoid problems with overflow limit this to 2^32.  */
     int64_t delta = INT32_MAX;
+    QEMUTimer *ts = qemu_clock_first_timer(clock);
 
-    if (clock->active_timers) {
-        delta = clock->active_timers->expire_time - qemu_get_clock_ns(clock);
+    if (ts) {
+        delta = ts->expire_time - qemu_get_clock_ns(clock);
     }
     if (delta < 0) {
         delta = 0;
@@ -287,31 +389,21 @@ QEMUTimer *qemu_new_timer(QEMUClock *clock, int scale,
     ts->cb = cb;
     ts->opaque = opaque;
     ts->scale = scale;
+    ts->heap_index = -1;
     return ts;
 }
 
 void qemu_free_timer(QEMUTimer *ts)
 {
+    qemu_del_timer(ts);
     g_free(ts);
 }
 
 /* stop a timer, but do not dealloc it */
 void qemu_del_timer(QEMUTimer *ts)
 {
-    QEMUTimer **pt, *t;
-
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!t)
-            break;
-        if (t == ts) {
-            *pt = t->next;
-            break;
-        }
-        pt = &t->next;
+    if (ts->heap_index >= 0) {
+        timer_heap_remove(ts->clock, ts);
     }
 }
 
@@ -319,27 +411,20 @@ void qemu_del_timer(QEMUTimer *ts)
    >= expire_time. The corresponding callback will be called. */
 void qemu_mod_timer_ns(QEMUTimer *ts, int64_t expire_time)
 {
-    QEMUTimer **pt, *t;
-
-    qemu_del_timer(ts);
+    QEMUClock *clock = ts->clock;
 
-    /* add the timer in the sorted list */
-    /* NOTE: this code must be signal safe because
-       qemu_timer_expired() can be called from a signal. */
-    pt = &ts->clock->active_timers;
-    for(;;) {
-        t = *pt;
-        if (!qemu_timer_expired_ns(t, expire_time)) {
-            break;
-        }
-        pt = &t->next;
-    }
+    /* Timers with the same expire time fire in the order they were
+       armed, so each (re)arm gets a new sequence number.  */
     ts->expire_time = expire_time;
-    ts->next = *pt;
-    *pt = ts;
+    ts->seq = clock->timer_seq++;
+    if (ts->heap_index >= 0) {
+        timer_heap_update(clock, ts->heap_index);
+    } else {
+        timer_heap_insert(clock, ts);
+    }
 
     /* Rearm if necessary  */
-    if (pt == &ts->clock->active_timers) {
+    if (ts->heap_index == 0) {
         if (!alarm_timer->pending) {
             qemu_rearm_alarm_timer(alarm_timer);
         }
@@ -358,13 +443,7 @@ void qemu_mod_timer(QEMUTimer *ts, int64_t expire_time)
 
 bool qemu_timer_pending(QEMUTimer *ts)
 {
-    QEMUTimer *t;
-    for (t = ts->clock->active_timers; t != NULL; t = t->next) {
-        if (t == ts) {
-            return true;
-        }
-    }
-    return false;
+    return ts->heap_index >= 0;
 }
 
 bool qemu_timer_expired(QEMUTimer *timer_head, int64_t current_time)
@@ -382,15 +461,14 @@ void qemu_run_timers(QEMUClock *clock)
 
     current_time = qemu_get_clock_ns(clock);
     for(;;) {
-        ts = clock->active_timers;
+        ts = qemu_clock_first_timer(clock);
         if (!qemu_timer_expired_ns(ts, current_time)) {
             break;
         }
-        /* remove timer from the list before calling the callback */
-        clock->active_timers = ts->next;
-        ts->next = NULL;
+        /* remove timer from the heap before calling the callback */
+        timer_heap_remove(clock, ts);
 
-        /* run the callback (the timer list can be modified) */
+        /* run the callback (the timer heap can be modified) */
         ts->cb(ts->opaque);
     }
 }
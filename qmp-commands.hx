@@ -702,6 +702,79 @@ Example:
 -> { "execute": "query-migrate-cache-size" }
 <- { "return": 67108864 }
 
+EQMP
+
+    {
+        .name       = "migrate-set-parameters",
+        .args_type  = "compress-level:i?,compress-threads:i?,decompress-threads:i?,"
+                      "postcopy-after-passes:i?",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_set_parameters,
+    },
+
+SQMP
+migrate-set-parameters
+----------------------
+
+Set migration tunables.  Changes take effect at the next migration.
+
+Arguments:
+
+- "compress-level": zlib compression level, 0-9 (json-int, optional)
+- "compress-threads": number of compression threads, 1-255
+  (json-int, optional)
+- "decompress-threads": number of decompression threads, 1-255
+  (json-int, optional)
+- "postcopy-after-passes": number of pre-copy passes over RAM after which
+  the migration switches to post-copy, 0 to disable (json-int, optional)
+
+Example:
+
+-> { "execute": "migrate-set-parameters",
+     "arguments": { "compress-level": 1, "compress-threads": 4 } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "query-migrate-parameters",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_migrate_parameters,
+    },
+
+SQMP
+query-migrate-parameters
+------------------------
+
+Show the current migration tunables
+
+Example:
+
+-> { "execute": "query-migrate-parameters" }
+<- { "return": { "compress-level": 1, "compress-threads": 8,
+                 "decompress-threads": 2, "postcopy-after-passes": 0 } }
+
+EQMP
+
+    {
+        .name       = "migrate-start-postcopy",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_migrate_start_postcopy,
+    },
+
+SQMP
+migrate-start-postcopy
+----------------------
+
+Switch the current migration to post-copy.  The postcopy-ram capability must
+have been enabled before the migration was started.
+
+Arguments: None.
+
+Example:
+
+-> { "execute": "migrate-start-postcopy" }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1029,7 +1102,7 @@ EQMP
         .name       = "drive-mirror",
         .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
                       "on-source-error:s?,on-target-error:s?,"
-                      "granularity:i?,buf-size:i?",
+                      "granularity:i?,buf-size:i?,bitmap:s?",
         .mhandler.cmd_new = qmp_marshal_input_drive_mirror,
     },
 
@@ -1058,12 +1131,16 @@ Arguments:
   (json-int, default 10M)
 - "sync": what parts of the disk image should be copied to the destination;
   possibilities include "full" for all the disk, "top" for only the sectors
-  allocated in the topmost image, or "none" to only replicate new I/O
+  allocated in the topmost image, "none" to only replicate new I/O, or
+  "incremental" for only the sectors that are dirty in "bitmap"
   (MirrorSyncMode).
 - "on-source-error": the action to take on an error on the source
   (BlockdevOnError, default 'report')
 - "on-target-error": the action to take on an error on the target
   (BlockdevOnError, default 'report')
+- "bitmap": name of the dirty bitmap to copy with sync "incremental"
+  (json-string, optional).  The bitmap is cleared when the job completes
+  successfully.
 
 The default value of the granularity is the image cluster size clamped
 between 4096 and 65536, if the image format defines one.  If the format
@@ -1079,6 +1156,144 @@ Example:
                                                "format": "qcow2" } }
 <- { "return": {} }
 
+EQMP
+
+    {
+        .name       = "drive-backup",
+        .args_type  = "sync:s,device:B,target:s,speed:i?,mode:s?,format:s?,"
+                      "on-source-error:s?,on-target-error:s?,bitmap:s?",
+        .mhandler.cmd_new = qmp_marshal_input_drive_backup,
+    },
+
+SQMP
+drive-backup
+------------
+
+Start a point-in-time copy of a block device to a new destination.  The
+status of ongoing drive-backup operations can be checked with
+query-block-jobs where the BlockJobInfo.type field has the value 'backup'.
+The operation can be stopped before it has completed using the
+block-job-cancel command.
+
+Arguments:
+
+- "device": the name of the device which should be copied.
+            (json-string)
+- "target": the target of the new image. If the file exists, or if it is a
+            device, the existing file/device will be used as the new
+            destination.  If it does not exist, a new file will be created.
+            (json-string)
+- "format": the format of the new destination, default is to probe if 'mode' is
+            'existing', else the format of the source
+            (json-string, optional)
+- "sync": what parts of the disk image should be copied to the destination;
+  possibilities include "full" for all the disk, "top" for only the sectors
+  allocated in the topmost image, "none" to only copy the sectors that the
+  guest overwrites, or "incremental" for only the sectors that are dirty in
+  "bitmap" (MirrorSyncMode).
+- "mode": whether and how QEMU should create a new image
+          (NewImageMode, optional, default 'absolute-paths')
+- "speed": the maximum speed, in bytes per second (json-int, optional)
+- "bitmap": name of the dirty bitmap to copy with sync "incremental"
+  (json-string, optional).  The bitmap is cleared when the job starts and
+  restored if the job fails or is cancelled.
+- "on-source-error": the action to take on an error on the source, default
+                     'report'.  'stop' and 'enospc' can only be used
+                     if the block device supports io-status.
+                     (BlockdevOnError, optional)
+- "on-target-error": the action to take on an error on the target, default
+                     'report' (no limitations, since this applies to
+                     a different block device than device).
+                     (BlockdevOnError, optional)
+
+Example:
+-> { "execute": "drive-backup", "arguments": { "device": "drive0",
+                                               "sync": "full",
+                                               "target": "backup.img" } }
+<- { "return": {} }
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-add",
+        .args_type  = "device:B,name:s,granularity:i?,persistent:b?",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_add,
+    },
+
+SQMP
+block-dirty-bitmap-add
+----------------------
+
+Create a named dirty bitmap that tracks the writes to a block device.
+Several bitmaps can exist at the same time, for example one for each
+backup schedule.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the new bitmap (json-string)
+- "granularity": granularity of the bitmap in bytes (json-int, optional,
+  default is the cluster size clamped between 4096 and 65536)
+- "persistent": save the bitmap in the image file on close and load it
+  again on open (json-bool, optional, default false).  Requires a qcow2
+  image with compat=1.1.
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-add", "arguments": { "device": "drive0",
+                                                         "name": "daily",
+                                                         "persistent": true } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-remove",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_remove,
+    },
+
+SQMP
+block-dirty-bitmap-remove
+-------------------------
+
+Delete a named dirty bitmap.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-remove", "arguments": { "device": "drive0",
+                                                            "name": "daily" } }
+<- { "return": {} }
+
+EQMP
+
+    {
+        .name       = "block-dirty-bitmap-clear",
+        .args_type  = "device:B,name:s",
+        .mhandler.cmd_new = qmp_marshal_input_block_dirty_bitmap_clear,
+    },
+
+SQMP
+block-dirty-bitmap-clear
+------------------------
+
+Mark everything as clean in a named dirty bitmap.
+
+Arguments:
+
+- "device": device name (json-string)
+- "name": name of the bitmap (json-string)
+
+Example:
+
+-> { "execute": "block-dirty-bitmap-clear", "arguments": { "device": "drive0",
+                                                           "name": "daily" } }
+<- { "return": {} }
+
 EQMP
 
     {
@@ -1335,7 +1550,7 @@ EQMP
 
     {
         .name       = "block_set_io_throttle",
-        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l",
+        .args_type  = "device:B,bps:l,bps_rd:l,bps_wr:l,iops:l,iops_rd:l,iops_wr:l,bps_max:l?,bps_rd_max:l?,bps_wr_max:l?,iops_max:l?,iops_rd_max:l?,iops_wr_max:l?,iops_size:l?,group:s?",
         .mhandler.cmd_new = qmp_marshal_input_block_set_io_throttle,
     },
 
@@ -1354,6 +1569,14 @@ Arguments:
 - "iops":  total I/O operations per second(json-int)
 - "iops_rd":  read I/O operations per second(json-int)
 - "iops_wr":  write I/O operations per second(json-int)
+- "bps_max":  total max in bytes(json-int, optional)
+- "bps_rd_max":  read max in bytes(json-int, optional)
+- "bps_wr_max":  write max in bytes(json-int, optional)
+- "iops_max":  total I/O operations max(json-int, optional)
+- "iops_rd_max":  read I/O operations max(json-int, optional)
+- "iops_wr_max":  write I/O operations max(json-int, optional)
+- "iops_size":  I/O size in bytes when limiting(json-int, optional)
+- "group": throttle group name(json-string, optional)
 
 Example:
 
@@ -1363,7 +1586,10 @@ Example:
                                                "bps_wr": "0",
                                                "iops": "0",
                                                "iops_rd": "0",
-                                               "iops_wr": "0" } }
+                                               "iops_wr": "0",
+                                               "bps_max": "8000000",
+                                               "iops_size": "4096",
+                                               "group": "shared" } }
 <- { "return": {} }
 
 EQMP
@@ -1666,6 +1892,55 @@ EQMP
         .mhandler.cmd_new = qmp_marshal_input_query_chardev,
     },
 
+SQMP
+query-nic-stats
+---------------
+
+Show packet and interrupt counters of the emulated network adapters.
+
+Each adapter is represented by a json-object. The returned value is a
+json-array of all adapters.
+
+Each json-object contain the following:
+
+- "name": adapter name (json-string)
+- "model": adapter model (json-string)
+- "rx-packets": packets delivered to the guest (json-int)
+- "tx-packets": packets sent by the guest (json-int)
+- "interrupts": interrupts raised (json-int, optional)
+- "coalesced": interrupt causes coalesced into a pending interrupt
+               (json-int, optional)
+- "moderation-delay": current minimum interval between interrupts, in
+                      nanoseconds (json-int, optional)
+
+The last three are only present for models that implement interrupt
+moderation.
+
+Example:
+
+-> { "execute": "query-nic-stats" }
+<- {
+      "return":[
+         {
+            "name":"e1000.0",
+            "model":"e1000",
+            "rx-packets":1402,
+            "tx-packets":981,
+            "interrupts":1012,
+            "coalesced":633,
+            "moderation-delay":0
+         }
+      ]
+   }
+
+EQMP
+
+    {
+        .name       = "query-nic-stats",
+        .args_type  = "",
+        .mhandler.cmd_new = qmp_marshal_input_query_nic_stats,
+    },
+
 SQMP
 query-block
 -----------
@@ -1704,6 +1979,16 @@ Each json-object contain the following:
          - "iops": limit total I/O operations per second (json-int)
          - "iops_rd": limit read operations per second (json-int)
          - "iops_wr": limit write operations per second (json-int)
+         - "bps_max": total max in bytes (json-int, optional)
+         - "bps_rd_max": read max in bytes (json-int, optional)
+         - "bps_wr_max": write max in bytes (json-int, optional)
+         - "iops_max": total I/O operations max (json-int, optional)
+         - "iops_rd_max": read I/O operations max (json-int, optional)
+         - "iops_wr_max": write I/O operations max (json-int, optional)
+         - "iops_size": I/O size when limiting by iops (json-int, optional)
+         - "group": throttle group name (json-string, optional)
+         - "detect_zeroes": detect and optimize zero writes (json-string)
+             - Possible values: "off", "on", "unmap"
 
 - "io-status": I/O operation status, only present if the device supports it
                and the VM is configured to stop on errors. It's always reset
@@ -1732,6 +2017,7 @@ Example:
                "iops":1000000,
                "iops_rd":0,
                "iops_wr":0,
+               "detect_zeroes":"on"
             },
             "type":"unknown"
          },
@@ -1788,6 +2074,13 @@ Each json-object contain the following:
     - "flush_total_time_ns": total time spend on cache flushes in nano-seconds (json-int)
     - "wr_highest_offset": Highest offset of a sector written since the
                            BlockDriverState has been opened (json-int)
+    - "l2_cache": statistics of the L2 table cache of the image format,
+                  only present for qcow2 (json-object, optional)
+        - "size": number of tables the cache can hold (json-int)
+        - "hits": lookups that found the table in the cache (json-int)
+        - "misses": lookups that loaded the table from the image (json-int)
+    - "refcount_cache": the same for the refcount block cache
+                        (json-object, optional)
 - "parent": Contains recursively the statistics of the underlying
             protocol (e.g. the host file for a qcow2 image). If there is
             no underlying protocol, this field is omitted
@@ -2498,7 +2791,8 @@ block migration status.
 The main json-object contains the following:
 
 - "status": migration status (json-string)
-     - Possible values: "active", "completed", "failed", "cancelled"
+     - Possible values: "active", "postcopy-active", "completed", "failed",
+       "cancelled"
 - "total-time": total amount of ms since migration started.  If
                 migration has ended, it returns the total migration
                 time (json-int)
@@ -2533,10 +2827,27 @@ The main json-object contains the following:
          - "bytes": number of bytes transferred for XBZRLE compressed pages
          - "pages": number of XBZRLE compressed pages
          - "cache-miss": number of XBRZRLE page cache misses
+         - "cache-hit": number of XBZRLE page cache hits
+         - "cache-eviction": number of pages evicted from the XBZRLE page
+           cache to make room for another one
          - "overflow": number of times XBZRLE overflows.  This means
            that the XBZRLE encoding was bigger than just sent the
            whole page, and then we sent the whole page instead (as as
            normal page).
+- "compression": only present if the compress capability is on.
+  It is a json-object with the following information:
+         - "pages": number of pages sent compressed
+         - "bytes": number of bytes of compressed page data sent
+         - "busy": number of times all compression threads were busy and
+           the migration thread had to wait for one of them
+         - "threads": json-array with one json-object per compression thread:
+                - "id": index of the thread
+                - "pages": number of pages compressed by the thread
+                - "bytes": number of compressed bytes it produced
+                - "busy-time": time spent compressing, in milliseconds
+- "postcopy-requests": only present once the migration has switched to
+  post-copy: number of page requests received from the destination
+  (json-int)
 
 Examples:
 
@@ -2633,6 +2944,8 @@ Examples:
             "bytes":20971520,
             "pages":2444343,
             "cache-miss":2244,
+            "cache-hit":2439870,
+            "cache-eviction":1180,
             "overflow":34434
          }
       }
@@ -2653,6 +2966,8 @@ migrate-set-capabilities
 Enable/Disable migration capabilities
 
 - "xbzrle": XBZRLE support
+- "compress": multi-threaded page compression
+- "postcopy-ram": allow switching to post-copy
 
 Arguments:
 
@@ -2677,6 +2992,8 @@ Query current migration capabilities
 
 - "capabilities": migration capabilities state
          - "xbzrle" : XBZRLE state (json-bool)
+         - "compress" : page compression state (json-bool)
+         - "postcopy-ram" : post-copy state (json-bool)
 
 Arguments:
 
@@ -32,6 +32,7 @@
 #include "qemu/timer.h"
 #include "audio/audio.h"
 #include "migration/migration.h"
+#include "migration/postcopy-ram.h"
 #include "qemu/sockets.h"
 #include "qemu/queue.h"
 #include "sysemu/cpus.h"
@@ -574,6 +575,47 @@ static QEMUFile *qemu_fopen_bdrv(BlockDriverState *bs, int is_writable)
     return qemu_fopen_ops(bs, &bdrv_read_ops);
 }
 
+/* In-memory QEMUFile; the caller owns the data */
+typedef struct QEMUFileBuffer {
+    uint8_t *data;
+    size_t size;
+    size_t len;
+} QEMUFileBuffer;
+
+static int buf_put_buffer(void *opaque, const uint8_t *buf,
+                          int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (b->len + size > b->size) {
+        b->size = MAX(b->size * 2, b->len + size);
+        b->data = g_realloc(b->data, b->size);
+    }
+    memcpy(b->data + b->len, buf, size);
+    b->len += size;
+    return size;
+}
+
+static int buf_get_buffer(void *opaque, uint8_t *buf, int64_t pos, int size)
+{
+    QEMUFileBuffer *b = opaque;
+
+    if (pos >= b->len) {
+        return 0;
+    }
+    size = MIN(size, b->len - pos);
+    memcpy(buf, b->data + pos, size);
+    return size;
+}
+
+static const QEMUFileOps buf_read_ops = {
+    .get_buffer = buf_get_buffer,
+};
+
+static const QEMUFileOps buf_write_ops = {
+    .put_buffer = buf_put_buffer,
+};
+
 QEMUFile *qemu_fopen_ops(void *opaque, const QEMUFileOps *ops)
 {
     QEMUFile *f;
@@ -608,7 +650,7 @@ static inline bool qemu_file_is_writable(QEMUFile *f)
  * If there is writev_buffer QEMUFileOps it uses it otherwise uses
  * put_buffer ops.
  */
-static void qemu_fflush(QEMUFile *f)
+void qemu_fflush(QEMUFile *f)
 {
     ssize_t ret = 0;
 
@@ -1779,6 +1821,25 @@ static void vmstate_save(QEMUFile *f, SaveStateEntry *se)
 #define QEMU_VM_SECTION_END          0x03
 #define QEMU_VM_SECTION_FULL         0x04
 #define QEMU_VM_SUBSECTION           0x05
+#define QEMU_VM_COMMAND              0x06
+
+/* Commands carried by QEMU_VM_COMMAND: be16 command, be32 length, payload */
+enum {
+    MIG_CMD_POSTCOPY_ADVISE = 1,  /* post-copy may follow, check support */
+    MIG_CMD_POSTCOPY_RAM_DISCARD, /* drop pages that were dirtied again */
+    MIG_CMD_POSTCOPY_RUN,         /* device state, then run the guest */
+};
+
+/* Set once the source has switched to post-copy.  From then on only
+ * handlers that support post-copy are iterated and completed.
+ */
+static bool savevm_postcopy;
+
+static bool se_has_postcopy(SaveStateEntry *se)
+{
+    return se->ops && se->ops->has_postcopy &&
+           se->ops->has_postcopy(se->opaque);
+}
 
 bool qemu_savevm_state_blocked(Error **errp)
 {
@@ -1805,7 +1866,8 @@ void qemu_savevm_state_begin(QEMUFile *f,
         }
         se->ops->set_params(params, se->opaque);
     }
-    
+
+    savevm_postcopy = false;
     qemu_put_be32(f, QEMU_VM_FILE_MAGIC);
     qemu_put_be32(f, QEMU_VM_FILE_VERSION);
 
@@ -1860,7 +1922,13 @@ int qemu_savevm_state_iterate(QEMUFile *f)
                 continue;
             }
         }
-        if (qemu_file_rate_limit(f)) {
+        if (savevm_postcopy && !se_has_postcopy(se)) {
+            continue;
+        }
+        /* In post-copy, pages requested by the destination are sent
+         * regardless of the rate limit; the handler throttles the rest.
+         */
+        if (qemu_file_rate_limit(f) && !savevm_postcopy) {
             return 0;
         }
         trace_savevm_section_start();
@@ -1885,34 +1953,23 @@ int qemu_savevm_state_iterate(QEMUFile *f)
     return ret;
 }
 
-void qemu_savevm_state_complete(QEMUFile *f)
+static int savevm_section_end(QEMUFile *f, SaveStateEntry *se)
 {
-    SaveStateEntry *se;
     int ret;
 
-    cpu_synchronize_all_states();
+    trace_savevm_section_start();
+    /* Section type */
+    qemu_put_byte(f, QEMU_VM_SECTION_END);
+    qemu_put_be32(f, se->section_id);
 
-    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
-        if (!se->ops || !se->ops->save_live_complete) {
-            continue;
-        }
-        if (se->ops && se->ops->is_active) {
-            if (!se->ops->is_active(se->opaque)) {
-                continue;
-            }
-        }
-        trace_savevm_section_start();
-        /* Section type */
-        qemu_put_byte(f, QEMU_VM_SECTION_END);
-        qemu_put_be32(f, se->section_id);
+    ret = se->ops->save_live_complete(f, se->opaque);
+    trace_savevm_section_end(se->section_id);
+    return ret;
+}
 
-        ret = se->ops->save_live_complete(f, se->opaque);
-        trace_savevm_section_end(se->section_id);
-        if (ret < 0) {
-            qemu_file_set_error(f, ret);
-            return;
-        }
-    }
+static void savevm_device_sections(QEMUFile *f)
+{
+    SaveStateEntry *se;
 
     QTAILQ_FOREACH(se, &savevm_handlers, entry) {
         int len;
@@ -1936,11 +1993,133 @@ void qemu_savevm_state_complete(QEMUFile *f)
         vmstate_save(f, se);
         trace_savevm_section_end(se->section_id);
     }
+}
+
+void qemu_savevm_state_complete(QEMUFile *f)
+{
+    SaveStateEntry *se;
+    int ret;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        if (savevm_postcopy && !se_has_postcopy(se)) {
+            continue;
+        }
+        ret = savevm_section_end(f, se);
+        if (ret < 0) {
+            qemu_file_set_error(f, ret);
+            return;
+        }
+    }
+
+    /* in post-copy the devices went out with MIG_CMD_POSTCOPY_RUN */
+    if (!savevm_postcopy) {
+        savevm_device_sections(f);
+    }
 
     qemu_put_byte(f, QEMU_VM_EOF);
     qemu_fflush(f);
 }
 
+static void qemu_savevm_command_send(QEMUFile *f, uint16_t command,
+                                     uint32_t len, const uint8_t *data)
+{
+    qemu_put_byte(f, QEMU_VM_COMMAND);
+    qemu_put_be16(f, command);
+    qemu_put_be32(f, len);
+    qemu_put_buffer(f, data, len);
+    qemu_fflush(f);
+}
+
+void qemu_savevm_send_postcopy_advise(QEMUFile *f)
+{
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_ADVISE, 0, NULL);
+}
+
+void qemu_savevm_send_postcopy_ram_discard(QEMUFile *f, const char *idstr,
+                                           unsigned int nr,
+                                           const uint64_t *start,
+                                           const uint64_t *length)
+{
+    size_t idlen = strlen(idstr);
+    uint32_t len = 1 + idlen + nr * 16;
+    uint8_t *buf = g_malloc(len);
+    uint8_t *p = buf;
+    unsigned int i;
+
+    *p++ = idlen;
+    memcpy(p, idstr, idlen);
+    p += idlen;
+    for (i = 0; i < nr; i++) {
+        stq_be_p(p, start[i]);
+        stq_be_p(p + 8, length[i]);
+        p += 16;
+    }
+    qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RAM_DISCARD, len, buf);
+    g_free(buf);
+}
+
+/*
+ * Switch to post-copy: complete every handler that cannot continue after
+ * the guest starts on the destination, and send the result together with
+ * the device state as a single command.  The destination reads it in full
+ * before loading it, so that the rest of the stream can be consumed by
+ * another thread while devices fault in guest pages.
+ */
+int qemu_savevm_send_postcopy_run(QEMUFile *f)
+{
+    QEMUFileBuffer b = { NULL };
+    QEMUFile *pkg = qemu_fopen_ops(&b, &buf_write_ops);
+    SaveStateEntry *se;
+    int ret = 0;
+
+    cpu_synchronize_all_states();
+
+    QTAILQ_FOREACH(se, &savevm_handlers, entry) {
+        if (!se->ops || !se->ops->save_live_complete) {
+            continue;
+        }
+        if (se->ops && se->ops->is_active) {
+            if (!se->ops->is_active(se->opaque)) {
+                continue;
+            }
+        }
+        if (se_has_postcopy(se)) {
+            continue;
+        }
+        ret = savevm_section_end(pkg, se);
+        if (ret < 0) {
+            break;
+        }
+    }
+
+    if (ret == 0) {
+        savevm_device_sections(pkg);
+        qemu_put_byte(pkg, QEMU_VM_EOF);
+    }
+    if (qemu_fclose(pkg) < 0 && ret == 0) {
+        ret = -EIO;
+    }
+
+    if (ret == 0) {
+        qemu_savevm_command_send(f, MIG_CMD_POSTCOPY_RUN, b.len, b.data);
+        savevm_postcopy = true;
+    } else {
+        qemu_file_set_error(f, ret);
+    }
+    g_free(b.data);
+    return ret;
+}
+
 uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
 {
     SaveStateEntry *se;
@@ -1955,6 +2134,9 @@ uint64_t qemu_savevm_state_pending(QEMUFile *f, uint64_t max_size)
                 continue;
             }
         }
+        if (savevm_postcopy && !se_has_postcopy(se)) {
+            continue;
+        }
         ret += se->ops->save_live_pending(f, se->opaque, max_size);
     }
     return ret;
@@ -2143,30 +2325,177 @@ typedef struct LoadStateEntry {
     int version_id;
 } LoadStateEntry;
 
-int qemu_loadvm_state(QEMUFile *f)
+static QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
+    QLIST_HEAD_INITIALIZER(loadvm_handlers);
+
+static void loadvm_free_handlers(void)
 {
-    QLIST_HEAD(, LoadStateEntry) loadvm_handlers =
-        QLIST_HEAD_INITIALIZER(loadvm_handlers);
     LoadStateEntry *le, *new_le;
-    uint8_t section_type;
-    unsigned int v;
+
+    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
+        QLIST_REMOVE(le, entry);
+        g_free(le);
+    }
+}
+
+static int qemu_loadvm_state_main(QEMUFile *f);
+
+static int loadvm_postcopy_ram_handle_discard(QEMUFile *f, uint32_t len)
+{
+    char idstr[256];
+    unsigned int nr;
+    uint8_t idlen;
     int ret;
 
-    if (qemu_savevm_state_blocked(NULL)) {
+    idlen = qemu_get_byte(f);
+    if (len < 1 + idlen || (len - 1 - idlen) % 16) {
+        fprintf(stderr, "postcopy: bad discard command length %u\n", len);
         return -EINVAL;
     }
+    qemu_get_buffer(f, (uint8_t *)idstr, idlen);
+    idstr[idlen] = 0;
 
-    v = qemu_get_be32(f);
-    if (v != QEMU_VM_FILE_MAGIC)
-        return -EINVAL;
+    nr = (len - 1 - idlen) / 16;
+    trace_loadvm_postcopy_discard(idstr, nr);
+    while (nr--) {
+        uint64_t start = qemu_get_be64(f);
+        uint64_t length = qemu_get_be64(f);
 
-    v = qemu_get_be32(f);
-    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
-        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
-        return -ENOTSUP;
+        ret = postcopy_ram_discard_range(idstr, start, length);
+        if (ret < 0) {
+            return ret;
+        }
+    }
+    return qemu_file_get_error(f);
+}
+
+static QemuThread loadvm_listen_thread;
+static QEMUBH *loadvm_listen_end_bh;
+
+static void loadvm_postcopy_listen_end(void *opaque)
+{
+    QEMUFile *f = opaque;
+    int ret;
+
+    qemu_bh_delete(loadvm_listen_end_bh);
+    loadvm_listen_end_bh = NULL;
+    ret = (intptr_t)qemu_thread_join(&loadvm_listen_thread);
+
+    /* On success all pages have arrived and the rest of guest RAM is zero.
+     * On failure this also wakes up the threads that wait for a page, so
+     * it must come before vm_stop() or pausing the vCPUs would hang.  */
+    postcopy_ram_incoming_cleanup();
+
+    qemu_fclose(f);
+    loadvm_free_handlers();
+    migrate_decompress_threads_join();
+
+    if (ret < 0) {
+        /* the guest cannot continue without its memory */
+        vm_stop(RUN_STATE_INTERNAL_ERROR);
+        fprintf(stderr, "load of post-copy migration failed\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+/* Receives the rest of RAM while the guest already runs */
+static void *loadvm_postcopy_listen_thread(void *opaque)
+{
+    QEMUFile *f = opaque;
+    int ret;
+
+    ret = qemu_loadvm_state_main(f);
+    if (ret == 0) {
+        ret = qemu_file_get_error(f);
+    }
+    trace_loadvm_postcopy_listen_end(ret);
+
+    /* Cleaning up, and stopping the guest on failure, is left to the main
+     * loop: the vCPUs and the iothread are running at this point.  */
+    qemu_mutex_lock_iothread();
+    qemu_bh_schedule(loadvm_listen_end_bh);
+    qemu_mutex_unlock_iothread();
+    return (void *)(intptr_t)ret;
+}
+
+static int loadvm_postcopy_handle_run(QEMUFile *f, uint32_t len)
+{
+    QEMUFileBuffer b = { .data = g_malloc(len), .len = len };
+    QEMUFile *pkg;
+    int fd = qemu_get_fd(f);
+    int ret;
+
+    trace_loadvm_postcopy_run(len);
+    qemu_get_buffer(f, b.data, len);
+    ret = qemu_file_get_error(f);
+    if (ret < 0) {
+        goto out;
+    }
+
+    if (fd < 0) {
+        fprintf(stderr, "postcopy: migration stream has no return path\n");
+        ret = -EINVAL;
+        goto out;
+    }
+    ret = postcopy_ram_incoming_init(fd);
+    if (ret < 0) {
+        goto out;
     }
-    if (v != QEMU_VM_FILE_VERSION)
-        return -ENOTSUP;
+
+    /* From here on this coroutine does not read from f any more */
+    qemu_set_block(fd);
+    loadvm_listen_end_bh = qemu_bh_new(loadvm_postcopy_listen_end, f);
+    qemu_thread_create(&loadvm_listen_thread, loadvm_postcopy_listen_thread,
+                       f, QEMU_THREAD_JOINABLE);
+
+    pkg = qemu_fopen_ops(&b, &buf_read_ops);
+    ret = qemu_loadvm_state_main(pkg);
+    if (ret == 0) {
+        ret = qemu_file_get_error(pkg);
+    }
+    qemu_fclose(pkg);
+    if (ret == 0) {
+        ret = 1;
+    }
+
+out:
+    g_free(b.data);
+    return ret;
+}
+
+static int loadvm_process_command(QEMUFile *f)
+{
+    uint16_t command = qemu_get_be16(f);
+    uint32_t len = qemu_get_be32(f);
+
+    switch (command) {
+    case MIG_CMD_POSTCOPY_ADVISE:
+        if (len != 0) {
+            return -EINVAL;
+        }
+        if (!postcopy_ram_supported_by_host()) {
+            return -ENOSYS;
+        }
+        return 0;
+    case MIG_CMD_POSTCOPY_RAM_DISCARD:
+        return loadvm_postcopy_ram_handle_discard(f, len);
+    case MIG_CMD_POSTCOPY_RUN:
+        return loadvm_postcopy_handle_run(f, len);
+    default:
+        fprintf(stderr, "Unknown savevm command %d\n", command);
+        return -EINVAL;
+    }
+}
+
+/*
+ * Returns 1 if the stream switched to post-copy: the device state is
+ * loaded, and another thread now owns f and receives the rest of RAM.
+ */
+static int qemu_loadvm_state_main(QEMUFile *f)
+{
+    LoadStateEntry *le;
+    uint8_t section_type;
+    int ret = 0;
 
     while ((section_type = qemu_get_byte(f)) != QEMU_VM_EOF) {
         uint32_t instance_id, version_id, section_id;
@@ -2189,31 +2518,31 @@ int qemu_loadvm_state(QEMUFile *f)
             se = find_se(idstr, instance_id);
             if (se == NULL) {
                 fprintf(stderr, "Unknown savevm section or instance '%s' %d\n", idstr, instance_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             /* Validate version */
             if (version_id > se->version_id) {
                 fprintf(stderr, "savevm: unsupported version %d for '%s' v%d\n",
                         version_id, idstr, se->version_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
-            /* Add entry */
-            le = g_malloc0(sizeof(*le));
+            /* Add entry; only live sections are referred to again */
+            if (section_type == QEMU_VM_SECTION_START) {
+                le = g_malloc0(sizeof(*le));
 
-            le->se = se;
-            le->section_id = section_id;
-            le->version_id = version_id;
-            QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+                le->se = se;
+                le->section_id = section_id;
+                le->version_id = version_id;
+                QLIST_INSERT_HEAD(&loadvm_handlers, le, entry);
+            }
 
-            ret = vmstate_load(f, le->se, le->version_id);
+            ret = vmstate_load(f, se, version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state for instance 0x%x of device '%s'\n",
                         instance_id, idstr);
-                goto out;
+                return ret;
             }
             break;
         case QEMU_VM_SECTION_PART:
@@ -2227,37 +2556,70 @@ int qemu_loadvm_state(QEMUFile *f)
             }
             if (le == NULL) {
                 fprintf(stderr, "Unknown savevm section %d\n", section_id);
-                ret = -EINVAL;
-                goto out;
+                return -EINVAL;
             }
 
             ret = vmstate_load(f, le->se, le->version_id);
             if (ret < 0) {
                 fprintf(stderr, "qemu: warning: error while loading state section id %d\n",
                         section_id);
-                goto out;
+                return ret;
+            }
+            break;
+        case QEMU_VM_COMMAND:
+            ret = loadvm_process_command(f);
+            if (ret != 0) {
+                return ret;
             }
             break;
         default:
             fprintf(stderr, "Unknown savevm section type %d\n", section_type);
-            ret = -EINVAL;
-            goto out;
+            return -EINVAL;
         }
     }
 
-    cpu_synchronize_all_post_init();
+    return 0;
+}
 
-    ret = 0;
+/*
+ * this function has three return values:
+ *   negative: there was one error, and we have -errno.
+ *   0 : the whole state has been loaded, the caller closes f
+ *   1 : switched to post-copy; the guest can run but RAM is still being
+ *       received in the background, which takes ownership of f
+ */
+int qemu_loadvm_state(QEMUFile *f)
+{
+    unsigned int v;
+    int ret;
 
-out:
-    QLIST_FOREACH_SAFE(le, &loadvm_handlers, entry, new_le) {
-        QLIST_REMOVE(le, entry);
-        g_free(le);
+    if (qemu_savevm_state_blocked(NULL)) {
+        return -EINVAL;
+    }
+
+    v = qemu_get_be32(f);
+    if (v != QEMU_VM_FILE_MAGIC)
+        return -EINVAL;
+
+    v = qemu_get_be32(f);
+    if (v == QEMU_VM_FILE_VERSION_COMPAT) {
+        fprintf(stderr, "SaveVM v2 format is obsolete and don't work anymore\n");
+        return -ENOTSUP;
+    }
+    if (v != QEMU_VM_FILE_VERSION)
+        return -ENOTSUP;
+
+    ret = qemu_loadvm_state_main(f);
+    if (ret == 1) {
+        cpu_synchronize_all_post_init();
+        return ret;
     }
 
     if (ret == 0) {
+        cpu_synchronize_all_post_init();
         ret = qemu_file_get_error(f);
     }
+    loadvm_free_handlers();
 
     return ret;
 }
@@ -2505,6 +2867,7 @@ int load_vmstate(const char *name)
     ret = qemu_loadvm_state(f);
 
     qemu_fclose(f);
+    migrate_decompress_threads_join();
     if (ret < 0) {
         error_report("Error %d while loading VM state", ret);
         return ret;
@@ -136,7 +136,10 @@ static void fpu_raise_exception(CPUX86State *env)
     }
 #if !defined(CONFIG_USER_ONLY)
     else {
+        bool locked = tcg_iothread_lock();
+
         cpu_set_ferr(env);
+        tcg_iothread_unlock(locked);
     }
 #endif
 }
@@ -24,20 +24,32 @@
 #include "exec/softmmu_exec.h"
 #endif /* !defined(CONFIG_USER_ONLY) */
 
-/* broken thread support */
+/* Locked instructions of different vCPU threads exclude each other.
+   This does not make them atomic against plain stores of other vCPUs.  */
 
 static spinlock_t global_cpu_lock = SPIN_LOCK_UNLOCKED;
+static DEFINE_TLS(bool, have_cpu_lock);
 
 void helper_lock(void)
 {
     spin_lock(&global_cpu_lock);
+    tls_var(have_cpu_lock) = true;
 }
 
 void helper_unlock(void)
 {
+    tls_var(have_cpu_lock) = false;
     spin_unlock(&global_cpu_lock);
 }
 
+/* Drop the lock if the instruction faulted before releasing it.  */
+void cpu_x86_lock_reset(void)
+{
+    if (tls_var(have_cpu_lock)) {
+        helper_unlock();
+    }
+}
+
 void helper_cmpxchg8b(CPUX86State *env, target_ulong a0)
 {
     uint64_t d;
@@ -136,6 +148,8 @@ void tlb_fill(CPUX86State *env, target_ulong addr, int is_write, int mmu_idx,
               uintptr_t retaddr)
 {
     int ret;
+    /* the page walk reads guest memory through the memory map */
+    bool locked = tcg_iothread_lock();
 
     ret = cpu_x86_handle_mmu_fault(env, addr, is_write, mmu_idx);
     if (ret) {
@@ -145,5 +159,6 @@ void tlb_fill(CPUX86State *env, target_ulong addr, int is_write, int mmu_idx,
         }
         raise_exception_err(env, env->exception_index, env->error_code);
     }
+    tcg_iothread_unlock(locked);
 }
 #endif
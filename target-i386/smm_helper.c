@@ -182,6 +182,8 @@ void helper_rsm(CPUX86State *env)
     target_ulong sm_state;
     int i, offset;
     uint32_t val;
+    /* leaving SMM remaps SMRAM */
+    bool locked = tcg_iothread_lock();
 
     sm_state = env->smbase + 0x8000;
 #ifdef TARGET_X86_64
@@ -293,6 +295,7 @@ void helper_rsm(CPUX86State *env)
     CC_OP = CC_OP_EFLAGS;
     env->hflags &= ~HF_SMM_MASK;
     cpu_smm_update(env);
+    tcg_iothread_unlock(locked);
 
     qemu_log_mask(CPU_LOG_INT, "SMM: after RSM\n");
     log_cpu_state_mask(CPU_LOG_INT, env, CPU_DUMP_CCOP);
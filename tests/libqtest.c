@@ -30,6 +30,7 @@
 
 #include "qemu/compiler.h"
 #include "qemu/osdep.h"
+#include "qapi/qmp/qjson.h"
 
 #define MAX_IRQ 256
 
@@ -106,6 +107,7 @@ static pid_t qtest_qemu_pid(QTestState *s)
 
 QTestState *qtest_init(const char *extra_args)
 {
+    static int instance;
     QTestState *s;
     int sock, qmpsock, i;
     gchar *pid_file;
@@ -118,9 +120,13 @@ QTestState *qtest_init(const char *extra_args)
 
     s = g_malloc(sizeof(*s));
 
-    s->socket_path = g_strdup_printf("/tmp/qtest-%d.sock", getpid());
-    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d.qmp", getpid());
-    pid_file = g_strdup_printf("/tmp/qtest-%d.pid", getpid());
+    /* A test may run several instances at once, e.g. for migration */
+    s->socket_path = g_strdup_printf("/tmp/qtest-%d-%d.sock",
+                                     getpid(), instance);
+    s->qmp_socket_path = g_strdup_printf("/tmp/qtest-%d-%d.qmp",
+                                         getpid(), instance);
+    pid_file = g_strdup_printf("/tmp/qtest-%d-%d.pid", getpid(), instance);
+    instance++;
 
     sock = init_socket(s->socket_path);
     qmpsock = init_socket(s->qmp_socket_path);
@@ -287,15 +293,14 @@ redo:
     return words;
 }
 
-void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+/* Read one JSON object from the QMP socket */
+static QDict *qtest_qmp_receive(QTestState *s)
 {
-    bool has_reply = false;
+    GString *json = g_string_new("");
+    bool has_reply = false, in_string = false, escape = false;
     int nesting = 0;
+    QObject *obj;
 
-    /* Send QMP request */
-    socket_sendf(s->qmp_fd, fmt, ap);
-
-    /* Receive reply */
     while (!has_reply || nesting > 0) {
         ssize_t len;
         char c;
@@ -310,16 +315,73 @@ void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
             exit(1);
         }
 
+        if (has_reply) {
+            g_string_append_c(json, c);
+        }
+        if (escape) {
+            escape = false;
+            continue;
+        }
         switch (c) {
+        case '\\':
+            escape = in_string;
+            break;
+        case '"':
+            in_string = !in_string;
+            break;
         case '{':
-            nesting++;
-            has_reply = true;
+            if (!in_string) {
+                if (!has_reply) {
+                    g_string_append_c(json, c);
+                }
+                nesting++;
+                has_reply = true;
+            }
             break;
         case '}':
-            nesting--;
+            if (!in_string) {
+                nesting--;
+            }
             break;
         }
     }
+
+    obj = qobject_from_json(json->str);
+    g_assert(obj && qobject_type(obj) == QTYPE_QDICT);
+    g_string_free(json, true);
+
+    return qobject_to_qdict(obj);
+}
+
+void qtest_qmpv(QTestState *s, const char *fmt, va_list ap)
+{
+    QDict *reply;
+
+    /* Send QMP request */
+    socket_sendf(s->qmp_fd, fmt, ap);
+
+    /* Receive reply */
+    reply = qtest_qmp_receive(s);
+    QDECREF(reply);
+}
+
+QDict *qtest_qmp_reply(QTestState *s, const char *fmt, ...)
+{
+    va_list ap;
+    QDict *reply;
+
+    va_start(ap, fmt);
+    socket_sendf(s->qmp_fd, fmt, ap);
+    va_end(ap);
+
+    /* Receive reply, skipping asynchronous events */
+    for (;;) {
+        reply = qtest_qmp_receive(s);
+        if (!qdict_haskey(reply, "event")) {
+            return reply;
+        }
+        QDECREF(reply);
+    }
 }
 
 void qtest_qmp(QTestState *s, const char *fmt, ...)
@@ -21,6 +21,7 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <sys/types.h>
+#include "qapi/qmp/qdict.h"
 
 typedef struct QTestState QTestState;
 
@@ -61,6 +62,17 @@ void qtest_qmp(QTestState *s, const char *fmt, ...);
  */
 void qtest_qmpv(QTestState *s, const char *fmt, va_list ap);
 
+/**
+ * qtest_qmp_reply:
+ * @s: #QTestState instance to operate on.
+ * @fmt...: QMP message to send to qemu
+ *
+ * Sends a QMP message to QEMU and returns its reply.  Asynchronous events
+ * received in the meantime are discarded.  The caller must QDECREF the
+ * reply.
+ */
+QDict *qtest_qmp_reply(QTestState *s, const char *fmt, ...);
+
 /**
  * qtest_get_irq:
  * @s: #QTestState instance to operate on.
@@ -0,0 +1,203 @@
+/*
+ * QTest testcase for post-copy RAM migration
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include "libqtest.h"
+#include "qemu-common.h"
+
+#define TEST_PAGE_SIZE  4096
+#define TEST_BASE       (1 << 20)   /* above the legacy ROM/VGA hole */
+#define TEST_PAGES      1024
+#define TEST_HDR_SIZE   16
+#define TIMEOUT_MS      60000
+
+static bool userfaultfd_available(void)
+{
+#if defined(CONFIG_USERFAULTFD) && defined(__NR_userfaultfd)
+    int fd = syscall(__NR_userfaultfd, O_CLOEXEC);
+
+    if (fd >= 0) {
+        close(fd);
+        return true;
+    }
+#endif
+    return false;
+}
+
+/* Only the start of each page is written: qtest_memwrite is slow */
+static void fill_page(uint8_t *buf, int page)
+{
+    uint64_t addr = TEST_BASE + (uint64_t)page * TEST_PAGE_SIZE;
+
+    memset(buf, 0, TEST_PAGE_SIZE);
+    memcpy(buf, &addr, sizeof(addr));
+    memset(buf + sizeof(addr), (page & 0xff) | 1,
+           TEST_HDR_SIZE - sizeof(addr));
+}
+
+static void qmp_assert_ok(QTestState *s, const char *cmd)
+{
+    QDict *reply = qtest_qmp_reply(s, "%s", cmd);
+
+    if (!qdict_haskey(reply, "return")) {
+        g_test_message("'%s' failed", cmd);
+        g_assert_not_reached();
+    }
+    QDECREF(reply);
+}
+
+static bool migration_status_is(QTestState *s, const char *status)
+{
+    QDict *reply = qtest_qmp_reply(s, "{ 'execute': 'query-migrate' }");
+    QDict *info = qdict_get_qdict(reply, "return");
+    bool ret;
+
+    g_assert(info);
+    g_assert(!qdict_haskey(info, "status") ||
+             strcmp(qdict_get_str(info, "status"), "failed") != 0);
+    ret = qdict_haskey(info, "status") &&
+          !strcmp(qdict_get_str(info, "status"), status);
+    QDECREF(reply);
+    return ret;
+}
+
+static bool vm_running(QTestState *s)
+{
+    QDict *reply = qtest_qmp_reply(s, "{ 'execute': 'query-status' }");
+    bool ret = qdict_get_bool(qdict_get_qdict(reply, "return"), "running");
+
+    QDECREF(reply);
+    return ret;
+}
+
+static void wait_for_migration_status(QTestState *s, const char *status)
+{
+    int ms;
+
+    for (ms = 0; !migration_status_is(s, status); ms += 10) {
+        g_assert_cmpint(ms, <, TIMEOUT_MS);
+        g_usleep(10 * 1000);
+    }
+}
+
+static void wait_for_vm_running(QTestState *s)
+{
+    int ms;
+
+    for (ms = 0; !vm_running(s); ms += 10) {
+        g_assert_cmpint(ms, <, TIMEOUT_MS);
+        g_usleep(10 * 1000);
+    }
+}
+
+static int64_t postcopy_requests(QTestState *s)
+{
+    QDict *reply = qtest_qmp_reply(s, "{ 'execute': 'query-migrate' }");
+    QDict *info = qdict_get_qdict(reply, "return");
+    int64_t ret = qdict_get_try_int(info, "postcopy-requests", 0);
+
+    QDECREF(reply);
+    return ret;
+}
+
+static void check_pages(QTestState *s)
+{
+    uint8_t expected[TEST_PAGE_SIZE], actual[TEST_PAGE_SIZE];
+    int i;
+
+    for (i = 0; i < TEST_PAGES; i++) {
+        fill_page(expected, i);
+        qtest_memread(s, TEST_BASE + (uint64_t)i * TEST_PAGE_SIZE,
+                      actual, TEST_PAGE_SIZE);
+        g_assert(memcmp(expected, actual, TEST_PAGE_SIZE) == 0);
+    }
+
+    /* a page the guest never wrote is zero */
+    qtest_memread(s, TEST_BASE + TEST_PAGES * TEST_PAGE_SIZE,
+                  actual, TEST_PAGE_SIZE);
+    memset(expected, 0, TEST_PAGE_SIZE);
+    g_assert(memcmp(expected, actual, TEST_PAGE_SIZE) == 0);
+}
+
+static void test_postcopy(void)
+{
+    QTestState *from, *to;
+    uint8_t buf[TEST_PAGE_SIZE];
+    const char *caps = "{ 'execute': 'migrate-set-capabilities',"
+                       "  'arguments': { 'capabilities': ["
+                       "    { 'capability': 'postcopy-ram',"
+                       "      'state': true } ] } }";
+    char *sock_path, *args, *cmd;
+    int i;
+
+    if (!userfaultfd_available()) {
+        g_test_message("userfaultfd not available, skipping");
+        return;
+    }
+
+    sock_path = g_strdup_printf("/tmp/postcopy-test-%d.sock", getpid());
+    unlink(sock_path);
+
+    from = qtest_init("-display none -m 32M");
+    args = g_strdup_printf("-display none -m 32M -incoming unix:%s",
+                           sock_path);
+    to = qtest_init(args);
+    g_free(args);
+
+    for (i = 0; i < TEST_PAGES; i++) {
+        fill_page(buf, i);
+        qtest_memwrite(from, TEST_BASE + (uint64_t)i * TEST_PAGE_SIZE,
+                       buf, TEST_HDR_SIZE);
+    }
+
+    qmp_assert_ok(from, caps);
+    qmp_assert_ok(to, caps);
+
+    /* Slow enough that pre-copy cannot finish; pages the destination
+     * asks for are sent regardless of the limit. */
+    qmp_assert_ok(from, "{ 'execute': 'migrate_set_speed',"
+                        "  'arguments': { 'value': 65536 } }");
+
+    cmd = g_strdup_printf("{ 'execute': 'migrate',"
+                          "  'arguments': { 'uri': 'unix:%s' } }", sock_path);
+    qmp_assert_ok(from, cmd);
+    g_free(cmd);
+
+    wait_for_migration_status(from, "active");
+    qmp_assert_ok(from, "{ 'execute': 'migrate-start-postcopy' }");
+    wait_for_migration_status(from, "postcopy-active");
+    wait_for_vm_running(to);
+
+    /* The destination runs now; most pages have to be fetched on demand */
+    check_pages(to);
+    g_assert_cmpint(postcopy_requests(from), >, 0);
+
+    qmp_assert_ok(from, "{ 'execute': 'migrate_set_speed',"
+                        "  'arguments': { 'value': 1073741824 } }");
+    wait_for_migration_status(from, "completed");
+    check_pages(to);
+
+    qtest_quit(to);
+    qtest_quit(from);
+    unlink(sock_path);
+    g_free(sock_path);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    qtest_add_func("/migration/postcopy/unix", test_postcopy);
+
+    return g_test_run();
+}
@@ -226,6 +226,43 @@ static void test_parse_uint_full_correct(void)
     g_assert_cmpint(i, ==, 123);
 }
 
+static uint8_t zero_test_buf[4096 + 128] __attribute__((aligned(64)));
+
+static void test_buffer_find_nonzero_offset_len(size_t len)
+{
+    uint8_t *buf = zero_test_buf;
+    size_t i, off;
+
+    g_assert(can_use_buffer_find_nonzero_offset(buf, len));
+
+    memset(buf, 0, len);
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), ==, len);
+    g_assert(buffer_is_zero(buf, len));
+
+    for (i = 0; i < len; i += 37) {
+        buf[i] = 0x80;
+        off = buffer_find_nonzero_offset(buf, len);
+        g_assert_cmpint(off, <=, i);
+        g_assert_cmpint(i - off, <, 512);
+        g_assert(!buffer_is_zero(buf, len));
+        buf[i] = 0;
+    }
+
+    /* the last byte of the buffer */
+    buf[len - 1] = 1;
+    g_assert_cmpint(buffer_find_nonzero_offset(buf, len), <, len);
+    g_assert(!buffer_is_zero(buf, len));
+    buf[len - 1] = 0;
+}
+
+static void test_buffer_find_nonzero_offset(void)
+{
+    /* a target page, and a length that rules out the wider vectors */
+    test_buffer_find_nonzero_offset_len(4096);
+    test_buffer_find_nonzero_offset_len(4096 + 128);
+    g_assert_cmpint(buffer_find_nonzero_offset(NULL, 0), ==, 0);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -247,5 +284,8 @@ int main(int argc, char **argv)
     g_test_add_func("/cutils/parse_uint_full/correct",
                     test_parse_uint_full_correct);
 
+    g_test_add_func("/cutils/buffer_find_nonzero_offset",
+                    test_buffer_find_nonzero_offset);
+
     return g_test_run();
 }
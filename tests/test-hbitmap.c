@@ -11,6 +11,7 @@
 
 #include <glib.h>
 #include <stdarg.h>
+#include <string.h>
 #include "qemu/hbitmap.h"
 
 #define LOG_BITS_PER_LONG          (BITS_PER_LONG == 32 ? 5 : 6)
@@ -369,6 +370,67 @@ static void test_hbitmap_iter_granularity(TestHBitmapData *data,
     g_assert_cmpint(hbitmap_iter_next(&hbi), <, 0);
 }
 
+static void test_hbitmap_serialize(TestHBitmapData *data,
+                                   const void *unused)
+{
+    uint64_t size = L2 * 2 + 5;
+    size_t buf_size = (size + 7) / 8;
+    uint8_t *buf = g_malloc(buf_size);
+    HBitmap *copy;
+    uint64_t i;
+
+    hbitmap_test_init(data, size, 0);
+    hbitmap_test_set(data, 3, 1);
+    hbitmap_test_set(data, L1 - 1, L1 + 2);
+    hbitmap_test_set(data, L2 + 5, L1 * 3);
+    hbitmap_test_set(data, size - 2, 2);
+
+    hbitmap_serialize(data->hb, buf, 0, size);
+    g_assert_cmpint(buf[0], ==, 1 << 3);
+    g_assert_cmpint(buf[buf_size - 1], ==, 0x18);
+
+    copy = hbitmap_alloc(size, 0);
+    hbitmap_deserialize(copy, buf, 0, size);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+    for (i = 0; i < size; i++) {
+        g_assert_cmpint(hbitmap_get(copy, i), ==, hbitmap_get(data->hb, i));
+    }
+
+    /* A partial range only touches its own bits.  */
+    memset(buf, 0xff, buf_size);
+    hbitmap_deserialize(copy, buf, L1, L1 * 2);
+    g_assert_cmpint(hbitmap_count(copy), ==,
+                    hbitmap_count(data->hb) + L1 * 2 - (L1 + 1));
+    g_assert(!hbitmap_get(copy, L1 * 3));
+    g_assert(hbitmap_get(copy, L1 * 3 - 1));
+    hbitmap_free(copy);
+    g_free(buf);
+}
+
+static void test_hbitmap_serialize_granularity(TestHBitmapData *data,
+                                               const void *unused)
+{
+    uint8_t buf[L1 / 8];
+    HBitmap *copy;
+
+    hbitmap_test_init(data, L1 << 2, 2);
+    hbitmap_test_set(data, 9, 1);
+    hbitmap_test_set(data, L1 << 1, L1);
+
+    /* Each bit in the buffer represents a group of four.  */
+    hbitmap_serialize(data->hb, buf, 0, L1 << 2);
+    g_assert_cmpint(buf[0], ==, 1 << 2);
+
+    copy = hbitmap_alloc(L1 << 2, 2);
+    hbitmap_deserialize(copy, buf, 0, L1 << 2);
+    g_assert_cmpint(hbitmap_count(copy), ==, hbitmap_count(data->hb));
+    g_assert(hbitmap_get(copy, 8));
+    g_assert(!hbitmap_get(copy, 12));
+    g_assert(hbitmap_get(copy, (L1 << 1) + L1 - 1));
+    g_assert(!hbitmap_get(copy, (L1 << 1) + L1));
+    hbitmap_free(copy);
+}
+
 static void hbitmap_test_add(const char *testpath,
                                    void (*test_func)(TestHBitmapData *data, const void *user_data))
 {
@@ -395,6 +457,9 @@ int main(int argc, char **argv)
     hbitmap_test_add("/hbitmap/reset/empty", test_hbitmap_reset_empty);
     hbitmap_test_add("/hbitmap/reset/general", test_hbitmap_reset);
     hbitmap_test_add("/hbitmap/granularity", test_hbitmap_granularity);
+    hbitmap_test_add("/hbitmap/serialize/basic", test_hbitmap_serialize);
+    hbitmap_test_add("/hbitmap/serialize/granularity",
+                     test_hbitmap_serialize_granularity);
     g_test_run();
 
     return 0;
@@ -398,6 +398,50 @@ static void test_discard_back(void)
     iov_free(iov, iov_cnt);
 }
 
+static void test_is_zero(void)
+{
+    QEMUIOVector qiov;
+    struct iovec *iov;
+    unsigned iov_cnt, i;
+    size_t size, j, o;
+
+    /* random element sizes exercise both the vectorized part and the
+     * unaligned tail of every element */
+    iov_random(&iov, &iov_cnt);
+    for (i = 0; i < iov_cnt; i++) {
+        memset(iov[i].iov_base, 0, iov[i].iov_len);
+    }
+    qemu_iovec_init_external(&qiov, iov, iov_cnt);
+    g_assert(qemu_iovec_is_zero(&qiov));
+
+    /* a single non-zero byte anywhere must be found */
+    size = iov_size(iov, iov_cnt);
+    for (o = 0; o < size; o++) {
+        iov_memset(iov, iov_cnt, o, 1, 1);
+        g_assert(!qemu_iovec_is_zero(&qiov));
+        iov_memset(iov, iov_cnt, o, 0, 1);
+    }
+    g_assert(qemu_iovec_is_zero(&qiov));
+    iov_free(iov, iov_cnt);
+
+    /* large elements go through buffer_find_nonzero_offset() */
+    iov = g_malloc(2 * sizeof(*iov));
+    for (i = 0; i < 2; i++) {
+        iov[i].iov_len = 4096 + i * 3;
+        iov[i].iov_base = g_malloc0(iov[i].iov_len);
+    }
+    qemu_iovec_init_external(&qiov, iov, 2);
+    g_assert(qemu_iovec_is_zero(&qiov));
+    for (j = 0; j < iov[1].iov_len; j += 511) {
+        ((unsigned char *)iov[1].iov_base)[j] = 0x80;
+        g_assert(!qemu_iovec_is_zero(&qiov));
+        ((unsigned char *)iov[1].iov_base)[j] = 0;
+    }
+    ((unsigned char *)iov[1].iov_base)[iov[1].iov_len - 1] = 0x80;
+    g_assert(!qemu_iovec_is_zero(&qiov));
+    iov_free(iov, 2);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -406,5 +450,6 @@ int main(int argc, char **argv)
     g_test_add_func("/basic/iov/io", test_io);
     g_test_add_func("/basic/iov/discard-front", test_discard_front);
     g_test_add_func("/basic/iov/discard-back", test_discard_back);
+    g_test_add_func("/basic/iov/is-zero", test_is_zero);
     return g_test_run();
 }
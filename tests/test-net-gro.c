@@ -0,0 +1,400 @@
+/*
+ * Receive segment coalescing tests
+ *
+ * Copyright 2013 Red Hat, Inc. and/or its affiliates
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ *
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/bswap.h"
+#include "net/checksum.h"
+#include "net/gro.h"
+
+#define MSS         1000
+#define MAX_OUT     64
+
+typedef struct Segment {
+    bool ipv6;
+    uint16_t sport;
+    uint32_t seq;
+    size_t len;
+    uint8_t flags;      /* in addition to ACK */
+} Segment;
+
+typedef struct Output {
+    uint8_t *buf;
+    size_t size;
+    bool has_hdr;
+    struct virtio_net_hdr hdr;
+} Output;
+
+static Output out[MAX_OUT];
+static int nout;
+
+static size_t build(uint8_t *buf, const Segment *s)
+{
+    static const uint8_t macs[] = {
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x56,
+        0x52, 0x54, 0x00, 0x12, 0x34, 0x57,
+    };
+    size_t l4_off = 14 + (s->ipv6 ? 40 : 20);
+    size_t l4_len = 20 + s->len;
+    uint8_t *ip = buf + 14;
+    uint8_t *tcp = buf + l4_off;
+    uint32_t sum;
+    size_t i;
+
+    memset(buf, 0, l4_off + l4_len);
+    memcpy(buf, macs, sizeof(macs));
+    if (s->ipv6) {
+        stw_be_p(buf + 12, 0x86dd);
+        ip[0] = 0x60;
+        stw_be_p(ip + 4, l4_len);
+        ip[6] = 6;
+        ip[7] = 64;
+        ip[8] = ip[24] = 0xfe;
+        ip[9] = ip[25] = 0x80;
+        ip[23] = 1;
+        ip[39] = 2;
+    } else {
+        stw_be_p(buf + 12, 0x0800);
+        ip[0] = 0x45;
+        stw_be_p(ip + 2, 20 + l4_len);
+        stw_be_p(ip + 6, 0x4000);
+        ip[8] = 64;
+        ip[9] = 6;
+        stl_be_p(ip + 12, 0x0a000202);
+        stl_be_p(ip + 16, 0x0a00020f);
+        stw_be_p(ip + 10, net_raw_checksum(ip, 20));
+    }
+
+    stw_be_p(tcp, s->sport);
+    stw_be_p(tcp + 2, 5000);
+    stl_be_p(tcp + 4, s->seq);
+    stl_be_p(tcp + 8, 1);
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x10 | s->flags;
+    stw_be_p(tcp + 14, 0xffff);
+    for (i = 0; i < s->len; i++) {
+        tcp[20 + i] = s->seq + i;
+    }
+
+    sum = net_checksum_add(l4_len, tcp) + 6 + l4_len;
+    sum += s->ipv6 ? net_checksum_add(32, ip + 8) : net_checksum_add(8, ip + 12);
+    stw_be_p(tcp + 16, net_checksum_finish(sum));
+
+    return l4_off + l4_len;
+}
+
+static void add(NetGRO *gro, bool ipv6, uint16_t sport, uint32_t seq,
+                size_t len, uint8_t flags)
+{
+    Segment s = { ipv6, sport, seq, len, flags };
+    uint8_t buf[2048];
+    size_t size = build(buf, &s);
+
+    g_assert(net_gro_add(gro, buf, size));
+}
+
+static void output(void *opaque, const uint8_t *buf, size_t size,
+                   const struct virtio_net_hdr *hdr)
+{
+    Output *o;
+
+    g_assert(nout < MAX_OUT);
+    o = &out[nout++];
+    o->buf = g_memdup(buf, size);
+    o->size = size;
+    o->has_hdr = hdr != NULL;
+    if (hdr) {
+        o->hdr = *hdr;
+    }
+}
+
+static void flush(NetGRO *gro, int gso_types)
+{
+    int i;
+
+    for (i = 0; i < nout; i++) {
+        g_free(out[i].buf);
+    }
+    nout = 0;
+    net_gro_flush(gro, gso_types, output, NULL);
+    g_assert_cmpint(net_gro_pending(gro), ==, 0);
+}
+
+/* Complete the checksum the way the guest would and check the frame */
+static void check_frame(Output *o, bool ipv6, uint16_t sport,
+                        uint32_t seq, size_t len)
+{
+    size_t l4_off = 14 + (ipv6 ? 40 : 20);
+    uint8_t *ip = o->buf + 14;
+    uint8_t *tcp = o->buf + l4_off;
+    size_t l4_len = o->size - l4_off;
+    uint32_t sum;
+    size_t i;
+
+    g_assert_cmpint(o->size, ==, l4_off + 20 + len);
+    g_assert_cmpint(lduw_be_p(tcp), ==, sport);
+    g_assert_cmpint(ldl_be_p(tcp + 4), ==, seq);
+    for (i = 0; i < len; i++) {
+        g_assert_cmpint(tcp[20 + i], ==, (uint8_t)(seq + i));
+    }
+
+    if (ipv6) {
+        g_assert_cmpint(lduw_be_p(ip + 4), ==, l4_len);
+    } else {
+        g_assert_cmpint(lduw_be_p(ip + 2), ==, 20 + l4_len);
+        g_assert_cmpint(net_raw_checksum(ip, 20), ==, 0);
+    }
+
+    if (o->has_hdr) {
+        g_assert_cmpint(o->hdr.flags, ==, VIRTIO_NET_HDR_F_NEEDS_CSUM);
+        g_assert_cmpint(o->hdr.csum_start, ==, l4_off);
+        g_assert_cmpint(o->hdr.csum_offset, ==, 16);
+        g_assert_cmpint(o->hdr.hdr_len, ==, l4_off + 20);
+        stw_be_p(o->buf + o->hdr.csum_start + o->hdr.csum_offset,
+                 net_raw_checksum(o->buf + o->hdr.csum_start,
+                                  o->size - o->hdr.csum_start));
+    }
+
+    sum = net_checksum_add(l4_len, tcp) + 6 + l4_len;
+    sum += ipv6 ? net_checksum_add(32, ip + 8) : net_checksum_add(8, ip + 12);
+    g_assert_cmpint(net_checksum_finish(sum), ==, 0);
+}
+
+static void test_merge(void)
+{
+    NetGRO *gro = net_gro_new();
+    NetGROStats stats;
+
+    add(gro, false, 1, 0, MSS, 0);
+    add(gro, false, 1, MSS, MSS, 0);
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    add(gro, false, 1, 3 * MSS, 500, 0x08);
+    flush(gro, NET_GRO_TCPV4 | NET_GRO_TCPV6);
+
+    g_assert_cmpint(nout, ==, 1);
+    g_assert(out[0].has_hdr);
+    g_assert_cmpint(out[0].hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV4);
+    g_assert_cmpint(out[0].hdr.gso_size, ==, MSS);
+    g_assert_cmpint(out[0].buf[14 + 20 + 13], ==, 0x18);
+    check_frame(&out[0], false, 1, 0, 3 * MSS + 500);
+
+    net_gro_get_stats(gro, &stats);
+    g_assert_cmpint(stats.frames_in, ==, 4);
+    g_assert_cmpint(stats.frames_out, ==, 1);
+    g_assert_cmpint(stats.merged, ==, 1);
+    g_assert_cmpint(stats.segments, ==, 4);
+
+    net_gro_free(gro);
+}
+
+static void test_out_of_order(void)
+{
+    NetGRO *gro = net_gro_new();
+    int i;
+
+    add(gro, false, 1, 0, MSS, 0);
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    add(gro, false, 1, MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 3);
+    for (i = 0; i < nout; i++) {
+        g_assert(!out[i].has_hdr);
+    }
+    check_frame(&out[0], false, 1, 0, MSS);
+    check_frame(&out[1], false, 1, 2 * MSS, MSS);
+    check_frame(&out[2], false, 1, MSS, MSS);
+
+    net_gro_free(gro);
+}
+
+static void test_flows(void)
+{
+    NetGRO *gro = net_gro_new();
+
+    add(gro, false, 1, 0, MSS, 0);
+    add(gro, false, 2, 5000, MSS, 0);
+    add(gro, false, 1, MSS, MSS, 0);
+    add(gro, false, 2, 5000 + MSS, MSS, 0);
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 2);
+    g_assert(out[0].has_hdr && out[1].has_hdr);
+    check_frame(&out[0], false, 1, 0, 3 * MSS);
+    check_frame(&out[1], false, 2, 5000, 2 * MSS);
+
+    net_gro_free(gro);
+}
+
+static void test_passthrough(void)
+{
+    NetGRO *gro = net_gro_new();
+    uint8_t arp[60];
+
+    memset(arp, 0xa5, sizeof(arp));
+    stw_be_p(arp + 12, 0x0806);
+
+    add(gro, false, 1, 0, MSS, 0);
+    g_assert(net_gro_add(gro, arp, sizeof(arp)));
+    add(gro, false, 1, MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 2);
+    check_frame(&out[0], false, 1, 0, 2 * MSS);
+    g_assert(!out[1].has_hdr);
+    g_assert_cmpint(out[1].size, ==, sizeof(arp));
+    g_assert(!memcmp(out[1].buf, arp, sizeof(arp)));
+
+    net_gro_free(gro);
+}
+
+static void test_psh(void)
+{
+    NetGRO *gro = net_gro_new();
+
+    add(gro, false, 1, 0, MSS, 0x08);
+    add(gro, false, 1, MSS, MSS, 0);
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 2);
+    g_assert(!out[0].has_hdr);
+    check_frame(&out[0], false, 1, 0, MSS);
+    g_assert(out[1].has_hdr);
+    check_frame(&out[1], false, 1, MSS, 2 * MSS);
+
+    net_gro_free(gro);
+}
+
+static void test_fin(void)
+{
+    NetGRO *gro = net_gro_new();
+
+    add(gro, false, 1, 0, MSS, 0);
+    add(gro, false, 1, MSS, MSS, 0);
+    add(gro, false, 1, 2 * MSS, 0, 0x01);
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 3);
+    check_frame(&out[0], false, 1, 0, 2 * MSS);
+    g_assert_cmpint(out[1].buf[14 + 20 + 13], ==, 0x11);
+    g_assert(!out[2].has_hdr);
+
+    net_gro_free(gro);
+}
+
+static void test_bad_csum(void)
+{
+    NetGRO *gro = net_gro_new();
+    Segment s = { false, 1, MSS, MSS, 0 };
+    NetGROStats stats;
+    uint8_t buf[2048];
+    size_t size;
+
+    size = build(buf, &s);
+    buf[size - 1] ^= 0xff;
+
+    add(gro, false, 1, 0, MSS, 0);
+    g_assert(net_gro_add(gro, buf, size));
+    add(gro, false, 1, 2 * MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 3);
+    g_assert(!out[0].has_hdr && !out[1].has_hdr && !out[2].has_hdr);
+    g_assert(!memcmp(out[1].buf, buf, size));
+
+    net_gro_get_stats(gro, &stats);
+    g_assert_cmpint(stats.bad_csum, ==, 1);
+    g_assert_cmpint(stats.merged, ==, 0);
+
+    net_gro_free(gro);
+}
+
+static void test_ipv6(void)
+{
+    NetGRO *gro = net_gro_new();
+
+    add(gro, true, 1, 0, MSS, 0);
+    add(gro, true, 1, MSS, MSS, 0);
+    add(gro, true, 1, 2 * MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4 | NET_GRO_TCPV6);
+
+    g_assert_cmpint(nout, ==, 1);
+    g_assert(out[0].has_hdr);
+    g_assert_cmpint(out[0].hdr.gso_type, ==, VIRTIO_NET_HDR_GSO_TCPV6);
+    check_frame(&out[0], true, 1, 0, 3 * MSS);
+
+    /* Not without TCPV6 support in the receiver */
+    add(gro, true, 1, 0, MSS, 0);
+    add(gro, true, 1, MSS, MSS, 0);
+    flush(gro, NET_GRO_TCPV4);
+    g_assert_cmpint(nout, ==, 2);
+    g_assert(!out[0].has_hdr && !out[1].has_hdr);
+
+    net_gro_free(gro);
+}
+
+static void test_max_size(void)
+{
+    NetGRO *gro = net_gro_new();
+    size_t len = 1400;
+    int i, n = 48;
+    int first = (0xffff - 40) / len;
+
+    for (i = 0; i < n; i++) {
+        add(gro, false, 1, i * len, len, 0);
+    }
+    flush(gro, NET_GRO_TCPV4);
+
+    g_assert_cmpint(nout, ==, 2);
+    check_frame(&out[0], false, 1, 0, first * len);
+    check_frame(&out[1], false, 1, first * len, (n - first) * len);
+
+    net_gro_free(gro);
+}
+
+static void test_full(void)
+{
+    NetGRO *gro = net_gro_new();
+    Segment s = { false, 1, 0, 100, 0 };
+    uint8_t buf[2048];
+    size_t size = build(buf, &s);
+    int i;
+
+    for (i = 0; net_gro_add(gro, buf, size); i++) {
+        g_assert_cmpint(net_gro_pending(gro), ==, i + 1);
+    }
+    g_assert_cmpint(i, >, 0);
+    g_assert_cmpint(net_gro_pending_bytes(gro), ==, i * size);
+
+    net_gro_purge(gro);
+    g_assert_cmpint(net_gro_pending(gro), ==, 0);
+    g_assert(net_gro_add(gro, buf, size));
+
+    net_gro_free(gro);
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/net/gro/merge", test_merge);
+    g_test_add_func("/net/gro/out-of-order", test_out_of_order);
+    g_test_add_func("/net/gro/flows", test_flows);
+    g_test_add_func("/net/gro/passthrough", test_passthrough);
+    g_test_add_func("/net/gro/psh", test_psh);
+    g_test_add_func("/net/gro/fin", test_fin);
+    g_test_add_func("/net/gro/bad-csum", test_bad_csum);
+    g_test_add_func("/net/gro/ipv6", test_ipv6);
+    g_test_add_func("/net/gro/max-size", test_max_size);
+    g_test_add_func("/net/gro/full", test_full);
+    return g_test_run();
+}
@@ -0,0 +1,511 @@
+/*
+ * Throttle infrastructure tests
+ *
+ * Copyright Red Hat, Inc. 2013
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <math.h>
+#include "qemu/throttle.h"
+
+static LeakyBucket    bkt;
+static ThrottleConfig cfg;
+static ThrottleState  ts;
+static ThrottleTimers tt;
+
+/* useful function */
+static bool double_cmp(double x, double y)
+{
+    return fabs(x - y) < 1e-6;
+}
+
+static void read_timer_cb(void *opaque)
+{
+}
+
+static void write_timer_cb(void *opaque)
+{
+}
+
+static void timers_setup(void)
+{
+    throttle_init(&ts);
+    throttle_timers_init(&tt, rt_clock, read_timer_cb, write_timer_cb, &ts);
+}
+
+/* tests for single bucket operations */
+static void test_leak_bucket(void)
+{
+    /* set initial value */
+    bkt.avg = 150;
+    bkt.max = 15;
+    bkt.level = 1.5;
+
+    /* leak an op work of time */
+    throttle_leak_bucket(&bkt, NANOSECONDS_PER_SECOND / 150);
+    g_assert(bkt.avg == 150);
+    g_assert(bkt.max == 15);
+    g_assert(double_cmp(bkt.level, 0.5));
+
+    /* leak again emptying the bucket */
+    throttle_leak_bucket(&bkt, NANOSECONDS_PER_SECOND / 150);
+    g_assert(bkt.avg == 150);
+    g_assert(bkt.max == 15);
+    g_assert(double_cmp(bkt.level, 0));
+
+    /* check that the bucket level won't go lower */
+    throttle_leak_bucket(&bkt, NANOSECONDS_PER_SECOND / 150);
+    g_assert(bkt.avg == 150);
+    g_assert(bkt.max == 15);
+    g_assert(double_cmp(bkt.level, 0));
+}
+
+static void test_compute_wait(void)
+{
+    int64_t wait;
+    int64_t result;
+
+    /* no operation limit set */
+    bkt.avg = 0;
+    bkt.max = 15;
+    bkt.level = 1.5;
+    wait = throttle_compute_wait(&bkt);
+    g_assert(!wait);
+
+    /* zero delta */
+    bkt.avg = 150;
+    bkt.max = 15;
+    bkt.level = 15;
+    wait = throttle_compute_wait(&bkt);
+    g_assert(!wait);
+
+    /* below zero delta */
+    bkt.avg = 150;
+    bkt.max = 15;
+    bkt.level = 9;
+    wait = throttle_compute_wait(&bkt);
+    g_assert(!wait);
+
+    /* half an operation above max */
+    bkt.avg = 150;
+    bkt.max = 15;
+    bkt.level = 15.5;
+    wait = throttle_compute_wait(&bkt);
+    /* time required to do half an operation */
+    result = (int64_t) NANOSECONDS_PER_SECOND / 150 / 2;
+    g_assert(wait == result);
+}
+
+/* functions to test ThrottleState initialization/destroy methods */
+static void test_init(void)
+{
+    int i;
+
+    /* fill the structures with crap */
+    memset(&ts, 1, sizeof(ts));
+    memset(&tt, 1, sizeof(tt));
+
+    /* init structures */
+    timers_setup();
+
+    /* check initialized fields */
+    g_assert(tt.clock == rt_clock);
+    g_assert(tt.timers[0]);
+    g_assert(tt.timers[1]);
+
+    /* check other fields where cleared */
+    g_assert(!ts.previous_leak);
+    g_assert(!ts.cfg.op_size);
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        g_assert(!ts.cfg.buckets[i].avg);
+        g_assert(!ts.cfg.buckets[i].max);
+        g_assert(!ts.cfg.buckets[i].level);
+    }
+
+    throttle_timers_destroy(&tt);
+}
+
+static void test_destroy(void)
+{
+    int i;
+    timers_setup();
+    throttle_timers_destroy(&tt);
+    for (i = 0; i < 2; i++) {
+        g_assert(!tt.timers[i]);
+    }
+    g_assert(!throttle_timers_are_initialized(&tt));
+}
+
+/* function to test throttle_config and throttle_get_config */
+static void test_config_functions(void)
+{
+    int i;
+    ThrottleConfig orig_cfg, final_cfg;
+
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].avg = 153;
+    orig_cfg.buckets[THROTTLE_BPS_READ].avg  = 56;
+    orig_cfg.buckets[THROTTLE_BPS_WRITE].avg = 1;
+
+    orig_cfg.buckets[THROTTLE_OPS_TOTAL].avg = 150;
+    orig_cfg.buckets[THROTTLE_OPS_READ].avg  = 69;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].avg = 23;
+
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].max = 0; /* should be corrected */
+    orig_cfg.buckets[THROTTLE_BPS_READ].max  = 56;
+    orig_cfg.buckets[THROTTLE_BPS_WRITE].max = 120;
+
+    orig_cfg.buckets[THROTTLE_OPS_TOTAL].max = 150;
+    orig_cfg.buckets[THROTTLE_OPS_READ].max  = 400;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].max = 500;
+
+    orig_cfg.buckets[THROTTLE_BPS_TOTAL].level = 45;
+    orig_cfg.buckets[THROTTLE_BPS_READ].level  = 65;
+    orig_cfg.buckets[THROTTLE_BPS_WRITE].level = 23;
+
+    orig_cfg.buckets[THROTTLE_OPS_TOTAL].level = 1;
+    orig_cfg.buckets[THROTTLE_OPS_READ].level  = 90;
+    orig_cfg.buckets[THROTTLE_OPS_WRITE].level = 75;
+
+    orig_cfg.op_size = 1;
+
+    timers_setup();
+    /* structure reset by throttle_init previous_leak should be null */
+    g_assert(!ts.previous_leak);
+    throttle_config(&ts, &tt, &orig_cfg);
+
+    /* has previous leak been initialized by throttle_config ? */
+    g_assert(ts.previous_leak);
+
+    /* get back the fixed configuration */
+    throttle_get_config(&ts, &final_cfg);
+
+    throttle_timers_destroy(&tt);
+
+    g_assert(final_cfg.buckets[THROTTLE_BPS_TOTAL].avg == 153);
+    g_assert(final_cfg.buckets[THROTTLE_BPS_READ].avg  == 56);
+    g_assert(final_cfg.buckets[THROTTLE_BPS_WRITE].avg == 1);
+
+    g_assert(final_cfg.buckets[THROTTLE_OPS_TOTAL].avg == 150);
+    g_assert(final_cfg.buckets[THROTTLE_OPS_READ].avg  == 69);
+    g_assert(final_cfg.buckets[THROTTLE_OPS_WRITE].avg == 23);
+
+    /* the derived burst is not reported back */
+    g_assert(final_cfg.buckets[THROTTLE_BPS_TOTAL].max == 0);
+    g_assert(final_cfg.buckets[THROTTLE_BPS_READ].max  == 56);
+    g_assert(final_cfg.buckets[THROTTLE_BPS_WRITE].max == 120);
+
+    g_assert(final_cfg.buckets[THROTTLE_OPS_TOTAL].max == 150);
+    g_assert(final_cfg.buckets[THROTTLE_OPS_READ].max  == 400);
+    g_assert(final_cfg.buckets[THROTTLE_OPS_WRITE].max == 500);
+
+    g_assert(final_cfg.op_size == 1);
+
+    /* check bucket have been cleared */
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        g_assert(!final_cfg.buckets[i].level);
+    }
+
+    /* internally the derived burst is a tenth of a second of I/O */
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].max, 15.3));
+}
+
+/* functions to test is throttle is enabled by a config */
+static void set_cfg_value(bool is_max, int index, int value)
+{
+    if (is_max) {
+        cfg.buckets[index].max = value;
+        /* If max is set, avg should never be 0 */
+        cfg.buckets[index].avg = MAX(cfg.buckets[index].avg, 1);
+    } else {
+        cfg.buckets[index].avg = value;
+    }
+}
+
+static void test_enabled(void)
+{
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    g_assert(!throttle_enabled(&cfg));
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        memset(&cfg, 0, sizeof(cfg));
+        set_cfg_value(false, i, 150);
+        g_assert(throttle_enabled(&cfg));
+    }
+
+    for (i = 0; i < BUCKETS_COUNT; i++) {
+        memset(&cfg, 0, sizeof(cfg));
+        set_cfg_value(false, i, -150);
+        g_assert(!throttle_enabled(&cfg));
+    }
+}
+
+/* tests functions for throttle_conflicting */
+
+static void test_conflicts_for_one_set(bool is_max,
+                                       int total,
+                                       int read,
+                                       int write)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    g_assert(!throttle_conflicting(&cfg));
+
+    set_cfg_value(is_max, total, 1);
+    set_cfg_value(is_max, read,  1);
+    g_assert(throttle_conflicting(&cfg));
+
+    memset(&cfg, 0, sizeof(cfg));
+    set_cfg_value(is_max, total, 1);
+    set_cfg_value(is_max, write, 1);
+    g_assert(throttle_conflicting(&cfg));
+
+    memset(&cfg, 0, sizeof(cfg));
+    set_cfg_value(is_max, total, 1);
+    set_cfg_value(is_max, read,  1);
+    set_cfg_value(is_max, write, 1);
+    g_assert(throttle_conflicting(&cfg));
+
+    memset(&cfg, 0, sizeof(cfg));
+    set_cfg_value(is_max, total, 1);
+    g_assert(!throttle_conflicting(&cfg));
+
+    memset(&cfg, 0, sizeof(cfg));
+    set_cfg_value(is_max, read,  1);
+    set_cfg_value(is_max, write, 1);
+    g_assert(!throttle_conflicting(&cfg));
+}
+
+static void test_conflicting_config(void)
+{
+    /* bps average conflicts */
+    test_conflicts_for_one_set(false,
+                               THROTTLE_BPS_TOTAL,
+                               THROTTLE_BPS_READ,
+                               THROTTLE_BPS_WRITE);
+
+    /* ops average conflicts */
+    test_conflicts_for_one_set(false,
+                               THROTTLE_OPS_TOTAL,
+                               THROTTLE_OPS_READ,
+                               THROTTLE_OPS_WRITE);
+
+    /* bps average conflicts */
+    test_conflicts_for_one_set(true,
+                               THROTTLE_BPS_TOTAL,
+                               THROTTLE_BPS_READ,
+                               THROTTLE_BPS_WRITE);
+    /* ops average conflicts */
+    test_conflicts_for_one_set(true,
+                               THROTTLE_OPS_TOTAL,
+                               THROTTLE_OPS_READ,
+                               THROTTLE_OPS_WRITE);
+}
+
+/* functions to test the throttle_is_valid function */
+static void test_is_valid_for_value(int value, bool should_be_valid)
+{
+    int is_max, index;
+
+    for (is_max = 0; is_max < 2; is_max++) {
+        for (index = 0; index < BUCKETS_COUNT; index++) {
+            memset(&cfg, 0, sizeof(cfg));
+            set_cfg_value(is_max, index, value);
+            g_assert(throttle_is_valid(&cfg) == should_be_valid);
+        }
+    }
+}
+
+static void test_is_valid(void)
+{
+    /* negative number are invalid */
+    test_is_valid_for_value(-1, false);
+    /* zero are valids */
+    test_is_valid_for_value(0, true);
+    /* positives numers are valids */
+    test_is_valid_for_value(1, true);
+
+    /* a burst needs an average */
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_TOTAL].max = 100;
+    g_assert(!throttle_is_valid(&cfg));
+
+    /* and cannot be smaller than it */
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 200;
+    g_assert(!throttle_is_valid(&cfg));
+
+    cfg.buckets[THROTTLE_BPS_TOTAL].avg = 100;
+    g_assert(throttle_is_valid(&cfg));
+}
+
+static void test_have_timer(void)
+{
+    /* zero structures */
+    memset(&ts, 0, sizeof(ts));
+    memset(&tt, 0, sizeof(tt));
+
+    /* no timer set should return false */
+    g_assert(!throttle_timers_are_initialized(&tt));
+
+    /* init structures */
+    timers_setup();
+
+    /* timer set by init should return true */
+    g_assert(throttle_timers_are_initialized(&tt));
+
+    throttle_timers_destroy(&tt);
+}
+
+/* An idle device gets its whole burst at once, then the average rate.
+ * The timestamps are passed explicitly so the test does not depend on
+ * the host clock.
+ */
+static void test_burst(void)
+{
+    int64_t now = 1000 * 1000 * 1000;
+    int64_t next;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 10;
+    cfg.buckets[THROTTLE_OPS_TOTAL].max = 50;
+
+    timers_setup();
+    throttle_config(&ts, &tt, &cfg);
+    ts.previous_leak = now;
+
+    /* 50 requests go through without waiting */
+    for (i = 0; i < 50; i++) {
+        g_assert(!throttle_compute_timer(&ts, false, now, &next));
+        g_assert(next == now);
+        throttle_account(&ts, false, 4096);
+    }
+
+    /* the bucket is full, so the next request has to wait... */
+    throttle_account(&ts, false, 4096);
+    g_assert(throttle_compute_timer(&ts, false, now, &next));
+    /* ...until one request worth of level has leaked at 10 ops/s */
+    g_assert(next == now + NANOSECONDS_PER_SECOND / 10);
+
+    /* half-way there it is still throttled */
+    now += NANOSECONDS_PER_SECOND / 20;
+    g_assert(throttle_compute_timer(&ts, true, now, &next));
+
+    /* at the timer deadline it goes through */
+    now += NANOSECONDS_PER_SECOND / 20;
+    g_assert(!throttle_compute_timer(&ts, true, now, &next));
+
+    /* after five idle seconds the burst is available again */
+    now += 5 * NANOSECONDS_PER_SECOND;
+    g_assert(!throttle_compute_timer(&ts, false, now, &next));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 0));
+
+    throttle_timers_destroy(&tt);
+}
+
+/* Without a burst, only a tenth of a second of I/O goes through at once */
+static void test_no_burst(void)
+{
+    int64_t now = 1000 * 1000 * 1000;
+    int64_t next;
+    int i;
+
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_BPS_WRITE].avg = 1000 * 1000;
+
+    timers_setup();
+    throttle_config(&ts, &tt, &cfg);
+    ts.previous_leak = now;
+
+    for (i = 0; i < 25; i++) {
+        g_assert(!throttle_compute_timer(&ts, true, now, &next));
+        throttle_account(&ts, true, 4096);
+    }
+    g_assert(throttle_compute_timer(&ts, true, now, &next));
+    g_assert(next > now);
+
+    /* reads are not affected by a write limit */
+    g_assert(!throttle_compute_timer(&ts, false, now, &next));
+
+    throttle_timers_destroy(&tt);
+}
+
+static void test_op_size(void)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_TOTAL].avg = 100;
+    cfg.buckets[THROTTLE_OPS_READ].avg = 100;
+    cfg.op_size = 4096;
+
+    timers_setup();
+    throttle_config(&ts, &tt, &cfg);
+
+    /* small requests are counted as one operation */
+    throttle_account(&ts, false, 512);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 1));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_BPS_TOTAL].level, 512));
+
+    /* large ones as several */
+    throttle_account(&ts, false, 4 * 4096);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 5));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_READ].level, 5));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 0));
+
+    throttle_account(&ts, true, 4096 + 2048);
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_TOTAL].level, 6.5));
+    g_assert(double_cmp(ts.cfg.buckets[THROTTLE_OPS_WRITE].level, 1.5));
+
+    throttle_timers_destroy(&tt);
+}
+
+static void test_schedule_timer(void)
+{
+    memset(&cfg, 0, sizeof(cfg));
+    cfg.buckets[THROTTLE_OPS_WRITE].avg = 1;
+    cfg.buckets[THROTTLE_OPS_WRITE].max = 1;
+
+    timers_setup();
+    throttle_config(&ts, &tt, &cfg);
+
+    /* the first request goes through without arming a timer */
+    g_assert(!throttle_schedule_timer(&ts, &tt, true));
+    g_assert(!qemu_timer_pending(tt.timers[1]));
+    throttle_account(&ts, true, 512);
+    throttle_account(&ts, true, 512);
+
+    /* the next one arms the write timer only */
+    g_assert(throttle_schedule_timer(&ts, &tt, true));
+    g_assert(qemu_timer_pending(tt.timers[1]));
+    g_assert(!qemu_timer_pending(tt.timers[0]));
+
+    /* reconfiguring cancels it */
+    throttle_config(&ts, &tt, &cfg);
+    g_assert(!qemu_timer_pending(tt.timers[1]));
+
+    throttle_timers_destroy(&tt);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    init_timer_alarm();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/throttle/leak_bucket",        test_leak_bucket);
+    g_test_add_func("/throttle/compute_wait",       test_compute_wait);
+    g_test_add_func("/throttle/init",               test_init);
+    g_test_add_func("/throttle/destroy",            test_destroy);
+    g_test_add_func("/throttle/have_timer",         test_have_timer);
+    g_test_add_func("/throttle/config/enabled",     test_enabled);
+    g_test_add_func("/throttle/config/conflicting", test_conflicting_config);
+    g_test_add_func("/throttle/config/is_valid",    test_is_valid);
+    g_test_add_func("/throttle/config_functions",   test_config_functions);
+    g_test_add_func("/throttle/burst",              test_burst);
+    g_test_add_func("/throttle/no_burst",           test_no_burst);
+    g_test_add_func("/throttle/op_size",            test_op_size);
+    g_test_add_func("/throttle/schedule_timer",     test_schedule_timer);
+    return g_test_run();
+}
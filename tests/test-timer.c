@@ -0,0 +1,236 @@
+/*
+ * QEMUTimer queue tests and microbenchmark
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include "qemu-common.h"
+#include "qemu/timer.h"
+
+#define NUM_TIMERS  10000
+
+typedef struct {
+    QEMUTimer *timer;
+    int64_t expire;
+    int arm_order;
+    int fired;
+} TimerTestData;
+
+static TimerTestData data[NUM_TIMERS];
+static int fire_log[NUM_TIMERS];
+static int nb_fired;
+
+static void timer_cb(void *opaque)
+{
+    TimerTestData *d = opaque;
+
+    d->fired++;
+    fire_log[nb_fired++] = d - data;
+}
+
+static void timers_create(int n)
+{
+    int i;
+
+    memset(data, 0, sizeof(data));
+    for (i = 0; i < n; i++) {
+        data[i].timer = qemu_new_timer_ns(rt_clock, timer_cb, &data[i]);
+    }
+    nb_fired = 0;
+}
+
+static void timers_free(int n)
+{
+    int i;
+
+    for (i = 0; i < n; i++) {
+        qemu_free_timer(data[i].timer);
+    }
+}
+
+/* Timers must fire by expire time, then in the order they were armed. */
+static bool fired_before(TimerTestData *a, TimerTestData *b)
+{
+    return a->expire < b->expire ||
+           (a->expire == b->expire && a->arm_order < b->arm_order);
+}
+
+static void check_fire_order(int expected)
+{
+    int i;
+
+    g_assert_cmpint(nb_fired, ==, expected);
+    for (i = 1; i < nb_fired; i++) {
+        g_assert(fired_before(&data[fire_log[i - 1]], &data[fire_log[i]]));
+    }
+}
+
+static void test_order(void)
+{
+    int64_t base = qemu_get_clock_ns(rt_clock) - 1000000000LL;
+    int n = 1000;
+    int i;
+
+    timers_create(n);
+    for (i = 0; i < n; i++) {
+        /* few distinct deadlines, so that ties are common */
+        data[i].expire = base + g_test_rand_int_range(0, 64);
+        data[i].arm_order = i;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert(qemu_timer_pending(data[i].timer));
+    }
+    g_assert(qemu_clock_has_timers(rt_clock));
+
+    qemu_run_timers(rt_clock);
+    check_fire_order(n);
+    for (i = 0; i < n; i++) {
+        g_assert_cmpint(data[i].fired, ==, 1);
+        g_assert(!qemu_timer_pending(data[i].timer));
+    }
+    g_assert(!qemu_clock_has_timers(rt_clock));
+    timers_free(n);
+}
+
+static void test_mod_del(void)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t base = now - 1000000000LL;
+    int n = 1000;
+    int arm = 0;
+    int i, expected;
+
+    timers_create(n);
+    for (i = 0; i < n; i++) {
+        data[i].expire = base + g_test_rand_int_range(0, 100000);
+        data[i].arm_order = arm++;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+    }
+
+    /* move some timers earlier or later, and cancel others */
+    expected = n;
+    for (i = 0; i < n; i += 3) {
+        data[i].expire = base + g_test_rand_int_range(0, 100000);
+        data[i].arm_order = arm++;
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+    }
+    for (i = 1; i < n; i += 7) {
+        qemu_del_timer(data[i].timer);
+        g_assert(!qemu_timer_pending(data[i].timer));
+        g_assert_cmpint(qemu_timer_expire_time_ns(data[i].timer), ==, -1);
+        expected--;
+    }
+    /* these stay in the future and must not fire */
+    for (i = 2; i < n; i += 11) {
+        if (!qemu_timer_pending(data[i].timer)) {
+            continue;
+        }
+        data[i].expire = now + 3600 * get_ticks_per_sec();
+        qemu_mod_timer_ns(data[i].timer, data[i].expire);
+        g_assert_cmpint(qemu_timer_expire_time_ns(data[i].timer), ==,
+                        data[i].expire);
+        expected--;
+    }
+
+    qemu_run_timers(rt_clock);
+    check_fire_order(expected);
+    for (i = 2; i < n; i += 11) {
+        if (data[i].expire > now) {
+            g_assert(qemu_timer_pending(data[i].timer));
+            g_assert_cmpint(data[i].fired, ==, 0);
+        }
+    }
+    timers_free(n);
+    g_assert(!qemu_clock_has_timers(rt_clock));
+}
+
+static void rearm_cb(void *opaque)
+{
+    TimerTestData *d = opaque;
+
+    d->fired++;
+    qemu_mod_timer_ns(d->timer, qemu_get_clock_ns(rt_clock) +
+                      3600 * get_ticks_per_sec());
+}
+
+static void test_rearm_in_cb(void)
+{
+    TimerTestData d = { 0 };
+
+    d.timer = qemu_new_timer_ns(rt_clock, rearm_cb, &d);
+    qemu_mod_timer_ns(d.timer, qemu_get_clock_ns(rt_clock) - 1);
+    qemu_run_timers(rt_clock);
+    g_assert_cmpint(d.fired, ==, 1);
+    g_assert(qemu_timer_pending(d.timer));
+    qemu_free_timer(d.timer);
+    g_assert(!qemu_clock_has_timers(rt_clock));
+}
+
+/* Arm/cancel/expire cost with NUM_TIMERS live timers on the clock.  */
+static void test_perf(void)
+{
+    int64_t now = qemu_get_clock_ns(rt_clock);
+    int64_t future = now + 3600 * get_ticks_per_sec();
+    int iterations = 1000000;
+    double t;
+    int i;
+
+    timers_create(NUM_TIMERS);
+    for (i = 0; i < NUM_TIMERS; i++) {
+        qemu_mod_timer_ns(data[i].timer,
+                          future + g_test_rand_int_range(0, 1000000000));
+    }
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        qemu_mod_timer_ns(data[i % NUM_TIMERS].timer,
+                          future + g_test_rand_int_range(0, 1000000000));
+    }
+    t = g_test_timer_elapsed();
+    g_test_message("rearm: %.1f ns/op with %d timers",
+                   t * 1e9 / iterations, NUM_TIMERS);
+
+    g_test_timer_start();
+    for (i = 0; i < iterations; i++) {
+        QEMUTimer *ts = data[g_test_rand_int_range(0, NUM_TIMERS)].timer;
+        qemu_del_timer(ts);
+        qemu_mod_timer_ns(ts, future + g_test_rand_int_range(0, 1000000000));
+    }
+    t = g_test_timer_elapsed();
+    g_test_message("cancel+arm: %.1f ns/op with %d timers",
+                   t * 1e9 / iterations, NUM_TIMERS);
+
+    /* expire a tenth of the timers at a time, then put them back */
+    g_test_timer_start();
+    for (i = 0; i < 100; i++) {
+        int j;
+
+        for (j = 0; j < NUM_TIMERS / 10; j++) {
+            qemu_mod_timer_ns(data[g_test_rand_int_range(0, NUM_TIMERS)].timer,
+                              now - g_test_rand_int_range(0, 1000000000));
+        }
+        nb_fired = 0;
+        qemu_run_timers(rt_clock);
+    }
+    t = g_test_timer_elapsed();
+    g_test_message("arm+expire: %.1f ns/timer with %d timers",
+                   t * 1e9 / (100 * (NUM_TIMERS / 10)), NUM_TIMERS);
+
+    timers_free(NUM_TIMERS);
+}
+
+int main(int argc, char **argv)
+{
+    init_clocks();
+    init_timer_alarm();
+
+    g_test_init(&argc, &argv, NULL);
+    g_test_add_func("/timer/order", test_order);
+    g_test_add_func("/timer/mod-del", test_mod_del);
+    g_test_add_func("/timer/rearm-in-cb", test_rearm_in_cb);
+    if (g_test_perf()) {
+        g_test_add_func("/timer/perf", test_perf);
+    }
+    return g_test_run();
+}
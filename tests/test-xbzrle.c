@@ -19,6 +19,7 @@
 #include <assert.h>
 #include "qemu-common.h"
 #include "include/migration/migration.h"
+#include "include/migration/page_cache.h"
 
 #define PAGE_SIZE 4096
 
@@ -179,6 +180,172 @@ static void test_encode_decode(void)
     }
 }
 
+static void test_cache_lru(void)
+{
+    uint8_t page[PAGE_SIZE];
+    PageCache *cache;
+    int i;
+
+    /* two sets of eight pages; even page numbers share set 0 */
+    cache = cache_init(16, PAGE_SIZE);
+    for (i = 0; i < 8; i++) {
+        memset(page, i, PAGE_SIZE);
+        g_assert(!cache_insert(cache, 2 * i * PAGE_SIZE, page));
+    }
+    for (i = 0; i < 8; i++) {
+        g_assert(cache_is_cached(cache, 2 * i * PAGE_SIZE));
+        g_assert_cmpint(get_cached_data(cache, 2 * i * PAGE_SIZE)[0], ==, i);
+    }
+
+    /* the other set is still empty */
+    g_assert(!cache_insert(cache, PAGE_SIZE, page));
+
+    /* page 0 was used most recently, so page 2 is the one to go */
+    get_cached_data(cache, 0);
+    memset(page, 8, PAGE_SIZE);
+    g_assert(cache_insert(cache, 16 * PAGE_SIZE, page));
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(!cache_is_cached(cache, 2 * PAGE_SIZE));
+    g_assert(!get_cached_data(cache, 2 * PAGE_SIZE));
+    g_assert_cmpint(get_cached_data(cache, 16 * PAGE_SIZE)[0], ==, 8);
+
+    /* reinserting a cached page replaces its data in place */
+    memset(page, 9, PAGE_SIZE);
+    g_assert(!cache_insert(cache, 0, page));
+    g_assert_cmpint(get_cached_data(cache, 0)[0], ==, 9);
+
+    /* shrinking to one set keeps the eight most recently used pages */
+    g_assert_cmpint(cache_resize(cache, 8), ==, 8);
+    g_assert(!cache_is_cached(cache, 4 * PAGE_SIZE));
+    g_assert(cache_is_cached(cache, PAGE_SIZE));
+    g_assert(cache_is_cached(cache, 0));
+    g_assert(cache_is_cached(cache, 16 * PAGE_SIZE));
+
+    cache_fini(cache);
+    g_free(cache);
+}
+
+typedef int (EncodeFn)(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                       uint8_t *dst, int dlen);
+
+static bool always(void)
+{
+    return true;
+}
+
+static const struct {
+    const char *name;
+    EncodeFn *encode;
+    bool (*usable)(void);
+} encoders[] = {
+    { "generic", xbzrle_encode_buffer_generic, always },
+#ifdef __SSE2__
+    { "sse2", xbzrle_encode_buffer_sse2, always },
+#endif
+#ifdef CONFIG_AVX2_OPT
+    { "avx2", xbzrle_encode_buffer_avx2, xbzrle_can_use_avx2 },
+#endif
+};
+
+/* Copies old into new and changes nr_runs runs of up to max_run bytes */
+static void make_diff(uint8_t *old, uint8_t *new, int nr_runs, int max_run)
+{
+    int i, j;
+
+    memcpy(new, old, PAGE_SIZE);
+    for (i = 0; i < nr_runs; i++) {
+        int start = g_test_rand_int_range(0, PAGE_SIZE);
+        int len = g_test_rand_int_range(1, max_run + 1);
+
+        for (j = start; j < start + len && j < PAGE_SIZE; j++) {
+            new[j] = old[j] + g_test_rand_int_range(1, 256);
+        }
+    }
+}
+
+static void test_encode_same_stream(void)
+{
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *ref = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    int i, j, k;
+
+    for (i = 0; i < 5000; i++) {
+        int dlen = i % 2 ? PAGE_SIZE : g_test_rand_int_range(0, PAGE_SIZE);
+        int ref_len;
+
+        for (j = 0; j < PAGE_SIZE; j++) {
+            old[j] = g_test_rand_int_range(0, 4);
+        }
+        make_diff(old, new, g_test_rand_int_range(0, 200),
+                  g_test_rand_int_range(1, 100));
+
+        ref_len = xbzrle_encode_buffer_generic(old, new, PAGE_SIZE, ref, dlen);
+        for (k = 1; k < ARRAY_SIZE(encoders); k++) {
+            int len;
+
+            if (!encoders[k].usable()) {
+                continue;
+            }
+            len = encoders[k].encode(old, new, PAGE_SIZE, out, dlen);
+            g_assert_cmpint(len, ==, ref_len);
+            g_assert(len <= 0 || memcmp(ref, out, len) == 0);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(ref);
+    g_free(out);
+}
+
+/* Encoding throughput of each implementation on a few kinds of page */
+static void test_perf(void)
+{
+    static const struct {
+        const char *name;
+        int nr_runs;
+        int max_run;
+    } kinds[] = {
+        { "unchanged", 0, 1 },
+        { "sparse", 8, 16 },
+        { "dense", 256, 8 },
+        { "random", 1, PAGE_SIZE },
+    };
+    uint8_t *old = g_malloc(PAGE_SIZE);
+    uint8_t *new = g_malloc(PAGE_SIZE);
+    uint8_t *out = g_malloc(PAGE_SIZE);
+    int iterations = 100000;
+    int i, j, k;
+    double t;
+
+    for (i = 0; i < PAGE_SIZE; i++) {
+        old[i] = g_test_rand_int();
+    }
+
+    for (i = 0; i < ARRAY_SIZE(kinds); i++) {
+        make_diff(old, new, kinds[i].nr_runs, kinds[i].max_run);
+        for (k = 0; k < ARRAY_SIZE(encoders); k++) {
+            if (!encoders[k].usable()) {
+                continue;
+            }
+            g_test_timer_start();
+            for (j = 0; j < iterations; j++) {
+                encoders[k].encode(old, new, PAGE_SIZE, out, PAGE_SIZE);
+            }
+            t = g_test_timer_elapsed();
+            g_test_message("%s page, %s: %.0f MB/s", kinds[i].name,
+                           encoders[k].name,
+                           (double)iterations * PAGE_SIZE / t / 1e6);
+        }
+    }
+
+    g_free(old);
+    g_free(new);
+    g_free(out);
+}
+
 int main(int argc, char **argv)
 {
     g_test_init(&argc, &argv, NULL);
@@ -191,6 +358,11 @@ int main(int argc, char **argv)
     g_test_add_func("/xbzrle/encode_decode_overflow",
                     test_encode_decode_overflow);
     g_test_add_func("/xbzrle/encode_decode", test_encode_decode);
+    g_test_add_func("/xbzrle/encode_same_stream", test_encode_same_stream);
+    g_test_add_func("/xbzrle/cache_lru", test_cache_lru);
+    if (g_test_perf()) {
+        g_test_add_func("/xbzrle/perf", test_perf);
+    }
 
     return g_test_run();
 }
@@ -0,0 +1,450 @@
+/*
+ * QTest testcase for virtio-blk
+ *
+ * Drives the legacy virtio-pci interface directly and polls the used rings,
+ * so no interrupts are needed.  In perf mode (gtester -m=perf) it runs a
+ * random read load on every queue and reports how IOPS scale with the
+ * number of queues, with and without the dataplane.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+
+#define PCI_SLOT                0x04
+#define PCI_VENDOR_ID_REDHAT    0x1af4
+#define PCI_DEVICE_ID_BLOCK     0x1001
+
+/* Legacy virtio-pci I/O BAR layout, without MSI-X */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+#define VIRTIO_PCI_CONFIG           20
+
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER      2
+#define VIRTIO_CONFIG_S_DRIVER_OK   4
+
+#define VIRTIO_BLK_F_MQ             12
+#define VIRTIO_BLK_CONFIG_NUM_QUEUES 34
+
+#define VIRTIO_BLK_T_IN             0
+#define VIRTIO_BLK_T_OUT            1
+
+#define VRING_DESC_F_NEXT           1
+#define VRING_DESC_F_WRITE          2
+
+#define IMAGE_SIZE                  (64 * 1024 * 1024)
+#define BLOCK_SIZE                  4096
+#define MAX_QUEUES                  8
+#define QUEUE_DEPTH                 32      /* three descriptors each */
+#define TIMEOUT_US                  (10 * 1000 * 1000)
+
+typedef struct VirtQueue {
+    uint16_t size;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+
+    /* per slot: 16-byte header, data block and status byte */
+    uint64_t hdrs;
+    uint64_t data;
+    uint32_t type[QUEUE_DEPTH];
+    unsigned int busy;
+} VirtQueue;
+
+typedef struct VirtIOBlkDev {
+    QPCIBus *bus;
+    QPCIDevice *pdev;
+    void *addr;
+    unsigned int num_queues;
+    VirtQueue vq[MAX_QUEUES];
+} VirtIOBlkDev;
+
+static char tmp_path[] = "/tmp/qtest.XXXXXX";
+
+static uint64_t slot_hdr(VirtQueue *vq, unsigned int slot)
+{
+    return vq->hdrs + slot * 16;
+}
+
+static uint64_t slot_status(VirtQueue *vq, unsigned int slot)
+{
+    return vq->hdrs + 2048 + slot;
+}
+
+static uint64_t slot_data(VirtQueue *vq, unsigned int slot)
+{
+    return vq->data + slot * BLOCK_SIZE;
+}
+
+static void write_desc(VirtQueue *vq, unsigned int i, uint64_t addr,
+                       uint32_t len, uint16_t flags, uint16_t next)
+{
+    uint64_t desc = vq->desc + i * 16;
+
+    writeq(desc, addr);
+    writel(desc + 8, len);
+    writew(desc + 12, flags);
+    writew(desc + 14, next);
+}
+
+static void vq_init(VirtIOBlkDev *d, QGuestAllocator *alloc, unsigned int n)
+{
+    VirtQueue *vq = &d->vq[n];
+    uint64_t ring;
+    unsigned int i;
+
+    qpci_io_writew(d->pdev, d->addr + VIRTIO_PCI_QUEUE_SEL, n);
+    vq->size = qpci_io_readw(d->pdev, d->addr + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->size, >=, QUEUE_DEPTH * 3);
+
+    /* desc, avail and used rings with the legacy 4096 byte alignment */
+    ring = guest_alloc(alloc, 4 * 4096);
+    vq->desc = ring;
+    vq->avail = ring + vq->size * 16;
+    vq->used = (vq->avail + 6 + vq->size * 2 + 4095) & ~4095ULL;
+    vq->hdrs = guest_alloc(alloc, 4096);
+    vq->data = guest_alloc(alloc, QUEUE_DEPTH * BLOCK_SIZE);
+    vq->avail_idx = 0;
+    vq->last_used_idx = 0;
+    vq->busy = 0;
+
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used + 2, 0);
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        vq->type[i] = VIRTIO_BLK_T_OUT;
+        write_desc(vq, i * 3, slot_hdr(vq, i), 16, VRING_DESC_F_NEXT,
+                   i * 3 + 1);
+        write_desc(vq, i * 3 + 1, slot_data(vq, i), BLOCK_SIZE,
+                   VRING_DESC_F_NEXT, i * 3 + 2);
+        write_desc(vq, i * 3 + 2, slot_status(vq, i), 1,
+                   VRING_DESC_F_WRITE, 0);
+    }
+
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_QUEUE_PFN, ring >> 12);
+}
+
+static void vq_submit(VirtIOBlkDev *d, unsigned int n, unsigned int slot,
+                      uint32_t type, uint64_t sector)
+{
+    VirtQueue *vq = &d->vq[n];
+    uint8_t hdr[16] = { 0 };
+
+    stl_le_p(hdr, type);
+    stq_le_p(hdr + 8, sector);
+    memwrite(slot_hdr(vq, slot), hdr, sizeof(hdr));
+    writeb(slot_status(vq, slot), 0xff);
+    if (vq->type[slot] != type) {
+        writew(vq->desc + (slot * 3 + 1) * 16 + 12,
+               VRING_DESC_F_NEXT |
+               (type == VIRTIO_BLK_T_IN ? VRING_DESC_F_WRITE : 0));
+        vq->type[slot] = type;
+    }
+
+    writew(vq->avail + 4 + (vq->avail_idx % vq->size) * 2, slot * 3);
+    vq->avail_idx++;
+    vq->busy++;
+}
+
+static void vq_kick(VirtIOBlkDev *d, unsigned int n)
+{
+    writew(d->vq[n].avail + 2, d->vq[n].avail_idx);
+    qpci_io_writew(d->pdev, d->addr + VIRTIO_PCI_QUEUE_NOTIFY, n);
+}
+
+/* Return the number of completed requests and store their slots */
+static unsigned int vq_reap(VirtIOBlkDev *d, unsigned int n,
+                            unsigned int *slots)
+{
+    VirtQueue *vq = &d->vq[n];
+    uint16_t used_idx = readw(vq->used + 2);
+    unsigned int count = 0;
+
+    while (vq->last_used_idx != used_idx) {
+        uint64_t elem = vq->used + 4 + (vq->last_used_idx % vq->size) * 8;
+        unsigned int slot = readl(elem) / 3;
+
+        g_assert_cmpint(readb(slot_status(vq, slot)), ==, 0);
+        slots[count++] = slot;
+        vq->last_used_idx++;
+        vq->busy--;
+    }
+    return count;
+}
+
+static void vq_wait(VirtIOBlkDev *d, unsigned int n)
+{
+    unsigned int slots[QUEUE_DEPTH];
+    gint64 end = g_get_monotonic_time() + TIMEOUT_US;
+
+    while (d->vq[n].busy) {
+        vq_reap(d, n, slots);
+        g_assert(g_get_monotonic_time() < end);
+    }
+}
+
+static VirtIOBlkDev *virtio_blk_start(unsigned int num_queues, bool dataplane,
+                                      const char *drive_opts)
+{
+    VirtIOBlkDev *d = g_new0(VirtIOBlkDev, 1);
+    QGuestAllocator *alloc;
+    char *cmdline;
+    uint32_t features;
+    unsigned int i;
+
+    cmdline = g_strdup_printf("-drive if=none,id=drive0,file=%s,format=raw,"
+                              "cache=none,aio=native%s "
+                              "-device virtio-blk-pci,drive=drive0,"
+                              "addr=%x.0,num-queues=%u%s",
+                              tmp_path, drive_opts, PCI_SLOT, num_queues,
+                              dataplane ? ",x-data-plane=on,config-wce=off,"
+                                          "scsi=off" : "");
+    qtest_start(cmdline);
+    g_free(cmdline);
+
+    d->bus = qpci_init_pc();
+    d->pdev = qpci_device_find(d->bus, QPCI_DEVFN(PCI_SLOT, 0));
+    g_assert(d->pdev != NULL);
+    g_assert_cmphex(qpci_config_readw(d->pdev, 0), ==, PCI_VENDOR_ID_REDHAT);
+    g_assert_cmphex(qpci_config_readw(d->pdev, 2), ==, PCI_DEVICE_ID_BLOCK);
+    qpci_device_enable(d->pdev);
+    d->addr = qpci_iomap(d->pdev, 0);
+    d->num_queues = num_queues;
+
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS, 0);
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    features = qpci_io_readl(d->pdev, d->addr + VIRTIO_PCI_HOST_FEATURES);
+    if (num_queues > 1) {
+        g_assert(features & (1u << VIRTIO_BLK_F_MQ));
+        g_assert_cmpint(qpci_io_readw(d->pdev, d->addr + VIRTIO_PCI_CONFIG +
+                                      VIRTIO_BLK_CONFIG_NUM_QUEUES),
+                        ==, num_queues);
+    } else {
+        g_assert(!(features & (1u << VIRTIO_BLK_F_MQ)));
+    }
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_GUEST_FEATURES,
+                   features & (1u << VIRTIO_BLK_F_MQ));
+
+    alloc = pc_alloc_init();
+    for (i = 0; i < num_queues; i++) {
+        vq_init(d, alloc, i);
+    }
+    g_free(alloc);
+
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                   VIRTIO_CONFIG_S_DRIVER_OK);
+    return d;
+}
+
+static void virtio_blk_stop(VirtIOBlkDev *d)
+{
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS, 0);
+    g_free(d->pdev);
+    g_free(d);
+    qtest_quit(global_qtest);
+    global_qtest = NULL;
+}
+
+/* Write a block through each queue and read it back through the next one */
+static void test_rw(unsigned int num_queues, bool dataplane)
+{
+    VirtIOBlkDev *d = virtio_blk_start(num_queues, dataplane, "");
+    uint8_t buf[BLOCK_SIZE], expected[BLOCK_SIZE];
+    unsigned int i;
+
+    for (i = 0; i < num_queues; i++) {
+        memset(buf, 'a' + i, sizeof(buf));
+        memwrite(slot_data(&d->vq[i], 0), buf, sizeof(buf));
+        vq_submit(d, i, 0, VIRTIO_BLK_T_OUT, i * (BLOCK_SIZE / 512));
+        vq_kick(d, i);
+        vq_wait(d, i);
+    }
+
+    for (i = 0; i < num_queues; i++) {
+        unsigned int n = (i + 1) % num_queues;
+
+        vq_submit(d, n, 1, VIRTIO_BLK_T_IN, i * (BLOCK_SIZE / 512));
+        vq_kick(d, n);
+        vq_wait(d, n);
+
+        memread(slot_data(&d->vq[n], 1), buf, sizeof(buf));
+        memset(expected, 'a' + i, sizeof(expected));
+        g_assert(memcmp(buf, expected, sizeof(buf)) == 0);
+    }
+
+    virtio_blk_stop(d);
+}
+
+static void test_single_queue(void)
+{
+    test_rw(1, false);
+}
+
+static void test_multi_queue(void)
+{
+    test_rw(4, false);
+}
+
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+static void test_dataplane_multi_queue(void)
+{
+    test_rw(4, true);
+}
+#endif
+
+static blkcnt_t image_blocks(void)
+{
+    struct stat st;
+
+    g_assert(stat(tmp_path, &st) == 0);
+    return st.st_blocks;
+}
+
+/* A zeroed write must punch a hole in the image instead of writing data */
+static void test_detect_zeroes(void)
+{
+    VirtIOBlkDev *d = virtio_blk_start(1, false,
+                                       ",discard=unmap,detect-zeroes=unmap");
+    uint64_t sector = (IMAGE_SIZE - BLOCK_SIZE) / 512;
+    uint8_t buf[BLOCK_SIZE], zero[BLOCK_SIZE] = { 0 };
+    blkcnt_t before;
+
+    memset(buf, 0xa5, sizeof(buf));
+    memwrite(slot_data(&d->vq[0], 0), buf, sizeof(buf));
+    vq_submit(d, 0, 0, VIRTIO_BLK_T_OUT, sector);
+    vq_kick(d, 0);
+    vq_wait(d, 0);
+
+    before = image_blocks();
+    g_assert_cmpint(before, >=, BLOCK_SIZE / 512);
+
+    memwrite(slot_data(&d->vq[0], 0), zero, sizeof(zero));
+    vq_submit(d, 0, 0, VIRTIO_BLK_T_OUT, sector);
+    vq_kick(d, 0);
+    vq_wait(d, 0);
+
+    g_assert_cmpint(image_blocks(), <=, before - BLOCK_SIZE / 512);
+
+    vq_submit(d, 0, 1, VIRTIO_BLK_T_IN, sector);
+    vq_kick(d, 0);
+    vq_wait(d, 0);
+    memread(slot_data(&d->vq[0], 1), buf, sizeof(buf));
+    g_assert(memcmp(buf, zero, sizeof(buf)) == 0);
+
+    virtio_blk_stop(d);
+}
+
+static uint64_t random_sector(void)
+{
+    return g_test_rand_int_range(0, IMAGE_SIZE / BLOCK_SIZE) *
+           (BLOCK_SIZE / 512);
+}
+
+/* Keep every queue full of random 4k reads for a second and count them */
+static double run_randread(unsigned int num_queues, bool dataplane)
+{
+    VirtIOBlkDev *d = virtio_blk_start(num_queues, dataplane, "");
+    unsigned int slots[QUEUE_DEPTH];
+    unsigned int i, j, n;
+    uint64_t completed = 0;
+    double elapsed;
+
+    for (i = 0; i < num_queues; i++) {
+        for (j = 0; j < QUEUE_DEPTH; j++) {
+            vq_submit(d, i, j, VIRTIO_BLK_T_IN, random_sector());
+        }
+        vq_kick(d, i);
+    }
+
+    g_test_timer_start();
+    do {
+        for (i = 0; i < num_queues; i++) {
+            n = vq_reap(d, i, slots);
+            if (!n) {
+                continue;
+            }
+            completed += n;
+            for (j = 0; j < n; j++) {
+                vq_submit(d, i, slots[j], VIRTIO_BLK_T_IN, random_sector());
+            }
+            vq_kick(d, i);
+        }
+        elapsed = g_test_timer_elapsed();
+    } while (elapsed < 1.0);
+
+    for (i = 0; i < num_queues; i++) {
+        vq_wait(d, i);
+    }
+    virtio_blk_stop(d);
+    return completed / elapsed;
+}
+
+static void test_perf(void)
+{
+    static const unsigned int queues[] = { 1, 2, 4 };
+    unsigned int i;
+    int dataplane;
+
+    for (dataplane = 0; dataplane < 2; dataplane++) {
+#ifndef CONFIG_VIRTIO_BLK_DATA_PLANE
+        if (dataplane) {
+            break;
+        }
+#endif
+        for (i = 0; i < ARRAY_SIZE(queues); i++) {
+            g_test_message("randread 4k, %u queue(s), depth %d, %s: "
+                           "%.0f IOPS", queues[i], QUEUE_DEPTH,
+                           dataplane ? "dataplane" : "main loop",
+                           run_randread(queues[i], dataplane));
+        }
+    }
+}
+
+int main(int argc, char **argv)
+{
+    int fd, ret;
+
+    g_test_init(&argc, &argv, NULL);
+
+    fd = mkstemp(tmp_path);
+    g_assert(fd >= 0);
+    ret = ftruncate(fd, IMAGE_SIZE);
+    g_assert(ret == 0);
+    close(fd);
+
+    g_test_add_func("/virtio/blk/pci/single-queue", test_single_queue);
+    g_test_add_func("/virtio/blk/pci/multi-queue", test_multi_queue);
+    g_test_add_func("/virtio/blk/pci/detect-zeroes", test_detect_zeroes);
+#ifdef CONFIG_VIRTIO_BLK_DATA_PLANE
+    g_test_add_func("/virtio/blk/pci/dataplane/multi-queue",
+                    test_dataplane_multi_queue);
+#endif
+    if (g_test_perf()) {
+        g_test_add_func("/virtio/blk/pci/perf", test_perf);
+    }
+
+    ret = g_test_run();
+
+    unlink(tmp_path);
+    return ret;
+}
@@ -0,0 +1,676 @@
+/*
+ * QTest testcase for virtio-net
+ *
+ * The tap backend is given one end of a datagram socket pair instead of a
+ * real tap device, so the test can send and receive frames without root
+ * privileges.  The legacy virtio-pci interface is driven directly and the
+ * used rings are polled, so no interrupts are needed.  In perf mode
+ * (gtester -m=perf) it reports the packet rate in each direction, with and
+ * without the dataplane.
+ *
+ * This work is licensed under the terms of the GNU GPL, version 2 or later.
+ * See the COPYING file in the top-level directory.
+ */
+
+#include <glib.h>
+#include <string.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/socket.h>
+#include "libqtest.h"
+#include "libqos/pci-pc.h"
+#include "libqos/malloc-pc.h"
+#include "qemu-common.h"
+
+#define PCI_SLOT                0x04
+#define PCI_VENDOR_ID_REDHAT    0x1af4
+#define PCI_DEVICE_ID_NET       0x1000
+
+/* Legacy virtio-pci I/O BAR layout, without MSI-X */
+#define VIRTIO_PCI_HOST_FEATURES    0
+#define VIRTIO_PCI_GUEST_FEATURES   4
+#define VIRTIO_PCI_QUEUE_PFN        8
+#define VIRTIO_PCI_QUEUE_NUM        12
+#define VIRTIO_PCI_QUEUE_SEL        14
+#define VIRTIO_PCI_QUEUE_NOTIFY     16
+#define VIRTIO_PCI_STATUS           18
+
+#define VIRTIO_CONFIG_S_ACKNOWLEDGE 1
+#define VIRTIO_CONFIG_S_DRIVER      2
+#define VIRTIO_CONFIG_S_DRIVER_OK   4
+
+#define VIRTIO_NET_F_GUEST_CSUM     1
+#define VIRTIO_NET_F_GUEST_TSO4     7
+#define VIRTIO_NET_F_MRG_RXBUF      15
+
+#define VRING_DESC_F_WRITE          2
+
+#define RX_QUEUE                    0
+#define TX_QUEUE                    1
+#define QUEUE_DEPTH                 64
+#define BUF_SIZE                    2048
+#define MRG_BUF_SIZE                1024
+#define HDR_LEN                     10
+#define MRG_HDR_LEN                 12
+#define TIMEOUT_US                  (10 * 1000 * 1000)
+
+typedef struct VirtQueue {
+    uint16_t size;
+    uint64_t desc;
+    uint64_t avail;
+    uint64_t used;
+    uint64_t bufs;
+    uint16_t avail_idx;
+    uint16_t last_used_idx;
+} VirtQueue;
+
+typedef struct VirtIONetDev {
+    QPCIBus *bus;
+    QPCIDevice *pdev;
+    void *addr;
+    int fd;                     /* our end of the socket pair */
+    size_t hdr_len;
+    size_t buf_size;
+    VirtQueue vq[2];
+} VirtIONetDev;
+
+static uint64_t slot_buf(VirtIONetDev *d, unsigned int n, unsigned int slot)
+{
+    return d->vq[n].bufs + slot * d->buf_size;
+}
+
+static void vq_init(VirtIONetDev *d, QGuestAllocator *alloc, unsigned int n,
+                    uint16_t flags)
+{
+    VirtQueue *vq = &d->vq[n];
+    uint64_t ring, desc;
+    unsigned int i;
+
+    qpci_io_writew(d->pdev, d->addr + VIRTIO_PCI_QUEUE_SEL, n);
+    vq->size = qpci_io_readw(d->pdev, d->addr + VIRTIO_PCI_QUEUE_NUM);
+    g_assert_cmpint(vq->size, >=, QUEUE_DEPTH);
+
+    /* desc, avail and used rings with the legacy 4096 byte alignment */
+    ring = guest_alloc(alloc, 4 * 4096);
+    vq->desc = ring;
+    vq->avail = ring + vq->size * 16;
+    vq->used = (vq->avail + 6 + vq->size * 2 + 4095) & ~4095ULL;
+    vq->bufs = guest_alloc(alloc, QUEUE_DEPTH * d->buf_size);
+    vq->avail_idx = 0;
+    vq->last_used_idx = 0;
+
+    writew(vq->avail, 0);
+    writew(vq->avail + 2, 0);
+    writew(vq->used + 2, 0);
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        desc = vq->desc + i * 16;
+        writeq(desc, slot_buf(d, n, i));
+        writel(desc + 8, d->buf_size);
+        writew(desc + 12, flags);
+        writew(desc + 14, 0);
+    }
+
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_QUEUE_PFN, ring >> 12);
+}
+
+static void vq_add(VirtIONetDev *d, unsigned int n, unsigned int slot,
+                   uint32_t len)
+{
+    VirtQueue *vq = &d->vq[n];
+
+    writel(vq->desc + slot * 16 + 8, len);
+    writew(vq->avail + 4 + (vq->avail_idx % vq->size) * 2, slot);
+    vq->avail_idx++;
+}
+
+static void vq_kick(VirtIONetDev *d, unsigned int n)
+{
+    writew(d->vq[n].avail + 2, d->vq[n].avail_idx);
+    qpci_io_writew(d->pdev, d->addr + VIRTIO_PCI_QUEUE_NOTIFY, n);
+}
+
+/* Return the number of used buffers and store their slots and lengths */
+static unsigned int vq_reap(VirtIONetDev *d, unsigned int n,
+                            unsigned int *slots, uint32_t *lens)
+{
+    VirtQueue *vq = &d->vq[n];
+    uint16_t used_idx = readw(vq->used + 2);
+    unsigned int count = 0;
+
+    while (vq->last_used_idx != used_idx) {
+        uint64_t elem = vq->used + 4 + (vq->last_used_idx % vq->size) * 8;
+
+        slots[count] = readl(elem);
+        lens[count++] = readl(elem + 4);
+        vq->last_used_idx++;
+    }
+    return count;
+}
+
+static unsigned int vq_wait(VirtIONetDev *d, unsigned int n,
+                            unsigned int *slots, uint32_t *lens)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_US;
+    unsigned int count;
+
+    while (!(count = vq_reap(d, n, slots, lens))) {
+        g_assert(g_get_monotonic_time() < end);
+    }
+    return count;
+}
+
+/* @opts is appended to the -device option and @features are acked.  A
+ * non-zero @sndbuf shrinks the socket buffer of the tap side, so that
+ * transmitting a burst runs into backpressure
+ */
+static VirtIONetDev *virtio_net_start_opts(const char *opts,
+                                           uint32_t features, int sndbuf)
+{
+    VirtIONetDev *d = g_new0(VirtIONetDev, 1);
+    QGuestAllocator *alloc;
+    char *cmdline;
+    uint32_t host_features;
+    int sv[2];
+
+    g_assert(socketpair(AF_UNIX, SOCK_DGRAM, 0, sv) == 0);
+    g_assert(fcntl(sv[0], F_SETFL, O_NONBLOCK) == 0);
+    if (sndbuf) {
+        g_assert(setsockopt(sv[1], SOL_SOCKET, SO_SNDBUF,
+                            &sndbuf, sizeof(sndbuf)) == 0);
+    }
+    d->fd = sv[0];
+
+    cmdline = g_strdup_printf("-netdev tap,id=net0,fd=%d "
+                              "-device virtio-net-pci,netdev=net0,"
+                              "addr=%x.0%s",
+                              sv[1], PCI_SLOT, opts);
+    qtest_start(cmdline);
+    g_free(cmdline);
+    close(sv[1]);
+
+    d->bus = qpci_init_pc();
+    d->pdev = qpci_device_find(d->bus, QPCI_DEVFN(PCI_SLOT, 0));
+    g_assert(d->pdev != NULL);
+    g_assert_cmphex(qpci_config_readw(d->pdev, 0), ==, PCI_VENDOR_ID_REDHAT);
+    g_assert_cmphex(qpci_config_readw(d->pdev, 2), ==, PCI_DEVICE_ID_NET);
+    qpci_device_enable(d->pdev);
+    d->addr = qpci_iomap(d->pdev, 0);
+
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS, 0);
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER);
+
+    host_features = qpci_io_readl(d->pdev,
+                                  d->addr + VIRTIO_PCI_HOST_FEATURES);
+    g_assert_cmphex(host_features & features, ==, features);
+    qpci_io_writel(d->pdev, d->addr + VIRTIO_PCI_GUEST_FEATURES, features);
+    if (features & (1u << VIRTIO_NET_F_MRG_RXBUF)) {
+        d->hdr_len = MRG_HDR_LEN;
+        d->buf_size = MRG_BUF_SIZE;
+    } else {
+        d->hdr_len = HDR_LEN;
+        d->buf_size = BUF_SIZE;
+    }
+
+    alloc = pc_alloc_init();
+    vq_init(d, alloc, RX_QUEUE, VRING_DESC_F_WRITE);
+    vq_init(d, alloc, TX_QUEUE, 0);
+    g_free(alloc);
+
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS,
+                   VIRTIO_CONFIG_S_ACKNOWLEDGE | VIRTIO_CONFIG_S_DRIVER |
+                   VIRTIO_CONFIG_S_DRIVER_OK);
+    return d;
+}
+
+static VirtIONetDev *virtio_net_start(bool dataplane, bool mergeable,
+                                      int sndbuf)
+{
+    return virtio_net_start_opts(dataplane ? ",x-data-plane=on" : "",
+                                 mergeable ? 1u << VIRTIO_NET_F_MRG_RXBUF : 0,
+                                 sndbuf);
+}
+
+static void virtio_net_stop(VirtIONetDev *d)
+{
+    qpci_io_writeb(d->pdev, d->addr + VIRTIO_PCI_STATUS, 0);
+    close(d->fd);
+    g_free(d->pdev);
+    g_free(d);
+    qtest_quit(global_qtest);
+    global_qtest = NULL;
+}
+
+static void fill_frame(uint8_t *buf, size_t len, unsigned int seed)
+{
+    size_t i;
+
+    /* broadcast destination, so that no receive filter can drop it */
+    memset(buf, 0xff, 6);
+    memset(buf + 6, 0x52, 6);
+    for (i = 12; i < len; i++) {
+        buf[i] = seed + i;
+    }
+}
+
+static ssize_t recv_frame(VirtIONetDev *d, uint8_t *buf, size_t len)
+{
+    gint64 end = g_get_monotonic_time() + TIMEOUT_US;
+    ssize_t ret;
+
+    do {
+        ret = recv(d->fd, buf, len, 0);
+        g_assert(ret >= 0 || errno == EAGAIN || errno == EINTR);
+        g_assert(g_get_monotonic_time() < end);
+    } while (ret < 0);
+    return ret;
+}
+
+/* Transmit a few frames and check that they come out of the tap, without
+ * the virtio-net header since the socket pair has no vnet_hdr support
+ */
+static void test_tx(VirtIONetDev *d)
+{
+    uint8_t frame[1514], buf[2048];
+    unsigned int slots[QUEUE_DEPTH], i;
+    uint32_t lens[QUEUE_DEPTH];
+    size_t len;
+
+    for (i = 0; i < 3; i++) {
+        len = 60 + i * 700;
+        fill_frame(frame, len, i);
+        memset(buf, 0, d->hdr_len);
+        memwrite(slot_buf(d, TX_QUEUE, i), buf, d->hdr_len);
+        memwrite(slot_buf(d, TX_QUEUE, i) + d->hdr_len, frame, len);
+        vq_add(d, TX_QUEUE, i, d->hdr_len + len);
+        vq_kick(d, TX_QUEUE);
+
+        g_assert_cmpint(recv_frame(d, buf, sizeof(buf)), ==, len);
+        g_assert(memcmp(buf, frame, len) == 0);
+        g_assert_cmpint(vq_wait(d, TX_QUEUE, slots, lens), ==, 1);
+        g_assert_cmpint(slots[0], ==, i);
+    }
+}
+
+/* Send frames into the tap and check that they land in the RX buffers with
+ * a zeroed virtio-net header, spread over several buffers if mergeable
+ */
+static void test_rx(VirtIONetDev *d, size_t len)
+{
+    uint8_t frame[4096], buf[4096];
+    unsigned int slots[QUEUE_DEPTH], i, n;
+    unsigned int num_buffers, expected_buffers;
+    uint32_t lens[QUEUE_DEPTH];
+    size_t copied = 0, hdr = d->hdr_len;
+
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        vq_add(d, RX_QUEUE, i, d->buf_size);
+    }
+    vq_kick(d, RX_QUEUE);
+
+    fill_frame(frame, len, 7);
+    g_assert_cmpint(send(d->fd, frame, len, 0), ==, len);
+
+    expected_buffers = DIV_ROUND_UP(hdr + len, d->buf_size);
+    n = 0;
+    while (n < expected_buffers) {
+        n += vq_wait(d, RX_QUEUE, slots + n, lens + n);
+    }
+    g_assert_cmpint(n, ==, expected_buffers);
+
+    memread(slot_buf(d, RX_QUEUE, slots[0]), buf, hdr);
+    for (i = 0; i < HDR_LEN; i++) {
+        g_assert_cmpint(buf[i], ==, 0);
+    }
+    if (hdr == MRG_HDR_LEN) {
+        num_buffers = buf[HDR_LEN] | (buf[HDR_LEN + 1] << 8);
+        g_assert_cmpint(num_buffers, ==, expected_buffers);
+    }
+
+    for (i = 0; i < n; i++) {
+        size_t skip = i ? 0 : hdr;
+
+        g_assert_cmpint(lens[i], <=, d->buf_size);
+        memread(slot_buf(d, RX_QUEUE, slots[i]) + skip, buf + copied,
+                lens[i] - skip);
+        copied += lens[i] - skip;
+    }
+    g_assert_cmpint(copied, ==, len);
+    g_assert(memcmp(buf, frame, len) == 0);
+}
+
+static void test_rxtx(bool dataplane, bool mergeable)
+{
+    VirtIONetDev *d = virtio_net_start(dataplane, mergeable, 0);
+
+    test_tx(d);
+    test_rx(d, mergeable ? 3000 : 1514);
+    virtio_net_stop(d);
+}
+
+#define BURST           40
+#define RX_POSTED       8
+
+/* Check that bursts keep their order, including when the tap cannot take
+ * the whole tx burst at once and when the rx queue fills up in the middle
+ * of a burst read from the tap
+ */
+static void test_burst(void)
+{
+    VirtIONetDev *d = virtio_net_start(false, false, 4096);
+    unsigned int slots[QUEUE_DEPTH], i, n;
+    uint32_t lens[QUEUE_DEPTH];
+    uint8_t frame[60], buf[BUF_SIZE];
+
+    memset(buf, 0, HDR_LEN);
+    for (i = 0; i < BURST; i++) {
+        fill_frame(buf + HDR_LEN, sizeof(frame), i);
+        memwrite(slot_buf(d, TX_QUEUE, i), buf, HDR_LEN + sizeof(frame));
+        vq_add(d, TX_QUEUE, i, HDR_LEN + sizeof(frame));
+    }
+    vq_kick(d, TX_QUEUE);
+    for (i = 0; i < BURST; i++) {
+        fill_frame(frame, sizeof(frame), i);
+        g_assert_cmpint(recv_frame(d, buf, sizeof(buf)), ==, sizeof(frame));
+        g_assert(memcmp(buf, frame, sizeof(frame)) == 0);
+    }
+    for (n = 0; n < BURST; ) {
+        n += vq_wait(d, TX_QUEUE, slots + n, lens + n);
+    }
+    g_assert_cmpint(n, ==, BURST);
+
+    for (i = 0; i < RX_POSTED; i++) {
+        vq_add(d, RX_QUEUE, i, BUF_SIZE);
+    }
+    vq_kick(d, RX_QUEUE);
+    for (i = 0; i < BURST; i++) {
+        fill_frame(frame, sizeof(frame), i);
+        g_assert_cmpint(send(d->fd, frame, sizeof(frame), 0), ==,
+                        sizeof(frame));
+    }
+    for (n = 0; n < RX_POSTED; ) {
+        n += vq_wait(d, RX_QUEUE, slots + n, lens + n);
+    }
+    g_assert_cmpint(n, ==, RX_POSTED);
+
+    for (i = RX_POSTED; i < BURST; i++) {
+        vq_add(d, RX_QUEUE, i, BUF_SIZE);
+    }
+    vq_kick(d, RX_QUEUE);
+    while (n < BURST) {
+        n += vq_wait(d, RX_QUEUE, slots + n, lens + n);
+    }
+    g_assert_cmpint(n, ==, BURST);
+
+    for (i = 0; i < BURST; i++) {
+        g_assert_cmpint(slots[i], ==, i);
+        g_assert_cmpint(lens[i], ==, HDR_LEN + sizeof(frame));
+        memread(slot_buf(d, RX_QUEUE, i) + HDR_LEN, buf, sizeof(frame));
+        fill_frame(frame, sizeof(frame), i);
+        g_assert(memcmp(buf, frame, sizeof(frame)) == 0);
+    }
+
+    virtio_net_stop(d);
+}
+
+#define GRO_SEGS        3
+#define GRO_MSS         1000
+#define GRO_HDRS        (14 + 20 + 20)
+
+static uint16_t csum_fold(uint32_t sum)
+{
+    while (sum >> 16) {
+        sum = (sum & 0xffff) + (sum >> 16);
+    }
+    return sum;
+}
+
+static uint32_t csum_add(uint32_t sum, const uint8_t *buf, size_t len)
+{
+    size_t i;
+
+    for (i = 0; i < len; i++) {
+        sum += i & 1 ? buf[i] : buf[i] << 8;
+    }
+    return sum;
+}
+
+static size_t fill_tcp_segment(uint8_t *buf, uint32_t seq)
+{
+    uint8_t *ip = buf + 14, *tcp = buf + 34;
+    size_t l4_len = 20 + GRO_MSS, i;
+
+    memset(buf, 0, GRO_HDRS);
+    memset(buf, 0xff, 6);
+    memset(buf + 6, 0x52, 6);
+    buf[12] = 0x08;
+    ip[0] = 0x45;
+    ip[2] = (20 + l4_len) >> 8;
+    ip[3] = (20 + l4_len) & 0xff;
+    ip[8] = 64;
+    ip[9] = 6;
+    ip[12] = ip[16] = 10;
+    ip[15] = 2;
+    ip[19] = 15;
+    i = ~csum_fold(csum_add(0, ip, 20));
+    ip[10] = i >> 8;
+    ip[11] = i & 0xff;
+
+    tcp[1] = 80;
+    tcp[3] = 80;
+    tcp[4] = seq >> 24;
+    tcp[5] = seq >> 16;
+    tcp[6] = seq >> 8;
+    tcp[7] = seq;
+    tcp[11] = 1;
+    tcp[12] = 5 << 4;
+    tcp[13] = 0x10;
+    tcp[14] = tcp[15] = 0xff;
+    for (i = 0; i < GRO_MSS; i++) {
+        tcp[20 + i] = seq + i;
+    }
+    i = ~csum_fold(csum_add(csum_add(6 + l4_len, ip + 12, 8), tcp, l4_len));
+    tcp[16] = i >> 8;
+    tcp[17] = i & 0xff;
+    return GRO_HDRS + GRO_MSS;
+}
+
+/* Segments of one TCP flow sent while the VM is stopped are read as one
+ * burst when it resumes, and must reach the guest as a single TSO frame
+ */
+static void test_gro(void)
+{
+    VirtIONetDev *d = virtio_net_start_opts(",x-gro=on",
+                                            (1u << VIRTIO_NET_F_MRG_RXBUF) |
+                                            (1u << VIRTIO_NET_F_GUEST_CSUM) |
+                                            (1u << VIRTIO_NET_F_GUEST_TSO4),
+                                            0);
+    uint8_t frame[GRO_HDRS + GRO_MSS], buf[MRG_HDR_LEN + 4096];
+    unsigned int slots[QUEUE_DEPTH], i, n, expected_buffers;
+    uint32_t lens[QUEUE_DEPTH];
+    size_t len = GRO_HDRS + GRO_SEGS * GRO_MSS, copied = 0;
+
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        vq_add(d, RX_QUEUE, i, MRG_BUF_SIZE);
+    }
+    vq_kick(d, RX_QUEUE);
+
+    qmp("{ 'execute': 'stop' }");
+    for (i = 0; i < GRO_SEGS; i++) {
+        size_t size = fill_tcp_segment(frame, i * GRO_MSS);
+
+        g_assert_cmpint(send(d->fd, frame, size, 0), ==, size);
+    }
+    qmp("{ 'execute': 'cont' }");
+
+    expected_buffers = DIV_ROUND_UP(MRG_HDR_LEN + len, MRG_BUF_SIZE);
+    n = 0;
+    while (n < expected_buffers) {
+        n += vq_wait(d, RX_QUEUE, slots + n, lens + n);
+    }
+    g_assert_cmpint(n, ==, expected_buffers);
+
+    for (i = 0; i < n; i++) {
+        memread(slot_buf(d, RX_QUEUE, slots[i]), buf + copied, lens[i]);
+        copied += lens[i];
+    }
+    g_assert_cmpint(copied, ==, MRG_HDR_LEN + len);
+
+    /* flags, gso_type, hdr_len, gso_size, csum_start, csum_offset */
+    g_assert_cmpint(buf[0], ==, 1);
+    g_assert_cmpint(buf[1], ==, 1);
+    g_assert_cmpint(buf[2] | buf[3] << 8, ==, GRO_HDRS);
+    g_assert_cmpint(buf[4] | buf[5] << 8, ==, GRO_MSS);
+    g_assert_cmpint(buf[6] | buf[7] << 8, ==, 34);
+    g_assert_cmpint(buf[8] | buf[9] << 8, ==, 16);
+    g_assert_cmpint(buf[10] | buf[11] << 8, ==, expected_buffers);
+
+    fill_tcp_segment(frame, 0);
+    g_assert_cmpint(buf[MRG_HDR_LEN + 16] << 8 | buf[MRG_HDR_LEN + 17], ==,
+                    20 + 20 + GRO_SEGS * GRO_MSS);
+    g_assert(memcmp(buf + MRG_HDR_LEN + 26, frame + 26, 8 + 8) == 0);
+    for (i = 0; i < GRO_SEGS * GRO_MSS; i++) {
+        g_assert_cmpint(buf[MRG_HDR_LEN + GRO_HDRS + i], ==, (uint8_t)i);
+    }
+
+    virtio_net_stop(d);
+}
+
+static void test_main_loop(void)
+{
+    test_rxtx(false, false);
+}
+
+static void test_main_loop_mergeable(void)
+{
+    test_rxtx(false, true);
+}
+
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+static void test_dataplane(void)
+{
+    test_rxtx(true, false);
+}
+
+static void test_dataplane_mergeable(void)
+{
+    test_rxtx(true, true);
+}
+#endif
+
+/* Keep the TX queue full of small frames for a second and count them */
+static double run_tx(bool dataplane)
+{
+    VirtIONetDev *d = virtio_net_start(dataplane, false, 0);
+    unsigned int slots[QUEUE_DEPTH], i, n;
+    uint32_t lens[QUEUE_DEPTH];
+    uint8_t buf[BUF_SIZE];
+    uint64_t packets = 0;
+    double elapsed;
+
+    memset(buf, 0, HDR_LEN);
+    fill_frame(buf + HDR_LEN, 60, 0);
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        memwrite(slot_buf(d, TX_QUEUE, i), buf, HDR_LEN + 60);
+        vq_add(d, TX_QUEUE, i, HDR_LEN + 60);
+    }
+    vq_kick(d, TX_QUEUE);
+
+    g_test_timer_start();
+    do {
+        while (recv(d->fd, buf, sizeof(buf), 0) > 0) {
+            packets++;
+        }
+        n = vq_reap(d, TX_QUEUE, slots, lens);
+        if (n) {
+            for (i = 0; i < n; i++) {
+                vq_add(d, TX_QUEUE, slots[i], HDR_LEN + 60);
+            }
+            vq_kick(d, TX_QUEUE);
+        }
+        elapsed = g_test_timer_elapsed();
+    } while (elapsed < 1.0);
+
+    virtio_net_stop(d);
+    return packets / elapsed;
+}
+
+/* Keep the socket full of small frames for a second and count the ones
+ * that reach the RX queue
+ */
+static double run_rx(bool dataplane)
+{
+    VirtIONetDev *d = virtio_net_start(dataplane, false, 0);
+    unsigned int slots[QUEUE_DEPTH], i, n;
+    uint32_t lens[QUEUE_DEPTH];
+    uint8_t frame[60];
+    uint64_t packets = 0;
+    double elapsed;
+
+    for (i = 0; i < QUEUE_DEPTH; i++) {
+        vq_add(d, RX_QUEUE, i, BUF_SIZE);
+    }
+    vq_kick(d, RX_QUEUE);
+    fill_frame(frame, sizeof(frame), 0);
+
+    g_test_timer_start();
+    do {
+        while (send(d->fd, frame, sizeof(frame), 0) > 0) {
+            /* until the socket buffer is full */
+        }
+        n = vq_reap(d, RX_QUEUE, slots, lens);
+        if (n) {
+            packets += n;
+            for (i = 0; i < n; i++) {
+                vq_add(d, RX_QUEUE, slots[i], BUF_SIZE);
+            }
+            vq_kick(d, RX_QUEUE);
+        }
+        elapsed = g_test_timer_elapsed();
+    } while (elapsed < 1.0);
+
+    virtio_net_stop(d);
+    return packets / elapsed;
+}
+
+static void test_perf(void)
+{
+    int dataplane;
+
+    for (dataplane = 0; dataplane < 2; dataplane++) {
+#ifndef CONFIG_VIRTIO_NET_DATA_PLANE
+        if (dataplane) {
+            break;
+        }
+#endif
+        g_test_message("tx 60 byte frames, %s: %.0f packets/s",
+                       dataplane ? "dataplane" : "main loop",
+                       run_tx(dataplane));
+        g_test_message("rx 60 byte frames, %s: %.0f packets/s",
+                       dataplane ? "dataplane" : "main loop",
+                       run_rx(dataplane));
+    }
+}
+
+int main(int argc, char **argv)
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/virtio/net/pci/main-loop", test_main_loop);
+    g_test_add_func("/virtio/net/pci/main-loop/mergeable",
+                    test_main_loop_mergeable);
+    g_test_add_func("/virtio/net/pci/main-loop/burst", test_burst);
+    g_test_add_func("/virtio/net/pci/main-loop/gro", test_gro);
+#ifdef CONFIG_VIRTIO_NET_DATA_PLANE
+    g_test_add_func("/virtio/net/pci/dataplane", test_dataplane);
+    g_test_add_func("/virtio/net/pci/dataplane/mergeable",
+                    test_dataplane_mergeable);
+#endif
+    if (g_test_perf()) {
+        g_test_add_func("/virtio/net/pci/perf", test_perf);
+    }
+
+    return g_test_run();
+}
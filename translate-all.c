@@ -60,6 +60,7 @@
 #include "exec/cputlb.h"
 #include "translate-all.h"
 #include "qemu/timer.h"
+#include "qemu/tls.h"
 
 //#define DEBUG_TB_INVALIDATE
 //#define DEBUG_FLUSH
@@ -122,6 +123,12 @@ static void *l1_map[V_L1_SIZE];
 /* code generation context */
 TCGContext tcg_ctx;
 
+/* tb_lock is not recursive; count whether the current thread holds it,
+   so that entry points that are reachable both with and without the
+   lock (tb_flush, TB invalidation) and the longjmp path out of the
+   translator can cope.  */
+static DEFINE_TLS(int, have_tb_lock);
+
 static void tb_link_page(TranslationBlock *tb, tb_page_addr_t phys_pc,
                          tb_page_addr_t phys_page2);
 static TranslationBlock *tb_find_pc(uintptr_t tc_ptr);
@@ -131,6 +138,44 @@ void cpu_gen_init(void)
     tcg_context_init(&tcg_ctx); 
 }
 
+/* tb_lock protects the TB cache: the physical hash table, the page
+   descriptors' TB lists, the jump lists and the code buffer itself.
+   It must be held while translating, chaining or invalidating TBs.  */
+void tb_lock(void)
+{
+    assert(!tls_var(have_tb_lock));
+    qemu_mutex_lock(&tcg_ctx.tb_ctx.tb_lock);
+    tls_var(have_tb_lock)++;
+}
+
+void tb_unlock(void)
+{
+    assert(tls_var(have_tb_lock));
+    tls_var(have_tb_lock)--;
+    qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+}
+
+/* Drop tb_lock if we still hold it after a longjmp out of the
+   translator or out of a TB invalidation.  */
+void tb_lock_reset(void)
+{
+    if (tls_var(have_tb_lock)) {
+        tls_var(have_tb_lock) = 0;
+        qemu_mutex_unlock(&tcg_ctx.tb_ctx.tb_lock);
+    }
+}
+
+/* Take tb_lock unless the current thread already holds it.  Returns
+   true if the lock was taken and must be released by the caller.  */
+static bool tb_lock_recursive(void)
+{
+    if (tls_var(have_tb_lock)) {
+        return false;
+    }
+    tb_lock();
+    return true;
+}
+
 /* return non zero if the very first instruction is invalid so that
    the virtual CPU can trigger an exception.
 
@@ -252,13 +297,20 @@ static int cpu_restore_state_from_tb(TranslationBlock *tb, CPUArchState *env,
 bool cpu_restore_state(CPUArchState *env, uintptr_t retaddr)
 {
     TranslationBlock *tb;
+    /* retranslating may fill the TLB, and the global mutex nests outside
+       tb_lock */
+    bool iothread_locked = tcg_iothread_lock();
+    bool locked = tb_lock_recursive();
 
     tb = tb_find_pc(retaddr);
     if (tb) {
         cpu_restore_state_from_tb(tb, env, retaddr);
-        return true;
     }
-    return false;
+    if (locked) {
+        tb_unlock();
+    }
+    tcg_iothread_unlock(iothread_locked);
+    return tb != NULL;
 }
 
 #ifdef _WIN32
@@ -589,6 +641,7 @@ static inline void code_gen_alloc(size_t tb_size)
 void tcg_exec_init(unsigned long tb_size)
 {
     cpu_gen_init();
+    qemu_mutex_init(&tcg_ctx.tb_ctx.tb_lock);
     code_gen_alloc(tb_size);
     tcg_ctx.code_gen_ptr = tcg_ctx.code_gen_buffer;
     tcg_register_jit(tcg_ctx.code_gen_buffer, tcg_ctx.code_gen_buffer_size);
@@ -677,10 +730,16 @@ static void page_flush_tb(void)
 }
 
 /* flush all the translation blocks */
-/* XXX: tb_flush is currently not thread safe */
 void tb_flush(CPUArchState *env1)
 {
     CPUArchState *env;
+    bool locked;
+
+    /* Other vCPU threads may be executing translated code */
+    if (tcg_defer_tb_flush()) {
+        return;
+    }
+    locked = tb_lock_recursive();
 
 #if defined(DEBUG_FLUSH)
     printf("qemu: flush code_size=%ld nb_tbs=%d avg_tb_size=%ld\n",
@@ -707,6 +766,10 @@ void tb_flush(CPUArchState *env1)
     /* XXX: flush processor icache at this point if cache flush is
        expensive */
     tcg_ctx.tb_ctx.tb_flush_count++;
+
+    if (locked) {
+        tb_unlock();
+    }
 }
 
 #ifdef DEBUG_TB_CHECK
@@ -826,6 +889,8 @@ void tb_phys_invalidate(TranslationBlock *tb, tb_page_addr_t page_addr)
     tb_page_addr_t phys_pc;
     TranslationBlock *tb1, *tb2;
 
+    assert(tls_var(have_tb_lock));
+
     /* remove the TB from the hash list */
     phys_pc = tb->page_addr[0] + (tb->pc & ~TARGET_PAGE_MASK);
     h = tb_phys_hash_func(phys_pc);
@@ -941,13 +1006,19 @@ TranslationBlock *tb_gen_code(CPUArchState *env,
     target_ulong virt_page2;
     int code_gen_size;
 
+    assert(tls_var(have_tb_lock));
+
     phys_pc = get_page_addr_code(env, pc);
     tb = tb_alloc(pc);
     if (!tb) {
         /* flush must be done */
         tb_flush(env);
-        /* cannot fail at this point */
         tb = tb_alloc(pc);
+        if (!tb) {
+            /* the flush waits until all vCPUs have left cpu_exec */
+            env->exception_index = EXCP_INTERRUPT;
+            cpu_loop_exit(env);
+        }
         /* Don't forget to invalidate previous TB info.  */
         tcg_ctx.tb_ctx.tb_invalidated_flag = 1;
     }
@@ -994,8 +1065,9 @@ void tb_invalidate_phys_range(tb_page_addr_t start, tb_page_addr_t end,
  * access: the virtual CPU will exit the current TB if code is modified inside
  * this TB.
  */
-void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
-                                   int is_cpu_write_access)
+static void tb_invalidate_phys_page_range_locked(tb_page_addr_t start,
+                                                tb_page_addr_t end,
+                                                int is_cpu_write_access)
 {
     TranslationBlock *tb, *tb_next, *saved_tb;
     CPUArchState *env = cpu_single_env;
@@ -1106,11 +1178,23 @@ void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
 #endif
 }
 
+void tb_invalidate_phys_page_range(tb_page_addr_t start, tb_page_addr_t end,
+                                   int is_cpu_write_access)
+{
+    bool locked = tb_lock_recursive();
+
+    tb_invalidate_phys_page_range_locked(start, end, is_cpu_write_access);
+    if (locked) {
+        tb_unlock();
+    }
+}
+
 /* len must be <= 8 and start must be a multiple of len */
 void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
 {
     PageDesc *p;
     int offset, b;
+    bool locked;
 
 #if 0
     if (1) {
@@ -1121,9 +1205,10 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
                   (intptr_t)cpu_single_env->segs[R_CS].base);
     }
 #endif
+    locked = tb_lock_recursive();
     p = page_find(start >> TARGET_PAGE_BITS);
     if (!p) {
-        return;
+        goto out;
     }
     if (p->code_bitmap) {
         offset = start & ~TARGET_PAGE_MASK;
@@ -1133,7 +1218,11 @@ void tb_invalidate_phys_page_fast(tb_page_addr_t start, int len)
         }
     } else {
     do_invalidate:
-        tb_invalidate_phys_page_range(start, start + len, 1);
+        tb_invalidate_phys_page_range_locked(start, start + len, 1);
+    }
+out:
+    if (locked) {
+        tb_unlock();
     }
 }
 
@@ -1153,11 +1242,13 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
     target_ulong current_cs_base = 0;
     int current_flags = 0;
 #endif
+    bool locked;
 
     addr &= TARGET_PAGE_MASK;
+    locked = tb_lock_recursive();
     p = page_find(addr >> TARGET_PAGE_BITS);
     if (!p) {
-        return;
+        goto out;
     }
     tb = p->first_tb;
 #ifdef TARGET_HAS_PRECISE_SMC
@@ -1200,6 +1291,10 @@ static void tb_invalidate_phys_page(tb_page_addr_t addr,
         cpu_resume_from_signal(env, puc);
     }
 #endif
+out:
+    if (locked) {
+        tb_unlock();
+    }
 }
 #endif
 
@@ -1422,6 +1517,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
     target_ulong pc, cs_base;
     uint64_t flags;
 
+    tb_lock();
     tb = tb_find_pc(retaddr);
     if (!tb) {
         cpu_abort(env, "cpu_io_recompile: could not find TB for pc=%p",
@@ -1470,6 +1566,7 @@ void cpu_io_recompile(CPUArchState *env, uintptr_t retaddr)
        repeating the fault, which is horribly inefficient.
        Better would be to execute just this insn uncached, or generate a
        second new TB.  */
+    tb_unlock();
     cpu_resume_from_signal(env, NULL);
 }
 
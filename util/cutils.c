@@ -157,11 +157,66 @@ int qemu_fdatasync(int fd)
  * down to a multiple of sizeof(VECTYPE) for the first
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR chunks and down to
  * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * sizeof(VECTYPE)
- * afterwards.
+ * afterwards.  When the host supports AVX2 and len allows it, 32-byte
+ * vectors are used instead and the granularity doubles.
  *
  * If the buffer is all zero the return value is equal to len.
  */
 
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+#define AVX2_VECSIZE sizeof(__m256i)
+
+static bool use_avx2;
+
+static void __attribute__((constructor)) init_buffer_find_nonzero_offset(void)
+{
+    __builtin_cpu_init();
+    use_avx2 = __builtin_cpu_supports("avx2");
+}
+
+/* len must be a non-zero multiple of
+ * BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * AVX2_VECSIZE; buf only needs
+ * the alignment of VECTYPE.
+ */
+static size_t buffer_find_nonzero_offset_avx2(const void *buf, size_t len)
+{
+    const __m256i *p = buf;
+    size_t i;
+
+    for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
+        __m256i v = _mm256_loadu_si256(p + i);
+        if (!_mm256_testz_si256(v, v)) {
+            return i * AVX2_VECSIZE;
+        }
+    }
+
+    for (i = BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR;
+         i < len / AVX2_VECSIZE;
+         i += BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR) {
+        __m256i tmp0 = _mm256_or_si256(_mm256_loadu_si256(p + i + 0),
+                                       _mm256_loadu_si256(p + i + 1));
+        __m256i tmp1 = _mm256_or_si256(_mm256_loadu_si256(p + i + 2),
+                                       _mm256_loadu_si256(p + i + 3));
+        __m256i tmp2 = _mm256_or_si256(_mm256_loadu_si256(p + i + 4),
+                                       _mm256_loadu_si256(p + i + 5));
+        __m256i tmp3 = _mm256_or_si256(_mm256_loadu_si256(p + i + 6),
+                                       _mm256_loadu_si256(p + i + 7));
+        __m256i tmp = _mm256_or_si256(_mm256_or_si256(tmp0, tmp1),
+                                      _mm256_or_si256(tmp2, tmp3));
+        if (!_mm256_testz_si256(tmp, tmp)) {
+            break;
+        }
+    }
+
+    return i * AVX2_VECSIZE;
+}
+#pragma GCC pop_options
+#endif
+
 size_t buffer_find_nonzero_offset(const void *buf, size_t len)
 {
     const VECTYPE *p = buf;
@@ -174,6 +229,13 @@ size_t buffer_find_nonzero_offset(const void *buf, size_t len)
         return 0;
     }
 
+#ifdef CONFIG_AVX2_OPT
+    if (use_avx2 &&
+        len % (BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR * AVX2_VECSIZE) == 0) {
+        return buffer_find_nonzero_offset_avx2(buf, len);
+    }
+#endif
+
     for (i = 0; i < BUFFER_FIND_NONZERO_OFFSET_UNROLL_FACTOR; i++) {
         if (!ALL_EQ(p[i], zero)) {
             return i * sizeof(VECTYPE);
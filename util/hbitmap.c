@@ -367,6 +367,59 @@ bool hbitmap_get(const HBitmap *hb, uint64_t item)
     return (hb->levels[HBITMAP_LEVELS - 1][pos >> BITS_PER_LEVEL] & bit) != 0;
 }
 
+void hbitmap_serialize(const HBitmap *hb, uint8_t *buf,
+                       uint64_t start, uint64_t count)
+{
+    unsigned long *last_level = hb->levels[HBITMAP_LEVELS - 1];
+    uint64_t pos = start >> hb->granularity;
+    uint64_t end = ((start + count - 1) >> hb->granularity) + 1;
+    uint64_t i;
+
+    assert((pos & 7) == 0);
+
+    /* Groups of eight bits never straddle two words.  */
+    for (i = pos; i < end; i += 8) {
+        uint8_t byte = 0;
+        if (i < hb->size) {
+            byte = last_level[i >> BITS_PER_LEVEL] >>
+                   (i & (BITS_PER_LONG - 1));
+        }
+        if (end - i < 8) {
+            byte &= (1 << (end - i)) - 1;
+        }
+        *buf++ = byte;
+    }
+}
+
+void hbitmap_deserialize(HBitmap *hb, const uint8_t *buf,
+                         uint64_t start, uint64_t count)
+{
+    uint64_t pos = start >> hb->granularity;
+    uint64_t end = ((start + count - 1) >> hb->granularity) + 1;
+    uint64_t i, run_start;
+
+    assert((pos & 7) == 0);
+    end = MIN(end, hb->size);
+
+    /* Set each run of ones with a single call.  */
+    for (i = pos; i < end; ) {
+        if ((i & 7) == 0 && buf[(i - pos) >> 3] == 0) {
+            i += 8;
+            continue;
+        }
+        if (!(buf[(i - pos) >> 3] & (1 << (i & 7)))) {
+            i++;
+            continue;
+        }
+        run_start = i;
+        while (i < end && (buf[(i - pos) >> 3] & (1 << (i & 7)))) {
+            i++;
+        }
+        hbitmap_set(hb, run_start << hb->granularity,
+                    (i - run_start) << hb->granularity);
+    }
+}
+
 void hbitmap_free(HBitmap *hb)
 {
     unsigned i;
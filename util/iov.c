@@ -356,6 +356,32 @@ void qemu_iovec_reset(QEMUIOVector *qiov)
     qiov->size = 0;
 }
 
+/*
+ * Check if the contents of the iovecs are all zero
+ */
+bool qemu_iovec_is_zero(QEMUIOVector *qiov)
+{
+    int i;
+    for (i = 0; i < qiov->niov; i++) {
+        const unsigned char *p = qiov->iov[i].iov_base;
+        size_t len = qiov->iov[i].iov_len;
+        size_t aligned = QEMU_ALIGN_DOWN(len, 4 * sizeof(long));
+
+        /* buffer_is_zero() wants a multiple of four longs; the bulk of
+         * the data is checked with the vectorized code, the tail by hand.
+         */
+        if (aligned && !buffer_is_zero(p, aligned)) {
+            return false;
+        }
+        for (; aligned < len; aligned++) {
+            if (p[aligned]) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
 size_t qemu_iovec_to_buf(QEMUIOVector *qiov, size_t offset,
                          void *buf, size_t bytes)
 {
@@ -429,6 +429,10 @@ static QemuOptsList qemu_machine_opts = {
             .name = "usb",
             .type = QEMU_OPT_BOOL,
             .help = "Set on/off to enable/disable usb",
+        }, {
+            .name = "tcg-thread",
+            .type = QEMU_OPT_STRING,
+            .help = "single or multi host threads for TCG vCPUs",
         },
         { /* End of list */ }
     },
@@ -4165,6 +4169,8 @@ int main(int argc, char **argv, char **envp)
         exit(1);
     }
     configure_icount(icount_option);
+    configure_tcg_thread(machine_opts ?
+                         qemu_opt_get(machine_opts, "tcg-thread") : NULL);
 
     /* clean up network at qemu process termination */
     atexit(&net_cleanup);
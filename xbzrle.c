@@ -11,6 +11,7 @@
  *
  */
 #include "qemu-common.h"
+#include "qemu/host-utils.h"
 #include "include/migration/migration.h"
 
 /*
@@ -23,8 +24,8 @@
 
   length = uleb128 encoded integer
  */
-int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
-                         uint8_t *dst, int dlen)
+int xbzrle_encode_buffer_generic(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                                 uint8_t *dst, int dlen)
 {
     uint32_t zrun_len = 0, nzrun_len = 0;
     int d = 0, i = 0;
@@ -123,6 +124,198 @@ int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
     return d;
 }
 
+/*
+ * The vector encoders below emit exactly the same stream as the generic
+ * one: zrun and nzrun are the longest runs of equal and different bytes,
+ * and overflow is checked at the same points.  Only the scan for the end
+ * of a run differs.
+ */
+typedef int (XBZRLEScanFn)(const uint8_t *old_buf, const uint8_t *new_buf,
+                           int i, int slen);
+
+static inline __attribute__((always_inline))
+int xbzrle_encode_vec(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                      uint8_t *dst, int dlen, XBZRLEScanFn *zrun_end,
+                      XBZRLEScanFn *nzrun_end)
+{
+    int zrun_len, nzrun_len;
+    int d = 0, i = 0;
+
+    while (i < slen) {
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        zrun_len = zrun_end(old_buf, new_buf, i, slen) - i;
+        i += zrun_len;
+
+        /* buffer unchanged */
+        if (zrun_len == slen) {
+            return 0;
+        }
+
+        /* skip last zero run */
+        if (i == slen) {
+            return d;
+        }
+
+        d += uleb128_encode_small(dst + d, zrun_len);
+
+        /* overflow */
+        if (d + 2 > dlen) {
+            return -1;
+        }
+
+        nzrun_len = nzrun_end(old_buf, new_buf, i, slen) - i;
+        d += uleb128_encode_small(dst + d, nzrun_len);
+
+        /* overflow */
+        if (d + nzrun_len > dlen) {
+            return -1;
+        }
+        memcpy(dst + d, new_buf + i, nzrun_len);
+        d += nzrun_len;
+        i += nzrun_len;
+    }
+
+    return d;
+}
+
+#ifdef __SSE2__
+/* Returns the offset of the first byte at or after i that differs */
+static inline int xbzrle_zrun_end_sse2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(old_buf + i)),
+            _mm_loadu_si128((const __m128i *)(new_buf + i)));
+        uint32_t ne = ~_mm_movemask_epi8(eq) & 0xffff;
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+/* Returns the offset of the first byte at or after i that is unchanged */
+static inline int xbzrle_nzrun_end_sse2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 16 <= slen; i += 16) {
+        __m128i eq = _mm_cmpeq_epi8(
+            _mm_loadu_si128((const __m128i *)(old_buf + i)),
+            _mm_loadu_si128((const __m128i *)(new_buf + i)));
+        uint32_t mask = _mm_movemask_epi8(eq);
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+int xbzrle_encode_buffer_sse2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_vec(old_buf, new_buf, slen, dst, dlen,
+                             xbzrle_zrun_end_sse2, xbzrle_nzrun_end_sse2);
+}
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+#pragma GCC push_options
+#pragma GCC target("avx2")
+#include <immintrin.h>
+
+static inline int xbzrle_zrun_end_avx2(const uint8_t *old_buf,
+                                       const uint8_t *new_buf,
+                                       int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(old_buf + i)),
+            _mm256_loadu_si256((const __m256i *)(new_buf + i)));
+        uint32_t ne = ~(uint32_t)_mm256_movemask_epi8(eq);
+
+        if (ne) {
+            return i + ctz32(ne);
+        }
+    }
+    while (i < slen && old_buf[i] == new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+static inline int xbzrle_nzrun_end_avx2(const uint8_t *old_buf,
+                                        const uint8_t *new_buf,
+                                        int i, int slen)
+{
+    for (; i + 32 <= slen; i += 32) {
+        __m256i eq = _mm256_cmpeq_epi8(
+            _mm256_loadu_si256((const __m256i *)(old_buf + i)),
+            _mm256_loadu_si256((const __m256i *)(new_buf + i)));
+        uint32_t mask = _mm256_movemask_epi8(eq);
+
+        if (mask) {
+            return i + ctz32(mask);
+        }
+    }
+    while (i < slen && old_buf[i] != new_buf[i]) {
+        i++;
+    }
+    return i;
+}
+
+int xbzrle_encode_buffer_avx2(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                              uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_vec(old_buf, new_buf, slen, dst, dlen,
+                             xbzrle_zrun_end_avx2, xbzrle_nzrun_end_avx2);
+}
+#pragma GCC pop_options
+#endif
+
+#ifdef __SSE2__
+static int (*xbzrle_encode_fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_sse2;
+#else
+static int (*xbzrle_encode_fn)(uint8_t *, uint8_t *, int, uint8_t *, int) =
+    xbzrle_encode_buffer_generic;
+#endif
+
+#ifdef CONFIG_AVX2_OPT
+bool xbzrle_can_use_avx2(void)
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+static void __attribute__((constructor)) init_xbzrle_encode(void)
+{
+    if (xbzrle_can_use_avx2()) {
+        xbzrle_encode_fn = xbzrle_encode_buffer_avx2;
+    }
+}
+#endif
+
+int xbzrle_encode_buffer(uint8_t *old_buf, uint8_t *new_buf, int slen,
+                         uint8_t *dst, int dlen)
+{
+    return xbzrle_encode_fn(old_buf, new_buf, slen, dst, dlen);
+}
+
 int xbzrle_decode_buffer(uint8_t *src, int slen, uint8_t *dst, int dlen)
 {
     int i = 0, d = 0;